@@ -63,6 +63,7 @@ bool armloader_load_snippet(enum SNIPPETS snippet, struct armloader_load_params
         return false;
     }
     memcpy(code_ptr, snippets_bin, code_size);
+    invalidate_decoded_range(code_ptr, code_size);
 
     orig_pc = arm.reg[15];
     arm.reg[14] = arm.reg[15]; // return address
@@ -89,13 +90,15 @@ bool armloader_load_snippet(enum SNIPPETS snippet, struct armloader_load_params
         }
     }
     armloader_cb_ptr = callback;
-    uint32_t *flags = &RAM_FLAGS(virt_mem_ptr(orig_pc, 4));
-    if (*flags & RF_CODE_TRANSLATED) flush_translations();
+    void *orig_ptr = virt_mem_ptr(orig_pc, 4);
+    uint32_t *flags = &RAM_FLAGS(orig_ptr);
+    if (*flags & RF_CODE_TRANSLATED) flush_translations(TF_OTHER);
+    if (*flags & RF_CODE_DECODED) invalidate_decoded(orig_ptr);
     *flags |= RF_ARMLOADER_CB;
 
     // TODO for debugging
     //	uint32_t *flags = &RAM_FLAGS(virt_mem_ptr(arm.reg[15], 4));
-    //	if (*flags & RF_CODE_TRANSLATED) flush_translations();
+    //	if (*flags & RF_CODE_TRANSLATED) flush_translations(TF_OTHER);
     //	*flags |= RF_EXEC_BREAKPOINT;
 
     return true;
@@ -6,17 +6,17 @@
 #define likely(x) (__builtin_expect(x, 1))
 #define unlikely(x) (__builtin_expect(x, 0))
 
-//TODO: Read and write breakpoints
-
-#if !defined(__i386__) && !defined(__x86_64__)
-void flush_translations() {}
+// No translator is linked in then
+#if defined(NO_TRANSLATION) && !defined(__i386__) && !defined(__x86_64__)
+void flush_translations(int cause) { (void) cause; }
+void unlink_translations() {}
 void fix_pc_for_fault() {}
 bool range_translated(uintptr_t x, uintptr_t y) { (void) x; (void) y; return false; }
 #endif
 
 void * FASTCALL ptr(uint32_t addr)
 {
-    uintptr_t entry = *(uintptr_t*)(addr_cache + ((addr >> 10) << 1));
+    uintptr_t entry = (uintptr_t)AC_ENTRY((addr >> 10) << 1);
 
     if(entry & AC_FLAGS)
     {
@@ -35,7 +35,7 @@ void * FASTCALL ptr(uint32_t addr)
 
 uint32_t FASTCALL read_word_ldr(uint32_t addr)
 {
-    uintptr_t entry = *(uintptr_t*)(addr_cache + ((addr >> 10) << 1));
+    uintptr_t entry = (uintptr_t)AC_ENTRY((addr >> 10) << 1);
 
     //If the sum doesn't contain the address directly
     if(entry & AC_FLAGS)
@@ -55,12 +55,15 @@ uint32_t FASTCALL read_word_ldr(uint32_t addr)
 
     entry += addr;
 
+    if(unlikely(RAM_FLAGS(entry & ~3) & DO_READ_ACTION))
+        read_action((void*)entry);
+
     return *(uint32_t*)entry;
 }
 
 uint32_t FASTCALL read_byte(uint32_t addr)
 {
-    uintptr_t entry = *(uintptr_t*)(addr_cache + ((addr >> 10) << 1));
+    uintptr_t entry = (uintptr_t)AC_ENTRY((addr >> 10) << 1);
 
     //If the sum doesn't contain the address directly
     if(entry & AC_FLAGS)
@@ -80,12 +83,15 @@ uint32_t FASTCALL read_byte(uint32_t addr)
 
     entry += addr;
 
+    if(unlikely(RAM_FLAGS(entry & ~3) & DO_READ_ACTION))
+        read_action((void*)entry);
+
     return *(uint8_t*)entry;
 }
 
 uint32_t FASTCALL read_half(uint32_t addr)
 {
-    uintptr_t entry = *(uintptr_t*)(addr_cache + ((addr >> 10) << 1));
+    uintptr_t entry = (uintptr_t)AC_ENTRY((addr >> 10) << 1);
 
     //If the sum doesn't contain the address directly
     if(entry & AC_FLAGS)
@@ -105,6 +111,9 @@ uint32_t FASTCALL read_half(uint32_t addr)
 
     entry += addr;
 
+    if(unlikely(RAM_FLAGS(entry & ~3) & DO_READ_ACTION))
+        read_action((void*)entry);
+
     return *(uint16_t*)entry;
 }
 
@@ -115,7 +124,7 @@ uint32_t FASTCALL read_word(uint32_t addr)
 
 void FASTCALL write_byte(uint32_t addr, uint32_t value)
 {
-    uintptr_t entry = *(uintptr_t*)(addr_cache + ((addr >> 10) << 1) + 1);
+    uintptr_t entry = (uintptr_t)AC_ENTRY(((addr >> 10) << 1) + 1);
 
     //If the sum doesn't contain the address directly
     if(entry & AC_NOT_PTR)
@@ -135,12 +144,15 @@ void FASTCALL write_byte(uint32_t addr, uint32_t value)
 
     entry += addr;
 
+    if(unlikely(RAM_FLAGS(entry & ~3) & DO_WRITE_ACTION))
+        write_action((void*)entry);
+
     *(uint8_t*)entry = value;
 }
 
 void FASTCALL write_half(uint32_t addr, uint32_t value)
 {
-    uintptr_t entry = *(uintptr_t*)(addr_cache + ((addr >> 10) << 1) + 1);
+    uintptr_t entry = (uintptr_t)AC_ENTRY(((addr >> 10) << 1) + 1);
 
     //If the sum doesn't contain the address directly
     if(entry & AC_NOT_PTR)
@@ -160,12 +172,15 @@ void FASTCALL write_half(uint32_t addr, uint32_t value)
 
     entry += addr;
 
+    if(unlikely(RAM_FLAGS(entry & ~3) & DO_WRITE_ACTION))
+        write_action((void*)entry);
+
     *(uint16_t*)entry = value;
 }
 
 void FASTCALL write_word(uint32_t addr, uint32_t value)
 {
-    uintptr_t entry = *(uintptr_t*)(addr_cache + ((addr >> 10) << 1) + 1);
+    uintptr_t entry = (uintptr_t)AC_ENTRY(((addr >> 10) << 1) + 1);
 
     //If the sum doesn't contain the address directly
     if(entry & AC_NOT_PTR)
@@ -185,5 +200,8 @@ void FASTCALL write_word(uint32_t addr, uint32_t value)
 
     entry += addr;
 
+    if(unlikely(RAM_FLAGS(entry & ~3) & DO_WRITE_ACTION))
+        write_action((void*)entry);
+
     *(uint32_t*)entry = value;
 }
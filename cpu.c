@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "emu.h"
 #include "cpu.h"
@@ -8,6 +9,7 @@
 #include "asmcode.h"
 #include "armsnippets.h"
 #include "translate.h"
+#include "schedule.h"
 
 struct arm_state arm;
 
@@ -269,32 +271,150 @@ void cpu_exception(int type) {
         arm.reg[15] += 0xFFFF0000;
 }
 
-void cpu_interpret_instruction(uint32_t insn) {
-    int exec;
-    switch (insn >> 29) {
-        case 0:  /* EQ/NE */ exec = arm.cpsr_z; break;
-        case 1:  /* CS/CC */ exec = arm.cpsr_c; break;
-        case 2:  /* MI/PL */ exec = arm.cpsr_n; break;
-        case 3:  /* VS/VC */ exec = arm.cpsr_v; break;
-        case 4:  /* HI/LS */ exec = !arm.cpsr_z && arm.cpsr_c; break;
-        case 5:  /* GE/LT */ exec = arm.cpsr_n == arm.cpsr_v; break;
-        case 6:  /* GT/LE */ exec = !arm.cpsr_z && arm.cpsr_n == arm.cpsr_v; break;
-        default: /* AL/-- */ exec = 1;
-            if (insn & (1 << 28)) {
-                if ((insn & 0xFD70F000) == 0xF550F000) {
-                    /* PLD: Preload to cache (implemented as no-op) */
-                } else if ((insn & 0xFE000000) == 0xFA000000) {
-                    /* BLX: Branch, link, and exchange T bit */
-                    arm.reg[14] = arm.reg[15];
-                    arm.reg[15] += 4 + ((int32_t)insn << 8 >> 6) + (insn >> 23 & 2);
-                    arm.cpsr_low28 |= 0x20; /* Enter THUMB mode */
-                } else {
-                    error("Invalid condition code");
-                }
-                return;
+/* Coprocessor 15 (system control) registers. Also called from translated
+ * code, with arm.reg[15] set to the address of the next instruction. */
+void FASTCALL cp15_write(uint32_t insn, uint32_t value) {
+    switch (insn & 0xEF00EF) {
+        case 0x010000: { /* MCR p15, 0, <Rd>, c1, c0, 0: Control Register */
+            uint32_t change = value ^ arm.control;
+            if ((value & 0xFFFF8CF8) != 0x00050078)
+                error("Bad or unimplemented control register value: %x\n", value);
+            arm.control = value;
+            if (change & 1) // MMU is being turned on or off
+                addr_cache_flush();
+            break;
+        }
+        case 0x020000: /* MCR p15, 0, <Rd>, c2, c0, 0: Translation Table Base Register */
+            arm.translation_table_base = value & ~0x3FFF;
+            addr_cache_flush();
+            break;
+        case 0x030000: /* MCR p15, 0, <Rd>, c3, c0, 0: Domain Access Control Register */
+            arm.domain_access_control = value;
+            addr_cache_flush();
+            break;
+        case 0x050000: /* MCR p15, 0, <Rd>, c5, c0, 0: Data Fault Status Register */
+            arm.data_fault_status = value;
+            break;
+        case 0x050020: /* MCR p15, 0, <Rd>, c5, c0, 1: Instruction Fault Status Register */
+            arm.instruction_fault_status = value;
+            break;
+        case 0x060000: /* MCR p15, 0, <Rd>, c6, c0, 0: Fault Address Register */
+            arm.fault_address = value;
+            break;
+        case 0x070080: /* MCR p15, 0, <Rd>, c7, c0, 4: Wait for interrupt */
+            cycle_count_delta = 0;
+            if (arm.interrupts == 0) {
+                arm.reg[15] -= 4;
+                cpu_events |= EVENT_WAITING;
+                //is_halting = 10;
             }
+            break;
+        case 0x080025: /* MCR p15, 0, <Rd>, c8, c5, 1: Invalidate instruction TLB entry */
+        case 0x080026: /* MCR p15, 0, <Rd>, c8, c6, 1: Invalidate data TLB entry */
+        case 0x080007: /* MCR p15, 0, <Rd>, c8, c7, 0: Invalidate TLB */
+            addr_cache_tlb_flush();
+            break;
+        case 0x070005: /* MCR p15, 0, <Rd>, c7, c5, 0: Invalidate ICache */
+        case 0x070025: /* MCR p15, 0, <Rd>, c7, c5, 1: Invalidate ICache line */
+        case 0x070007: /* MCR p15, 0, <Rd>, c7, c7, 0: Invalidate ICache and DCache */
+        case 0x07002A: /* MCR p15, 0, <Rd>, c7, c10, 1: Clean DCache line */
+        case 0x07008A: /* MCR p15, 0, <Rd>, c7, c10, 4: Drain write buffer */
+        case 0x0F0000: /* MCR p15, 0, <Rd>, c15, c0, 0: Debug Override Register */
+            // Ignore
+            break;
+        default:
+            warn("Unknown coprocessor instruction MCR %08X", insn);
+            break;
     }
-    if (!(exec ^ (insn >> 28 & 1)))
+}
+
+uint32_t FASTCALL cp15_read(uint32_t insn) {
+    uint32_t value;
+    switch (insn & 0xEF00EF) {
+        case 0x000000: /* MRC p15, 0, <Rd>, c0, c0, 0: ID Code Register */
+            value = 0x41069264; /* ARM926EJ-S revision 4 */
+            break;
+        case 0x000010: /* MRC p15, 0, <Rd>, c0, c0, 1: Cache Type Register */
+            value = 0x1D112152; /* ICache: 16KB 4-way 8 word, DCache: 8KB 4-way 8 word */
+            break;
+        case 0x000020: /* MRC p15, 0, <Rd>, c0, c0, 2: TCM Status Register */
+            value = 0;
+            break;
+        case 0x010000: /* MRC p15, 0, <Rd>, c1, c0, 0: Control Register */
+            value = arm.control;
+            break;
+        case 0x020000: /* MRC p15, 0, <Rd>, c2, c0, 0: Translation Table Base Register */
+            value = arm.translation_table_base;
+            break;
+        case 0x030000: /* MRC p15, 0, <Rd>, c3, c0, 0: Domain Access Control Register */
+            value = arm.domain_access_control;
+            break;
+        case 0x050000: /* MRC p15, 0, <Rd>, c5, c0, 0: Data Fault Status Register */
+            value = arm.data_fault_status;
+            break;
+        case 0x050020: /* MRC p15, 0, <Rd>, c5, c0, 1: Instruction Fault Status Register */
+            value = arm.instruction_fault_status;
+            break;
+        case 0x060000: /* MRC p15, 0, <Rd>, c6, c0, 0: Fault Address Register */
+            value = arm.fault_address;
+            break;
+        case 0x07006A: /* MRC p15, 0, <Rd>, c7, c10, 3: Test and clean DCache */
+            value = 1 << 30;
+            break;
+        case 0x07006E: /* MRC p15, 0, <Rd>, c7, c14, 3: Test, clean, and invalidate DCache */
+            value = 1 << 30;
+            break;
+        case 0x0F0000: /* MRC p15, 0, <Rd>, c15, c0, 0: Debug Override Register */
+            // Unimplemented
+            value = 0;
+            break;
+        default:
+            warn("Unknown coprocessor instruction MRC %08X", insn);
+            value = 0;
+            break;
+    }
+    return value;
+}
+
+/* Data processing operations; c is the carry flag from before the operand
+ * was shifted */
+static inline uint32_t arm_alu(int opcode, uint32_t left, uint32_t right, uint8_t c, int setcc) {
+    switch (opcode) {
+        default: /* not used, obviously - here to shut up gcc warning */
+        case 0:  /* AND */ return left & right;
+        case 1:  /* EOR */ return left ^ right;
+        case 2:  /* SUB */ return add( left, ~right, 1, setcc);
+        case 3:  /* RSB */ return add(~left,  right, 1, setcc);
+        case 4:  /* ADD */ return add( left,  right, 0, setcc);
+        case 5:  /* ADC */ return add( left,  right, c, setcc);
+        case 6:  /* SBC */ return add( left, ~right, c, setcc);
+        case 7:  /* RSC */ return add(~left,  right, c, setcc);
+        case 8:  /* TST */ return left & right;
+        case 9:  /* TEQ */ return left ^ right;
+        case 10: /* CMP */ return add( left, ~right, 1, setcc);
+        case 11: /* CMN */ return add( left,  right, 0, setcc);
+        case 12: /* ORR */ return left | right;
+        case 13: /* MOV */ return right;
+        case 14: /* BIC */ return left & ~right;
+        case 15: /* MVN */ return ~right;
+    }
+}
+
+void cpu_interpret_instruction(uint32_t insn) {
+    if (insn >= 0xF0000000) {
+        if ((insn & 0xFD70F000) == 0xF550F000) {
+            /* PLD: Preload to cache (implemented as no-op) */
+        } else if ((insn & 0xFE000000) == 0xFA000000) {
+            /* BLX: Branch, link, and exchange T bit */
+            arm.reg[14] = arm.reg[15];
+            arm.reg[15] += 4 + ((int32_t)insn << 8 >> 6) + (insn >> 23 & 2);
+            arm.cpsr_low28 |= 0x20; /* Enter THUMB mode */
+        } else {
+            error("Invalid condition code");
+        }
+        return;
+    }
+    if (!condition_passed(insn >> 28))
         return;
 
     if ((insn & 0xE000090) == 0x0000090) {
@@ -513,25 +633,7 @@ void cpu_interpret_instruction(uint32_t insn) {
         else
             right = get_shifted_reg(insn, setcc);
 
-        switch (opcode) {
-            default: /* not used, obviously - here to shut up gcc warning */
-            case 0:  /* AND */ res = left & right; break;
-            case 1:  /* EOR */ res = left ^ right; break;
-            case 2:  /* SUB */ res = add( left, ~right, 1, setcc); break;
-            case 3:  /* RSB */ res = add(~left,  right, 1, setcc); break;
-            case 4:  /* ADD */ res = add( left,  right, 0, setcc); break;
-            case 5:  /* ADC */ res = add( left,  right, c, setcc); break;
-            case 6:  /* SBC */ res = add( left, ~right, c, setcc); break;
-            case 7:  /* RSC */ res = add(~left,  right, c, setcc); break;
-            case 8:  /* TST */ res = left & right; break;
-            case 9:  /* TEQ */ res = left ^ right; break;
-            case 10: /* CMP */ res = add( left, ~right, 1, setcc); break;
-            case 11: /* CMN */ res = add( left,  right, 0, setcc); break;
-            case 12: /* ORR */ res = left | right; break;
-            case 13: /* MOV */ res = right; break;
-            case 14: /* BIC */ res = left & ~right; break;
-            case 15: /* MVN */ res = ~right; break;
-        }
+        res = arm_alu(opcode, left, right, c, setcc);
 
         if ((opcode & 12) == 8) {
             if (dest_reg != 0)
@@ -648,105 +750,10 @@ void cpu_interpret_instruction(uint32_t insn) {
         arm.reg[15] += 4 + ((int32_t)insn << 8 >> 6);
     } else if ((insn & 0xF100F10) == 0xE000F10) {
         /* MCR p15 */
-        uint32_t value = get_reg(insn >> 12 & 15);
-        switch (insn & 0xEF00EF) {
-            case 0x010000: { /* MCR p15, 0, <Rd>, c1, c0, 0: Control Register */
-                uint32_t change = value ^ arm.control;
-                if ((value & 0xFFFF8CF8) != 0x00050078)
-                    error("Bad or unimplemented control register value: %x\n", value);
-                arm.control = value;
-                if (change & 1) // MMU is being turned on or off
-                    addr_cache_flush();
-                break;
-            }
-            case 0x020000: /* MCR p15, 0, <Rd>, c2, c0, 0: Translation Table Base Register */
-                arm.translation_table_base = value & ~0x3FFF;
-                addr_cache_flush();
-                break;
-            case 0x030000: /* MCR p15, 0, <Rd>, c3, c0, 0: Domain Access Control Register */
-                arm.domain_access_control = value;
-                addr_cache_flush();
-                break;
-            case 0x050000: /* MCR p15, 0, <Rd>, c5, c0, 0: Data Fault Status Register */
-                arm.data_fault_status = value;
-                break;
-            case 0x050020: /* MCR p15, 0, <Rd>, c5, c0, 1: Instruction Fault Status Register */
-                arm.instruction_fault_status = value;
-                break;
-            case 0x060000: /* MCR p15, 0, <Rd>, c6, c0, 0: Fault Address Register */
-                arm.fault_address = value;
-                break;
-            case 0x070080: /* MCR p15, 0, <Rd>, c7, c0, 4: Wait for interrupt */
-                cycle_count_delta = 0;
-                if (arm.interrupts == 0) {
-                    arm.reg[15] -= 4;
-                    cpu_events |= EVENT_WAITING;
-                    //is_halting = 10;
-                }
-                break;
-            case 0x080025: /* MCR p15, 0, <Rd>, c8, c5, 1: Invalidate instruction TLB entry */
-            case 0x080026: /* MCR p15, 0, <Rd>, c8, c6, 1: Invalidate data TLB entry */
-            case 0x080007: /* MCR p15, 0, <Rd>, c8, c7, 0: Invalidate TLB */
-                addr_cache_flush();
-                break;
-            case 0x070005: /* MCR p15, 0, <Rd>, c7, c5, 0: Invalidate ICache */
-            case 0x070025: /* MCR p15, 0, <Rd>, c7, c5, 1: Invalidate ICache line */
-            case 0x070007: /* MCR p15, 0, <Rd>, c7, c7, 0: Invalidate ICache and DCache */
-            case 0x07002A: /* MCR p15, 0, <Rd>, c7, c10, 1: Clean DCache line */
-            case 0x07008A: /* MCR p15, 0, <Rd>, c7, c10, 4: Drain write buffer */
-            case 0x0F0000: /* MCR p15, 0, <Rd>, c15, c0, 0: Debug Override Register */
-                // Ignore
-                break;
-            default:
-                warn("Unknown coprocessor instruction MCR %08X", insn);
-                break;
-        }
+        cp15_write(insn, get_reg(insn >> 12 & 15));
     } else if ((insn & 0xF100F10) == 0xE100F10) {
         /* MRC p15 */
-        uint32_t value;
-        switch (insn & 0xEF00EF) {
-            case 0x000000: /* MRC p15, 0, <Rd>, c0, c0, 0: ID Code Register */
-                value = 0x41069264; /* ARM926EJ-S revision 4 */
-                break;
-            case 0x000010: /* MRC p15, 0, <Rd>, c0, c0, 1: Cache Type Register */
-                value = 0x1D112152; /* ICache: 16KB 4-way 8 word, DCache: 8KB 4-way 8 word */
-                break;
-            case 0x000020: /* MRC p15, 0, <Rd>, c0, c0, 2: TCM Status Register */
-                value = 0;
-                break;
-            case 0x010000: /* MRC p15, 0, <Rd>, c1, c0, 0: Control Register */
-                value = arm.control;
-                break;
-            case 0x020000: /* MRC p15, 0, <Rd>, c2, c0, 0: Translation Table Base Register */
-                value = arm.translation_table_base;
-                break;
-            case 0x030000: /* MRC p15, 0, <Rd>, c3, c0, 0: Domain Access Control Register */
-                value = arm.domain_access_control;
-                break;
-            case 0x050000: /* MRC p15, 0, <Rd>, c5, c0, 0: Data Fault Status Register */
-                value = arm.data_fault_status;
-                break;
-            case 0x050020: /* MRC p15, 0, <Rd>, c5, c0, 1: Instruction Fault Status Register */
-                value = arm.instruction_fault_status;
-                break;
-            case 0x060000: /* MRC p15, 0, <Rd>, c6, c0, 0: Fault Address Register */
-                value = arm.fault_address;
-                break;
-            case 0x07006A: /* MRC p15, 0, <Rd>, c7, c10, 3: Test and clean DCache */
-                value = 1 << 30;
-                break;
-            case 0x07006E: /* MRC p15, 0, <Rd>, c7, c14, 3: Test, clean, and invalidate DCache */
-                value = 1 << 30;
-                break;
-            case 0x0F0000: /* MRC p15, 0, <Rd>, c15, c0, 0: Debug Override Register */
-                // Unimplemented
-                value = 0;
-                break;
-            default:
-                warn("Unknown coprocessor instruction MRC %08X", insn);
-                value = 0;
-                break;
-        }
+        uint32_t value = cp15_read(insn);
         if ((insn >> 12 & 15) == 15) {
             arm.cpsr_n = value >> 31 & 1;
             arm.cpsr_z = value >> 30 & 1;
@@ -764,16 +771,781 @@ bad_insn:
     }
 }
 
+/* THUMB ALU operations, on registers dst and src. Returns the result for
+ * the N and Z flags. */
+static inline uint32_t thumb_alu(int op, int rd, uint32_t src) {
+    switch (op) {
+        default:
+        case 0x0: /* AND */ return arm.reg[rd] &= src;
+        case 0x1: /* EOR */ return arm.reg[rd] ^= src;
+        case 0x2: /* LSL */ return arm.reg[rd] = shift(0, arm.reg[rd], src & 0xFF, true);
+        case 0x3: /* LSR */ return arm.reg[rd] = shift(1, arm.reg[rd], src & 0xFF, true);
+        case 0x4: /* ASR */ return arm.reg[rd] = shift(2, arm.reg[rd], src & 0xFF, true);
+        case 0x5: /* ADC */ return arm.reg[rd] = add(arm.reg[rd], src, arm.cpsr_c, true);
+        case 0x6: /* SBC */ return arm.reg[rd] = add(arm.reg[rd], ~src, arm.cpsr_c, true);
+        case 0x7: /* ROR */ return arm.reg[rd] = shift(3, arm.reg[rd], src & 0xFF, true);
+        case 0x8: /* TST */ return arm.reg[rd] & src;
+        case 0x9: /* NEG */ return arm.reg[rd] = add(0, ~src, 1, true);
+        case 0xA: /* CMP */ return add(arm.reg[rd], ~src, 1, true);
+        case 0xB: /* CMN */ return add(arm.reg[rd], src, 0, true);
+        case 0xC: /* ORR */ return arm.reg[rd] |= src;
+        case 0xD: /* MUL */ return arm.reg[rd] *= src;
+        case 0xE: /* BIC */ return arm.reg[rd] &= ~src;
+        case 0xF: /* MVN */ return arm.reg[rd] = ~src;
+    }
+}
+
+void cpu_interpret_thumb_instruction(uint16_t insn) {
+#define CASE_x2(base) case base: case base+1
+#define CASE_x4(base) CASE_x2(base): CASE_x2(base+2)
+#define CASE_x8(base) CASE_x4(base): CASE_x4(base+4)
+#define REG0 arm.reg[insn & 7]
+#define REG3 arm.reg[insn >> 3 & 7]
+#define REG6 arm.reg[insn >> 6 & 7]
+#define REG8 arm.reg[insn >> 8 & 7]
+    switch (insn >> 8) {
+        CASE_x8(0x00): /* LSL Rd, Rm, #imm */
+            CASE_x8(0x08): /* LSR Rd, Rm, #imm */
+          CASE_x8(0x10): /* ASR Rd, Rm, #imm */
+          set_nz_flags(REG0 = shift(insn >> 11, REG3, insn >> 6 & 31, true));
+        break;
+        CASE_x2(0x18): /* ADD Rd, Rn, Rm */ set_nz_flags(REG0 = add(REG3, REG6, 0, true)); break;
+        CASE_x2(0x1A): /* SUB Rd, Rn, Rm */ set_nz_flags(REG0 = add(REG3, ~REG6, 1, true)); break;
+        CASE_x2(0x1C): /* ADD Rd, Rn, #imm */ set_nz_flags(REG0 = add(REG3, insn >> 6 & 7, 0, true)); break;
+        CASE_x2(0x1E): /* SUB Rd, Rn, #imm */ set_nz_flags(REG0 = add(REG3, ~(insn >> 6 & 7), 1, true)); break;
+        CASE_x8(0x20): /* MOV Rd, #imm */ set_nz_flags(REG8 = insn & 0xFF); break;
+        CASE_x8(0x28): /* CMP Rn, #imm */ set_nz_flags(add(REG8, ~(insn & 0xFF), 1, true)); break;
+        CASE_x8(0x30): /* ADD Rd, #imm */ set_nz_flags(REG8 = add(REG8, insn & 0xFF, 0, true)); break;
+        CASE_x8(0x38): /* SUB Rd, #imm */ set_nz_flags(REG8 = add(REG8, ~(insn & 0xFF), 1, true)); break;
+        CASE_x4(0x40): /* ALU operations */
+            set_nz_flags(thumb_alu(insn >> 6 & 15, insn & 7, REG3));
+            break;
+        case 0x44: { /* ADD Rd, Rm (high registers allowed) */
+            uint32_t left = (insn >> 4 & 8) | (insn & 7), right = insn >> 3 & 15;
+            set_reg_pc(left, get_reg_pc_thumb(left) + get_reg_pc_thumb(right));
+            break;
+        }
+        case 0x45: { /* CMP Rn, Rm (high registers allowed) */
+            uint32_t left = (insn >> 4 & 8) | (insn & 7), right = insn >> 3 & 15;
+            set_nz_flags(add(get_reg(left), ~get_reg_pc_thumb(right), 1, true));
+            break;
+        }
+        case 0x46: { /* MOV Rd, Rm (high registers allowed) */
+            uint32_t left = (insn >> 4 & 8) | (insn & 7), right = insn >> 3 & 15;
+            set_reg_pc(left, get_reg_pc_thumb(right));
+            break;
+        }
+        case 0x47: { /* BX/BLX Rm (high register allowed) */
+            uint32_t target = get_reg_pc_thumb(insn >> 3 & 15);
+            if (insn & 0x80)
+                arm.reg[14] = arm.reg[15] + 1;
+            arm.reg[15] = target & ~1;
+            if (!(target & 1)) {
+                arm.cpsr_low28 &= ~0x20; /* Exit THUMB mode */
+                return;
+            }
+            break;
+        }
+            CASE_x8(0x48): /* LDR reg, [PC, #imm] */ REG8 = read_word_ldr(((arm.reg[15] + 2) & -4) + ((insn & 0xFF) << 2)); break;
+            CASE_x2(0x50): /* STR   Rd, [Rn, Rm] */ write_word(REG3 + REG6, REG0); break;
+            CASE_x2(0x52): /* STRH  Rd, [Rn, Rm] */ write_half(REG3 + REG6, REG0); break;
+            CASE_x2(0x54): /* STRB  Rd, [Rn, Rm] */ write_byte(REG3 + REG6, REG0); break;
+            CASE_x2(0x56): /* LDRSB Rd, [Rn, Rm] */ REG0 = (int8_t)read_byte(REG3 + REG6); break;
+            CASE_x2(0x58): /* LDR   Rd, [Rn, Rm] */ REG0 = read_word_ldr(REG3 + REG6); break;
+            CASE_x2(0x5A): /* LDRH  Rd, [Rn, Rm] */ REG0 = read_half(REG3 + REG6); break;
+            CASE_x2(0x5C): /* LDRB  Rd, [Rn, Rm] */ REG0 = read_byte(REG3 + REG6); break;
+            CASE_x2(0x5E): /* LDRSH Rd, [Rn, Rm] */ REG0 = (int16_t)read_half(REG3 + REG6); break;
+            CASE_x8(0x60): /* STR  Rd, [Rn, #imm] */ write_word(REG3 + (insn >> 4 & 124), REG0); break;
+            CASE_x8(0x68): /* LDR  Rd, [Rn, #imm] */ REG0 = read_word_ldr(REG3 + (insn >> 4 & 124)); break;
+            CASE_x8(0x70): /* STRB Rd, [Rn, #imm] */ write_byte(REG3 + (insn >> 6 & 31), REG0); break;
+            CASE_x8(0x78): /* LDRB Rd, [Rn, #imm] */ REG0 = read_byte(REG3 + (insn >> 6 & 31)); break;
+            CASE_x8(0x80): /* STRH Rd, [Rn, #imm] */ write_half(REG3 + (insn >> 5 & 62), REG0); break;
+            CASE_x8(0x88): /* LDRH Rd, [Rn, #imm] */ REG0 = read_half(REG3 + (insn >> 5 & 62)); break;
+            CASE_x8(0x90): /* STR Rd, [SP, #imm] */ write_word(arm.reg[13] + ((insn & 0xFF) << 2), REG8); break;
+            CASE_x8(0x98): /* LDR Rd, [SP, #imm] */ REG8 = read_word_ldr(arm.reg[13] + ((insn & 0xFF) << 2)); break;
+            CASE_x8(0xA0): /* ADD Rd, PC, #imm */ REG8 = ((arm.reg[15] + 2) & -4) + ((insn & 0xFF) << 2); break;
+            CASE_x8(0xA8): /* ADD Rd, SP, #imm */ REG8 = arm.reg[13] + ((insn & 0xFF) << 2); break;
+        case 0xB0: /* ADD/SUB SP, #imm */
+            arm.reg[13] += ((insn & 0x80) ? -(insn & 0x7F) : (insn & 0x7F)) << 2;
+            break;
+
+            CASE_x2(0xB4): { /* PUSH {reglist[,LR]} */
+                int i;
+                uint32_t addr = arm.reg[13];
+                for (i = 8; i >= 0; i--)
+                    addr -= (insn >> i & 1) * 4;
+                uint32_t sp = addr;
+                for (i = 0; i < 8; i++)
+                    if (insn >> i & 1)
+                        write_word(addr, arm.reg[i]), addr += 4;
+                if (insn & 0x100)
+                    write_word(addr, arm.reg[14]);
+                arm.reg[13] = sp;
+                break;
+            }
+
+            CASE_x2(0xBC): { /* POP {reglist[,PC]} */
+                int i;
+                uint32_t addr = arm.reg[13];
+                for (i = 0; i < 8; i++)
+                    if (insn >> i & 1)
+                        arm.reg[i] = read_word(addr), addr += 4;
+                if (insn & 0x100) {
+                    uint32_t target = read_word(addr); addr += 4;
+                    arm.reg[15] = target & ~1;
+                    if (!(target & 1)) {
+                        arm.cpsr_low28 &= ~0x20;
+                        arm.reg[13] = addr;
+                        return;
+                    }
+                }
+                arm.reg[13] = addr;
+                break;
+            }
+        case 0xBE:
+            printf("Software breakpoint at %08x (%02x)\n", arm.reg[15], insn & 0xFF);
+            debugger(DBG_EXEC_BREAKPOINT, 0);
+            break;
+
+            CASE_x8(0xC0): { /* STMIA Rn!, {reglist} */
+                int i;
+                uint32_t addr = REG8;
+                for (i = 0; i < 8; i++)
+                    if (insn >> i & 1)
+                        write_word(addr, arm.reg[i]), addr += 4;
+                REG8 = addr;
+                break;
+            }
+            CASE_x8(0xC8): { /* LDMIA Rn!, {reglist} */
+                int i;
+                uint32_t addr = REG8;
+                uint32_t tmp = 0; // value not used, just suppressing uninitialized variable warning
+                for (i = 0; i < 8; i++) {
+                    if (insn >> i & 1) {
+                        if (i == (insn >> 8 & 7))
+                            tmp = read_word(addr);
+                        else
+                            arm.reg[i] = read_word(addr);
+                        addr += 4;
+                    }
+                }
+                // must set address register last so it is unchanged on exception
+                REG8 = addr;
+                if (insn >> (insn >> 8 & 7) & 1)
+                    REG8 = tmp;
+                break;
+            }
+#define BRANCH_IF(cond) if (cond) arm.reg[15] += 2 + ((int8_t)insn << 1); break;
+        case 0xD0: /* BEQ */ BRANCH_IF(arm.cpsr_z)
+                case 0xD1: /* BNE */ BRANCH_IF(!arm.cpsr_z)
+          case 0xD2: /* BCS */ BRANCH_IF(arm.cpsr_c)
+          case 0xD3: /* BCC */ BRANCH_IF(!arm.cpsr_c)
+          case 0xD4: /* BMI */ BRANCH_IF(arm.cpsr_n)
+          case 0xD5: /* BPL */ BRANCH_IF(!arm.cpsr_n)
+          case 0xD6: /* BVS */ BRANCH_IF(arm.cpsr_v)
+          case 0xD7: /* BVC */ BRANCH_IF(!arm.cpsr_v)
+          case 0xD8: /* BHI */ BRANCH_IF(arm.cpsr_c > arm.cpsr_z)
+          case 0xD9: /* BLS */ BRANCH_IF(arm.cpsr_c <= arm.cpsr_z)
+          case 0xDA: /* BGE */ BRANCH_IF(arm.cpsr_n == arm.cpsr_v)
+          case 0xDB: /* BLT */ BRANCH_IF(arm.cpsr_n != arm.cpsr_v)
+          case 0xDC: /* BGT */ BRANCH_IF(!arm.cpsr_z && arm.cpsr_n == arm.cpsr_v)
+          case 0xDD: /* BLE */ BRANCH_IF(arm.cpsr_z || arm.cpsr_n != arm.cpsr_v)
+
+          case 0xDF: /* SWI */
+              cpu_exception(EX_SWI);
+            return; /* Exits THUMB mode */
+
+            CASE_x8(0xE0): /* B */ arm.reg[15] += 2 + ((int32_t)insn << 21 >> 20); break;
+            CASE_x8(0xE8): { /* Second half of BLX */
+                uint32_t target = (arm.reg[14] + ((insn & 0x7FF) << 1)) & ~3;
+                arm.reg[14] = arm.reg[15] + 1;
+                arm.reg[15] = target;
+                arm.cpsr_low28 &= ~0x20; /* Exit THUMB mode */
+                return;
+            }
+            CASE_x8(0xF0): /* First half of BL/BLX */
+                arm.reg[14] = arm.reg[15] + 2 + ((int32_t)insn << 21 >> 9);
+            break;
+            CASE_x8(0xF8): { /* Second half of BL */
+                uint32_t target = arm.reg[14] + ((insn & 0x7FF) << 1);
+                arm.reg[14] = arm.reg[15] + 1;
+                arm.reg[15] = target;
+                break;
+            }
+        default:
+            error("Unknown instruction: %04X\n", insn);
+            break;
+    }
+}
+
+/* ----------------------------------------------------------------------
+ * Decoded instruction cache. Instructions are run by an operation chosen the
+ * first time they are seen, with their operands already extracted, instead
+ * of being decoded again every time. Entries are kept per 1 KB page of
+ * memory, separately for ARM words and THUMB halfwords, so that the loops
+ * below can run through consecutive ones without looking the PC up again.
+ * The words they were decoded from are flagged RF_CODE_DECODED, so a write
+ * to one goes through write_action, which drops its entries. Words with
+ * exec flags never get one, since the loops must stop there. */
+
+#define DECODED_PAGES (MEM_MAXSIZE >> 10)
+#define DECODED_MAX_PAGES 2048 // pages with entries before they are all dropped
+static struct decoded_insn *decoded_arm_pages[DECODED_PAGES];
+static struct decoded_insn *decoded_thumb_pages[DECODED_PAGES];
+static uint32_t decoded_page_list[DECODED_MAX_PAGES];
+static int num_decoded_pages;
+// Counts flushes, so that a run stops if one of its instructions caused one
+static uint32_t decoded_flushes;
+
+/* ARM data processing, with the second operand an immediate, a register,
+ * or a shifted register. Neither Rd nor Rn is the PC. */
+enum { DOP_IMM, DOP_REG, DOP_SHIFT };
+static inline __attribute__((always_inline))
+void decoded_data_proc(const struct decoded_insn *d, int opcode, int operand, int setcc) {
+    uint8_t c = arm.cpsr_c;
+    uint32_t left = arm.reg[d->rn], right, res;
+    if (operand == DOP_IMM) {
+        right = d->imm;
+        if (setcc && d->rm) // rotated
+            arm.cpsr_c = right >> 31;
+    } else if (operand == DOP_REG) {
+        right = arm.reg[d->rm];
+    } else {
+        right = get_shifted_reg(d->insn, setcc);
+    }
+    res = arm_alu(opcode, left, right, c, setcc);
+    if ((opcode & 12) != 8)
+        arm.reg[d->rd] = res;
+    if (setcc)
+        set_nz_flags(res);
+}
+
+/* ARM LDR(B)/STR(B), with an immediate offset (already signed, and for a PC
+ * base including the +4 the PC is off by) or a shifted register offset.
+ * Rd is not the PC, and a load with writeback does not go to the base. */
+enum { LS_OFFSET, LS_PRE_INDEXED, LS_POST_INDEXED };
+static inline __attribute__((always_inline))
+void decoded_load_store(const struct decoded_insn *d, int load, int byte, int mode, int reg_offset) {
+    uint32_t rd = d->rd, rn = d->rn;
+    uint32_t offset = d->imm;
+    if (reg_offset) {
+        offset = get_shifted_reg(d->insn, 0);
+        if (!(d->insn & (1 << 23)))
+            offset = -offset;
+    }
+    uint32_t addr = arm.reg[rn];
+    if (mode != LS_POST_INDEXED)
+        addr += offset;
+    if (load) {
+        uint32_t value = byte ? read_byte(addr) : read_word_ldr(addr);
+        arm.reg[rd] = value;
+    } else {
+        if (byte) write_byte(addr, arm.reg[rd]);
+        else      write_word(addr, arm.reg[rd]);
+    }
+    if (mode == LS_PRE_INDEXED)
+        arm.reg[rn] = addr;
+    else if (mode == LS_POST_INDEXED)
+        arm.reg[rn] = addr + offset;
+}
+
+/* MUL, MLA: rn is the accumulator, imm the multiplier register */
+static inline __attribute__((always_inline))
+void decoded_multiply(const struct decoded_insn *d, int accumulate, int setcc) {
+    uint32_t res = arm.reg[d->rm] * arm.reg[d->imm];
+    if (accumulate)
+        res += arm.reg[d->rn];
+    arm.reg[d->rd] = res;
+    if (setcc)
+        set_nz_flags(res);
+}
+
+/* The ARM operations, as X(name, body running d). Each one becomes a handler
+ * function (arm_<name>) and a label in run_arm, and its index in the list is
+ * kept in d->op. The data processing and load/store ones are indexed by their
+ * variant; see cpu_decode_instruction. */
+#define DP_OPS(X, op) \
+    X(dp##op##_imm,   decoded_data_proc(d, op, DOP_IMM, 0)) \
+    X(dp##op##_imms,  decoded_data_proc(d, op, DOP_IMM, 1)) \
+    X(dp##op##_reg,   decoded_data_proc(d, op, DOP_REG, 0)) \
+    X(dp##op##_regs,  decoded_data_proc(d, op, DOP_REG, 1)) \
+    X(dp##op##_shift, decoded_data_proc(d, op, DOP_SHIFT, 0)) \
+    X(dp##op##_shifts, decoded_data_proc(d, op, DOP_SHIFT, 1))
+#define LS_OPS(X, name, load, byte) \
+    X(name##_offset,    decoded_load_store(d, load, byte, LS_OFFSET, 0)) \
+    X(name##_offset_r,  decoded_load_store(d, load, byte, LS_OFFSET, 1)) \
+    X(name##_pre,       decoded_load_store(d, load, byte, LS_PRE_INDEXED, 0)) \
+    X(name##_pre_r,     decoded_load_store(d, load, byte, LS_PRE_INDEXED, 1)) \
+    X(name##_post,      decoded_load_store(d, load, byte, LS_POST_INDEXED, 0)) \
+    X(name##_post_r,    decoded_load_store(d, load, byte, LS_POST_INDEXED, 1))
+#define ARM_DECODED_OPS(X) \
+    X(generic, cpu_interpret_instruction(d->insn)) \
+    DP_OPS(X, 0)  DP_OPS(X, 1)  DP_OPS(X, 2)  DP_OPS(X, 3) \
+    DP_OPS(X, 4)  DP_OPS(X, 5)  DP_OPS(X, 6)  DP_OPS(X, 7) \
+    DP_OPS(X, 8)  DP_OPS(X, 9)  DP_OPS(X, 10) DP_OPS(X, 11) \
+    DP_OPS(X, 12) DP_OPS(X, 13) DP_OPS(X, 14) DP_OPS(X, 15) \
+    LS_OPS(X, str, 0, 0) LS_OPS(X, strb, 0, 1) LS_OPS(X, ldr, 1, 0) LS_OPS(X, ldrb, 1, 1) \
+    X(mul,  decoded_multiply(d, 0, 0)) \
+    X(muls, decoded_multiply(d, 0, 1)) \
+    X(mla,  decoded_multiply(d, 1, 0)) \
+    X(mlas, decoded_multiply(d, 1, 1)) \
+    X(b,  arm.reg[15] += d->imm) \
+    X(bl, arm.reg[14] = arm.reg[15]; arm.reg[15] += d->imm)
+
+/* ARM_OP_SYNC is left to the interpreter like ARM_OP_generic, but ends a run:
+ * the instruction may switch to THUMB, change mode or remap memory without
+ * leaving the PC somewhere else. */
+#define X(name, ...) ARM_OP_##name,
+enum { ARM_OP_SYNC = DECODED_OP_SYNC, ARM_DECODED_OPS(X) };
+#undef X
+#define X(name, ...) static void arm_##name(const struct decoded_insn *d) { __VA_ARGS__; }
+ARM_DECODED_OPS(X)
+#undef X
+#define X(name, ...) arm_##name,
+static decoded_handler *const arm_op_handlers[] = { arm_generic, ARM_DECODED_OPS(X) };
+#undef X
+
+void cpu_decode_instruction(struct decoded_insn *d, uint32_t insn) {
+    uint32_t rd = insn >> 12 & 15, rn = insn >> 16 & 15, rm = insn & 15;
+    int op;
+    d->insn = insn;
+    d->imm = 0;
+    d->cond = insn >> 28;
+    d->rd = rd;
+    d->rn = rn;
+    d->rm = rm;
+
+    if (d->cond == 15) {
+        goto sync;
+    } else if ((insn & 0xE000090) == 0x0000090) {
+        /* MUL, MLA; the rest is left to the interpreter */
+        if ((insn & 0xFC000F0) != 0x0000090 || rn == 15 || rd == 15 || rm == 15 || (insn >> 8 & 15) == 15)
+            goto generic;
+        d->rd = rn;
+        d->rn = rd;
+        d->imm = insn >> 8 & 15;
+        op = ARM_OP_mul + (insn >> 20 & 3);
+    } else if ((insn & 0xD900000) == 0x1000000) {
+        // MSR, BX and BLX end a run
+        if ((insn & 0xDB0F000) == 0x120F000 || (insn & 0xFFFFFD0) == 0x12FFF10)
+            goto sync;
+        goto generic;
+    } else if ((insn & 0xC000000) == 0) {
+        int opcode = insn >> 21 & 15, operand;
+        if (rd == 15 || rn == 15 || ((opcode & 12) == 8 && rd != 0))
+            goto generic;
+        if (insn & (1 << 25)) {
+            operand = DOP_IMM;
+            int count = insn >> 7 & 30;
+            d->imm = insn & 0xFF;
+            if (count)
+                d->imm = d->imm >> count | d->imm << (32 - count);
+            d->rm = count != 0;
+        } else if ((insn & 0xFF0) == 0 && rm != 15) {
+            operand = DOP_REG;
+        } else {
+            operand = DOP_SHIFT;
+        }
+        op = ARM_OP_dp0_imm + (opcode * 3 + operand) * 2 + (insn >> 20 & 1);
+    } else if ((insn & 0xC000000) == 0x4000000) {
+        bool load = insn & (1 << 20), reg_offset = insn & (1 << 25);
+        int mode;
+        if (!(insn & (1 << 24))) {
+            if (insn & (1 << 21))
+                goto generic; // T-type
+            mode = LS_POST_INDEXED;
+        } else {
+            mode = insn & (1 << 21) ? LS_PRE_INDEXED : LS_OFFSET;
+        }
+        if (rd == 15 || (reg_offset && (insn & (1 << 4)))
+                || (rn == 15 && (reg_offset || mode != LS_OFFSET))
+                || (load && rn == rd && mode != LS_OFFSET))
+            goto generic;
+        if (!reg_offset) {
+            d->imm = insn & (1 << 23) ? (insn & 0xFFF) : -(insn & 0xFFF);
+            if (rn == 15)
+                d->imm += 4;
+        }
+        op = ARM_OP_str_offset + ((load * 2 + (insn >> 22 & 1)) * 3 + mode) * 2 + reg_offset;
+    } else if ((insn & 0xE000000) == 0xA000000) {
+        d->imm = 4 + ((int32_t)insn << 8 >> 6);
+        op = insn & (1 << 24) ? ARM_OP_bl : ARM_OP_b;
+    } else if ((insn & 0xC000000) == 0xC000000) {
+        goto sync; // coprocessor, SWI
+    } else {
+        goto generic;
+    }
+    d->op = op;
+    d->handler = arm_op_handlers[op];
+    return;
+sync:
+    d->op = ARM_OP_SYNC;
+    d->cond = 14; // the interpreter checks it
+    d->handler = arm_generic;
+    return;
+generic:
+    d->op = ARM_OP_generic;
+    d->cond = 14;
+    d->handler = arm_generic;
+}
+
+/* THUMB operations, listed like the ARM ones. rd, rn and rm are the register
+ * fields at bits 0, 3 and 6 (or 8 for instructions with one register). */
+#define TREG_D arm.reg[d->rd]
+#define TREG_N arm.reg[d->rn]
+#define TREG_M arm.reg[d->rm]
+#define THUMB_ALU_OP(X, op) X(alu##op, set_nz_flags(thumb_alu(op, d->rd, TREG_N)))
+#define THUMB_DECODED_OPS(X) \
+    X(generic,  cpu_interpret_thumb_instruction(d->insn)) \
+    X(lsl_imm,  set_nz_flags(TREG_D = shift(0, TREG_N, d->imm, true))) \
+    X(lsr_imm,  set_nz_flags(TREG_D = shift(1, TREG_N, d->imm, true))) \
+    X(asr_imm,  set_nz_flags(TREG_D = shift(2, TREG_N, d->imm, true))) \
+    X(add_reg,  set_nz_flags(TREG_D = add(TREG_N, TREG_M, 0, true))) \
+    X(sub_reg,  set_nz_flags(TREG_D = add(TREG_N, ~TREG_M, 1, true))) \
+    X(add_imm3, set_nz_flags(TREG_D = add(TREG_N, d->imm, 0, true))) \
+    X(sub_imm3, set_nz_flags(TREG_D = add(TREG_N, ~d->imm, 1, true))) \
+    X(mov_imm,  set_nz_flags(TREG_D = d->imm)) \
+    X(cmp_imm,  set_nz_flags(add(TREG_D, ~d->imm, 1, true))) \
+    X(add_imm,  set_nz_flags(TREG_D = add(TREG_D, d->imm, 0, true))) \
+    X(sub_imm,  set_nz_flags(TREG_D = add(TREG_D, ~d->imm, 1, true))) \
+    THUMB_ALU_OP(X, 0)  THUMB_ALU_OP(X, 1)  THUMB_ALU_OP(X, 2)  THUMB_ALU_OP(X, 3) \
+    THUMB_ALU_OP(X, 4)  THUMB_ALU_OP(X, 5)  THUMB_ALU_OP(X, 6)  THUMB_ALU_OP(X, 7) \
+    THUMB_ALU_OP(X, 8)  THUMB_ALU_OP(X, 9)  THUMB_ALU_OP(X, 10) THUMB_ALU_OP(X, 11) \
+    THUMB_ALU_OP(X, 12) THUMB_ALU_OP(X, 13) THUMB_ALU_OP(X, 14) THUMB_ALU_OP(X, 15) \
+    /* high registers, neither of them the PC */ \
+    X(add_hi,   TREG_D += TREG_N) \
+    X(cmp_hi,   set_nz_flags(add(TREG_D, ~TREG_N, 1, true))) \
+    X(mov_hi,   TREG_D = TREG_N) \
+    /* loads and stores to Rd at Rn + Rm, or at Rn + imm */ \
+    X(str_reg,   write_word(TREG_N + TREG_M, TREG_D)) \
+    X(strh_reg,  write_half(TREG_N + TREG_M, TREG_D)) \
+    X(strb_reg,  write_byte(TREG_N + TREG_M, TREG_D)) \
+    X(ldrsb_reg, uint32_t rd = d->rd; arm.reg[rd] = (int8_t)read_byte(TREG_N + TREG_M)) \
+    X(ldr_reg,   uint32_t rd = d->rd; arm.reg[rd] = read_word_ldr(TREG_N + TREG_M)) \
+    X(ldrh_reg,  uint32_t rd = d->rd; arm.reg[rd] = read_half(TREG_N + TREG_M)) \
+    X(ldrb_reg,  uint32_t rd = d->rd; arm.reg[rd] = read_byte(TREG_N + TREG_M)) \
+    X(ldrsh_reg, uint32_t rd = d->rd; arm.reg[rd] = (int16_t)read_half(TREG_N + TREG_M)) \
+    X(str_imm,   write_word(TREG_N + d->imm, TREG_D)) \
+    X(strb_imm,  write_byte(TREG_N + d->imm, TREG_D)) \
+    X(strh_imm,  write_half(TREG_N + d->imm, TREG_D)) \
+    X(ldr_imm,   uint32_t rd = d->rd; arm.reg[rd] = read_word_ldr(TREG_N + d->imm)) \
+    X(ldrb_imm,  uint32_t rd = d->rd; arm.reg[rd] = read_byte(TREG_N + d->imm)) \
+    X(ldrh_imm,  uint32_t rd = d->rd; arm.reg[rd] = read_half(TREG_N + d->imm)) \
+    X(ldr_pc,    uint32_t rd = d->rd; arm.reg[rd] = read_word_ldr(((arm.reg[15] + 2) & -4) + d->imm)) \
+    X(add_pc,    TREG_D = ((arm.reg[15] + 2) & -4) + d->imm) \
+    X(add_sp,    TREG_D = arm.reg[13] + d->imm) \
+    X(adjust_sp, arm.reg[13] += d->imm) \
+    X(b_cond,    if (condition_passed(d->cond)) arm.reg[15] += d->imm) \
+    X(b,         arm.reg[15] += d->imm) \
+    X(bl_high,   arm.reg[14] = arm.reg[15] + d->imm) \
+    X(bl_low,    uint32_t target = arm.reg[14] + d->imm; \
+                 arm.reg[14] = arm.reg[15] + 1; \
+                 arm.reg[15] = target)
+
+// THUMB_OP_SYNC: like generic, but ends a run (BX)
+#define X(name, ...) THUMB_OP_##name,
+enum { THUMB_OP_SYNC = DECODED_OP_SYNC, THUMB_DECODED_OPS(X) };
+#undef X
+#define X(name, ...) static void thumb_##name(const struct decoded_insn *d) { __VA_ARGS__; }
+THUMB_DECODED_OPS(X)
+#undef X
+#define X(name, ...) thumb_##name,
+static decoded_handler *const thumb_op_handlers[] = { thumb_generic, THUMB_DECODED_OPS(X) };
+#undef X
+
+static void decode_thumb_insn(struct decoded_insn *d, uint16_t insn) {
+    int op = THUMB_OP_generic;
+    d->insn = insn;
+    d->cond = 14;
+    d->rd = insn & 7;
+    d->rn = insn >> 3 & 7;
+    d->rm = insn >> 6 & 7;
+    d->imm = 0;
+
+    switch (insn >> 11) {
+        case 0x00: d->imm = insn >> 6 & 31; op = THUMB_OP_lsl_imm; break;
+        case 0x01: d->imm = insn >> 6 & 31; op = THUMB_OP_lsr_imm; break;
+        case 0x02: d->imm = insn >> 6 & 31; op = THUMB_OP_asr_imm; break;
+        case 0x03:
+            d->imm = insn >> 6 & 7;
+            op = THUMB_OP_add_reg + (insn >> 9 & 3);
+            break;
+        case 0x04: case 0x05: case 0x06: case 0x07:
+            d->rd = insn >> 8 & 7;
+            d->imm = insn & 0xFF;
+            op = THUMB_OP_mov_imm + (insn >> 11 & 3);
+            break;
+        case 0x08:
+            if (insn < 0x4400) {
+                op = THUMB_OP_alu0 + (insn >> 6 & 15);
+            } else if (insn < 0x4700) {
+                d->rd = (insn >> 4 & 8) | (insn & 7);
+                d->rn = insn >> 3 & 15;
+                if (d->rd != 15 && d->rn != 15)
+                    op = THUMB_OP_add_hi + (insn >> 8 & 3);
+            } else {
+                op = THUMB_OP_SYNC; // BX, BLX
+            }
+            break;
+        case 0x09:
+            d->rd = insn >> 8 & 7;
+            d->imm = (insn & 0xFF) << 2;
+            op = THUMB_OP_ldr_pc;
+            break;
+        case 0x0A: case 0x0B:
+            op = THUMB_OP_str_reg + (insn >> 9 & 7);
+            break;
+        case 0x0C: d->imm = insn >> 4 & 124; op = THUMB_OP_str_imm; break;
+        case 0x0D: d->imm = insn >> 4 & 124; op = THUMB_OP_ldr_imm; break;
+        case 0x0E: d->imm = insn >> 6 & 31; op = THUMB_OP_strb_imm; break;
+        case 0x0F: d->imm = insn >> 6 & 31; op = THUMB_OP_ldrb_imm; break;
+        case 0x10: d->imm = insn >> 5 & 62; op = THUMB_OP_strh_imm; break;
+        case 0x11: d->imm = insn >> 5 & 62; op = THUMB_OP_ldrh_imm; break;
+        case 0x12: case 0x13:
+            d->rd = insn >> 8 & 7;
+            d->rn = 13;
+            d->imm = (insn & 0xFF) << 2;
+            op = insn & 0x800 ? THUMB_OP_ldr_imm : THUMB_OP_str_imm;
+            break;
+        case 0x14: case 0x15:
+            d->rd = insn >> 8 & 7;
+            d->imm = (insn & 0xFF) << 2;
+            op = insn & 0x800 ? THUMB_OP_add_sp : THUMB_OP_add_pc;
+            break;
+        case 0x16:
+            if ((insn >> 8) == 0xB0) {
+                d->imm = ((insn & 0x80) ? -(insn & 0x7F) : (insn & 0x7F)) << 2;
+                op = THUMB_OP_adjust_sp;
+            }
+            break;
+        case 0x1A: case 0x1B:
+            if ((insn >> 8 & 15) < 14) {
+                d->cond = insn >> 8 & 15;
+                d->imm = 2 + ((int8_t)insn << 1);
+                op = THUMB_OP_b_cond;
+            }
+            break;
+        case 0x1C: d->imm = 2 + ((int32_t)insn << 21 >> 20); op = THUMB_OP_b; break;
+        case 0x1E: d->imm = 2 + ((int32_t)insn << 21 >> 9); op = THUMB_OP_bl_high; break;
+        case 0x1F: d->imm = (insn & 0x7FF) << 1; op = THUMB_OP_bl_low; break;
+    }
+    d->op = op;
+    d->handler = thumb_op_handlers[op];
+}
+
+void flush_decoded() {
+    int i, j;
+    for (i = 0; i < num_decoded_pages; i++) {
+        uint32_t page = decoded_page_list[i];
+        uint32_t *flags = &RAM_FLAGS(mem_and_flags + (page << 10));
+        for (j = 0; j < 0x100; j++)
+            flags[j] &= ~RF_CODE_DECODED;
+        free(decoded_arm_pages[page]);
+        free(decoded_thumb_pages[page]);
+        decoded_arm_pages[page] = decoded_thumb_pages[page] = NULL;
+    }
+    num_decoded_pages = 0;
+    decoded_flushes++;
+}
+
+void invalidate_decoded(void *ptr) {
+    uint32_t offset = ((uint8_t *)ptr - mem_and_flags) & ~3;
+    struct decoded_insn *page;
+    RAM_FLAGS(mem_and_flags + offset) &= ~RF_CODE_DECODED;
+    if ((page = decoded_arm_pages[offset >> 10]))
+        page[offset >> 2 & 0xFF].handler = NULL;
+    if ((page = decoded_thumb_pages[offset >> 10])) {
+        page[offset >> 1 & 0x1FF].handler = NULL;
+        page[(offset >> 1 & 0x1FF) + 1].handler = NULL;
+    }
+}
+
+void invalidate_decoded_range(void *start, uint32_t size) {
+    uint8_t *ptr = (uint8_t *)((uintptr_t)start & ~3);
+    for (; ptr < (uint8_t *)start + size; ptr += 4)
+        if (RAM_FLAGS(ptr) & RF_CODE_DECODED)
+            invalidate_decoded(ptr);
+}
+
+// The entries of page in pages, which holds count of them per page
+static struct decoded_insn *decoded_page(struct decoded_insn **pages, uint32_t page, int count) {
+    if (!pages[page]) {
+        bool listed = decoded_arm_pages[page] || decoded_thumb_pages[page];
+        if (!listed && num_decoded_pages == DECODED_MAX_PAGES)
+            flush_decoded();
+        pages[page] = calloc(count, sizeof(struct decoded_insn));
+        if (pages[page] && !listed)
+            decoded_page_list[num_decoded_pages++] = page;
+    }
+    return pages[page];
+}
+
+#define DECODED_NO_ENTRY (RF_EXEC_BREAKPOINT | RF_EXEC_DEBUG_NEXT | RF_ARMLOADER_CB | RF_EXEC_HACK)
+
+/* Decode the instruction at insnp into its entry. Returns NULL if it can't
+ * have one; it then has to be interpreted on its own. Can flush the cache. */
+static const struct decoded_insn * __attribute__((noinline)) decode_arm(uint32_t *insnp) {
+    uint32_t offset = (uint8_t *)insnp - mem_and_flags;
+    struct decoded_insn *page;
+    if (RAM_FLAGS(insnp) & DECODED_NO_ENTRY)
+        return NULL;
+    if (!(page = decoded_page(decoded_arm_pages, offset >> 10, 0x100)))
+        return NULL;
+    struct decoded_insn *d = &page[offset >> 2 & 0xFF];
+    cpu_decode_instruction(d, *insnp);
+    RAM_FLAGS(insnp) |= RF_CODE_DECODED;
+    return d;
+}
+
+static const struct decoded_insn * __attribute__((noinline)) decode_thumb(uint16_t *insnp) {
+    uint32_t offset = (uint8_t *)insnp - mem_and_flags;
+    struct decoded_insn *page;
+    if (RAM_FLAGS((uintptr_t)insnp & ~3) & DECODED_NO_ENTRY)
+        return NULL;
+    if (!(page = decoded_page(decoded_thumb_pages, offset >> 10, 0x200)))
+        return NULL;
+    struct decoded_insn *d = &page[offset >> 1 & 0x1FF];
+    decode_thumb_insn(d, *insnp);
+    RAM_FLAGS((uintptr_t)insnp & ~3) |= RF_CODE_DECODED;
+    return d;
+}
+
+static inline const struct decoded_insn *decoded_arm(uint32_t *insnp) {
+    uint32_t offset = (uint8_t *)insnp - mem_and_flags;
+    struct decoded_insn *page = decoded_arm_pages[offset >> 10];
+    if (page && page[offset >> 2 & 0xFF].handler)
+        return &page[offset >> 2 & 0xFF];
+    return decode_arm(insnp);
+}
+
+static inline const struct decoded_insn *decoded_thumb(uint16_t *insnp) {
+    uint32_t offset = (uint8_t *)insnp - mem_and_flags;
+    struct decoded_insn *page = decoded_thumb_pages[offset >> 10];
+    if (page && page[offset >> 1 & 0x1FF].handler)
+        return &page[offset >> 1 & 0x1FF];
+    return decode_thumb(insnp);
+}
+
+#ifndef NO_TRANSLATION
+#define COUNT_INTERPRETED() tcache_stats.interpreted++
+#else
+#define COUNT_INTERPRETED()
+#endif
+
+/* Run decoded ARM instructions from d (the entry for insnp) on, for as long
+ * as they follow each other: until one writes the PC or ends a run, the page
+ * ends, the entries are flushed, or the next word can't have an entry.
+ * Operations are dispatched through a table of labels, and events are left
+ * for the caller to check after the run, as they would be after a
+ * translated block. */
+static void run_arm(const struct decoded_insn *d, uint32_t *insnp) {
+#define X(name, ...) &&arm_op_##name,
+    static const void *const labels[] = { &&arm_op_sync, ARM_DECODED_OPS(X) };
+#undef X
+    uint32_t pc = arm.reg[15], flushes = decoded_flushes;
+    goto start;
+next:
+    // An instruction that entered the debugger may have freed d
+    if (arm.reg[15] != pc || !(pc & 0x3FF) || decoded_flushes != flushes)
+        return;
+    insnp++;
+    if (!(++d)->handler) {
+        if (!(d = decode_arm(insnp)))
+            return;
+        flushes = decoded_flushes;
+    }
+start:
+    arm.reg[15] = pc += 4;
+    cycle_count_delta++;
+    COUNT_INTERPRETED();
+    if (!condition_passed(d->cond))
+        goto next;
+    goto *labels[d->op];
+arm_op_sync:
+    cpu_interpret_instruction(d->insn);
+    return;
+#define X(name, ...) arm_op_##name: { __VA_ARGS__; } goto next;
+    ARM_DECODED_OPS(X)
+#undef X
+}
+
+static void run_thumb(const struct decoded_insn *d, uint16_t *insnp) {
+#define X(name, ...) &&thumb_op_##name,
+    static const void *const labels[] = { &&thumb_op_sync, THUMB_DECODED_OPS(X) };
+#undef X
+    uint32_t pc = arm.reg[15], flushes = decoded_flushes;
+    goto start;
+next:
+    // An instruction that entered the debugger may have freed d
+    if (arm.reg[15] != pc || !(pc & 0x3FF) || decoded_flushes != flushes)
+        return;
+    insnp++;
+    if (!(++d)->handler) {
+        if (!(d = decode_thumb(insnp)))
+            return;
+        flushes = decoded_flushes;
+    }
+start:
+    arm.reg[15] = pc += 2;
+    cycle_count_delta++;
+    COUNT_INTERPRETED();
+    goto *labels[d->op];
+thumb_op_sync:
+    cpu_interpret_thumb_instruction(d->insn);
+    return;
+#define X(name, ...) thumb_op_##name: { __VA_ARGS__; } goto next;
+    THUMB_DECODED_OPS(X)
+#undef X
+}
+
+#ifndef NO_TRANSLATION
+/* A word can be flagged as translated without the translation being usable
+ * here: it may be the other instruction set, or (in THUMB code) the halfword
+ * may lie just past the end of the block owning the word. */
+static inline bool translation_covers(void *insnp, uint32_t flags, bool thumb) {
+    struct translation *t = &translation_table[flags >> RFS_TRANSLATION_INDEX];
+    return !t->thumb == !thumb && insnp >= (void *)t->start_ptr && insnp < (void *)t->end_ptr;
+}
+
+/* Code is only translated once it has been interpreted translate_threshold
+ * times, so that boot code and one-shot init routines don't fill the
+ * translation cache. Counters are hashed by address; sharing one only makes
+ * code hot sooner. */
+uint32_t translate_threshold = 16;
+static uint16_t exec_count[0x10000];
+
+static inline bool code_is_hot(void *insnp) {
+    uint16_t *count = &exec_count[(uintptr_t)insnp >> 1 & 0xFFFF];
+    if (++*count < translate_threshold)
+        return false;
+    *count = 0;
+    return true;
+}
+
+/* Run translated code, counting the instructions it ran by the CPU ticks
+ * that passed. Events can change cycle_count_delta meanwhile, so measure
+ * the tick itself. */
+static inline void run_translation() {
+    uint32_t start = next_cputick + cycle_count_delta;
+    tcache_stats.entries++;
+    translation_enter();
+    int32_t ran = next_cputick + cycle_count_delta - start;
+    if (ran < 0) // a new second began
+        ran += clock_rates[CLOCK_CPU];
+    tcache_stats.translated += ran;
+}
+#endif
+
 static inline void *get_pc_ptr(uint32_t align) {
-again:;
     uint32_t pc = arm.reg[15];
-    void *ptr = &addr_cache[(pc >> 10) << 1][pc];
-    if ((uintptr_t)ptr & (AC_NOT_PTR | (align - 1))) {
-        if (pc & (align - 1)) {
-            // Handle misaligned PC by truncating low bits; gpsp-nspire
-            arm.reg[15] = pc & -align;
-            goto again;
-        }
+    if (pc & (align - 1)) {
+        // Handle misaligned PC by truncating low bits; gpsp-nspire
+        arm.reg[15] = pc &= -align;
+    }
+    /* Checked after the truncation: where AC_NOT_PTR is the low bit, an odd
+     * PC would make an invalid entry look like a pointer */
+    void *ptr = &AC_ENTRY((pc >> 10) << 1)[pc];
+    if ((uintptr_t)ptr & AC_NOT_PTR) {
         ptr = addr_cache_miss(pc, false, prefetch_abort);
         if (!ptr)
             error("Bad PC: %08x\n", pc);
@@ -793,8 +1565,8 @@ void cpu_arm_loop() {
         }
 
 #ifndef NO_TRANSLATION
-        if (*flags & RF_CODE_TRANSLATED) {
-            translation_enter();
+        if ((*flags & RF_CODE_TRANSLATED) && translation_covers(insnp, *flags, false)) {
+            run_translation();
             continue;
         }
 #endif
@@ -815,23 +1587,32 @@ enter_debugger:
                     continue;
         } else {
 #ifndef NO_TRANSLATION
-            if (do_translate && !(*flags & (RF_CODE_NO_TRANSLATE))) {
-                translate(arm.reg[15], insnp);
-                continue;
+            if (do_translate && !(*flags & (RF_CODE_TRANSLATED | RF_CODE_NO_TRANSLATE)) && code_is_hot(insnp)) {
+                if (translate(arm.reg[15], insnp) >= 0)
+                    continue;
             }
 #endif
         }
 
+        // A debugger step runs one instruction at a time
+        const struct decoded_insn *d = decoded_arm(insnp);
+        if (d && !cpu_events) {
+            run_arm(d, insnp);
+            continue;
+        }
         arm.reg[15] += 4;
         cycle_count_delta++;
-        cpu_interpret_instruction(*insnp);
+        COUNT_INTERPRETED();
+        if (!d)
+            cpu_interpret_instruction(*insnp);
+        else if (condition_passed(d->cond))
+            d->handler(d);
     }
 }
 
 void cpu_thumb_loop() {
-    while (!exiting && cycle_count_delta < 0) {
+    while (!exiting && cycle_count_delta < 0 && (arm.cpsr_low28 & 0x20)) {
         uint16_t *insnp = get_pc_ptr(2);
-        uint16_t insn = *insnp;
 
         if (cpu_events != 0) {
             if (cpu_events & ~EVENT_DEBUG_STEP)
@@ -839,219 +1620,41 @@ void cpu_thumb_loop() {
             goto enter_debugger;
         }
 
-        uintptr_t flags = RAM_FLAGS((uintptr_t)insnp & ~3);
+        uint32_t flags = RAM_FLAGS((uintptr_t)insnp & ~3);
+#ifdef THUMB_TRANSLATION
+        if ((flags & RF_CODE_TRANSLATED) && translation_covers(insnp, flags, true)) {
+            run_translation();
+            continue;
+        }
+#endif
+
         if (flags & (RF_EXEC_BREAKPOINT | RF_EXEC_DEBUG_NEXT)) {
             if (flags & RF_EXEC_BREAKPOINT)
                 printf("Hit breakpoint at %08X. Entering debugger.\n", arm.reg[15]);
 enter_debugger:
             debugger(DBG_EXEC_BREAKPOINT, 0);
         }
+#ifdef THUMB_TRANSLATION
+        /* A block may start in the second halfword of a word already owned by
+         * the block before it; it then takes over the word's translation index. */
+        else if (do_translate && !(flags & (RF_CODE_NO_TRANSLATE | RF_EXEC_HACK | RF_ARMLOADER_CB))
+                 && (!(flags & RF_CODE_TRANSLATED) || ((uintptr_t)insnp & 2)) && code_is_hot(insnp)) {
+            if (translate_thumb(arm.reg[15], insnp) >= 0)
+                continue;
+        }
+#endif
 
+        const struct decoded_insn *d = decoded_thumb(insnp);
+        if (d && !cpu_events) {
+            run_thumb(d, insnp);
+            continue;
+        }
         arm.reg[15] += 2;
         cycle_count_delta++;
-
-#define CASE_x2(base) case base: case base+1
-#define CASE_x4(base) CASE_x2(base): CASE_x2(base+2)
-#define CASE_x8(base) CASE_x4(base): CASE_x4(base+4)
-#define REG0 arm.reg[insn & 7]
-#define REG3 arm.reg[insn >> 3 & 7]
-#define REG6 arm.reg[insn >> 6 & 7]
-#define REG8 arm.reg[insn >> 8 & 7]
-        switch (insn >> 8) {
-            CASE_x8(0x00): /* LSL Rd, Rm, #imm */
-                CASE_x8(0x08): /* LSR Rd, Rm, #imm */
-              CASE_x8(0x10): /* ASR Rd, Rm, #imm */
-              set_nz_flags(REG0 = shift(insn >> 11, REG3, insn >> 6 & 31, true));
-            break;
-            CASE_x2(0x18): /* ADD Rd, Rn, Rm */ set_nz_flags(REG0 = add(REG3, REG6, 0, true)); break;
-            CASE_x2(0x1A): /* SUB Rd, Rn, Rm */ set_nz_flags(REG0 = add(REG3, ~REG6, 1, true)); break;
-            CASE_x2(0x1C): /* ADD Rd, Rn, #imm */ set_nz_flags(REG0 = add(REG3, insn >> 6 & 7, 0, true)); break;
-            CASE_x2(0x1E): /* SUB Rd, Rn, #imm */ set_nz_flags(REG0 = add(REG3, ~(insn >> 6 & 7), 1, true)); break;
-            CASE_x8(0x20): /* MOV Rd, #imm */ set_nz_flags(REG8 = insn & 0xFF); break;
-            CASE_x8(0x28): /* CMP Rn, #imm */ set_nz_flags(add(REG8, ~(insn & 0xFF), 1, true)); break;
-            CASE_x8(0x30): /* ADD Rd, #imm */ set_nz_flags(REG8 = add(REG8, insn & 0xFF, 0, true)); break;
-            CASE_x8(0x38): /* SUB Rd, #imm */ set_nz_flags(REG8 = add(REG8, ~(insn & 0xFF), 1, true)); break;
-            CASE_x4(0x40): {
-                uint32_t *dst = &REG0;
-                uint32_t res;
-                uint32_t src = REG3;
-                switch (insn >> 6 & 15) {
-                    default:
-                    case 0x0: /* AND */ res = *dst &= src; break;
-                    case 0x1: /* EOR */ res = *dst ^= src; break;
-                    case 0x2: /* LSL */ res = *dst = shift(0, *dst, src & 0xFF, true); break;
-                    case 0x3: /* LSR */ res = *dst = shift(1, *dst, src & 0xFF, true); break;
-                    case 0x4: /* ASR */ res = *dst = shift(2, *dst, src & 0xFF, true); break;
-                    case 0x5: /* ADC */ res = *dst = add(*dst, src, arm.cpsr_c, true); break;
-                    case 0x6: /* SBC */ res = *dst = add(*dst, ~src, arm.cpsr_c, true); break;
-                    case 0x7: /* ROR */ res = *dst = shift(3, *dst, src & 0xFF, true); break;
-                    case 0x8: /* TST */ res = *dst & src; break;
-                    case 0x9: /* NEG */ res = *dst = add(0, ~src, 1, true); break;
-                    case 0xA: /* CMP */ res = add(*dst, ~src, 1, true); break;
-                    case 0xB: /* CMN */ res = add(*dst, src, 0, true); break;
-                    case 0xC: /* ORR */ res = *dst |= src; break;
-                    case 0xD: /* MUL */ res = *dst *= src; break;
-                    case 0xE: /* BIC */ res = *dst &= ~src; break;
-                    case 0xF: /* MVN */ res = *dst = ~src; break;
-                }
-                set_nz_flags(res);
-                break;
-            }
-            case 0x44: { /* ADD Rd, Rm (high registers allowed) */
-                uint32_t left = (insn >> 4 & 8) | (insn & 7), right = insn >> 3 & 15;
-                set_reg_pc(left, get_reg_pc_thumb(left) + get_reg_pc_thumb(right));
-                break;
-            }
-            case 0x45: { /* CMP Rn, Rm (high registers allowed) */
-                uint32_t left = (insn >> 4 & 8) | (insn & 7), right = insn >> 3 & 15;
-                set_nz_flags(add(get_reg(left), ~get_reg_pc_thumb(right), 1, true));
-                break;
-            }
-            case 0x46: { /* MOV Rd, Rm (high registers allowed) */
-                uint32_t left = (insn >> 4 & 8) | (insn & 7), right = insn >> 3 & 15;
-                set_reg_pc(left, get_reg_pc_thumb(right));
-                break;
-            }
-            case 0x47: { /* BX/BLX Rm (high register allowed) */
-                uint32_t target = get_reg_pc_thumb(insn >> 3 & 15);
-                if (insn & 0x80)
-                    arm.reg[14] = arm.reg[15] + 1;
-                arm.reg[15] = target & ~1;
-                if (!(target & 1)) {
-                    arm.cpsr_low28 &= ~0x20; /* Exit THUMB mode */
-                    return;
-                }
-                break;
-            }
-                CASE_x8(0x48): /* LDR reg, [PC, #imm] */ REG8 = read_word_ldr(((arm.reg[15] + 2) & -4) + ((insn & 0xFF) << 2)); break;
-                CASE_x2(0x50): /* STR   Rd, [Rn, Rm] */ write_word(REG3 + REG6, REG0); break;
-                CASE_x2(0x52): /* STRH  Rd, [Rn, Rm] */ write_half(REG3 + REG6, REG0); break;
-                CASE_x2(0x54): /* STRB  Rd, [Rn, Rm] */ write_byte(REG3 + REG6, REG0); break;
-                CASE_x2(0x56): /* LDRSB Rd, [Rn, Rm] */ REG0 = (int8_t)read_byte(REG3 + REG6); break;
-                CASE_x2(0x58): /* LDR   Rd, [Rn, Rm] */ REG0 = read_word_ldr(REG3 + REG6); break;
-                CASE_x2(0x5A): /* LDRH  Rd, [Rn, Rm] */ REG0 = read_half(REG3 + REG6); break;
-                CASE_x2(0x5C): /* LDRB  Rd, [Rn, Rm] */ REG0 = read_byte(REG3 + REG6); break;
-                CASE_x2(0x5E): /* LDRSH Rd, [Rn, Rm] */ REG0 = (int16_t)read_half(REG3 + REG6); break;
-                CASE_x8(0x60): /* STR  Rd, [Rn, #imm] */ write_word(REG3 + (insn >> 4 & 124), REG0); break;
-                CASE_x8(0x68): /* LDR  Rd, [Rn, #imm] */ REG0 = read_word_ldr(REG3 + (insn >> 4 & 124)); break;
-                CASE_x8(0x70): /* STRB Rd, [Rn, #imm] */ write_byte(REG3 + (insn >> 6 & 31), REG0); break;
-                CASE_x8(0x78): /* LDRB Rd, [Rn, #imm] */ REG0 = read_byte(REG3 + (insn >> 6 & 31)); break;
-                CASE_x8(0x80): /* STRH Rd, [Rn, #imm] */ write_half(REG3 + (insn >> 5 & 62), REG0); break;
-                CASE_x8(0x88): /* LDRH Rd, [Rn, #imm] */ REG0 = read_half(REG3 + (insn >> 5 & 62)); break;
-                CASE_x8(0x90): /* STR Rd, [SP, #imm] */ write_word(arm.reg[13] + ((insn & 0xFF) << 2), REG8); break;
-                CASE_x8(0x98): /* LDR Rd, [SP, #imm] */ REG8 = read_word_ldr(arm.reg[13] + ((insn & 0xFF) << 2)); break;
-                CASE_x8(0xA0): /* ADD Rd, PC, #imm */ REG8 = ((arm.reg[15] + 2) & -4) + ((insn & 0xFF) << 2); break;
-                CASE_x8(0xA8): /* ADD Rd, SP, #imm */ REG8 = arm.reg[13] + ((insn & 0xFF) << 2); break;
-            case 0xB0: /* ADD/SUB SP, #imm */
-                arm.reg[13] += ((insn & 0x80) ? -(insn & 0x7F) : (insn & 0x7F)) << 2;
-                break;
-
-                CASE_x2(0xB4): { /* PUSH {reglist[,LR]} */
-                    int i;
-                    uint32_t addr = arm.reg[13];
-                    for (i = 8; i >= 0; i--)
-                        addr -= (insn >> i & 1) * 4;
-                    uint32_t sp = addr;
-                    for (i = 0; i < 8; i++)
-                        if (insn >> i & 1)
-                            write_word(addr, arm.reg[i]), addr += 4;
-                    if (insn & 0x100)
-                        write_word(addr, arm.reg[14]);
-                    arm.reg[13] = sp;
-                    break;
-                }
-
-                CASE_x2(0xBC): { /* POP {reglist[,PC]} */
-                    int i;
-                    uint32_t addr = arm.reg[13];
-                    for (i = 0; i < 8; i++)
-                        if (insn >> i & 1)
-                            arm.reg[i] = read_word(addr), addr += 4;
-                    if (insn & 0x100) {
-                        uint32_t target = read_word(addr); addr += 4;
-                        arm.reg[15] = target & ~1;
-                        if (!(target & 1)) {
-                            arm.cpsr_low28 &= ~0x20;
-                            arm.reg[13] = addr;
-                            return;
-                        }
-                    }
-                    arm.reg[13] = addr;
-                    break;
-                }
-            case 0xBE:
-                printf("Software breakpoint at %08x (%02x)\n", arm.reg[15], insn & 0xFF);
-                debugger(DBG_EXEC_BREAKPOINT, 0);
-                break;
-
-                CASE_x8(0xC0): { /* STMIA Rn!, {reglist} */
-                    int i;
-                    uint32_t addr = REG8;
-                    for (i = 0; i < 8; i++)
-                        if (insn >> i & 1)
-                            write_word(addr, arm.reg[i]), addr += 4;
-                    REG8 = addr;
-                    break;
-                }
-                CASE_x8(0xC8): { /* LDMIA Rn!, {reglist} */
-                    int i;
-                    uint32_t addr = REG8;
-                    uint32_t tmp = 0; // value not used, just suppressing uninitialized variable warning
-                    for (i = 0; i < 8; i++) {
-                        if (insn >> i & 1) {
-                            if (i == (insn >> 8 & 7))
-                                tmp = read_word(addr);
-                            else
-                                arm.reg[i] = read_word(addr);
-                            addr += 4;
-                        }
-                    }
-                    // must set address register last so it is unchanged on exception
-                    REG8 = addr;
-                    if (insn >> (insn >> 8 & 7) & 1)
-                        REG8 = tmp;
-                    break;
-                }
-#define BRANCH_IF(cond) if (cond) arm.reg[15] += 2 + ((int8_t)insn << 1); break;
-            case 0xD0: /* BEQ */ BRANCH_IF(arm.cpsr_z)
-                    case 0xD1: /* BNE */ BRANCH_IF(!arm.cpsr_z)
-              case 0xD2: /* BCS */ BRANCH_IF(arm.cpsr_c)
-              case 0xD3: /* BCC */ BRANCH_IF(!arm.cpsr_c)
-              case 0xD4: /* BMI */ BRANCH_IF(arm.cpsr_n)
-              case 0xD5: /* BPL */ BRANCH_IF(!arm.cpsr_n)
-              case 0xD6: /* BVS */ BRANCH_IF(arm.cpsr_v)
-              case 0xD7: /* BVC */ BRANCH_IF(!arm.cpsr_v)
-              case 0xD8: /* BHI */ BRANCH_IF(arm.cpsr_c > arm.cpsr_z)
-              case 0xD9: /* BLS */ BRANCH_IF(arm.cpsr_c <= arm.cpsr_z)
-              case 0xDA: /* BGE */ BRANCH_IF(arm.cpsr_n == arm.cpsr_v)
-              case 0xDB: /* BLT */ BRANCH_IF(arm.cpsr_n != arm.cpsr_v)
-              case 0xDC: /* BGT */ BRANCH_IF(!arm.cpsr_z && arm.cpsr_n == arm.cpsr_v)
-              case 0xDD: /* BLE */ BRANCH_IF(arm.cpsr_z || arm.cpsr_n != arm.cpsr_v)
-
-              case 0xDF: /* SWI */
-                  cpu_exception(EX_SWI);
-                return; /* Exits THUMB mode */
-
-                CASE_x8(0xE0): /* B */ arm.reg[15] += 2 + ((int32_t)insn << 21 >> 20); break;
-                CASE_x8(0xE8): { /* Second half of BLX */
-                    uint32_t target = (arm.reg[14] + ((insn & 0x7FF) << 1)) & ~3;
-                    arm.reg[14] = arm.reg[15] + 1;
-                    arm.reg[15] = target;
-                    arm.cpsr_low28 &= ~0x20; /* Exit THUMB mode */
-                    return;
-                }
-                CASE_x8(0xF0): /* First half of BL/BLX */
-                    arm.reg[14] = arm.reg[15] + 2 + ((int32_t)insn << 21 >> 9);
-                break;
-                CASE_x8(0xF8): { /* Second half of BL */
-                    uint32_t target = arm.reg[14] + ((insn & 0x7FF) << 1);
-                    arm.reg[14] = arm.reg[15] + 1;
-                    arm.reg[15] = target;
-                    break;
-                }
-            default:
-                error("Unknown instruction: %04X\n", insn);
-                break;
-        }
+        COUNT_INTERPRETED();
+        if (!d)
+            cpu_interpret_thumb_instruction(*insnp);
+        else
+            d->handler(d);
     }
 }
@@ -52,6 +52,22 @@ extern struct arm_state arm __asm__("arm");
 #define EX_IRQ            6
 #define EX_FIQ            7
 
+/* Whether condition cond (0-14) of an instruction holds */
+static inline bool condition_passed(uint32_t cond) {
+    bool exec;
+    switch (cond >> 1) {
+        case 0:  /* EQ/NE */ exec = arm.cpsr_z; break;
+        case 1:  /* CS/CC */ exec = arm.cpsr_c; break;
+        case 2:  /* MI/PL */ exec = arm.cpsr_n; break;
+        case 3:  /* VS/VC */ exec = arm.cpsr_v; break;
+        case 4:  /* HI/LS */ exec = !arm.cpsr_z && arm.cpsr_c; break;
+        case 5:  /* GE/LT */ exec = arm.cpsr_n == arm.cpsr_v; break;
+        case 6:  /* GT/LE */ exec = !arm.cpsr_z && arm.cpsr_n == arm.cpsr_v; break;
+        default: /* AL */ return true;
+    }
+    return exec ^ (cond & 1);
+}
+
 #define current_instr_size (arm.cpsr_low28 & 0x20 ? 2 /* thumb */ : 4)
 
 void cpu_int_check();
@@ -61,7 +77,31 @@ void FASTCALL set_cpsr(uint32_t cpsr, uint32_t mask);
 uint32_t FASTCALL get_spsr();
 void FASTCALL set_spsr(uint32_t cpsr, uint32_t mask);
 void cpu_exception(int type);
+void FASTCALL cp15_write(uint32_t insn, uint32_t value);
+uint32_t FASTCALL cp15_read(uint32_t insn);
 void cpu_interpret_instruction(uint32_t insn);
+void cpu_interpret_thumb_instruction(uint16_t insn);
+/* A decoded instruction: handler runs it, if its condition passes, with
+ * the PC already advanced past it */
+struct decoded_insn;
+typedef void decoded_handler(const struct decoded_insn *d);
+struct decoded_insn {
+    decoded_handler *handler; // NULL until decoded
+    uint32_t insn;
+    uint32_t imm;             // immediate operand, offset or branch displacement
+    uint8_t cond;             // ARM condition, checked before calling handler
+    uint8_t rd, rn, rm;
+    uint8_t op;               // index of the operation handler is for, in cpu.c
+};
+/* op of an instruction that may switch to THUMB, change mode or remap memory
+ * without moving the PC (MSR, BX, coprocessor, SWI). Code run from decoded
+ * instructions must go back to the loop after it. */
+#define DECODED_OP_SYNC 0
+void cpu_decode_instruction(struct decoded_insn *d, uint32_t insn);
+// Decoded instruction cache
+void flush_decoded();
+void invalidate_decoded(void *ptr);
+void invalidate_decoded_range(void *start, uint32_t size);
 void cpu_arm_loop();
 void cpu_thumb_loop();
 
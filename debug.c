@@ -158,7 +158,9 @@ static void set_debug_next(uint32_t *next) {
         RAM_FLAGS(debug_next) &= ~RF_EXEC_DEBUG_NEXT;
     if (next != NULL) {
         if (RAM_FLAGS(next) & RF_CODE_TRANSLATED)
-            flush_translations();
+            flush_translations(TF_OTHER);
+        if (RAM_FLAGS(next) & RF_CODE_DECODED)
+            invalidate_decoded(next);
         RAM_FLAGS(next) |= RF_EXEC_DEBUG_NEXT;
     }
     debug_next = next;
@@ -167,6 +169,11 @@ static void set_debug_next(uint32_t *next) {
 bool gdb_connected = false;
 FILE *debugger_input = NULL;
 
+static bool rdebug_command; // the command being run came from the remote debug socket
+#ifndef NO_TRANSLATION
+static void rdebug_reply(const char *str, size_t len);
+#endif
+
 // return 1: break (should stop being feed with debugger commands), 0: continue (can be feed with other debugger commands)
 static int process_debug_cmd(char *cmdline) {
     char *cmd = strtok(cmdline, " \n");
@@ -176,6 +183,8 @@ static int process_debug_cmd(char *cmdline) {
     if (!strcasecmp(cmd, "?") || !strcasecmp(cmd, "h")) {
         gui_debug_printf(
                     "Debugger commands:\n"
+                    "ac [size <entries>] - address cache usage, or change how many entries it keeps\n"
+                    "ac bench <MB> - time address cache lookups over a small area and over MB megabytes\n"
                     "b - stack backtrace\n"
                     "c - continue\n"
                     "d <address> - dump memory\n"
@@ -192,8 +201,10 @@ static int process_debug_cmd(char *cmdline) {
                     "rs <regnum> <value> - change register value\n"
                     "ss <address> <length> <string> - search a string\n"
                     "s - step instruction\n"
-                    "t+ - enable instruction translation\n"
+                    "t+ [count] - enable instruction translation, of code run count times\n"
                     "t- - disable instruction translation\n"
+                    "tc [code <bytes>|blocks <count>|pages <count>|async <0|1>] - translation cache usage, or change its settings\n"
+                    "tc stats - translation statistics, one \"name value\" per line\n"
                     "u[a|t] [address] - disassemble memory\n"
                     "wm <file> <start> <size> - write memory to file\n"
                     "wf <file> <start> [size] - write file to memory\n");
@@ -275,7 +286,8 @@ static int process_debug_cmd(char *cmdline) {
                             break;
                         case 'x':
                             if (on) {
-                                if (*flags & RF_CODE_TRANSLATED) flush_translations();
+                                if (*flags & RF_CODE_TRANSLATED) flush_translations(TF_OTHER);
+                                if (*flags & RF_CODE_DECODED) invalidate_decoded(ptr);
                                 *flags |= RF_EXEC_BREAKPOINT;
                             } else
                                 *flags &= ~RF_EXEC_BREAKPOINT;
@@ -427,10 +439,79 @@ static int process_debug_cmd(char *cmdline) {
         //} else if (!stricmp(cmd, "t+")) {
     } else if (!strcasecmp(cmd, "t+")) {
         do_translate = 1;
+#ifndef NO_TRANSLATION
+        char *threshold_str = strtok(NULL, " \n");
+        if (threshold_str) {
+            uint32_t value = parse_expr(threshold_str);
+            if (value < 1) value = 1;
+            if (value > MAX_TRANSLATE_THRESHOLD) value = MAX_TRANSLATE_THRESHOLD;
+            translate_threshold = value;
+        }
+#endif
         //} else if (!stricmp(cmd, "t-")) {
     } else if (!strcasecmp(cmd, "t-")) {
-        flush_translations();
+        flush_translations(TF_OTHER);
         do_translate = 0;
+    } else if (!strcasecmp(cmd, "tc")) {
+#ifndef NO_TRANSLATION
+        char *what = strtok(NULL, " \n");
+        char *value_str = strtok(NULL, " \n");
+        if (!what) {
+            tcache_info();
+        } else if (!strcasecmp(what, "stats")) {
+            static char stats[0x8000];
+            size_t len = tcache_stats_dump(stats, sizeof stats);
+            if (rdebug_command)
+                rdebug_reply(stats, len);
+            else
+                gui_debug_printf("%s", stats);
+        } else if (!value_str) {
+            gui_debug_printf("Missing value.\n");
+        } else if (!strcasecmp(what, "code")) {
+            uint32_t value = parse_expr(value_str);
+            if (value < 2 * TCACHE_RESERVE) value = 2 * TCACHE_RESERVE;
+            if (value > INSN_BUFFER_SIZE) value = INSN_BUFFER_SIZE;
+            tcache_code_limit = value; // takes effect at the next translation
+        } else if (!strcasecmp(what, "blocks")) {
+            uint32_t value = parse_expr(value_str);
+            if (value < 1) value = 1;
+            if (value > MAX_TRANSLATIONS) value = MAX_TRANSLATIONS;
+            tcache_block_limit = value;
+#ifdef MULTI_PAGE_BLOCKS
+        } else if (!strcasecmp(what, "pages")) {
+            uint32_t value = parse_expr(value_str);
+            if (value < 1) value = 1;
+            if (value > MAX_BLOCK_PAGES) value = MAX_BLOCK_PAGES;
+            block_max_pages = value;
+#endif
+#ifdef BACKGROUND_TRANSLATION
+        } else if (!strcasecmp(what, "async")) {
+            translate_async = parse_expr(value_str) != 0;
+#endif
+        } else {
+            gui_debug_printf("Unknown limit %s\n", what);
+        }
+#endif
+    } else if (!strcasecmp(cmd, "ac")) {
+        char *what = strtok(NULL, " \n");
+        char *value_str = strtok(NULL, " \n");
+        if (!what) {
+            addr_cache_info();
+        } else if (!value_str) {
+            gui_debug_printf("Missing value.\n");
+        } else if (!strcasecmp(what, "size")) {
+            uint32_t value = parse_expr(value_str);
+            if (value < 1) value = 1;
+            if (value > AC_VALID_MAX) value = AC_VALID_MAX;
+            addr_cache_flush(); // the list may not fit the new size
+            ac_valid_limit = value;
+        } else if (!strcasecmp(what, "bench")) {
+            uint32_t mb = parse_expr(value_str);
+            if (mb < 1 || mb > 1024) mb = 64;
+            addr_cache_bench(mb);
+        } else {
+            gui_debug_printf("Unknown setting %s\n", what);
+        }
         //} else if (!stricmp(cmd, "wm") || !stricmp(cmd, "wf")) {
     } else if (!strcasecmp(cmd, "wm") || !strcasecmp(cmd, "wf")) {
         bool frommem = cmd[1] != 'f';
@@ -467,6 +548,10 @@ static int process_debug_cmd(char *cmdline) {
             return 0;
         }
         fclose(f);
+        if (!frommem) {
+            invalidate_decoded_range(ram, size);
+            mmu_table_write(ram, size);
+        }
         return 0;
         //} else if (!stricmp(cmd, "ss")) {
     } else if (!strcasecmp(cmd, "ss")) {
@@ -608,6 +693,13 @@ static void log_socket_error(const char *msg) {
 #endif
 }
 
+#ifndef NO_TRANSLATION
+static void rdebug_reply(const char *str, size_t len) {
+    if (socket_fd && send(socket_fd, str, len, 0) < 0)
+        log_socket_error("Remote debug: send failed");
+}
+#endif
+
 static void set_nonblocking(int socket, bool nonblocking) {
 #ifdef __MINGW32__
     u_long mode = nonblocking;
@@ -726,7 +818,9 @@ void rdebug_recv(void) {
     char *line_end;
     while ( (line_end = (char*)memchr((void*)line_start, '\n', rdebug_inbuf_used - (line_start - rdebug_inbuf)))) {
         *line_end = 0;
+        rdebug_command = true;
         process_debug_cmd(line_start);
+        rdebug_command = false;
         line_start = line_end + 1;
     }
     /* Shift buffer down so the unprocessed data is at the start */
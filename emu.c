@@ -15,6 +15,7 @@
 #include "gdbstub.h"
 #include "flash.h"
 #include "misc.h"
+#include "perfmap.h"
 #include "os/os.h"
 
 #include <stdint.h>
@@ -37,6 +38,10 @@ bool exiting, debug_on_start, debug_on_warn, large_nand, large_sdram;
 int product = 0x0E0;
 uint32_t boot2_base;
 const char *path_boot1 = NULL, *path_boot2 = NULL, *path_flash = NULL, *pre_boot2 = NULL, *pre_diags = NULL, *pre_os = NULL;
+const char *path_jit_cache = NULL;
+bool perf_map = false;
+const char *path_symbols = NULL;
+const char *path_jit_stats = NULL;
 
 void *restart_after_exception[32];
 
@@ -212,13 +217,25 @@ int emulate(unsigned int port_gdb, unsigned int port_rdbg)
 #ifndef NO_TRANSLATION
     if(!insn_buffer)
     {
-        insn_buffer = os_alloc_executable(INSN_BUFFER_SIZE);
+#ifdef THREADED_TRANSLATION
+        insn_buffer = malloc(INSN_BUFFER_SIZE); // not machine code
+#else
+        insn_buffer = os_alloc_executable(INSN_BUFFER_SIZE + INSN_STAGE_SIZE);
+#endif
         insn_bufptr = insn_buffer;
     }
 
     if(!insn_buffer)
         return false;
 #endif
+#ifdef PERSISTENT_TRANSLATIONS
+    if (path_jit_cache)
+        tcache_load(path_jit_cache);
+#endif
+#ifndef NO_TRANSLATION
+    if (perf_map)
+        perf_map_open(path_symbols);
+#endif
 
     os_exception_frame_t frame;
     addr_cache_init(&frame);
@@ -299,7 +316,8 @@ reset:
         }
     }
     addr_cache_flush();
-    flush_translations();
+    flush_translations(TF_RESET);
+    flush_decoded();
 
     sched_reset();
 
@@ -344,6 +362,21 @@ reset:
                 cpu_arm_loop();
         }
     }
+#ifdef PERSISTENT_TRANSLATIONS
+    if (path_jit_cache)
+        tcache_save(path_jit_cache);
+#endif
+#ifndef NO_TRANSLATION
+    if (path_jit_stats) {
+        static char stats[0x8000];
+        size_t len = tcache_stats_dump(stats, sizeof stats);
+        FILE *f = fopen(path_jit_stats, "w");
+        if (!f || fwrite(stats, 1, len, f) != len)
+            gui_perror(path_jit_stats);
+        if (f)
+            fclose(f);
+    }
+#endif
     return 0;
 }
 
@@ -352,9 +385,15 @@ void emu_cleanup()
     if(debugger_input)
         fclose(debugger_input);
 
+#ifdef BACKGROUND_TRANSLATION
+    translate_worker_quit();
+#endif
     memory_deinitialize();
     flash_close();
 
     gdbstub_quit();
     rdebug_quit();
+#ifndef NO_TRANSLATION
+    perf_map_close();
+#endif
 }
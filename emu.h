@@ -5,9 +5,11 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-// Can also be set manually
-#if !defined(__i386__) && !defined(__x86_64__)
-#define NO_TRANSLATION
+/* Hosts without a native code translator use the portable threaded one
+ * (translate_threaded.c). Both can also be set manually; NO_TRANSLATION
+ * turns translation off entirely. */
+#if !defined(__i386__) && !defined(__x86_64__) && !defined(NO_TRANSLATION)
+#define THREADED_TRANSLATION
 #endif
 
 // Needed for the assembler calling convention
@@ -52,6 +54,10 @@ extern int product;
 extern int asic_user_flags;
 extern uint32_t boot2_base;
 extern const char *path_boot1, *path_boot2, *path_flash, *pre_boot2, *pre_diags, *pre_os;
+extern const char *path_jit_cache; // translations saved across runs, if set
+extern bool perf_map;               // name translated code in /tmp/perf-<pid>.map
+extern const char *path_symbols;    // guest symbols for those names, if set
+extern const char *path_jit_stats;  // translation statistics written here at exit, if set
 
 #define emulate_casplus (product == 0x0C0)
 // 0C-0E (CAS, lab cradle, plain Nspire) use old ASIC
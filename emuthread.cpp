@@ -121,6 +121,10 @@ void EmuThread::run()
 
     path_boot1 = emu_path_boot1.c_str();
     path_flash = emu_path_flash.c_str();
+    path_jit_cache = emu_path_jit_cache.empty() ? NULL : emu_path_jit_cache.c_str();
+    perf_map = emu_perf_map;
+    path_symbols = emu_path_symbols.empty() ? NULL : emu_path_symbols.c_str();
+    path_jit_stats = emu_path_jit_stats.empty() ? NULL : emu_path_jit_stats.c_str();
 
     int ret = emulate(port_gdb, port_rdbg);
 
@@ -13,7 +13,8 @@ public:
 
     volatile bool paused = false;
 
-    std::string emu_path_boot1 = "", emu_path_flash = "";
+    std::string emu_path_boot1 = "", emu_path_flash = "", emu_path_jit_cache = "", emu_path_symbols = "", emu_path_jit_stats = "";
+    bool emu_perf_map = false;
     unsigned int port_gdb = 0, port_rdbg = 0;
 
 signals:
@@ -33,6 +33,7 @@
 #include "armsnippets.h"
 #include "gdbstub.h"
 #include "translate.h"
+#include "mmu.h"
 
 static void gdbstub_disconnect(void);
 
@@ -504,7 +505,9 @@ void gdbstub_loop(void) {
                         break;
                     }
                     if (range_translated((uintptr_t)ramaddr, (uintptr_t)((char *)ramaddr + length)))
-                        flush_translations();
+                        flush_translations(TF_OTHER);
+                    invalidate_decoded_range(ramaddr, length);
+                    mmu_table_write(ramaddr, length);
                     if (hex2mem(ptr, ramaddr, length))
                         strcpy(remcomOutBuffer, "OK");
                     else
@@ -551,7 +554,8 @@ z:
                         case '0': // mem breakpoint
                         case '1': // hw breakpoint
                             if (set) {
-                                if (*flags & RF_CODE_TRANSLATED) flush_translations();
+                                if (*flags & RF_CODE_TRANSLATED) flush_translations(TF_OTHER);
+                                if (*flags & RF_CODE_DECODED) invalidate_decoded(ramaddr);
                                 *flags |= RF_EXEC_BREAKPOINT;
                             } else
                                 *flags &= ~RF_EXEC_BREAKPOINT;
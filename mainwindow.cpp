@@ -76,6 +76,10 @@ MainWindow::MainWindow(QWidget *parent) :
     setUSBPath(settings->value("usbdir", QString("ndless")).toString());
     setGDBPort(settings->value("gdbPort", 3333).toUInt());
     setRDBGPort(settings->value("rdbgPort", 3334).toUInt());
+    emu.emu_path_jit_cache = settings->value("jitCache", "").toString().toStdString();
+    emu.emu_perf_map = settings->value("perfMap", false).toBool();
+    emu.emu_path_symbols = settings->value("symbolMap", "").toString().toStdString();
+    emu.emu_path_jit_stats = settings->value("jitStats", "").toString().toStdString();
 
     bool autostart = settings->value("emuAutostart", false).toBool();
     setAutostart(autostart);
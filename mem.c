@@ -14,8 +14,10 @@
 #include "usb.h"
 #include "casplus.h"
 #include "mem.h"
+#include "cpu.h"
 #include "debug.h"
 #include "translate.h"
+#include "mmu.h"
 
 uint8_t   (*read_byte_map[64])(uint32_t addr);
 uint16_t  (*read_half_map[64])(uint32_t addr);
@@ -56,8 +58,6 @@ uint32_t phys_mem_addr(void *ptr) {
 }
 
 
-#define DO_READ_ACTION (RF_READ_BREAKPOINT)
-void read_action(void *ptr) __asm__("read_action");
 void read_action(void *ptr) {
     uint32_t addr = phys_mem_addr(ptr);
     if (!gdb_connected)
@@ -65,8 +65,6 @@ void read_action(void *ptr) {
     debugger(DBG_READ_BREAKPOINT, addr);
 }
 
-#define DO_WRITE_ACTION (RF_WRITE_BREAKPOINT | RF_CODE_TRANSLATED | RF_CODE_NO_TRANSLATE)
-void write_action(void *ptr) __asm__("write_action");
 void write_action(void *ptr) {
     uint32_t addr = phys_mem_addr(ptr);
     uint32_t *flags = &RAM_FLAGS((size_t)ptr & ~3);
@@ -75,6 +73,10 @@ void write_action(void *ptr) {
             emuprintf("Hit write breakpoint at %08x. Entering debugger.\n", addr);
         debugger(DBG_WRITE_BREAKPOINT, addr);
     }
+    if (*flags & RF_CODE_DECODED)
+        invalidate_decoded(ptr);
+    if (*flags & RF_MMU_TABLE)
+        mmu_table_write(ptr, 1);
 #ifndef NO_TRANSLATION
     if (*flags & RF_CODE_TRANSLATED) {
         logprintf(LOG_CPU, "Wrote to translated code at %08x. Deleting translations.\n", addr);
@@ -17,25 +17,38 @@ struct mem_area_desc {
 };
 extern struct mem_area_desc mem_areas[4];
 void *phys_mem_ptr(uint32_t addr, uint32_t size);
+uint32_t phys_mem_addr(void *ptr);
 
 /* Each word of memory has a flag word associated with it. For fast access,
  * flags are located at a constant offset from the memory data itself.
  *
  * These can't be per-byte because a translation index wouldn't fit then.
  * This does mean byte/halfword accesses have to mask off the low bits to
- * check flags, but the alternative would be another 32MB of memory overhead. */
+ * check flags, but the alternative would be another 32MB of memory overhead.
+ * Most words never get a flag set. On Linux and macOS, pages of flags that
+ * were only read take up no memory (see os_reserve in os-linux.c); on
+ * Windows every page of flags the guest touches is committed. */
 #define RAM_FLAGS(memptr) (*(uint32_t *)((uint8_t *)(memptr) + MEM_MAXSIZE))
 
 #define RF_READ_BREAKPOINT   1
 #define RF_WRITE_BREAKPOINT  2
 #define RF_EXEC_BREAKPOINT   4
 #define RF_EXEC_DEBUG_NEXT   8
-#define RF_EXEC_HACK         16
+#define RF_MMU_TABLE         16  // part of a translation table the MMU has read (see mmu.c)
 #define RF_CODE_TRANSLATED   32
 #define RF_CODE_NO_TRANSLATE 64
-#define RF_READ_ONLY         128
+#define RF_CODE_DECODED      128 // the interpreter has it in its decoded instruction cache
 #define RF_ARMLOADER_CB      256
-#define RFS_TRANSLATION_INDEX 9
+#define RF_READ_ONLY         512
+#define RF_EXEC_HACK         1024
+#define RFS_TRANSLATION_INDEX 11
+
+/* Flags that make an access go through read_action or write_action. The
+ * assembly code and the x86_64 translator test these as a byte. */
+#define DO_READ_ACTION (RF_READ_BREAKPOINT)
+#define DO_WRITE_ACTION (RF_WRITE_BREAKPOINT | RF_MMU_TABLE | RF_CODE_TRANSLATED | RF_CODE_NO_TRANSLATE | RF_CODE_DECODED)
+void read_action(void *ptr) __asm__("read_action");
+void write_action(void *ptr) __asm__("write_action");
 
 uint8_t bad_read_byte(uint32_t addr);
 uint16_t bad_read_half(uint32_t addr);
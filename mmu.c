@@ -1,13 +1,113 @@
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
 #include "emu.h"
 #include "cpu.h"
 #include "mmu.h"
 #include "mem.h"
+#include "translate.h"
 #include "os/os.h"
 
-/* Copy of translation table in memory (hack to approximate effect of having a TLB) */
+/* Copy of translation table in memory (hack to approximate effect of having a TLB).
+ * The words of the table it was copied from are flagged RF_MMU_TABLE, so
+ * the ones written to since can be brought over without copying the rest. */
 static uint32_t mmu_translation_table[0x1000];
+static uint32_t *mmu_table_ptr; // the table copied from, or NULL
+static uint32_t mmu_dirty[0x1000 / 32];
+static uint16_t mmu_dirty_list[0x1000];
+static uint32_t mmu_num_dirty;
+
+/* Second level tables are read in place, so addr_cache entries made from
+ * them can go stale when they are written to. The 1kB pieces of them that
+ * have been walked are flagged too, and a write to one makes the next TLB
+ * flush a full one. */
+#define MMU_L2_MAX 256
+static uint32_t *mmu_l2_list[MMU_L2_MAX];
+static uint32_t mmu_num_l2;
+static bool mmu_l2_dirty;
+
+static void mmu_flag_words(uint32_t *ptr, uint32_t count, bool set) {
+    uint32_t *flags = &RAM_FLAGS(ptr);
+    while (count--) {
+        if (set)
+            *flags++ |= RF_MMU_TABLE;
+        else
+            *flags++ &= ~RF_MMU_TABLE;
+    }
+}
+
+static bool in_l1_table(uint32_t *ptr) {
+    return mmu_table_ptr && ptr >= mmu_table_ptr && ptr < mmu_table_ptr + 0x1000;
+}
+
+static void mmu_unwatch_l2() {
+    uint32_t i;
+    for (i = 0; i < mmu_num_l2; i++)
+        if (!in_l1_table(mmu_l2_list[i]))
+            mmu_flag_words(mmu_l2_list[i], 0x100, false);
+    mmu_num_l2 = 0;
+    mmu_l2_dirty = true;
+}
+
+static void mmu_watch_l2(uint32_t *entry) {
+    uint32_t *piece = (uint32_t *)((uintptr_t)entry & ~0x3FF);
+    if (RAM_FLAGS(piece) & RF_MMU_TABLE)
+        return;
+    if (mmu_num_l2 == MMU_L2_MAX)
+        mmu_unwatch_l2();
+    mmu_flag_words(piece, 0x100, true);
+    mmu_l2_list[mmu_num_l2++] = piece;
+}
+
+static void mmu_clear_dirty() {
+    uint32_t i;
+    for (i = 0; i < mmu_num_dirty; i++)
+        mmu_dirty[mmu_dirty_list[i] >> 5] = 0;
+    mmu_num_dirty = 0;
+}
+
+static void mmu_unwatch_table() {
+    if (mmu_table_ptr)
+        mmu_flag_words(mmu_table_ptr, 0x1000, false);
+    mmu_clear_dirty();
+    mmu_table_ptr = NULL;
+}
+
+/* Called before memory flagged RF_MMU_TABLE is written to */
+void mmu_table_write(void *ptr, uint32_t size) {
+    uint32_t *word = (uint32_t *)((uintptr_t)ptr & ~3);
+    uint32_t *end = (uint32_t *)((uintptr_t)ptr + size);
+    for (; word < end; word++) {
+        if (!(RAM_FLAGS(word) & RF_MMU_TABLE))
+            continue;
+        if (in_l1_table(word)) {
+            uint32_t i = word - mmu_table_ptr;
+            if (!(mmu_dirty[i >> 5] & 1u << (i & 31))) {
+                mmu_dirty[i >> 5] |= 1u << (i & 31);
+                mmu_dirty_list[mmu_num_dirty++] = i;
+            }
+        } else {
+            mmu_l2_dirty = true;
+        }
+    }
+}
+
+/* Bring the words written to over to the copy. Those that changed are left
+ * set in mmu_dirty; returns how many there are */
+static uint32_t mmu_sync_table() {
+    uint32_t i, changed = 0;
+    for (i = 0; i < mmu_num_dirty; i++) {
+        uint32_t n = mmu_dirty_list[i];
+        if (mmu_translation_table[n] != mmu_table_ptr[n]) {
+            mmu_translation_table[n] = mmu_table_ptr[n];
+            changed++;
+        } else {
+            mmu_dirty[n >> 5] &= ~(1u << (n & 31));
+        }
+    }
+    return changed;
+}
+
 
 /* Translate a virtual address to a physical address */
 uint32_t mmu_translate(uint32_t addr, bool writing, fault_proc *fault) {
@@ -32,6 +132,7 @@ uint32_t mmu_translate(uint32_t addr, bool writing, fault_proc *fault) {
                 return 0xFFFFFFFF;
             }
             entry = table[addr >> 12 & 0xFF];
+            mmu_watch_l2(&table[addr >> 12 & 0xFF]);
             break;
         case 2: /* Section (1MB) */
             page_size = 0x100000;
@@ -44,6 +145,7 @@ uint32_t mmu_translate(uint32_t addr, bool writing, fault_proc *fault) {
                 return 0xFFFFFFFF;
             }
             entry = table[addr >> 10 & 0x3FF];
+            mmu_watch_l2(&table[addr >> 10 & 0x3FF]);
             break;
     }
 
@@ -110,27 +212,104 @@ perm_fault:
     return (entry & -page_size) | (addr & (page_size - 1));
 }
 
+#ifndef AC_TWO_LEVEL
 ac_entry *addr_cache;
+#endif
 
-// Keep a list of valid entries so we can invalidate everything quickly
-#define AC_VALID_MAX 256
+/* Keep a list of valid entries so we can invalidate everything quickly: a
+ * flush only touches the entries filled since the last one. Once the list
+ * holds ac_valid_limit of them, the oldest is dropped for each new one. The
+ * dropped entry is marked evicted, so a miss on it can be told apart from a
+ * first access. */
 static uint32_t ac_valid_index;
+static uint32_t ac_valid_count;
 static uint32_t ac_valid_list[AC_VALID_MAX];
+uint32_t ac_valid_limit = 8192;
+struct ac_stats ac_stats;
 
-static void addr_cache_invalidate(int i) {
-    AC_SET_ENTRY_INVALID(addr_cache[i], i >> 1 << 10)
+#ifdef AC_TWO_LEVEL
+/* Blocks are given out round robin; when the pool runs out, the oldest goes
+ * back to pointing at the shared invalid block. */
+ac_entry **addr_cache_dir;
+static ac_entry *ac_dir[AC_DIR_SIZE];
+static ac_entry ac_invalid_block[AC_BLOCK_ENTRIES];
+static ac_entry ac_blocks[AC_BLOCK_MAX][AC_BLOCK_ENTRIES];
+static uint32_t ac_block_owner[AC_BLOCK_MAX]; // directory index + 1, 0 if unused
+static uint32_t ac_block_index;
+static uint32_t ac_commit_count;
+
+#define AC_COMMITTED(i) (addr_cache_dir[(i) / AC_BLOCK_ENTRIES] != ac_invalid_block)
+
+void addr_cache_dir_init() {
+    uint32_t i;
+    for (i = 0; i < AC_BLOCK_ENTRIES; i++)
+        AC_SET_ENTRY_INVALID(ac_invalid_block[i], 0)
+    for (i = 0; i < AC_DIR_SIZE; i++)
+        ac_dir[i] = ac_invalid_block;
+    addr_cache_dir = ac_dir;
 }
 
+// Give the block of entry i storage of its own, so it can be written to
+static void addr_cache_block_alloc(uint32_t i) {
+    uint32_t j, *owner = &ac_block_owner[ac_block_index];
+    ac_entry *block = ac_blocks[ac_block_index];
+    if (*owner) {
+        ac_dir[*owner - 1] = ac_invalid_block;
+        ac_stats.decommits++;
+    } else {
+        ac_commit_count++;
+    }
+    for (j = 0; j < AC_BLOCK_ENTRIES; j++)
+        AC_SET_ENTRY_INVALID(block[j], 0)
+    *owner = i / AC_BLOCK_ENTRIES + 1;
+    ac_dir[i / AC_BLOCK_ENTRIES] = block;
+    ac_stats.commits++;
+    ac_block_index = (ac_block_index + 1) % AC_BLOCK_MAX;
+}
+#else
 /* Since only a small fraction of the virtual address space, and therefore
  * only a small fraction of the pages making up addr_cache, will be in use
  * at a time, we can keep only a few pages committed and thereby reduce
- * the memory used by a lot. */
-#define AC_COMMIT_MAX 128
+ * the memory used by a lot. The table starts out reserved but inaccessible,
+ * and a page is committed, filled with invalid entries, the first time it
+ * is touched. */
+#define AC_COMMIT_MAX 256
 #define PAGE_SIZE 4096
 uint8_t ac_commit_map[AC_NUM_ENTRIES * sizeof(ac_entry) / PAGE_SIZE];
 ac_entry *ac_commit_list[AC_COMMIT_MAX];
 uint32_t ac_commit_index;
+static uint32_t ac_commit_count;
+
+#define AC_COMMITTED(i) ac_commit_map[(i) / (PAGE_SIZE / sizeof(ac_entry))]
+#endif
+
+// Entries in pages (or blocks) not in use are invalid already
+static void addr_cache_invalidate(int i) {
+    if (AC_COMMITTED(i)) {
+        AC_SET_ENTRY_INVALID(AC_ENTRY(i), i >> 1 << 10)
+    }
+}
+
+void addr_cache_info() {
+    struct ac_stats *s = &ac_stats;
+    gui_debug_printf("Entries:    %u valid, at most %u\n", ac_valid_count, ac_valid_limit);
+#ifdef AC_TWO_LEVEL
+    gui_debug_printf("Table:      %u of %u blocks in use, %llu allocated, %llu reused\n",
+                     ac_commit_count, AC_BLOCK_MAX,
+#else
+    gui_debug_printf("Table:      %u of %u pages committed, %llu commits, %llu decommits\n",
+                     ac_commit_count, AC_COMMIT_MAX,
+#endif
+                     (unsigned long long)s->commits, (unsigned long long)s->decommits);
+    gui_debug_printf("Misses:     %llu, %llu of them on evicted entries\n",
+                     (unsigned long long)s->misses, (unsigned long long)s->refills);
+    gui_debug_printf("Evicted:    %llu entries\n", (unsigned long long)s->evictions);
+    gui_debug_printf("Flushes:    %u, of %llu entries\n", s->flushes, (unsigned long long)s->flushed);
+    gui_debug_printf("TLB ops:    %u, %llu entries dropped without a full flush\n",
+                     s->tlb_flushes, (unsigned long long)s->tlb_flushed);
+}
 
+#ifndef AC_TWO_LEVEL
 bool addr_cache_pagefault(void *addr) {
     ac_entry *page = (ac_entry *)((uintptr_t)addr & -PAGE_SIZE);
     uint32_t offset = page - addr_cache;
@@ -140,12 +319,16 @@ bool addr_cache_pagefault(void *addr) {
     if (oldpage) {
         //printf("Freeing %p, ", oldpage);
         os_sparse_decommit(oldpage, PAGE_SIZE);
-        ac_commit_map[offset / (PAGE_SIZE / sizeof(ac_entry))] = 0;
+        AC_COMMITTED(oldpage - addr_cache) = 0;
+        ac_stats.decommits++;
+    } else {
+        ac_commit_count++;
     }
     //printf("Committing %p\n", page);
     if (!os_sparse_commit(page, PAGE_SIZE))
         return false;
-    ac_commit_map[offset / (PAGE_SIZE / sizeof(ac_entry))] = 1;
+    AC_COMMITTED(offset) = 1;
+    ac_stats.commits++;
 
     uint32_t i;
     for (i = 0; i < (PAGE_SIZE / sizeof(ac_entry)); i++)
@@ -155,6 +338,7 @@ bool addr_cache_pagefault(void *addr) {
     ac_commit_index = (ac_commit_index + 1) % AC_COMMIT_MAX;
     return true;
 }
+#endif
 
 void *addr_cache_miss(uint32_t virt, bool writing, fault_proc *fault) {
     ac_entry entry;
@@ -167,13 +351,27 @@ void *addr_cache_miss(uint32_t virt, bool writing, fault_proc *fault) {
         AC_SET_ENTRY_PHYS(entry, virt, phys)
                 //printf("addr_cache_miss VA=%08x PA=%08x entry=%p\n", virt, phys, entry);
     }
-    uint32_t oldoffset = ac_valid_list[ac_valid_index];
     uint32_t offset = (virt >> 10) * 2 + writing;
-    //if (ac_commit_map[oldoffset / (PAGE_SIZE / sizeof(ac_entry))])
-    addr_cache_invalidate(oldoffset);
-    addr_cache[offset] = entry;
+    ac_stats.misses++;
+    if (AC_ENTRY_EVICTED(AC_ENTRY(offset), virt & ~0x3FF))
+        ac_stats.refills++;
+    if (ac_valid_count < ac_valid_limit) {
+        ac_valid_count++;
+    } else {
+        uint32_t oldoffset = ac_valid_list[ac_valid_index];
+        if (AC_COMMITTED(oldoffset)) {
+            AC_SET_ENTRY_EVICTED(AC_ENTRY(oldoffset), oldoffset >> 1 << 10)
+        }
+        ac_stats.evictions++;
+    }
+#ifdef AC_TWO_LEVEL
+    if (!AC_COMMITTED(offset))
+        addr_cache_block_alloc(offset);
+#endif
+    AC_ENTRY(offset) = entry;
     ac_valid_list[ac_valid_index] = offset;
-    ac_valid_index = (ac_valid_index + 1) % AC_VALID_MAX;
+    if (++ac_valid_index >= ac_valid_limit)
+        ac_valid_index = 0;
     return ptr;
 }
 
@@ -181,15 +379,98 @@ void addr_cache_flush() {
     uint32_t i;
 
     if (arm.control & 1) {
-        void *table = phys_mem_ptr(arm.translation_table_base, 0x4000);
+        uint32_t *table = phys_mem_ptr(arm.translation_table_base, 0x4000);
         if (!table)
             error("Bad translation table base register: %x", arm.translation_table_base);
-        memcpy(mmu_translation_table, table, 0x4000);
+        if (table != mmu_table_ptr) {
+            mmu_unwatch_table();
+            memcpy(mmu_translation_table, table, 0x4000);
+            mmu_flag_words(table, 0x1000, true);
+            mmu_table_ptr = table;
+        } else {
+            mmu_sync_table();
+            mmu_clear_dirty();
+        }
+    } else {
+        mmu_unwatch_table();
+        mmu_unwatch_l2();
     }
+    mmu_l2_dirty = false;
 
-    for (i = 0; i < AC_VALID_MAX; i++) {
+    for (i = 0; i < ac_valid_count; i++) {
         uint32_t offset = ac_valid_list[i];
-        //	if (ac_commit_map[offset / (PAGE_SIZE / sizeof(ac_entry))])
         addr_cache_invalidate(offset);
     }
+    ac_stats.flushes++;
+    ac_stats.flushed += ac_valid_count;
+    ac_valid_count = ac_valid_index = 0;
+
+    unlink_translations();
+}
+
+/* TLB invalidate: unless a second level table was written to, only the
+ * entries for sections whose first level descriptor changed are dropped. */
+void addr_cache_tlb_flush() {
+    uint32_t i, kept = 0;
+
+    ac_stats.tlb_flushes++;
+    if (!mmu_table_ptr || mmu_l2_dirty) {
+        addr_cache_flush();
+        return;
+    }
+    if (!mmu_sync_table()) {
+        mmu_clear_dirty();
+        return;
+    }
+
+    for (i = 0; i < ac_valid_count; i++) {
+        uint32_t offset = ac_valid_list[i];
+        uint32_t section = offset >> 11;
+        if (mmu_dirty[section >> 5] & 1u << (section & 31))
+            addr_cache_invalidate(offset);
+        else
+            ac_valid_list[kept++] = offset;
+    }
+    mmu_clear_dirty();
+    ac_stats.tlb_flushed += ac_valid_count - kept;
+    ac_valid_count = kept;
+    ac_valid_index = kept < ac_valid_limit ? kept : 0;
+
+    unlink_translations();
+}
+
+/* Time lookups done the way the memory access code does them, to compare
+ * table layouts: first over a few pages, like code running out of a small
+ * area during boot, then one entry per 1kB over mb megabytes of address
+ * space from 10000000. Misses go through addr_cache_miss without aborts. */
+static volatile uintptr_t ac_bench_sum; // keeps the lookups from being optimized out
+void addr_cache_bench(uint32_t mb) {
+    static const char *names[] = { "Small", "Large" };
+    uint32_t sizes[] = { 0x4000, mb << 20 }, strides[] = { 4, 0x400 };
+    uintptr_t sum = 0;
+    int run;
+    for (run = 0; run < 2; run++) {
+        uint32_t n = 0, passes = (16 << 20) / (sizes[run] / strides[run]);
+        uint64_t misses = ac_stats.misses, commits = ac_stats.commits, decommits = ac_stats.decommits;
+        addr_cache_flush();
+        clock_t start = clock();
+        while (passes--) {
+            uint32_t va;
+            for (va = 0x10000000; va < 0x10000000 + sizes[run]; va += strides[run], n++) {
+                ac_entry entry = AC_ENTRY((va >> 10) << 1);
+                if ((uintptr_t)(entry + va) & AC_NOT_PTR && (uintptr_t)entry & AC_INVALID) {
+                    addr_cache_miss(va, false, NULL);
+                    entry = AC_ENTRY((va >> 10) << 1);
+                }
+                sum += (uintptr_t)entry;
+            }
+        }
+        double ms = (double)(clock() - start) * 1000 / CLOCKS_PER_SEC;
+        gui_debug_printf("%s: %u lookups in %.1f ms (%.2f ns each), %llu misses, %llu commits, %llu decommits\n",
+                         names[run], n, ms, ms * 1e6 / n, (unsigned long long)(ac_stats.misses - misses),
+                         (unsigned long long)(ac_stats.commits - commits),
+                         (unsigned long long)(ac_stats.decommits - decommits));
+    }
+    addr_cache_flush();
+    ac_bench_sum = sum;
 }
@@ -24,11 +24,38 @@ uint32_t mmu_translate(uint32_t addr, bool writing, fault_proc *fault);
  * c) Invalid entry
  *    VA + entry has bit 31 set, entry has bit 22 set. Entry is invalid and
  *    addr_cache_miss must be called.
+ *
+ * That is the i386 encoding. Other hosts tag the low bits of the entry
+ * instead: AC_NOT_PTR (bit 0) is set in b) and c), AC_INVALID (bit 1) in c).
+ * An invalid entry that was evicted to make room for another also has
+ * AC_EVICTED set (bit 23 on i386, bit 2 elsewhere), which only matters for
+ * statistics.
  */
 
 #define AC_NUM_ENTRIES (4194304*2)
 typedef uint8_t *ac_entry;
+
+#ifdef AC_TWO_LEVEL
+/* Instead of one table that is reserved whole and committed a page at a time
+ * from a SIGSEGV handler, a directory with a pointer for every 256kB of
+ * virtual address space. Those not in use point to a shared block of invalid
+ * entries, and addr_cache_miss gives them a block of their own from a pool
+ * of AC_BLOCK_MAX. No signals are involved, at the cost of one more load on
+ * each access. Only for hosts using the encoding where invalid entries do
+ * not depend on the VA. */
+#ifdef __i386__
+#error "AC_TWO_LEVEL is not supported on i386 hosts"
+#endif
+#define AC_BLOCK_ENTRIES 512
+#define AC_BLOCK_MAX 256
+#define AC_DIR_SIZE (AC_NUM_ENTRIES / AC_BLOCK_ENTRIES)
+extern ac_entry **addr_cache_dir;
+#define AC_ENTRY(i) addr_cache_dir[(i) / AC_BLOCK_ENTRIES][(i) % AC_BLOCK_ENTRIES]
+void addr_cache_dir_init();
+#else
 extern ac_entry *addr_cache;
+#define AC_ENTRY(i) addr_cache[i]
+#endif
 
 #ifdef __i386__
     #define AC_SET_ENTRY_PTR(entry, va, ptr) \
@@ -41,6 +68,13 @@ extern ac_entry *addr_cache;
     #define AC_SET_ENTRY_INVALID(entry, va) \
             entry = (ac_entry)(AC_INVALID); \
             entry += (~(uintptr_t)((va) + entry) & AC_NOT_PTR);
+    #define AC_EVICTED (1 << 23)
+    #define AC_SET_ENTRY_EVICTED(entry, va) \
+            entry = (ac_entry)(AC_INVALID | AC_EVICTED); \
+            entry += (~(uintptr_t)((va) + entry) & AC_NOT_PTR);
+    #define AC_ENTRY_EVICTED(entry, va) \
+            (((uintptr_t)((va) + (entry)) & AC_NOT_PTR) \
+             && ((uintptr_t)(entry) & (AC_INVALID | AC_EVICTED)) == (AC_INVALID | AC_EVICTED))
 #else
     #define AC_SET_ENTRY_PTR(entry, va, ptr) \
             entry = (ptr) - (va);
@@ -51,10 +85,44 @@ extern ac_entry *addr_cache;
             entry = (ac_entry)(((pa) - (va)) | AC_NOT_PTR);
     #define AC_SET_ENTRY_INVALID(entry, va) \
             entry = (ac_entry)(AC_INVALID | AC_NOT_PTR);
+    #define AC_EVICTED 0x4
+    #define AC_SET_ENTRY_EVICTED(entry, va) \
+            entry = (ac_entry)(AC_EVICTED | AC_INVALID | AC_NOT_PTR);
+    #define AC_ENTRY_EVICTED(entry, va) \
+            ((uintptr_t)(entry) == (AC_EVICTED | AC_INVALID | AC_NOT_PTR))
 #endif
 
+/* Valid entries are kept track of so that a flush only has to invalidate
+ * those. There can be up to ac_valid_limit of them at a time.
+ * Hits are not counted: most lookups are inlined in the assembly accessors
+ * and in translated code, where a counter would add a memory write to every
+ * guest load and store. Compare misses with the instructions run instead. */
+#define AC_VALID_MAX 65536
+extern uint32_t ac_valid_limit;
+struct ac_stats {
+    uint64_t misses;    // calls to addr_cache_miss
+    uint64_t refills;   // of those, on entries evicted earlier
+    uint64_t evictions; // entries invalidated to make room for another
+    uint32_t flushes;
+    uint64_t flushed;   // valid entries invalidated by flushes
+    uint32_t tlb_flushes;
+    uint64_t tlb_flushed; // entries invalidated by those that did not need a full flush
+    uint64_t commits;     // pages (or blocks) of addr_cache taken into use
+    uint64_t decommits;   // to stay within AC_COMMIT_MAX (or AC_BLOCK_MAX)
+};
+extern struct ac_stats ac_stats;
+void addr_cache_info();
+// Times table lookups over a small and a large area (mb megabytes)
+void addr_cache_bench(uint32_t mb);
+
+#ifndef AC_TWO_LEVEL
 bool addr_cache_pagefault(void *addr);
+#endif
 void *addr_cache_miss(uint32_t addr, bool writing, fault_proc *fault) __asm__("addr_cache_miss");
 void addr_cache_flush();
+// Like addr_cache_flush, but keeps what the page table writes since the last one left alone
+void addr_cache_tlb_flush();
+// Notes a write to memory that may be part of a page table
+void mmu_table_write(void *ptr, uint32_t size);
 
 #endif
@@ -40,17 +40,30 @@ linux-g++-32:QMAKE_TARGET.arch = x86
 linux-g++-64:QMAKE_TARGET.arch = x86_64
 macx-clang:QMAKE_TARGET.arch = $$QMAKE_HOST.arch
 
+# Hosts without a native translator, and builds with
+# CONFIG+=threaded_translation, use the portable one
 TRANSLATE = $$join(QMAKE_TARGET.arch, "", "translate_", ".c")
-exists($$TRANSLATE) {
-    SOURCES += $$TRANSLATE
+threaded_translation {
+    DEFINES += THREADED_TRANSLATION
+    TRANSLATE = translate_threaded.c
+}
+!exists($$TRANSLATE) {
+    TRANSLATE = translate_threaded.c
+}
+SOURCES += $$TRANSLATE translate_common.c
+
+# CONFIG+=two_level_addr_cache looks up the address cache through a
+# directory instead of committing its pages from a SIGSEGV handler (64 bit hosts)
+two_level_addr_cache {
+    DEFINES += AC_TWO_LEVEL
 }
 
 ASMCODE = $$join(QMAKE_TARGET.arch, "", "asmcode_", ".S")
-exists($$ASMCODE) {
+exists($$ASMCODE):!threaded_translation {
     ASMCODE_IMPL = $$ASMCODE
 }
 
-macx-clang {
+macx-clang:!threaded_translation {
 	ASMCODE_IMPL = asmcode_mac.S
 }
 
@@ -85,6 +98,7 @@ SOURCES += mainwindow.cpp \
     mem.c \
     misc.c \
     mmu.c \
+    perfmap.c \
     schedule.c \
     serial.c \
     sha256.c \
@@ -14,12 +14,14 @@
 #include "../debug.h"
 #include "../mmu.h"
 
+/* Private mappings, so that reading memory that was never written (most of
+ * RAM_FLAGS, for one) maps the shared zero page instead of committing it */
 void *os_reserve(size_t size)
 {
 #ifndef __x86_64__
-    void *ptr = mmap((void*)0x70000000, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+    void *ptr = mmap((void*)0x70000000, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON|MAP_NORESERVE, -1, 0);
 #else
-    void *ptr = mmap((void*)0, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+    void *ptr = mmap((void*)0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON|MAP_NORESERVE, -1, 0);
 #endif
 
     if((intptr_t)ptr == -1)
@@ -37,14 +39,14 @@ void os_free(void *ptr, size_t size)
 
 void *os_commit(void *addr, size_t size)
 {
-    void *ptr = mmap(addr, size, PROT_READ|PROT_WRITE, MAP_FIXED|MAP_SHARED|MAP_ANON, -1, 0);
+    void *ptr = mmap(addr, size, PROT_READ|PROT_WRITE, MAP_FIXED|MAP_PRIVATE|MAP_ANON|MAP_NORESERVE, -1, 0);
     msync(addr, size, MS_SYNC|MS_INVALIDATE);
     return ptr;
 }
 
 void *os_sparse_commit(void *page, size_t size)
 {
-    void *ptr = mmap(page, size, PROT_READ|PROT_WRITE, MAP_FIXED|MAP_SHARED|MAP_ANON, -1, 0);
+    void *ptr = mmap(page, size, PROT_READ|PROT_WRITE, MAP_FIXED|MAP_PRIVATE|MAP_ANON, -1, 0);
     msync(page, size, MS_SYNC|MS_INVALIDATE);
     return ptr;
 }
@@ -94,11 +96,16 @@ void os_query_frequency(os_frequency_t *f)
     fclose(freq);
 }
 
+#ifndef AC_TWO_LEVEL
 static void addr_cache_exception(int sig, siginfo_t *si, void *uctx)
 {
     (void) sig;
     (void) uctx;
 
+    // The first access to a page of addr_cache commits it
+    if(addr_cache_pagefault((uint8_t*)si->si_addr))
+        return;
+
     ucontext_t *u = (ucontext_t*) uctx;
 #ifdef __i386__
 #ifdef __linux__
@@ -116,9 +123,9 @@ static void addr_cache_exception(int sig, siginfo_t *si, void *uctx)
     emuprintf("Got SIGSEGV (PC=0x%x)\n", u->uc_mcontext.arm_pc);
 #endif
 
-    if(!addr_cache_pagefault((uint8_t*)si->si_addr))
-        exit(1);
+    exit(1);
 }
+#endif
 
 void make_writable(void *addr)
 {
@@ -139,10 +146,20 @@ void addr_cache_init(os_exception_frame_t *frame)
 
     initialized = true;
 
-    addr_cache = mmap((void*)0, AC_NUM_ENTRIES * sizeof(ac_entry), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
-
     setbuf(stdout, NULL);
 
+#ifdef AC_TWO_LEVEL
+    // Blocks of the table are given out by addr_cache_miss, no signals needed
+    addr_cache_dir_init();
+#else
+    // Only reserved: pages get committed by addr_cache_pagefault as they are used
+    addr_cache = mmap((void*)0, AC_NUM_ENTRIES * sizeof(ac_entry), PROT_NONE, MAP_PRIVATE|MAP_ANON|MAP_NORESERVE, -1, 0);
+    if(addr_cache == MAP_FAILED)
+    {
+        emuprintf("Failed to reserve address cache.\n");
+        exit(1);
+    }
+
     struct sigaction sa;
 
     sa.sa_flags = SA_SIGINFO;
@@ -153,14 +170,16 @@ void addr_cache_init(os_exception_frame_t *frame)
         emuprintf("Failed to initialize SEGV handler.\n");
         exit(1);
     }
-
-    unsigned int i;
-    for(i = 0; i < AC_NUM_ENTRIES; ++i)
+#ifdef __APPLE__
+    // Accessing a PROT_NONE page raises SIGBUS here
+    if(sigaction(SIGBUS, &sa, NULL) == -1)
     {
-        AC_SET_ENTRY_INVALID(addr_cache[i], (i >> 1) << 10)
+        emuprintf("Failed to initialize BUS handler.\n");
+        exit(1);
     }
+#endif
 
-#ifdef __i386__
+#if defined(__i386__) && !defined(THREADED_TRANSLATION)
     // Relocate the assembly code that wants addr_cache at a fixed address
     extern uint32_t *ac_reloc_start[] __asm__("ac_reloc_start"), *ac_reloc_end[] __asm__("ac_reloc_end");
     uint32_t **reloc;
@@ -170,4 +189,5 @@ void addr_cache_init(os_exception_frame_t *frame)
         **reloc += (uintptr_t)addr_cache;
     }
 #endif
+#endif
 }
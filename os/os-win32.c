@@ -88,6 +88,7 @@ void addr_cache_init(os_exception_frame_t *frame) {
     asm ("movl %%fs:(%1), %0" : "=r" (frame->prev) : "r" (0));
     asm ("movl %0, %%fs:(%1)" : : "r" (frame), "r" (0));
 
+#ifndef THREADED_TRANSLATION
     // Relocate the assembly code that wants addr_cache at a fixed address
     extern DWORD *ac_reloc_start[] __asm__("ac_reloc_start"), *ac_reloc_end[] __asm__("ac_reloc_end");
     DWORD **reloc;
@@ -97,4 +98,5 @@ void addr_cache_init(os_exception_frame_t *frame) {
         **reloc += (DWORD)addr_cache;
         VirtualProtect(*reloc, 4, prot, &prot);
     }
+#endif
 }
@@ -0,0 +1,117 @@
+/* Names for translated code, for profilers. Linux perf reads "start size
+ * name" lines for JIT code from /tmp/perf-<pid>.map; each block gets the
+ * guest address it starts at, and the nearest symbol at or below it if a
+ * symbol file was given. A symbol file has a hex address and a name per
+ * line, like the output of nm.
+ *
+ * Entries are not removed when the translation cache is flushed, so once
+ * it has been, perf may report a block by the name of an older one. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "emu.h"
+#include "perfmap.h"
+
+struct symbol {
+    uint32_t addr;
+    char *name;
+};
+static struct symbol *symbols;
+static uint32_t num_symbols;
+static FILE *perf_map_file;
+
+static int symbol_cmp(const void *a, const void *b) {
+    uint32_t x = ((const struct symbol *)a)->addr, y = ((const struct symbol *)b)->addr;
+    return x < y ? -1 : x > y;
+}
+
+static void load_symbols(const char *filename) {
+    FILE *f = fopen(filename, "r");
+    char line[256], first[256], second[256], *name;
+    uint32_t addr, alloc = 0;
+    if (!f) {
+        gui_perror(filename);
+        return;
+    }
+    while (fgets(line, sizeof line, f)) {
+        int fields = sscanf(line, "%x %255s %255s", &addr, first, second);
+        if (fields < 2)
+            continue;
+        // "addr name", or "addr type name" as printed by nm
+        name = (fields == 3 && !first[1]) ? second : first;
+        if (num_symbols == alloc) {
+            uint32_t new_alloc = alloc ? alloc * 2 : 1024;
+            struct symbol *s = realloc(symbols, new_alloc * sizeof *s);
+            if (!s)
+                break;
+            symbols = s;
+            alloc = new_alloc;
+        }
+        symbols[num_symbols].addr = addr;
+        symbols[num_symbols].name = strdup(name);
+        if (symbols[num_symbols].name)
+            num_symbols++;
+    }
+    fclose(f);
+    qsort(symbols, num_symbols, sizeof *symbols, symbol_cmp);
+    emuprintf("Loaded %u symbols from %s\n", num_symbols, filename);
+}
+
+static const struct symbol *find_symbol(uint32_t addr) {
+    uint32_t lo = 0, hi = num_symbols;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (symbols[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo ? &symbols[lo - 1] : NULL;
+}
+
+bool perf_map_open(const char *symbols_filename) {
+    char filename[64];
+    if (perf_map_file)
+        return true;
+    sprintf(filename, "/tmp/perf-%d.map", (int)getpid());
+    perf_map_file = fopen(filename, "w");
+    if (!perf_map_file) {
+        gui_perror(filename);
+        return false;
+    }
+    if (symbols_filename && !num_symbols)
+        load_symbols(symbols_filename);
+    return true;
+}
+
+void perf_map_close() {
+    uint32_t i;
+    if (perf_map_file) {
+        fclose(perf_map_file);
+        perf_map_file = NULL;
+    }
+    for (i = 0; i < num_symbols; i++)
+        free(symbols[i].name);
+    free(symbols);
+    symbols = NULL;
+    num_symbols = 0;
+}
+
+// A block of size bytes at code was translated from pc
+void perf_map_block(void *code, uint32_t size, uint32_t pc, bool thumb) {
+    const struct symbol *s;
+    if (!perf_map_file)
+        return;
+    fprintf(perf_map_file, "%llx %x %s:%08x", (unsigned long long)(uintptr_t)code, size,
+            thumb ? "thumb" : "arm", pc);
+    if ((s = find_symbol(pc))) {
+        fprintf(perf_map_file, " %s", s->name);
+        if (pc != s->addr)
+            fprintf(perf_map_file, "+0x%x", pc - s->addr);
+    }
+    fputc('\n', perf_map_file);
+    fflush(perf_map_file);
+}
@@ -0,0 +1,10 @@
+/* Declarations for perfmap.c */
+
+#ifndef _H_PERFMAP
+#define _H_PERFMAP
+
+bool perf_map_open(const char *symbols_filename);
+void perf_map_close();
+void perf_map_block(void *code, uint32_t size, uint32_t pc, bool thumb);
+
+#endif
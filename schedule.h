@@ -23,6 +23,8 @@ extern struct sched_item {
         uint32_t cputick;
         void (*proc)(int index);
 } sched_items[SCHED_NUM_ITEMS];
+// CPU tick of the next event this second; the current one is next_cputick + cycle_count_delta
+extern uint32_t next_cputick;
 
 void sched_reset(void);
 void event_repeat(int index, uint32_t ticks);
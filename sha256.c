@@ -7,15 +7,16 @@ static uint32_t hash_block[16];
 
 #define ROR(x, y) ((x) >> (y) | (x) << (32 - (y)))
 
+static const uint32_t initial_state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
 static inline void initialize() {
-    static const uint32_t initial_state[8] = {
-        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
-        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
-    };
     memcpy(hash_state, initial_state, 32);
 }
 
-static void process_block() {
+static void process_block(uint32_t *state, const uint32_t *block) {
     static const uint32_t k[64] = {
         0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
         0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
@@ -31,21 +32,21 @@ static void process_block() {
     uint32_t w[64];
     int i;
 
-    memcpy(w, hash_block, 64);
+    memcpy(w, block, 64);
     for (i = 16; i < 64; i++) {
         uint32_t s0 = ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3);
         uint32_t s1 = ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10);
         w[i] = w[i-16] + s0 + w[i-7] + s1;
     }
 
-    a = hash_state[0];
-    b = hash_state[1];
-    c = hash_state[2];
-    d = hash_state[3];
-    e = hash_state[4];
-    f = hash_state[5];
-    g = hash_state[6];
-    h = hash_state[7];
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    f = state[5];
+    g = state[6];
+    h = state[7];
 
     for (i = 0; i < 64; i++) {
         uint32_t s0 = ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22);
@@ -65,14 +66,43 @@ static void process_block() {
         a = t1 + t2;
     }
 
-    hash_state[0] += a;
-    hash_state[1] += b;
-    hash_state[2] += c;
-    hash_state[3] += d;
-    hash_state[4] += e;
-    hash_state[5] += f;
-    hash_state[6] += g;
-    hash_state[7] += h;
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+/* Hash a buffer on the host side, independently of the emulated hardware */
+void sha256_digest(const void *data, uint32_t size, uint32_t digest[8]) {
+    const uint8_t *p = data;
+    uint8_t tail[128];
+    uint32_t block[16];
+    uint32_t i, left;
+
+    memcpy(digest, initial_state, 32);
+    for (; size >= 64; size -= 64, p += 64) {
+        for (i = 0; i < 16; i++)
+            block[i] = p[i*4] << 24 | p[i*4+1] << 16 | p[i*4+2] << 8 | p[i*4+3];
+        process_block(digest, block);
+    }
+
+    // Padding: 0x80, zeros, then the length in bits
+    uint64_t bits = ((uint64_t)(p - (const uint8_t *)data) + size) * 8;
+    memset(tail, 0, sizeof tail);
+    memcpy(tail, p, size);
+    tail[size] = 0x80;
+    left = size < 56 ? 64 : 128;
+    for (i = 0; i < 8; i++)
+        tail[left - 1 - i] = bits >> (i * 8);
+    for (p = tail; p < tail + left; p += 64) {
+        for (i = 0; i < 16; i++)
+            block[i] = p[i*4] << 24 | p[i*4+1] << 16 | p[i*4+2] << 8 | p[i*4+3];
+        process_block(digest, block);
+    }
 }
 
 void sha256_reset(void) {
@@ -100,7 +130,7 @@ void sha256_write_word(uint32_t addr, uint32_t value) {
                 if ((value & 0xE) == 0xA) // 0A or 0B: first block
                     initialize();
                 if ((value & 0xA) == 0xA) // 0E or 0F: subsequent blocks
-                    process_block();
+                    process_block(hash_state, hash_block);
             }
             return;
         case 0x08: return;
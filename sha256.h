@@ -4,6 +4,7 @@
 #define _H_SHA256
 
 void sha256_reset(void);
+void sha256_digest(const void *data, uint32_t size, uint32_t digest[8]);
 uint32_t sha256_read_word(uint32_t addr);
 void sha256_write_word(uint32_t addr, uint32_t value);
 
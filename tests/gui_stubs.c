@@ -0,0 +1,31 @@
+/* The GUI functions the emulator calls, for running it without Qt:
+ * debugger output goes to stderr and the debugger continues right away */
+
+#include "emu.h"
+#include "os/os.h"
+
+#include <stdio.h>
+#include <string.h>
+
+void gui_do_stuff() {}
+int gui_getchar() { return -1; }
+void gui_putchar(char c) { (void) c; }
+void gui_debug_vprintf(const char *fmt, va_list ap) { vfprintf(stderr, fmt, ap); }
+void gui_debug_printf(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+void gui_perror(const char *msg) { perror(msg); }
+char *gui_debug_prompt() {
+    static char line[] = "c\n";
+    return line;
+}
+void gui_status_printf(const char *fmt, ...) { (void) fmt; }
+void gui_show_speed(double speed) { (void) speed; }
+void gui_usblink_changed(bool state) { (void) state; }
+
+void throttle_timer_on() {}
+void throttle_timer_off() {}
+void throttle_timer_wait() {}
@@ -0,0 +1,682 @@
+/* Differential test of the translator: random ARM or THUMB programs are run
+ * by the interpreter, then as translated code, and must leave the same
+ * registers, flags and memory behind. With -c, fixed programs check code
+ * that writes to itself and blocks whose pages get remapped instead.
+ * "make check" in this directory runs a set of both. */
+
+#include "emu.h"
+#include "cpu.h"
+#include "mem.h"
+#include "mmu.h"
+#include "translate.h"
+#include "os/os.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern void *restart_after_exception[32];
+
+// Physical addresses used, all in SDRAM
+static uint32_t code_offset;
+#define CODE (0x10100000 + code_offset)
+#define DATA 0x10400000
+#define DATA_SIZE 0x100000
+#define STACK 0x10600000
+#define VECTORS 0x10700000
+#define TT_BASE 0x10780000
+
+static uint32_t rng_state;
+static uint32_t rnd() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+static uint32_t rn(uint32_t n) { return rnd() % n; }
+
+static uint32_t code[4096];
+static uint16_t *tcode = (uint16_t *)code;
+static int ncode; // instructions (THUMB: halfwords); the last one is "B ."
+static bool thumb;
+static bool with_aborts; // MMU on, with DATA unmapped until the abort handler maps it
+static uint32_t init_regs[16];
+
+struct state {
+    uint32_t reg[16], cpsr;
+    uint8_t data[DATA_SIZE];
+    uint8_t stack[0x1000];
+};
+static struct state ref, res;
+
+/* ----------------------------------------------------------------------
+ * Random ARM programs. r10 counts the loop around the body, r11 points
+ * into DATA and r13 to the stack; the body changes only r0-r9, flags and
+ * memory at those. */
+
+static uint32_t arm_reg() { return rn(10); }
+static uint32_t arm_cond() { return (rn(4) ? 14 : rn(15)) << 28; }
+
+static uint32_t arm_op2() {
+    switch (rn(3)) {
+        case 0: return 1 << 25 | rn(16) << 8 | rn(256);
+        case 1: return rn(32) << 7 | rn(4) << 5 | arm_reg();
+        default: return arm_reg() << 8 | rn(4) << 5 | 1 << 4 | arm_reg();
+    }
+}
+
+static void gen_arm_insn(int body_end) {
+    uint32_t c = arm_cond(), insn;
+    int i = ncode;
+    switch (rn(15)) {
+        case 0: case 1: case 2: case 3: case 4: { // data processing
+            int op = rn(16), s = rn(2), rd = arm_reg(), rn_ = arm_reg();
+            if ((op & 12) == 8) {
+                s = 1;
+                rd = 0;
+            }
+            if (rn(20) == 0 && op != 13 && op != 15)
+                rn_ = 15;
+            insn = c | op << 21 | s << 20 | rn_ << 16 | rd << 12 | arm_op2();
+            break;
+        }
+        case 5: { // multiply, multiply long
+            int rd = arm_reg(), rm = arm_reg(), rs = arm_reg(), ra = arm_reg();
+            if (rn(2)) {
+                insn = c | 0x90 | rd << 16 | rs << 8 | rm | rn(2) << 21 | ra << 12 | rn(2) << 20;
+            } else {
+                int lo = arm_reg(), hi;
+                do hi = arm_reg(); while (hi == lo);
+                insn = c | 0x800090 | rn(4) << 21 | rn(2) << 20 | hi << 16 | lo << 12 | rs << 8 | rm;
+            }
+            break;
+        }
+        case 6: { // halfword, signed and doubleword transfers
+            int type = 1 + rn(3), load = rn(2), p = rn(2), u = rn(2), w = p ? rn(2) : 0;
+            int off = w || !p ? rn(16) * 2 : rn(64) * 4;
+            int rd = arm_reg();
+            if (!load && type != 1)
+                rd &= ~1; // STRD
+            if (load && type == 2 && rn(2)) {
+                load = 0; // LDRD
+                rd &= ~1;
+            }
+            insn = c | p << 24 | u << 23 | 1 << 22 | w << 21 | load << 20 | 11 << 16 | rd << 12
+                 | (off >> 4) << 8 | 1 << 7 | type << 5 | 1 << 4 | (off & 15);
+            if (rn(4) == 0) // register offset r12
+                insn = (insn & ~(1 << 22 | 0xF0F)) | 12;
+            break;
+        }
+        case 7: case 8: { // word and byte transfers
+            int load = rn(2), b = rn(2), p = rn(2), u = rn(2), w = p ? rn(2) : 0, rd = arm_reg();
+            insn = c | 1 << 26 | p << 24 | u << 23 | b << 22 | w << 21 | load << 20 | 11 << 16 | rd << 12;
+            if (rn(3))
+                insn |= (w || !p) ? rn(16) * 4 : rn(1024) * 4;
+            else
+                insn |= 1 << 25 | rn(3) << 7 | 12;
+            break;
+        }
+        case 9: { // LDM, STM
+            uint32_t list = rnd() & 0x3FF;
+            insn = c | 4 << 25 | rn(4) << 23 | rn(2) << 21 | rn(2) << 20 | (rn(2) ? 11 : 13) << 16 | (list ? list : 1);
+            break;
+        }
+        case 10: { // forward branch, or BL
+            int max = body_end - i - 1;
+            if (max < 1) {
+                insn = c | 0x1A00000 | arm_reg() << 12 | arm_reg();
+                break;
+            }
+            insn = c | 0xA000000 | (rn(4) == 0) << 24 | rn(max < 8 ? max : 8);
+            break;
+        }
+        case 11: // CLZ, SWP
+            if (rn(2))
+                insn = c | 0x16F0F10 | arm_reg() << 12 | arm_reg();
+            else
+                insn = c | 0x1000090 | rn(2) << 22 | 11 << 16 | arm_reg() << 12 | arm_reg();
+            break;
+        case 12: // MRS, MSR flags
+            if (rn(2))
+                insn = c | 0x10F0000 | arm_reg() << 12;
+            else
+                insn = c | 0x328F000 | 2 << 8 | rn(16);
+            break;
+        case 13: // unconditional space, p15, writes to pc
+            switch (rn(6)) {
+                case 0: insn = 0xF5D0F000 | 11 << 16 | rn(4096); break; // PLD [r11, #x]
+                case 1: insn = c | (rn(2) ? 0xE070F3A : 0xE070F9A) | arm_reg() << 12; break; // MCR clean line, drain
+                case 2: insn = c | 0xE100F10 | arm_reg() << 12 | (rn(2) ? 0 : 0x20); break; // MRC ID, cache type
+                case 3: insn = c | 0xE170F7E | 15 << 12; break; // MRC r15 test, clean, invalidate
+                case 4: // ADD pc, pc, #0
+                    insn = i + 1 < body_end ? (c | 0x28FF000) : (c | 0x1A00000 | arm_reg() << 12 | arm_reg());
+                    break;
+                default: insn = c | 0x28F0000 | arm_reg() << 12 | rn(256); break; // ADR
+            }
+            break;
+        default: // MOV, MOVS with an immediate
+            insn = c | 13 << 21 | rn(2) << 20 | arm_reg() << 12 | 1 << 25 | rn(16) << 8 | rn(256);
+            break;
+    }
+    code[ncode++] = insn;
+}
+
+static void gen_arm_program() {
+    int n = 1 + rn(rn(4) ? 40 : 400), body;
+    ncode = 0;
+    code[ncode++] = 0xE3A0A000 | (1 + rn(8)); // MOV r10, #N
+    body = ncode;
+    while (ncode < body + n)
+        gen_arm_insn(body + n);
+    code[ncode++] = 0xE25AA001; // SUBS r10, r10, #1
+    code[ncode] = 0x1A000000 | ((body - ncode - 2) & 0xFFFFFF); // BNE body
+    ncode++;
+    code[ncode++] = 0xEAFFFFFE; // B .
+}
+
+/* ----------------------------------------------------------------------
+ * Random THUMB programs: r6 counts the loop, r7 points into DATA, and the
+ * body changes r0-r5 */
+
+static uint32_t thumb_reg() { return rn(5); }
+
+static void gen_thumb_insn(int body_end) {
+    int i = ncode;
+    uint16_t insn;
+    switch (rn(18)) {
+        case 0: insn = rn(3) << 11 | rn(32) << 6 | rn(8) << 3 | thumb_reg(); break; // shift by immediate
+        case 1: insn = 0x1800 | rn(4) << 9 | rn(8) << 6 | rn(8) << 3 | thumb_reg(); break; // ADD/SUB
+        case 2: { // MOV/CMP/ADD/SUB immediate
+            int op = rn(4);
+            insn = 0x2000 | op << 11 | (op == 1 ? rn(8) : thumb_reg()) << 8 | rn(256);
+            break;
+        }
+        case 3: case 4: insn = 0x4000 | rn(16) << 6 | rn(8) << 3 | thumb_reg(); break; // ALU
+        case 5: { // high register ADD/CMP/MOV
+            static const int dest[] = { 0, 1, 2, 3, 4, 0, 8, 9, 10, 12 };
+            int op = rn(3), d = dest[rn(10)], m = rn(20) ? rn(13) : 15;
+            if (op == 1)
+                d = rn(13);
+            if (d == 5 && op != 1)
+                d = 0;
+            if (m == 13 && op != 1)
+                m = 12;
+            insn = 0x4400 | op << 8 | (d & 8) << 4 | m << 3 | (d & 7);
+            break;
+        }
+        case 6: insn = 0x4800 | thumb_reg() << 8 | rn(256); break; // LDR pc-relative
+        case 7: // register offset, from a small offset in r5
+            tcode[ncode++] = 0x0D80 | rn(6) << 3 | 5; // LSR r5, rX, #22
+            insn = 0x5000 | rn(8) << 9 | 5 << 6 | 7 << 3 | rn(5);
+            break;
+        case 8: case 9: { // immediate offset
+            static const uint16_t base[] = { 0x6000, 0x6800, 0x7000, 0x7800, 0x8000 };
+            insn = base[rn(5)] | rn(2) << 11 | rn(32) << 6 | 7 << 3 | thumb_reg();
+            break;
+        }
+        case 10: insn = 0x9000 | rn(2) << 11 | thumb_reg() << 8 | rn(64); break; // SP-relative
+        case 11: insn = 0xA000 | rn(2) << 11 | thumb_reg() << 8 | rn(256); break; // ADD rd, pc/sp
+        case 12: insn = 0xB000 | rn(2) << 7 | rn(16); break; // ADD/SUB sp
+        case 13: { // PUSH, POP
+            int pop = rn(2);
+            insn = 0xB400 | pop << 11 | (pop ? 0 : rn(2)) << 8 | (rnd() & 0x1F);
+            if (!(insn & 0x1FF))
+                insn |= 1;
+            break;
+        }
+        case 14: // LDMIA, STMIA, sometimes storing the base
+            insn = 0xC000 | rn(2) << 11 | 7 << 8 | ((rnd() & 0x1F) | 1);
+            if (!(insn & 0x800) && !rn(3))
+                insn |= 0x80;
+            break;
+        case 15: case 16: { // forward branches
+            int max = body_end - i - 2;
+            if (max < 1) {
+                insn = 0x46C0; // NOP
+                break;
+            }
+            int off = rn(max < 8 ? max : 8), kind = rn(4);
+            if (kind == 0) {
+                insn = 0xE000 | off;
+            } else if (kind == 1 && max >= 2) {
+                if (off < 1)
+                    off = 1;
+                tcode[ncode++] = 0xF000; // BL
+                insn = 0xF800 | (off - 1);
+            } else {
+                insn = 0xD000 | rn(14) << 8 | off;
+            }
+            break;
+        }
+        default: insn = 0x2000 | thumb_reg() << 8 | rn(256); break; // MOV immediate
+    }
+    tcode[ncode++] = insn;
+}
+
+static void gen_thumb_program() {
+    int n = 1 + rn(rn(4) ? 40 : 400), body, i;
+    memset(code, 0, sizeof code);
+    ncode = 0;
+    tcode[ncode++] = 0x465F;               // MOV r7, r11
+    tcode[ncode++] = 0x2600 | (1 + rn(8)); // MOV r6, #N
+    tcode[ncode++] = 0x2500 | rn(256);     // MOV r5, #imm
+    body = ncode;
+    while (ncode < body + n)
+        gen_thumb_insn(body + n);
+    // Keep branches from landing on the second half of a BL
+    for (i = body; i < ncode; i++) {
+        int target, off;
+        if ((tcode[i] & 0xF800) == 0xE000)
+            off = (int16_t)(tcode[i] << 5) >> 5;
+        else if ((tcode[i] & 0xF000) == 0xD000)
+            off = (int8_t)tcode[i];
+        else
+            continue;
+        target = i + 2 + off;
+        if (target < ncode && (tcode[target] & 0xF800) == 0xF800 && (tcode[target - 1] & 0xF800) == 0xF000)
+            tcode[i]++;
+    }
+    tcode[ncode++] = 0x3E01; // SUB r6, #1
+    tcode[ncode++] = 0xD000; // BEQ +0
+    tcode[ncode] = 0xE000 | ((body - ncode - 2) & 0x7FF); // B body
+    ncode++;
+    tcode[ncode++] = 0xE7FE; // B .
+}
+
+/* ----------------------------------------------------------------------
+ * Running a program */
+
+// Page table and data abort handler for with_aborts
+static void setup_aborts() {
+    static const uint32_t handler[] = {
+        0xE58F0018, // 100: str r0, [pc, #0x18] -> 120
+        0xE59F0018, // 104: ldr r0, [pc, #0x18] -> 124
+        0xE59FD018, // 108: ldr r13, [pc, #0x18] -> 128
+        0xE58D0000, // 10c: str r0, [r13]
+        0xEE080F17, // 110: mcr p15, 0, r0, c8, c7, 0
+        0xE59F0004, // 114: ldr r0, [pc, #4] -> 120
+        0xE25EF008, // 118: subs pc, lr, #8
+        0, 0, DATA | 0xC02, TT_BASE + (DATA >> 20) * 4
+    };
+    uint32_t *tt = phys_mem_ptr(TT_BASE, 0x4000);
+    uint32_t *vectors = phys_mem_ptr(VECTORS, 0x200);
+    uint32_t i;
+    memset(tt, 0, 0x4000);
+    tt[0] = VECTORS | 0xC02;
+    for (i = 0x100; i < 0x108; i++)
+        if (i != DATA >> 20)
+            tt[i] = i << 20 | 0xC02;
+    memset(vectors, 0, 0x200);
+    vectors[4] = 0xEA00003A; // 10: b 100
+    memcpy(&vectors[0x40], handler, sizeof handler);
+    arm.translation_table_base = TT_BASE;
+    arm.domain_access_control = 3;
+    arm.control |= 1;
+    mmu_table_write(tt, 0x4000);
+}
+
+/* Run the program in code from CODE up to its last instruction, through
+ * translated code if translate is set. Returns false if it faulted or
+ * ran too long. */
+static bool run(bool translate, struct state *st) {
+    uint8_t *code_ptr = phys_mem_ptr(CODE, sizeof code);
+    uint32_t *flags, end, i;
+    volatile int loops = 0;
+
+    flush_translations(TF_OTHER);
+    flush_decoded();
+    memcpy(code_ptr, code, sizeof code);
+    for (flags = &RAM_FLAGS(code_ptr); flags < &RAM_FLAGS(code_ptr + sizeof code); flags++)
+        *flags = 0;
+    memset(phys_mem_ptr(STACK - 0x10000, 0x20000), 0xA5, 0x20000);
+    for (i = 0; i < DATA_SIZE; i += 4)
+        *(uint32_t *)((uint8_t *)phys_mem_ptr(DATA, DATA_SIZE) + i) = i * 0x9E3779B1;
+
+    memset(&arm, 0, sizeof arm);
+    arm.control = 0x00050078;
+    arm.cpsr_low28 = MODE_SVC | 0xC0 | (thumb ? 0x20 : 0);
+    memcpy(arm.reg, init_regs, sizeof init_regs);
+    if (with_aborts)
+        setup_aborts();
+    addr_cache_flush();
+    do_translate = translate;
+    cpu_events = 0;
+
+    end = CODE + ((ncode - 1) << (thumb ? 1 : 2));
+    if (__builtin_setjmp(restart_after_exception) && !with_aborts) {
+        printf("%s: error at pc=%08x\n", translate ? "translated" : "interpreted", arm.reg[15]);
+        return false;
+    }
+    while (arm.reg[15] != end) {
+        if (++loops > 2000000) {
+            printf("%s: timeout at pc=%08x\n", translate ? "translated" : "interpreted", arm.reg[15]);
+            return false;
+        }
+        // Stop at varying points so blocks get entered in the middle too
+        cycle_count_delta = -(int)(1 + rn(50));
+        if (arm.cpsr_low28 & 0x20)
+            cpu_thumb_loop();
+        else
+            cpu_arm_loop();
+    }
+    memcpy(st->reg, arm.reg, sizeof st->reg);
+    st->cpsr = get_cpsr();
+    memcpy(st->data, phys_mem_ptr(DATA, DATA_SIZE), DATA_SIZE);
+    memcpy(st->stack, phys_mem_ptr(STACK - 0x800, 0x1000), 0x1000);
+    return true;
+}
+
+/* Run the program both ways from the same random state. Returns 0 if the
+ * results match, 1 if they don't, -1 if the interpreter failed. */
+static int compare() {
+    uint32_t seed = rng_state;
+    if (!run(false, &ref))
+        return -1;
+    rng_state = seed;
+    if (!run(true, &res))
+        return 1;
+    return memcmp(ref.reg, res.reg, sizeof ref.reg) || ref.cpsr != res.cpsr
+        || memcmp(ref.data, res.data, DATA_SIZE) || memcmp(ref.stack, res.stack, sizeof ref.stack);
+}
+
+static void print_differences() {
+    int i;
+    for (i = 0; i < 16; i++)
+        if (ref.reg[i] != res.reg[i])
+            printf("  r%d: %08x interpreted, %08x translated\n", i, ref.reg[i], res.reg[i]);
+    if (ref.cpsr != res.cpsr)
+        printf("  cpsr: %08x interpreted, %08x translated\n", ref.cpsr, res.cpsr);
+    if (memcmp(ref.data, res.data, DATA_SIZE) || memcmp(ref.stack, res.stack, sizeof ref.stack))
+        printf("  memory differs\n");
+}
+
+// Replace what instructions it can by NOPs with the mismatch staying, and print the rest
+static void minimize() {
+    uint32_t seed = rng_state;
+    int pass, i;
+    for (pass = 0; pass < 4; pass++) {
+        for (i = 1; i < ncode - 3; i++) {
+            if (thumb) {
+                uint16_t old = tcode[i];
+                tcode[i] = 0x46C0;
+                rng_state = seed;
+                if (old != 0x46C0 && compare() != 1)
+                    tcode[i] = old;
+            } else {
+                uint32_t old = code[i];
+                code[i] = 0xE1A00000;
+                rng_state = seed;
+                if (old != 0xE1A00000 && compare() != 1)
+                    code[i] = old;
+            }
+        }
+    }
+    rng_state = seed;
+    compare();
+    for (i = 0; i < 16; i++)
+        printf("  initial r%d=%08x\n", i, init_regs[i]);
+    for (i = 0; i < ncode; i++) {
+        if (thumb && tcode[i] != 0x46C0)
+            printf("  %04x: %04x\n", i * 2, tcode[i]);
+        else if (!thumb && code[i] != 0xE1A00000)
+            printf("  %04x: %08x\n", i * 4, code[i]);
+    }
+}
+
+static int fuzz(uint32_t seed, int iterations, bool verbose) {
+    int failures = 0, it, i;
+    for (it = 0; it < iterations && failures <= 5; it++) {
+        rng_state = seed * 2654435761u + it * 40503u + 1;
+        rnd();
+        if (thumb)
+            gen_thumb_program();
+        else
+            gen_arm_program();
+        for (i = 0; i < 16; i++)
+            init_regs[i] = rn(3) ? rnd() : rn(64);
+        init_regs[11] = DATA + DATA_SIZE / 2;
+        init_regs[12] = rn(64) * 4;
+        init_regs[13] = STACK;
+        init_regs[15] = CODE;
+        uint32_t program_seed = rng_state;
+        if (compare() != 1)
+            continue;
+        failures++;
+        printf("Mismatch: seed %u, iteration %d, %d instructions\n", seed, it, ncode);
+        print_differences();
+        if (verbose) {
+            rng_state = program_seed;
+            minimize();
+        }
+    }
+    printf("%s: %d programs, %d failures\n", thumb ? "THUMB" : "ARM", it, failures);
+    return failures;
+}
+
+/* ----------------------------------------------------------------------
+ * Fixed programs */
+
+static void set_program(const void *prog, size_t size, int insns, bool is_thumb) {
+    memset(code, 0, sizeof code);
+    memcpy(code, prog, size);
+    ncode = insns;
+    thumb = is_thumb;
+    memset(init_regs, 0, sizeof init_regs);
+    init_regs[13] = STACK;
+    init_regs[15] = CODE;
+}
+
+/* Run the program both ways and check r0. allow_stale: translated code
+ * may also give the result of the code before the program rewrote it. */
+static int check_case(const char *name, uint32_t expected, uint32_t stale, bool allow_stale) {
+    rng_state = 1;
+    bool ok = run(false, &ref);
+    rng_state = 1;
+    ok = run(true, &res) && ok;
+    ok = ok && ref.reg[0] == expected
+         && (res.reg[0] == expected || (allow_stale && res.reg[0] == stale));
+    printf("%-8s r0: %u interpreted, %u translated%s\n", name, ref.reg[0], res.reg[0], ok ? "" : " FAILED");
+    return !ok;
+}
+
+/* A block running from one 1 MB section into the next, whose mapping then
+ * changes: the block's page guard must send the second run elsewhere */
+static void run_remapped(bool translate, uint32_t r0[2]) {
+    static const uint32_t first[] = { 0xE3A00001, 0xE2800001 }; // mov r0, #1; add r0, r0, #1
+    static const uint32_t second[] = { 0xE2800002, 0xEAFFFFFE }; // add r0, r0, #2; b .
+    static const uint32_t other[] = { 0xE2800010, 0xEAFFFFFE }; // add r0, r0, #0x10; b .
+    uint32_t *tt = phys_mem_ptr(TT_BASE, 0x4000), *flags, i;
+    memset(tt, 0, 0x4000);
+    for (i = 0x100; i < 0x108; i++)
+        tt[i] = i << 20 | 0xC02;
+    mmu_table_write(tt, 0x4000);
+    memcpy(phys_mem_ptr(0x101FFFF8, 8), first, 8);
+    memcpy(phys_mem_ptr(0x10200000, 8), second, 8);
+    memcpy(phys_mem_ptr(0x10500000, 8), other, 8);
+    for (flags = &RAM_FLAGS(phys_mem_ptr(0x101FFFF8, 4)); flags < &RAM_FLAGS(phys_mem_ptr(0x10200008, 4)); flags++)
+        *flags = 0;
+    for (flags = &RAM_FLAGS(phys_mem_ptr(0x10500000, 4)); flags < &RAM_FLAGS(phys_mem_ptr(0x10500008, 4)); flags++)
+        *flags = 0;
+    flush_translations(TF_OTHER);
+    flush_decoded();
+    memset(&arm, 0, sizeof arm);
+    arm.cpsr_low28 = MODE_SVC | 0xC0;
+    arm.translation_table_base = TT_BASE;
+    arm.domain_access_control = 3;
+    arm.control = 0x00050079;
+    addr_cache_flush();
+    do_translate = translate;
+    for (i = 0; i < 2; i++) {
+        if (i) {
+            tt[0x102] = 0x10500C02;
+            mmu_table_write(&tt[0x102], 4);
+            addr_cache_tlb_flush();
+        }
+        arm.reg[15] = 0x101FFFF8;
+        while (arm.reg[15] != 0x10200004) {
+            cycle_count_delta = -50;
+            cpu_arm_loop();
+        }
+        r0[i] = arm.reg[0];
+    }
+}
+
+static int run_cases() {
+    int failures = 0;
+    {
+        // A call to code that rewrites the instruction after its return
+        static const uint32_t prog[] = {
+            0xE3A00000, // mov r0, #0
+            0xEB000003, // bl 14
+            0xE59F1010, // ldr r1, [pc, #0x10] -> 20
+            0xE58F1004, // str r1, [pc, #4] -> 14
+            0xEB000000, // bl 14
+            0xEAFFFFFE, // b .
+            0xE2800001, // 14: add r0, r0, #1
+            0xE12FFF1E, // bx lr
+            0xE2800005, // 20: add r0, r0, #5
+        };
+        set_program(prog, sizeof prog, 6, false);
+        failures += check_case("smc", 6, 0, false);
+    }
+    {
+        /* A block that rewrites one of its own later instructions. It may
+         * run to its exit with the old code: software must issue an IMB. */
+        static const uint32_t prog[] = {
+            0xE3A00000, // mov r0, #0
+            0xE59F100C, // ldr r1, [pc, #0xC] -> 18
+            0xE58F1000, // str r1, [pc] -> 10
+            0xE1A00000, // nop
+            0xE2800001, // 10: add r0, r0, #1
+            0xEAFFFFFE, // b .
+            0xE2800005, // 18: add r0, r0, #5
+        };
+        set_program(prog, sizeof prog, 6, false);
+        failures += check_case("smcself", 5, 1, true);
+    }
+    {
+        /* A THUMB block crossing into the next page ends with the first half
+         * of a word starting another block, which then rewrites that half */
+        static uint16_t prog[0x210];
+        static const uint16_t tail[] = {
+            0x3001, 0x46C0, 0x46C0, 0x46C0, 0x2900, 0x46C0, 0xD002, 0x4A04, 0x4B04, 0x2C00,
+            0xD102, 0x3401, 0x801A, 0xE7F1, 0xE7FE, 0, 0x300A, 0, 0x0404, 0x1010
+        };
+        prog[0] = 0xE1FA; // b 3f8
+        memcpy(&prog[0x3F8 / 2], tail, sizeof tail);
+        set_program(prog, sizeof prog, 0x415 / 2 + 1, true);
+        init_regs[1] = 1;
+        failures += check_case("smcpage", 12, 0, false);
+    }
+    {
+        /* Calls into a page that another call writes to, so the links into it
+         * are dropped and made again each time around */
+        static uint32_t prog[0x240];
+        static const uint32_t start[] = {
+            0xEB0001FE, // bl 800
+            0xEB0000FD, // bl 400
+            0xEB0001FC, // bl 800
+            0xE25AA001, // subs r10, r10, #1
+            0x1AFFFFFA, // bne 0
+            0xEAFFFFFE, // b .
+        };
+        memcpy(prog, start, sizeof start);
+        prog[0x100] = 0xE59F13F8; // 400: ldr r1, [pc, #0x3F8] -> 800
+        prog[0x101] = 0xE58F13F4; // str r1, [pc, #0x3F4] -> 800
+        prog[0x102] = 0xE12FFF1E; // bx lr
+        prog[0x200] = 0xE080000A; // 800: add r0, r0, r10
+        prog[0x201] = 0xE12FFF1E; // bx lr
+        set_program(prog, sizeof prog, 6, false);
+        init_regs[10] = 20000;
+        failures += check_case("smcloop", 400020000, 0, false);
+    }
+    {
+        static const uint32_t expected[] = { 4, 0x12 };
+        uint32_t interpreted[2], translated[2];
+        int i;
+        run_remapped(false, interpreted);
+        run_remapped(true, translated);
+        for (i = 0; i < 2; i++) {
+            bool ok = interpreted[i] == expected[i] && translated[i] == expected[i];
+            printf("remap%d   r0: %u interpreted, %u translated%s\n", i, interpreted[i], translated[i], ok ? "" : " FAILED");
+            failures += !ok;
+        }
+    }
+    thumb = false;
+    return failures;
+}
+
+static void usage() {
+    printf("Usage: jitfuzz [options]\n"
+           "  -s seed        first seed (1)\n"
+           "  -n count       programs per seed (1000)\n"
+           "  -t             THUMB programs instead of ARM\n"
+           "  -a             run with the MMU on, taking and handling data aborts\n"
+           "  -o offset      load programs at this offset from 0x10100000\n"
+           "  -l blocks      flush the code cache after this many blocks\n"
+#ifdef BACKGROUND_TRANSLATION
+           "  -b             translate on the worker thread\n"
+#endif
+#ifdef PERSISTENT_TRANSLATIONS
+           "  -p file        load and save translations in file\n"
+#endif
+           "  -c             run the fixed programs instead\n"
+           "  -v             print a minimized program for each mismatch\n"
+           "  -i             print translation statistics at the end\n");
+}
+
+int main(int argc, char **argv) {
+    uint32_t seed = 1;
+    int iterations = 1000, failures, opt;
+    bool cases = false, verbose = false, info = false;
+    const char *pcache = NULL;
+    os_exception_frame_t frame;
+
+    while ((opt = getopt(argc, argv, "s:n:tao:l:bp:cvih")) != -1) {
+        switch (opt) {
+            case 's': seed = strtoul(optarg, NULL, 0); break;
+            case 'n': iterations = atoi(optarg); break;
+            case 't': thumb = true; break;
+            case 'a': with_aborts = true; break;
+            case 'o': code_offset = strtoul(optarg, NULL, 0) & 0x1FFFFC; break;
+            case 'l': tcache_block_limit = strtoul(optarg, NULL, 0); break;
+#ifdef BACKGROUND_TRANSLATION
+            case 'b': translate_async = true; break;
+#endif
+#ifdef PERSISTENT_TRANSLATIONS
+            case 'p': pcache = optarg; break;
+#endif
+            case 'c': cases = true; break;
+            case 'v': verbose = true; break;
+            case 'i': info = true; break;
+            default: usage(); return 2;
+        }
+    }
+
+    product = 0x0E0;
+    if (!memory_initialize(32 << 20))
+        return 1;
+    insn_buffer = os_alloc_executable(INSN_BUFFER_SIZE + INSN_STAGE_SIZE);
+    insn_bufptr = insn_buffer;
+    addr_cache_init(&frame);
+    translate_threshold = 1;
+#ifdef PERSISTENT_TRANSLATIONS
+    if (pcache)
+        tcache_load(pcache);
+#endif
+
+    failures = cases ? run_cases() : fuzz(seed, iterations, verbose);
+
+    if (info)
+        tcache_info();
+#ifdef PERSISTENT_TRANSLATIONS
+    if (pcache)
+        tcache_save(pcache);
+#endif
+#ifdef BACKGROUND_TRANSLATION
+    translate_worker_quit();
+#endif
+    (void) pcache;
+    return failures != 0;
+}
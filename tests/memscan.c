@@ -0,0 +1,151 @@
+/* Times a guest that touches all of its memory: with the MMU on, it reads
+ * every word of the 32 MB of SDRAM and writes every eighth one, first
+ * interpreted and then as translated code. Build it with TWO_LEVEL=1 as
+ * well to compare the two addr_cache layouts ("make bench"). */
+
+#include "emu.h"
+#include "cpu.h"
+#include "mem.h"
+#include "mmu.h"
+#include "translate.h"
+#include "os/os.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// The program and page table are in SRAM, out of the way of the scan
+#define CODE 0xA4000000
+#define TT_BASE 0xA4010000
+#define SDRAM_SIZE (32 << 20)
+#define ACCESSES (SDRAM_SIZE / 4 + SDRAM_SIZE / 32)
+
+static const uint32_t scan[] = {
+    0xE59F0028, // 00: ldr r0, [pc, #0x28] -> 30
+    0xE59F1028, // 04: ldr r1, [pc, #0x28] -> 34
+    0xE3A02000, // 08: mov r2, #0
+    0xE4903004, // 0c: ldr r3, [r0], #4
+    0xE0822003, // 10: add r2, r2, r3
+    0xE1500001, // 14: cmp r0, r1
+    0x3AFFFFFB, // 18: bcc 0c
+    0xE59F000C, // 1c: ldr r0, [pc, #0xC] -> 30
+    0xE4800020, // 20: str r0, [r0], #32
+    0xE1500001, // 24: cmp r0, r1
+    0x3AFFFFFC, // 28: bcc 20
+    0xEAFFFFFE, // 2c: b .
+    0x10000000, // 30: start of SDRAM
+    0x10000000 + SDRAM_SIZE,
+};
+
+static long rss_kb() {
+    char line[256];
+    long kb = 0;
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof line, f))
+        if (!strncmp(line, "VmRSS:", 6))
+            kb = atol(line + 6);
+    fclose(f);
+    return kb;
+}
+
+static double now_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+static void setup(bool translate) {
+    uint32_t *tt = phys_mem_ptr(TT_BASE, 0x4000), i;
+    flush_translations(TF_OTHER);
+    flush_decoded();
+    memcpy(phys_mem_ptr(CODE, sizeof scan), scan, sizeof scan);
+    memset(&RAM_FLAGS(phys_mem_ptr(CODE, sizeof scan)), 0, sizeof scan);
+    memset(tt, 0, 0x4000);
+    tt[CODE >> 20] = CODE | 0xC02;
+    for (i = 0; i < SDRAM_SIZE >> 20; i++)
+        tt[0x100 + i] = (0x100 + i) << 20 | 0xC02;
+    mmu_table_write(tt, 0x4000);
+
+    memset(&arm, 0, sizeof arm);
+    arm.cpsr_low28 = MODE_SVC | 0xC0;
+    arm.translation_table_base = TT_BASE;
+    arm.domain_access_control = 3;
+    arm.control = 0x00050079;
+    addr_cache_flush();
+    do_translate = translate;
+    cpu_events = 0;
+}
+
+static void run_scan() {
+    arm.reg[15] = CODE;
+    while (arm.reg[15] != CODE + 0x2C) {
+        cycle_count_delta = -1000000;
+        cpu_arm_loop();
+    }
+}
+
+static void time_scans(bool translate, int passes) {
+    uint64_t misses = ac_stats.misses, commits = ac_stats.commits;
+    long rss = rss_kb();
+    double first, rest, start;
+    int i;
+
+    setup(translate);
+    start = now_ms();
+    run_scan();
+    first = now_ms() - start;
+    start = now_ms();
+    for (i = 1; i < passes; i++)
+        run_scan();
+    rest = passes > 1 ? (now_ms() - start) / (passes - 1) : first;
+    printf("%-11s first pass %.1f ms, then %.1f ms (%.2f ns per access); %llu misses, %llu commits, RSS +%ld kB\n",
+           translate ? "Translated:" : "Interpreted:", first, rest, rest * 1e6 / ACCESSES,
+           (unsigned long long)(ac_stats.misses - misses), (unsigned long long)(ac_stats.commits - commits),
+           rss_kb() - rss);
+}
+
+int main(int argc, char **argv) {
+    int passes = 4, opt;
+    bool interpret = true;
+    os_exception_frame_t frame;
+
+    while ((opt = getopt(argc, argv, "p:t")) != -1) {
+        switch (opt) {
+            case 'p': passes = atoi(optarg); break;
+            case 't': interpret = false; break;
+            default:
+                printf("Usage: memscan [-p passes] [-t]\n"
+                       "  -p passes  scans to time each way (4)\n"
+                       "  -t         only as translated code\n");
+                return 2;
+        }
+    }
+    if (passes < 1)
+        passes = 1;
+
+    product = 0x0E0;
+    if (!memory_initialize(SDRAM_SIZE))
+        return 1;
+    insn_buffer = os_alloc_executable(INSN_BUFFER_SIZE + INSN_STAGE_SIZE);
+    insn_bufptr = insn_buffer;
+    addr_cache_init(&frame);
+    translate_threshold = 1;
+
+#ifdef AC_TWO_LEVEL
+    printf("Two-level addr_cache, ");
+#else
+    printf("Flat addr_cache, ");
+#endif
+    printf("%d accesses per pass, RSS %ld kB\n", ACCESSES, rss_kb());
+    if (interpret)
+        time_scans(false, passes);
+    time_scans(true, passes);
+#ifdef BACKGROUND_TRANSLATION
+    translate_worker_quit();
+#endif
+    return 0;
+}
@@ -4,18 +4,79 @@
 #define _H_TRANSLATE
 
 struct translation {
-    uintptr_t unused;
+    uintptr_t thumb; // Nonzero if the code is THUMB; jump_table then has one entry per halfword
     void** jump_table;
     uint32_t *start_ptr;
     uint32_t *end_ptr;
 } __attribute__((packed));
+#define MAX_TRANSLATIONS 262144
 extern struct translation translation_table[] __asm__("translation_table");
 #define INSN_BUFFER_SIZE 10000000
+#define INSN_STAGE_SIZE 0x100000 // after the cache, where the x86_64 translator builds blocks
 extern uint8_t *insn_buffer;
 extern uint8_t *insn_bufptr;
 
+/* The code cache is flushed whenever it may not have room for another block,
+ * right before adding one. Its limits can be lowered at runtime. */
+#define TCACHE_RESERVE 0x10000 // room needed for a block
+extern uint32_t tcache_code_limit;  // bytes of insn_buffer to use
+extern uint32_t tcache_block_limit; // translations
+enum { TC_FULL_CODE, TC_FULL_JUMP_TABLE, TC_FULL_BLOCKS, TC_FULL_EXITS, TC_FULL_MAX };
+/* Why the whole cache is flushed: it was full, translated code was written
+ * to, the emulator was reset, or the debugger, gdb or the loader asked */
+enum { TF_FULL, TF_SMC, TF_RESET, TF_OTHER, TF_MAX };
+/* Instructions the translator leaves to the interpreter, by encoding class
+ * (see unimpl_class_names) */
+enum { TU_UNCONDITIONAL, TU_MULTIPLY, TU_EXTRA_LOAD_STORE, TU_MISC, TU_DATA_PROCESSING,
+       TU_LOAD_STORE, TU_LOAD_STORE_MULTIPLE, TU_COPROCESSOR, TU_SWI, TU_OTHER,
+       TU_THUMB_SHIFT, TU_THUMB_HI_REG, TU_THUMB_OTHER, TU_MAX };
+struct tcache_stats {
+    uint32_t evictions[TC_FULL_MAX]; // flushes to make room, by what ran out
+    uint32_t cut_blocks;             // blocks ended early for lack of room
+    uint32_t evicted_blocks;         // translations thrown away by those flushes
+    uint64_t evicted_bytes;
+    uint32_t saved_blocks;           // in the persistent cache
+    uint32_t saved_hits;             // blocks taken from it instead of translated
+    uint32_t unimpl[TU_MAX];         // code addresses flagged RF_CODE_NO_TRANSLATE
+    uint32_t blocks;                 // installed since startup
+    uint64_t block_insns, block_bytes;
+    uint32_t flushes;                // of the whole cache, for any reason
+    uint32_t flush_causes[TF_MAX];   // the same, by cause
+    uint32_t smc_pages;              // code writes that dropped only the translations
+                                     // on a page (a block, in the threaded translator)
+    uint64_t entries;                // from the interpreter into translated code
+    uint64_t interpreted, translated; // instructions run each way, counted in cycles
+};
+extern struct tcache_stats tcache_stats;
+// Lookups in translation_next, counted by the assembly code
+extern uint64_t tcache_dispatches __asm__("tcache_dispatches");
+void tcache_info();
+// Writes the statistics as "name value" lines. Returns the length
+size_t tcache_stats_dump(char *buf, size_t size);
+
+#define MAX_TRANSLATE_THRESHOLD 0xFFFF
+extern uint32_t translate_threshold; // times code is interpreted before it gets translated
+
 int translate(uint32_t start_pc, uint32_t *insnp);
-void flush_translations();
+// So far only the x86_64 translator handles THUMB code
+#if defined(__x86_64__) && !defined(NO_TRANSLATION) && !defined(THREADED_TRANSLATION)
+#define THUMB_TRANSLATION
+int translate_thumb(uint32_t start_pc, uint16_t *insnp);
+// Blocks continue into following pages that are contiguous in host memory
+#define MULTI_PAGE_BLOCKS
+#define MAX_BLOCK_PAGES 64
+extern uint32_t block_max_pages;
+// Translations can be saved to a file and reused by the next run
+#define PERSISTENT_TRANSLATIONS
+bool tcache_load(const char *filename);
+bool tcache_save(const char *filename);
+// Blocks can be translated on a worker thread while the code is interpreted
+#define BACKGROUND_TRANSLATION
+extern bool translate_async;
+void translate_worker_quit();
+#endif
+void flush_translations(int cause);
+void unlink_translations();
 void invalidate_translation(int index);
 void fix_pc_for_fault();
 int range_translated(uint32_t range_start, uint32_t range_end);
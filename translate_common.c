@@ -0,0 +1,290 @@
+/* The ARM decoder and statistics output shared by the translators
+ * (see translate_common.h) */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "emu.h"
+#include "mem.h"
+#include "translate.h"
+#include "translate_common.h"
+
+#ifndef NO_TRANSLATION
+
+/* Immediate operand of data processing or MSR: 8 bits rotated right by
+ * twice the rotate field */
+static uint32_t rotated_imm(uint32_t insn) {
+    uint32_t imm = insn & 0xFF;
+    int rotate = insn >> 7 & 30;
+    return rotate ? imm >> rotate | imm << (32 - rotate) : imm;
+}
+
+/* Register operand of data processing or single load/store, bits 0-11 */
+static void decode_shift(uint32_t insn, struct arm_insn *i) {
+    i->rm = insn & 15;
+    i->shift = insn >> 5 & 3;
+    if (insn & 0x10) {
+        i->operand = AO_SHIFT_REG;
+        i->rs = insn >> 8 & 15;
+        return;
+    }
+    i->count = insn >> 7 & 31;
+    if (i->count)
+        i->operand = AO_SHIFT_IMM;
+    else if (i->shift == SHIFT_LSL)
+        i->operand = AO_REG;
+    else if (i->shift == SHIFT_ROR)
+        i->operand = AO_RRX;
+    else {
+        i->operand = AO_SHIFT_IMM;
+        i->count = 32;
+    }
+}
+
+// Bits 20-24 of a single or extra load/store
+static void decode_transfer(uint32_t insn, struct arm_insn *i) {
+    i->load = insn >> 20 & 1;
+    i->up = insn >> 23 & 1;
+    i->pre = insn >> 24 & 1;
+    i->writeback = !i->pre || insn & 0x200000;
+    i->user = !i->pre && insn & 0x200000;
+}
+
+static int flags_written(struct arm_insn *i) {
+    if (!i->s)
+        return 0;
+    if (i->form != AI_DATA)
+        return FLAG_N | FLAG_Z; // MULS, MLAS, UMULLS...
+    switch (i->op) {
+        case 2: case 3: case 4: case 10: case 11:
+            if (i->operand == AO_RRX)
+                return FLAG_N | FLAG_Z | FLAG_V; // RRX reads C
+            return FLAG_N | FLAG_Z | FLAG_C | FLAG_V;
+        case 5: case 6: case 7:
+            return FLAG_N | FLAG_Z | FLAG_V;
+        default:
+            return FLAG_N | FLAG_Z;
+    }
+}
+
+void arm_decode(uint32_t insn, uint32_t pc, struct arm_insn *i) {
+    memset(i, 0, sizeof *i);
+    i->cond = insn >> 28;
+    i->rd = insn >> 12 & 15;
+    i->rn = insn >> 16 & 15;
+    i->rm = insn & 15;
+    i->imm_carry = -1;
+
+    if (i->cond == 0xF) {
+        if ((insn & 0xFD70F000) == 0xF550F000) {
+            i->form = AI_PLD;
+        } else if ((insn & 0xFE000000) == 0xFA000000) {
+            i->form = AI_BLX_IMM;
+            i->link = true;
+            i->imm = (pc + 8 + ((int32_t)insn << 8 >> 6) + (insn >> 23 & 2)) | 1;
+        }
+        return;
+    }
+
+    if ((insn & 0xE000090) == 0x0000090) {
+        if ((insn & 0xFC000F0) == 0x0000090) {
+            i->form = AI_MUL;
+            i->rd = insn >> 16 & 15;
+            i->rn = insn >> 12 & 15;
+            i->rs = insn >> 8 & 15;
+            i->accumulate = insn >> 21 & 1;
+            i->s = insn >> 20 & 1;
+        } else if ((insn & 0xF8000F0) == 0x0800090) {
+            i->form = AI_MULL;
+            i->rd = insn >> 12 & 15;
+            i->rn = insn >> 16 & 15;
+            i->rs = insn >> 8 & 15;
+            i->sign = insn >> 22 & 1;
+            i->accumulate = insn >> 21 & 1;
+            i->s = insn >> 20 & 1;
+        } else if ((insn & 0xFB00FF0) == 0x1000090) {
+            i->form = AI_SWP;
+            i->byte = insn >> 22 & 1;
+        } else if (insn & 0x60) {
+            i->form = AI_EXTRA_LS;
+            decode_transfer(insn, i);
+            i->op = insn >> 5 & 3;
+            if (!i->load && i->op != AX_H) {
+                // Stores of type SB and SH are LDRD and STRD
+                i->load = i->op == AX_SB;
+                i->op = AX_D;
+            }
+            if (insn & 0x400000) {
+                i->operand = AO_IMM;
+                i->imm = (insn & 0x0F) | (insn >> 4 & 0xF0);
+            } else {
+                i->operand = AO_REG;
+            }
+        }
+    } else if ((insn & 0xD900000) == 0x1000000) {
+        if ((insn & 0xFFFFFD0) == 0x12FFF10) {
+            i->form = AI_BX;
+            i->link = insn >> 5 & 1;
+        } else if ((insn & 0xFBF0FFF) == 0x10F0000) {
+            i->form = AI_MRS;
+            i->spsr = insn >> 22 & 1;
+        } else if ((insn & 0xFB0FFF0) == 0x120F000 ||
+                   (insn & 0xFB0F000) == 0x320F000) {
+            i->form = AI_MSR;
+            i->spsr = insn >> 22 & 1;
+            if (insn & 0x0080000) i->mask |= 0xFF000000;
+            if (insn & 0x0040000) i->mask |= 0x00FF0000;
+            if (insn & 0x0020000) i->mask |= 0x0000FF00;
+            if (insn & 0x0010000) i->mask |= 0x000000FF;
+            if (insn & 0x2000000) {
+                i->operand = AO_IMM;
+                i->imm = rotated_imm(insn);
+            } else {
+                i->operand = AO_REG;
+            }
+        } else if ((insn & 0xFFF0FF0) == 0x16F0F10) {
+            i->form = AI_CLZ;
+        }
+    } else if ((insn & 0xC000000) == 0) {
+        i->form = AI_DATA;
+        i->op = insn >> 21 & 15;
+        i->s = insn >> 20 & 1;
+        if (insn & 0x2000000) {
+            // If rotated, the shifter carry out is bit 31
+            i->operand = AO_IMM;
+            i->imm = rotated_imm(insn);
+            if (insn & 0xF00)
+                i->imm_carry = i->imm >> 31;
+        } else {
+            decode_shift(insn, i);
+            if (i->operand == AO_REG && i->rm == 15) {
+                i->operand = AO_IMM;
+                i->imm = pc + 8;
+            }
+        }
+    } else if ((insn & 0xC000000) == 0x4000000) {
+        if ((insn & 0x2000010) == 0x2000010)
+            return; // undefined
+        i->form = AI_LS;
+        i->byte = insn >> 22 & 1;
+        decode_transfer(insn, i);
+        if (insn & 0x2000000) {
+            decode_shift(insn, i);
+        } else {
+            i->operand = AO_IMM;
+            i->imm = insn & 0xFFF;
+        }
+    } else if ((insn & 0xE000000) == 0x8000000) {
+        i->form = AI_LSM;
+        i->load = insn >> 20 & 1;
+        i->writeback = insn >> 21 & 1;
+        i->user = insn >> 22 & 1;
+        i->up = insn >> 23 & 1;
+        i->pre = insn >> 24 & 1;
+        i->reglist = insn & 0xFFFF;
+    } else if ((insn & 0xE000000) == 0xA000000) {
+        i->form = AI_BRANCH;
+        i->link = insn >> 24 & 1;
+        i->imm = pc + 8 + ((int32_t)insn << 8 >> 6);
+    } else if ((insn & 0xF100F10) == 0xE000F10) {
+        i->form = AI_MCR15;
+    } else if ((insn & 0xF100F10) == 0xE100F10) {
+        i->form = AI_MRC15;
+    }
+    i->flags_written = flags_written(i);
+}
+
+static const char *const unimpl_class_names[TU_MAX] = {
+    "unconditional (BLX, PLD)", "multiply", "halfword/doubleword/swap", "MRS/MSR/BX/CLZ",
+    "data processing", "load/store", "load/store multiple", "coprocessor", "SWI", "other",
+    "THUMB shift", "THUMB high register", "THUMB other"
+};
+// The same, for tcache_stats_dump
+static const char *const unimpl_class_keys[TU_MAX] = {
+    "unconditional", "multiply", "extra_load_store", "misc", "data_processing", "load_store",
+    "load_store_multiple", "coprocessor", "swi", "other",
+    "thumb_shift", "thumb_hi_reg", "thumb_other"
+};
+
+void tcache_activity_info() {
+    struct tcache_stats *s = &tcache_stats;
+    uint64_t run = s->interpreted + s->translated;
+    gui_debug_printf("Translated %u blocks, %llu bytes", s->blocks, (unsigned long long)s->block_bytes);
+    if (s->blocks)
+        gui_debug_printf("; %.1f instructions, %.0f bytes each",
+                         (double)s->block_insns / s->blocks, (double)s->block_bytes / s->blocks);
+    gui_debug_printf("\nFlushes:    %u; %u when full, %u for code writes, %u for resets, %u other\n",
+                     s->flushes, s->flush_causes[TF_FULL], s->flush_causes[TF_SMC],
+                     s->flush_causes[TF_RESET], s->flush_causes[TF_OTHER]);
+    if (s->smc_pages)
+        gui_debug_printf("Code writes that dropped only their page: %u\n", s->smc_pages);
+    gui_debug_printf("Entered %llu times from the interpreter, %llu lookups by the dispatcher\n",
+                     (unsigned long long)s->entries, (unsigned long long)tcache_dispatches);
+    if (run)
+        gui_debug_printf("Instructions: %llu interpreted, %llu translated (%.1f%%)\n",
+                         (unsigned long long)s->interpreted, (unsigned long long)s->translated,
+                         100.0 * s->translated / run);
+}
+
+void tcache_unimpl_info() {
+    uint32_t total = 0;
+    int i;
+    for (i = 0; i < TU_MAX; i++)
+        total += tcache_stats.unimpl[i];
+    if (!total)
+        return;
+    gui_debug_printf("Left to the interpreter: %u instructions\n", total);
+    for (i = 0; i < TU_MAX; i++)
+        if (tcache_stats.unimpl[i])
+            gui_debug_printf("  %-26s %u\n", unimpl_class_names[i], tcache_stats.unimpl[i]);
+}
+
+#define DUMP_MAX_NO_TRANSLATE 1000
+size_t tcache_stats_write(char *buf, size_t size, int cached_blocks) {
+    struct tcache_stats *s = &tcache_stats;
+    size_t len = 0;
+    int i, listed = 0;
+#define DUMP(...) do { \
+        int n = snprintf(buf + len, size - len, __VA_ARGS__); \
+        if (n < 0 || (size_t)n >= size - len) \
+            return len; \
+        len += n; \
+    } while (0)
+    DUMP("blocks %u\n", s->blocks);
+    DUMP("block_insns %llu\n", (unsigned long long)s->block_insns);
+    DUMP("block_bytes %llu\n", (unsigned long long)s->block_bytes);
+    DUMP("cached_blocks %d\n", cached_blocks);
+    DUMP("cached_bytes %u\n", (uint32_t)(insn_bufptr - insn_buffer));
+    DUMP("flushes %u\n", s->flushes);
+    DUMP("flushes_full %u\n", s->flush_causes[TF_FULL]);
+    DUMP("flushes_smc %u\n", s->flush_causes[TF_SMC]);
+    DUMP("flushes_reset %u\n", s->flush_causes[TF_RESET]);
+    DUMP("flushes_other %u\n", s->flush_causes[TF_OTHER]);
+    DUMP("smc_pages %u\n", s->smc_pages);
+    // Writes to translated code, however the translator dealt with them
+    DUMP("smc %u\n", s->flush_causes[TF_SMC] + s->smc_pages);
+    DUMP("evicted_blocks %u\n", s->evicted_blocks);
+    DUMP("evicted_bytes %llu\n", (unsigned long long)s->evicted_bytes);
+    DUMP("cut_blocks %u\n", s->cut_blocks);
+    DUMP("saved_hits %u\n", s->saved_hits);
+    DUMP("entries %llu\n", (unsigned long long)s->entries);
+    DUMP("dispatches %llu\n", (unsigned long long)tcache_dispatches);
+    DUMP("interpreted %llu\n", (unsigned long long)s->interpreted);
+    DUMP("translated %llu\n", (unsigned long long)s->translated);
+    for (i = 0; i < TU_MAX; i++)
+        DUMP("unimpl_%s %u\n", unimpl_class_keys[i], s->unimpl[i]);
+    for (i = 0; i < 3; i++) {
+        uint32_t offset;
+        for (offset = 0; offset < mem_areas[i].size; offset += 4) {
+            if (!(RAM_FLAGS(mem_areas[i].ptr + offset) & RF_CODE_NO_TRANSLATE))
+                continue;
+            if (listed++ == DUMP_MAX_NO_TRANSLATE)
+                return len;
+            DUMP("no_translate %08x\n", mem_areas[i].base + offset);
+        }
+    }
+#undef DUMP
+    return len;
+}
+
+#endif
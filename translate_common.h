@@ -0,0 +1,127 @@
+/* Shared by the translators: x86 encodings and the ARM decoder, which
+ * does not depend on the code being generated */
+
+#ifndef _H_TRANSLATE_COMMON
+#define _H_TRANSLATE_COMMON
+
+enum x86_reg { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI };
+enum x86_reg8 { AL, CL, DL, BL, AH, CH, DH, BH };
+enum group1 { ADD, OR, ADC, SBB, AND, SUB, XOR, CMP };
+enum group2 { ROL, ROR, RCL, RCR, SHL, SHR, SAL, SAR };
+enum group3 { NOT = 2, NEG, MUL, IMUL, DIV, IDIV };
+
+/* x86 conditional jump instructions */
+enum { JO = 0x70, JNO, JB,  JAE, JZ, JNZ, JBE, JA,
+       JS = 0x78, JNS, JPE, JPO, JL, JGE, JLE, JG };
+
+/* x86 set byte on condition instructions (after a 0F prefix) */
+enum { SETO = 0x90, SETNO, SETB,  SETAE, SETZ, SETNZ, SETBE, SETA,
+       SETS,        SETNS, SETPE, SETPO, SETL, SETGE, SETLE, SETG };
+
+/* ARM instructions, decoded once by arm_decode for the x86 translators.
+ * Each translator generates code from these fields; the forms it does not
+ * handle, or handles only in part, go to the interpreter. */
+enum arm_form {
+    AI_OTHER,      // not decoded
+    AI_PLD,
+    AI_BLX_IMM,    // imm: target, with bit 0 set
+    AI_MUL,        // MUL, MLA: rd = rm * rs (+ rn)
+    AI_MULL,       // UMULL, UMLAL, SMULL, SMLAL: rd is RdLo, rn RdHi
+    AI_SWP,        // SWP, SWPB: rd <- [rn] <- rm
+    AI_EXTRA_LS,   // halfword, signed byte and doubleword loads and stores; op is the type
+    AI_BX,         // BX, BLX rm
+    AI_MRS,
+    AI_MSR,        // mask: the PSR bits written
+    AI_CLZ,
+    AI_DATA,       // data processing; op is the opcode
+    AI_LS,         // LDR, STR, LDRB, STRB
+    AI_LSM,        // LDM, STM
+    AI_BRANCH,     // B, BL; imm: target
+    AI_MCR15,      // MCR/MRC p15: rd is the ARM register
+    AI_MRC15,
+};
+
+// Type of an AI_EXTRA_LS; AX_D loads or stores rd and rd + 1
+enum { AX_H = 1, AX_SB, AX_SH, AX_D };
+
+/* Second operand of data processing, or offset of a load or store.
+ * Shifts by an immediate are normalized: LSL #0 is AO_REG, ROR #0 is
+ * AO_RRX and LSR or ASR #0 has a count of 32. */
+enum arm_operand {
+    AO_IMM,        // imm; data processing only: imm_carry is the shifter carry out, or -1
+    AO_REG,        // rm
+    AO_SHIFT_IMM,  // rm shifted by count
+    AO_SHIFT_REG,  // rm shifted by the low byte of rs
+    AO_RRX,        // rm rotated right through the carry
+};
+enum { SHIFT_LSL, SHIFT_LSR, SHIFT_ASR, SHIFT_ROR };
+
+// ARM flags, in the order of CPSR bits 28-31
+enum { FLAG_V = 1, FLAG_C = 2, FLAG_Z = 4, FLAG_N = 8 };
+
+struct arm_insn {
+    uint8_t form;          // enum arm_form
+    uint8_t cond;
+    uint8_t op;
+    uint8_t operand;       // enum arm_operand
+    uint8_t shift, count;
+    uint8_t rd, rn, rm, rs;
+    int8_t imm_carry;
+    uint8_t flags_written; // flags set without being read first (a subset is fine)
+    bool s;                // set flags
+    bool load, byte;
+    bool up, pre;          // add the offset; apply it before the access
+    bool writeback;        // update rn: W is set, or post-indexed
+    bool user;             // LDRT/STRT, or LDM/STM with the S bit
+    bool link;             // BL, BLX
+    bool spsr;             // MRS/MSR: SPSR rather than CPSR
+    bool accumulate, sign; // multiplications
+    uint16_t reglist;
+    uint32_t imm;
+    uint32_t mask;
+};
+
+/* The instruction at pc. Constant operands are folded: a data processing
+ * operand of pc becomes AO_IMM pc + 8, and branch targets are absolute. */
+void arm_decode(uint32_t insn, uint32_t pc, struct arm_insn *i);
+
+/* Class of an instruction that ends a block untranslated */
+static inline int arm_unimpl_class(uint32_t insn) {
+    if (insn >> 28 == 0xF)
+        return TU_UNCONDITIONAL;
+    if ((insn & 0xE000090) == 0x0000090) {
+        if (insn & 0x60 || insn & 0x1000000)
+            return TU_EXTRA_LOAD_STORE; // halfword, signed byte, doubleword, SWP
+        return TU_MULTIPLY;
+    }
+    if ((insn & 0xD900000) == 0x1000000)
+        return TU_MISC;
+    if ((insn & 0xC000000) == 0)
+        return TU_DATA_PROCESSING;
+    if ((insn & 0xC000000) == 0x4000000)
+        return TU_LOAD_STORE;
+    if ((insn & 0xE000000) == 0x8000000)
+        return TU_LOAD_STORE_MULTIPLE;
+    if ((insn & 0xF000000) == 0xF000000)
+        return TU_SWI;
+    if ((insn & 0xC000000) == 0xC000000)
+        return TU_COPROCESSOR;
+    return TU_OTHER;
+}
+
+static inline int thumb_unimpl_class(uint16_t insn) {
+    if (insn < 0x1800)
+        return TU_THUMB_SHIFT;
+    if (insn >= 0x4400 && insn < 0x4800)
+        return TU_THUMB_HI_REG;
+    return TU_THUMB_OTHER;
+}
+
+// Parts of tcache_info
+void tcache_activity_info();
+void tcache_unimpl_info();
+/* Body of tcache_stats_dump. Code flagged RF_CODE_NO_TRANSLATE is listed
+ * by physical address, up to a limit. */
+size_t tcache_stats_write(char *buf, size_t size, int cached_blocks);
+
+#endif
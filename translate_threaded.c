@@ -0,0 +1,235 @@
+/* Portable translator: blocks of ARM code become arrays of decoded
+ * instructions (see cpu_decode_instruction), run one handler after another
+ * without going back through the interpreter loop. No machine code is
+ * generated, so this works on any host. Translations are kept track of
+ * through translation_table and RF_CODE_TRANSLATED like the native ones. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "emu.h"
+#include "mem.h"
+#include "cpu.h"
+#include "asmcode.h"
+#include "translate.h"
+#include "debug.h"
+#include "translate_common.h"
+
+#ifdef THREADED_TRANSLATION
+
+/* jump_table of a translation points to its array of decoded instructions,
+ * one for each word from start_ptr to end_ptr. They are allocated from
+ * insn_buffer, which needs no execute permission here. */
+struct translation translation_table[MAX_TRANSLATIONS];
+
+static int next_index = 0;
+uint8_t *insn_buffer = NULL;
+uint8_t *insn_bufptr = NULL;
+
+uint32_t tcache_code_limit = INSN_BUFFER_SIZE;
+uint32_t tcache_block_limit = MAX_TRANSLATIONS;
+struct tcache_stats tcache_stats;
+uint64_t tcache_dispatches;
+
+// End of the block being run. Set to NULL when it gets dropped, to stop it
+static const struct decoded_insn *run_end;
+
+static inline struct decoded_insn *block_insns(struct translation *t) {
+    return (struct decoded_insn *)t->jump_table;
+}
+
+/* Branch target cache. translation_enter looks the PC up here before taking
+ * the long way through addr_cache, RAM_FLAGS and translation_table, and adds
+ * what it finds that way. Entries depend on the virtual memory mapping and
+ * on the translations, so a change to either empties it. */
+struct btc_entry {
+    uint32_t key; // PC | 1, so that an empty entry never matches
+    const struct decoded_insn *insn, *end;
+};
+#define BTC_SIZE 1024
+static struct btc_entry btc_table[BTC_SIZE];
+
+static void btc_clear() {
+    memset(btc_table, 0, sizeof btc_table);
+}
+
+/* Flush the cache if it may not have room for another block */
+static void tcache_make_room() {
+    int full;
+    if (insn_bufptr + TCACHE_RESERVE > insn_buffer + tcache_code_limit)
+        full = TC_FULL_CODE;
+    else if (next_index >= (int)tcache_block_limit)
+        full = TC_FULL_BLOCKS;
+    else
+        return;
+    tcache_stats.evictions[full]++;
+    tcache_stats.evicted_blocks += next_index;
+    tcache_stats.evicted_bytes += insn_bufptr - insn_buffer;
+    flush_translations(TF_FULL);
+}
+
+void tcache_info() {
+    gui_debug_printf("Code:       %u of %u bytes of decoded instructions\n",
+                     (uint32_t)(insn_bufptr - insn_buffer), tcache_code_limit);
+    gui_debug_printf("Blocks:     %d of %u\n", next_index, tcache_block_limit);
+    gui_debug_printf("Flushes when full: %u code, %u blocks\n",
+                     tcache_stats.evictions[TC_FULL_CODE], tcache_stats.evictions[TC_FULL_BLOCKS]);
+    gui_debug_printf("Evicted %u blocks, %llu bytes\n", tcache_stats.evicted_blocks,
+                     (unsigned long long)tcache_stats.evicted_bytes);
+    tcache_activity_info();
+}
+
+size_t tcache_stats_dump(char *buf, size_t size) {
+    return tcache_stats_write(buf, size, next_index);
+}
+
+// Whether insn always leaves the block, by writing the PC or switching to THUMB
+static bool ends_block(uint32_t insn) {
+    if (insn >> 28 == 0xF)
+        return true;
+    if (insn >> 28 != 0xE)
+        return false;
+    if ((insn & 0xE000000) == 0xA000000)          // B, BL
+        return true;
+    if ((insn & 0xF000000) == 0xF000000)          // SWI
+        return true;
+    if ((insn & 0xFFFFFD0) == 0x12FFF10)          // BX, BLX
+        return true;
+    if ((insn & 0xE108000) == 0x8108000)          // LDM with PC
+        return true;
+    if ((insn & 0xC10F000) == 0x410F000)          // LDR PC
+        return true;
+    if ((insn & 0xC00F000) == 0x000F000           // data processing to PC
+            && (insn & 0x1900000) != 0x1000000 && (insn & 0xE000090) != 0x0000090)
+        return true;
+    return false;
+}
+
+int translate(uint32_t start_pc, uint32_t *start_insnp) {
+    tcache_make_room();
+    struct decoded_insn *out = (struct decoded_insn *)insn_bufptr;
+    uint32_t pc = start_pc;
+    uint32_t *insnp = start_insnp;
+    int index = next_index;
+
+    while (!((pc ^ start_pc) & ~0x3FF)) {
+        if (RAM_FLAGS(insnp) & (RF_EXEC_BREAKPOINT | RF_EXEC_DEBUG_NEXT | RF_EXEC_HACK
+                                | RF_ARMLOADER_CB | RF_CODE_TRANSLATED))
+            break;
+        uint32_t insn = *insnp;
+        cpu_decode_instruction(out, insn);
+        RAM_FLAGS(insnp) |= RF_CODE_TRANSLATED | index << RFS_TRANSLATION_INDEX;
+        pc += 4;
+        insnp++;
+        // After MSR or MCR, an interrupt may be due or the mapping may have changed
+        if ((out++)->op == DECODED_OP_SYNC || ends_block(insn))
+            break;
+    }
+
+    if (pc == start_pc)
+        return -1;
+
+    next_index++;
+    translation_table[index].thumb      = 0;
+    translation_table[index].jump_table = (void **)insn_bufptr;
+    translation_table[index].start_ptr  = start_insnp;
+    translation_table[index].end_ptr    = insnp;
+
+    tcache_stats.blocks++;
+    tcache_stats.block_insns += insnp - start_insnp;
+    tcache_stats.block_bytes += (uint8_t *)out - insn_bufptr;
+    insn_bufptr = (uint8_t *)out;
+
+    return index;
+}
+
+/* Run translated code from arm.reg[15] until it leaves translated code, or
+ * an event is due. The PC and cycle count are kept up to date as in the
+ * interpreter, so faults need no fixing up. */
+void translation_enter() {
+    while (cycle_count_delta < 0 && !cpu_events) {
+        uint32_t pc = arm.reg[15];
+        if (pc & 3 || arm.cpsr_low28 & 0x20)
+            return;
+        tcache_dispatches++;
+        struct btc_entry *e = &btc_table[(pc >> 10 ^ pc) >> 2 & (BTC_SIZE - 1)];
+        if (e->key != (pc | 1)) {
+            uint32_t *insnp = ptr(pc);
+            if (!insnp)
+                return;
+            uint32_t flags = RAM_FLAGS(insnp);
+            if (!(flags & RF_CODE_TRANSLATED))
+                return;
+            struct translation *t = &translation_table[flags >> RFS_TRANSLATION_INDEX];
+            if (t->thumb)
+                return;
+            e->key = pc | 1;
+            e->insn = block_insns(t) + (insnp - t->start_ptr);
+            e->end = block_insns(t) + (t->end_ptr - t->start_ptr);
+        }
+
+        const struct decoded_insn *d = e->insn;
+        run_end = e->end;
+        do {
+            arm.reg[15] = pc += 4;
+            cycle_count_delta++;
+            if (condition_passed(d->cond))
+                d->handler(d);
+        } while (arm.reg[15] == pc && ++d < run_end);
+    }
+}
+
+void flush_translations(int cause) {
+    int index;
+    tcache_stats.flushes++;
+    tcache_stats.flush_causes[cause]++;
+    for (index = 0; index < next_index; index++) {
+        uint32_t *start = translation_table[index].start_ptr;
+        uint32_t *end   = translation_table[index].end_ptr;
+        for (; start < end; start++)
+            RAM_FLAGS(start) &= ~(RF_CODE_TRANSLATED | ~0u << RFS_TRANSLATION_INDEX);
+    }
+    next_index = 0;
+    insn_bufptr = insn_buffer;
+    run_end = NULL;
+    btc_clear();
+}
+
+// Translations are not linked to each other here, only cached by address
+void unlink_translations() {
+    btc_clear();
+}
+
+/* Code was written to: drop only its own block. Its decoded instructions
+ * stay where they are until the next flush, in case it is the one running. */
+void invalidate_translation(int index) {
+    struct translation *t = &translation_table[index];
+    uint32_t *start;
+    for (start = t->start_ptr; start < t->end_ptr; start++)
+        RAM_FLAGS(start) &= ~(RF_CODE_TRANSLATED | ~0u << RFS_TRANSLATION_INDEX);
+    if (run_end == block_insns(t) + (t->end_ptr - t->start_ptr))
+        run_end = NULL;
+    // An empty range keeps it from being flushed again
+    t->end_ptr = t->start_ptr;
+    tcache_stats.smc_pages++;
+    btc_clear();
+}
+
+void fix_pc_for_fault() {
+    arm.reg[15] -= (arm.cpsr_low28 & 0x20) ? 2 : 4;
+}
+
+// returns 1 if at least one instruction translated in the range
+int range_translated(uint32_t range_start, uint32_t range_end) {
+    uint32_t pc;
+    int translated = 0;
+    for (pc = range_start; pc < range_end;  pc += 4) {
+        void *pc_ram_ptr = virt_mem_ptr(pc, 4);
+        if (!pc_ram_ptr)
+            break;
+        translated |= RAM_FLAGS(pc_ram_ptr) & RF_CODE_TRANSLATED;
+    }
+    return translated;
+}
+
+#endif
@@ -6,6 +6,8 @@
 #include "asmcode.h"
 #include "translate.h"
 #include "debug.h"
+#include "translate_common.h"
+#include "perfmap.h"
 
 extern void translation_enter() __asm__("translation_enter");
 extern void translation_next() __asm__("translation_next");
@@ -14,7 +16,6 @@ extern uint32_t arm_shift_proc[2][4] __asm__("arm_shift_proc");
 void **in_translation_esp __asm__("in_translation_esp");
 void *in_translation_pc_ptr __asm__("in_translation_pc_ptr");
 
-#define MAX_TRANSLATIONS 262144
 struct translation translation_table[MAX_TRANSLATIONS];
 
 static int next_index = 0;
@@ -22,19 +23,15 @@ uint8_t *insn_buffer = NULL;
 uint8_t *insn_bufptr = NULL;
 static uint8_t *jtbl_buffer[500000];
 static uint8_t **jtbl_bufptr = jtbl_buffer;
+#define JTBL_SIZE (sizeof jtbl_buffer / sizeof *jtbl_buffer)
+
+uint32_t tcache_code_limit = INSN_BUFFER_SIZE;
+uint32_t tcache_block_limit = MAX_TRANSLATIONS;
+struct tcache_stats tcache_stats;
+uint64_t tcache_dispatches;
 static uint8_t *out;
 static uint8_t **outj;
 
-enum x86_reg { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI };
-enum x86_reg8 { AL, CL, DL, BL, AH, CH, DH, BH };
-enum group1 { ADD, OR, ADC, SBB, AND, SUB, XOR, CMP };
-enum group2 { ROL, ROR, RCL, RCR, SHL, SHR, SAL, SAR };
-enum group3 { NOT = 2, NEG, MUL, IMUL, DIV, IDIV };
-
-/* x86 conditional jump instructions */
-enum { JO = 0x70, JNO, JB,  JAE, JZ, JNZ, JBE, JA,
-       JS = 0x78, JNS, JPE, JPO, JL, JGE, JLE, JG };
-
 static inline void emit_byte(uint8_t b)    { *out++ = b; }
 static inline void emit_word(uint16_t w)   { *(uint16_t *)out = w; out += 2; }
 static inline void emit_dword(uint32_t dw) { *(uint32_t *)out = dw; out += 4; }
@@ -223,30 +220,61 @@ static inline void emit_mov_flag_immediate(void *flagptr, int imm) {
     emit_modrm_base_offset(0, EBX, (uint8_t *)flagptr - (uint8_t *)&arm);
     emit_byte(imm);
 }
-enum { SETO = 0x90, SETNO, SETB,  SETAE, SETZ, SETNZ, SETBE, SETA,
-       SETS,        SETNS, SETPE, SETPO, SETL, SETGE, SETLE, SETG };
 static inline void emit_setcc_flag(int setcc, void *flagptr) {
     emit_byte(0x0F);
     emit_byte(setcc);
     emit_modrm_base_offset(0, EBX, (uint8_t *)flagptr - (uint8_t *)&arm);
 }
 
+/* Flush the code cache if it may not have room for another block */
+static void tcache_make_room() {
+    int full;
+    if (insn_bufptr + TCACHE_RESERVE > insn_buffer + tcache_code_limit)
+        full = TC_FULL_CODE;
+    else if (jtbl_bufptr + 0x400 / 4 > &jtbl_buffer[JTBL_SIZE])
+        full = TC_FULL_JUMP_TABLE;
+    else if (next_index >= (int)tcache_block_limit)
+        full = TC_FULL_BLOCKS;
+    else
+        return;
+    tcache_stats.evictions[full]++;
+    tcache_stats.evicted_blocks += next_index;
+    tcache_stats.evicted_bytes += insn_bufptr - insn_buffer;
+    flush_translations(TF_FULL);
+}
+
+void tcache_info() {
+    gui_debug_printf("Code:       %u of %u bytes\n", (uint32_t)(insn_bufptr - insn_buffer), tcache_code_limit);
+    gui_debug_printf("Blocks:     %d of %u\n", next_index, tcache_block_limit);
+    gui_debug_printf("Jump table: %u of %u entries\n", (uint32_t)(jtbl_bufptr - jtbl_buffer), (uint32_t)JTBL_SIZE);
+    gui_debug_printf("Flushes when full: %u code, %u jump table, %u blocks\n",
+                     tcache_stats.evictions[TC_FULL_CODE], tcache_stats.evictions[TC_FULL_JUMP_TABLE],
+                     tcache_stats.evictions[TC_FULL_BLOCKS]);
+    gui_debug_printf("Evicted %u blocks, %llu bytes; %u blocks cut short\n", tcache_stats.evicted_blocks,
+                     (unsigned long long)tcache_stats.evicted_bytes, tcache_stats.cut_blocks);
+    tcache_activity_info();
+    tcache_unimpl_info();
+}
+
+size_t tcache_stats_dump(char *buf, size_t size) {
+    return tcache_stats_write(buf, size, next_index);
+}
+
 int translate(uint32_t start_pc, uint32_t *start_insnp) {
+    tcache_make_room();
     out = insn_bufptr;
     outj = jtbl_bufptr;
     uint32_t pc = start_pc;
     uint32_t *insnp = start_insnp;
 
-    if (next_index >= MAX_TRANSLATIONS)
-        error("too many translations");
-
     uint8_t *insn_start;
     int stop_here = 0;
     while (1) {
-        if (out >= &insn_buffer[INSN_BUFFER_SIZE - 1000])
-            error("Out of instruction space");
-        if (outj >= &jtbl_buffer[sizeof jtbl_buffer / sizeof *jtbl_buffer])
-            error("Out of jump table space");
+        if (out >= &insn_buffer[tcache_code_limit - 1000] || outj >= &jtbl_buffer[JTBL_SIZE]) {
+            // The cache gets flushed before the next block
+            tcache_stats.cut_blocks++;
+            goto branch_conditional;
+        }
 
         insn_start = out;
 
@@ -259,9 +287,11 @@ int translate(uint32_t start_pc, uint32_t *start_insnp) {
             goto branch_conditional;
         }
         uint32_t insn = *insnp;
+        struct arm_insn i;
+        arm_decode(insn, pc, &i);
 
         /* Condition code */
-        int cond = insn >> 28;
+        int cond = i.cond;
         int jcc = JZ;
         uint8_t *cond_jmp_offset = NULL;
         switch (cond >> 1) {
@@ -304,45 +334,39 @@ int translate(uint32_t start_pc, uint32_t *start_insnp) {
         cond_jmp_offset = out;
 no_condition:
 
-        if ((insn & 0xE000090) == 0x0000090) {
-            if ((insn & 0xFC000F0) == 0x0000090) {
+        switch (i.form) {
+            case AI_MUL:
                 /* MUL, MLA - 32x32->32 multiplications */
-                int left_reg  = insn & 15;
-                int right_reg = insn >> 8 & 15;
-                int acc_reg   = insn >> 12 & 15;
-                int dest_reg  = insn >> 16 & 15;
-                if (left_reg == 15 || right_reg == 15 || acc_reg == 15 || dest_reg == 15)
+                if (i.rm == 15 || i.rs == 15 || i.rn == 15 || i.rd == 15)
                     goto unimpl;
 
-                emit_mov_x86reg_armreg(EAX, left_reg);
-                emit_unary_armreg(MUL, right_reg);
-                if (insn & 0x0200000)
-                    emit_alu_x86reg_armreg(ADD, EAX, acc_reg);
-                emit_mov_armreg_x86reg(dest_reg, EAX);
+                emit_mov_x86reg_armreg(EAX, i.rm);
+                emit_unary_armreg(MUL, i.rs);
+                if (i.accumulate)
+                    emit_alu_x86reg_armreg(ADD, EAX, i.rn);
+                emit_mov_armreg_x86reg(i.rd, EAX);
 
-                if (insn & 0x0100000) {
-                    if (!(insn & 0x0200000))
+                if (i.s) {
+                    if (!i.accumulate)
                         emit_test_x86reg_x86reg(EAX, EAX);
                     emit_setcc_flag(SETS, &arm.cpsr_n);
                     emit_setcc_flag(SETZ, &arm.cpsr_z);
                 }
-            } else if ((insn & 0xF8000F0) == 0x0800090) {
-                /* UMULL, UMLAL, SMULL, SMLAL: 32x32 to 64 multiplications */
-                uint32_t left_reg  = insn & 15;
-                uint32_t right_reg = insn >> 8  & 15;
-                uint32_t reg_lo    = insn >> 12 & 15;
-                uint32_t reg_hi    = insn >> 16 & 15;
+                break;
 
-                if (left_reg == 15 || right_reg == 15 || reg_lo == 15 || reg_hi == 15)
+            case AI_MULL: {
+                /* UMULL, UMLAL, SMULL, SMLAL: 32x32 to 64 multiplications */
+                int reg_lo = i.rd, reg_hi = i.rn;
+                if (i.rm == 15 || i.rs == 15 || reg_lo == 15 || reg_hi == 15)
                     goto unimpl;
                 if (reg_lo == reg_hi)
                     goto unimpl;
-                if (insn & 0x0100000) // set flags
+                if (i.s) // set flags
                     goto unimpl;
 
-                emit_mov_x86reg_armreg(EAX, left_reg);
-                emit_unary_armreg((insn & 0x0400000) ? IMUL : MUL, right_reg);
-                if (insn & 0x0200000) {
+                emit_mov_x86reg_armreg(EAX, i.rm);
+                emit_unary_armreg(i.sign ? IMUL : MUL, i.rs);
+                if (i.accumulate) {
                     /* Accumulate */
                     emit_alu_armreg_x86reg(ADD, reg_lo, EAX);
                     emit_alu_armreg_x86reg(ADC, reg_hi, EDX);
@@ -350,55 +374,48 @@ no_condition:
                     emit_mov_armreg_x86reg(reg_lo, EAX);
                     emit_mov_armreg_x86reg(reg_hi, EDX);
                 }
-            } else {
-                enum { INVALID, H, SB, SH } type;
-                int is_load = insn & (1 << 20);
-                type = insn >> 5 & 3;
-                if (type == INVALID || (!is_load && type != H))
-                    // multiply, SWP, or doubleword access
-                    goto unimpl;
+                break;
+            }
 
-                int post_index = !(insn & (1 << 24));
-                int offset_op = (insn & (1 << 23)) ? ADD : SUB;
-                int pre_index = insn & (1 << 21);
-                int base_reg = insn >> 16 & 15;
-                int data_reg = insn >> 12 & 15;
+            case AI_EXTRA_LS: {
+                int offset_op = i.up ? ADD : SUB;
+                int base_reg = i.rn;
+                int data_reg = i.rd;
 
+                if (i.op == AX_D) // doubleword access
+                    goto unimpl;
                 if (base_reg == 15 || data_reg == 15)
                     goto unimpl;
 
-                if (pre_index || post_index) {
-                    if (pre_index && post_index) goto unimpl;
-                    if (base_reg == 15) goto unimpl;
-                    if (is_load && base_reg == data_reg) goto unimpl;
+                if (i.writeback) {
+                    if (i.user) goto unimpl;
+                    if (i.load && base_reg == data_reg) goto unimpl;
                 }
 
-                if (insn & (1 << 22)) {
+                if (i.operand == AO_IMM) {
                     // Offset is immediate
-                    int offset = (insn & 0x0F) | (insn >> 4 & 0xF0);
                     emit_mov_x86reg_armreg(ECX, base_reg);
-                    if (!post_index && offset != 0)
-                        emit_alu_x86reg_immediate(offset_op, ECX, offset);
+                    if (i.pre && i.imm != 0)
+                        emit_alu_x86reg_immediate(offset_op, ECX, i.imm);
                 } else {
                     // Offset is register
-                    int offset_reg = insn & 0x0F;
-                    if (offset_reg == 15)
+                    if (i.rm == 15)
                         goto unimpl;
-                    if (post_index || pre_index)
+                    if (i.writeback)
                         goto unimpl;
                     emit_mov_x86reg_armreg(ECX, base_reg);
-                    emit_alu_x86reg_armreg(offset_op, ECX, offset_reg);
+                    emit_alu_x86reg_armreg(offset_op, ECX, i.rm);
                 }
 
-                if (is_load) {
-                    if (type == SB) {
+                if (i.load) {
+                    if (i.op == AX_SB) {
                         emit_call((uint32_t)read_byte);
                         // movsx eax,al
                         emit_word(0xBE0F);
                         emit_byte(0xC0);
                     } else {
                         emit_call((uint32_t)read_half);
-                        if (type == SH) {
+                        if (i.op == AX_SH) {
                             // cwde
                             emit_byte(0x98);
                         }
@@ -409,134 +426,121 @@ no_condition:
                     emit_call((uint32_t)write_half);
                 }
 
-                if (post_index || pre_index)
-                    emit_alu_armreg_immediate(offset_op, base_reg, ((insn & 0x0F) | (insn >> 4 & 0xF0)));
+                if (i.writeback)
+                    emit_alu_armreg_immediate(offset_op, base_reg, i.imm);
+                break;
             }
-        } else if ((insn & 0xD900000) == 0x1000000) {
-            if ((insn & 0xFFFFFD0) == 0x12FFF10) {
+
+            case AI_BX:
                 /* BX/BLX */
-                int target_reg = insn & 15;
-                if (target_reg == 15)
-                    break;
-                emit_mov_x86reg_armreg(EAX, target_reg);
-                if (insn & 0x20)
+                if (i.rm == 15)
+                    goto unimpl;
+                emit_mov_x86reg_armreg(EAX, i.rm);
+                if (i.link)
                     emit_mov_armreg_immediate(14, pc + 4);
                 emit_jump((uint32_t)translation_next_bx);
                 stop_here = 1;
-            } else if ((insn & 0xFBF0FFF) == 0x10F0000) {
+                break;
+
+            case AI_MRS:
                 /* MRS - move reg <- status */
-                int target_reg = insn >> 12 & 15;
-                if (target_reg == 15)
-                    break;
-                emit_call(insn & 0x0400000 ? (uint32_t)get_spsr : (uint32_t)get_cpsr);
-                emit_mov_armreg_x86reg(target_reg, EAX);
-            } else if ((insn & 0xFB0FFF0) == 0x120F000 ||
-                       (insn & 0xFB0F000) == 0x320F000) {
+                if (i.rd == 15)
+                    goto unimpl;
+                emit_call(i.spsr ? (uint32_t)get_spsr : (uint32_t)get_cpsr);
+                emit_mov_armreg_x86reg(i.rd, EAX);
+                break;
+
+            case AI_MSR:
                 /* MSR - move status <- reg/imm */
-                uint32_t mask = 0;
-                if (insn & 0x2000000) {
-                    uint32_t imm = insn & 0xFF;
-                    int rotate = insn >> 7 & 30;
-                    imm = imm >> rotate | imm << (32 - rotate);
-                    emit_mov_x86reg_immediate(ECX, imm);
+                if (i.operand == AO_IMM) {
+                    emit_mov_x86reg_immediate(ECX, i.imm);
                 } else {
-                    int reg = insn & 15;
-                    if (reg == 15)
-                        break;
-                    emit_mov_x86reg_armreg(ECX, reg);
+                    if (i.rm == 15)
+                        goto unimpl;
+                    emit_mov_x86reg_armreg(ECX, i.rm);
                 }
-                if (insn & 0x0080000) mask |= 0xFF000000;
-                if (insn & 0x0040000) mask |= 0x00FF0000;
-                if (insn & 0x0020000) mask |= 0x0000FF00;
-                if (insn & 0x0010000) mask |= 0x000000FF;
-                emit_mov_x86reg_immediate(EDX, mask);
-                emit_call(insn & 0x0400000 ? (uint32_t)set_spsr : (uint32_t)set_cpsr);
+                emit_mov_x86reg_immediate(EDX, i.mask);
+                emit_call(i.spsr ? (uint32_t)set_spsr : (uint32_t)set_cpsr);
                 // If cpsr_c changed, leave translation to check for interrupts
-                if ((insn & 0x0410000) == 0x0010000) {
+                if (!i.spsr && i.mask & 0xFF) {
                     emit_mov_x86reg_immediate(EAX, pc + 4);
                     emit_jump((uint32_t)translation_next);
                 }
-            } else if ((insn & 0xFFF0FF0) == 0x16F0F10) {
+                break;
+
+            case AI_CLZ:
                 /* CLZ: Count leading zeros */
-                int src_reg = insn & 15;
-                int dst_reg = insn >> 12 & 15;
-                if (src_reg == 15 || dst_reg == 15)
-                    break;
+                if (i.rm == 15 || i.rd == 15)
+                    goto unimpl;
                 emit_word(0xBD0F); // BSR
-                emit_modrm_armreg(EAX, src_reg);
+                emit_modrm_armreg(EAX, i.rm);
                 emit_word(5 << 8 | JNZ);
                 emit_mov_x86reg_immediate(EAX, 63);
                 emit_alu_x86reg_immediate(XOR, EAX, 31);
-                emit_mov_armreg_x86reg(dst_reg, EAX);
-            } else {
+                emit_mov_armreg_x86reg(i.rd, EAX);
                 break;
-            }
-        } else if ((insn & 0xC000000) == 0) {
-            /* Data processing instructions */
-            int right_reg = insn & 15;
-            int dest_reg = insn >> 12 & 15;
-            int left_reg = insn >> 16 & 15;
-            int setcc = insn >> 20 & 1;
-            int op = insn >> 21 & 15;
-
-            if (dest_reg == 15 || left_reg == 15)
-                break; // not dealing with this for now
-
-            int set_overflow = -1;
-            int set_carry = -1;
-            int right_is_imm = insn >> 25 & 1;
-            int right_is_reg = 0;
-            uint32_t imm = 0; // value not used, just suppressing uninitialized variable warning
-            if (right_is_imm) {
-                // Right operand is immediate
-                imm = insn & 0xFF;
-                int rotate = insn >> 7 & 30;
-                imm = imm >> rotate | imm << (32 - rotate);
-                if (rotate != 0)
-                    set_carry = imm >> 31;
-            } else if (right_reg == 15) {
-                if (insn & 0xFF0) // Shifted PC?! Not likely.
-                    goto unimpl;
-                imm = pc + 8;
-                right_is_imm = 1;
-            } else {
-                int shift_type = insn >> 5 & 3;
-                static const uint8_t shift_table[] = { SHL, SHR, SAR, ROR };
-                int x86_shift_type = shift_table[shift_type];
-
-                int count = insn >> 7 & 31;
-                int shift_need_carry = setcc & (0xF303 >> op & 1);
-
-                if (insn & (1 << 4)) {
-                    if (insn & (1 << 7))
-                        goto unimpl;
-                    /* Register shifted by register.
-                     * ARM's shifts are very different from x86's, unfortunately.
-                     * In x86, only 5 bits of the shift count are used.
-                     * In ARM, 8 bits are used. To implement ARM shifts on x86,
-                     * one must check for the 32-255 cases explicitly.
-                     * This is done in asmcode.S */
-
-                    int shift_reg = count >> 1;
-                    if (shift_reg == 15)
-                        goto unimpl;
 
-                    emit_mov_x86reg_armreg(ECX, shift_reg);
-                    if (shift_type == 3 && !shift_need_carry) {
-                        /* Ignoring flags, ARM's ROR is the same as x86's :) */
-                        count = SHIFT_BY_CL;
-                        goto simple_shift;
-                    }
+            case AI_DATA: {
+                /* Data processing instructions */
+                int right_reg = i.rm;
+                int dest_reg = i.rd;
+                int left_reg = i.rn;
+                int setcc = i.s;
+                int op = i.op;
+
+                if (dest_reg == 15 || left_reg == 15)
+                    goto unimpl; // not dealing with this for now
+
+                int set_overflow = -1;
+                int set_carry = -1;
+                int right_is_imm = 0;
+                int right_is_reg = 0;
+                uint32_t imm = i.imm;
+                if (i.operand == AO_IMM) {
+                    // Right operand is immediate (or pc)
+                    right_is_imm = 1;
+                    set_carry = i.imm_carry;
+                } else if (right_reg == 15) {
+                    goto unimpl; // Shifted PC?! Not likely.
+                } else {
+                    static const uint8_t shift_table[] = { SHL, SHR, SAR, ROR };
+                    int x86_shift_type = shift_table[i.shift];
+
+                    int count = i.count;
+                    int shift_need_carry = setcc & (0xF303 >> op & 1);
+
+                    if (i.operand == AO_SHIFT_REG) {
+                        /* Register shifted by register.
+                         * ARM's shifts are very different from x86's, unfortunately.
+                         * In x86, only 5 bits of the shift count are used.
+                         * In ARM, 8 bits are used. To implement ARM shifts on x86,
+                         * one must check for the 32-255 cases explicitly.
+                         * This is done in asmcode.S */
+                        if (i.rs == 15)
+                            goto unimpl;
+
+                        emit_mov_x86reg_armreg(ECX, i.rs);
+                        if (i.shift == SHIFT_ROR && !shift_need_carry) {
+                            /* Ignoring flags, ARM's ROR is the same as x86's :) */
+                            count = SHIFT_BY_CL;
+                            goto simple_shift;
+                        }
 
-                    emit_mov_x86reg_armreg(EAX, right_reg);
-                    emit_call(arm_shift_proc[shift_need_carry][shift_type]);
-                    shift_need_carry = 0; /* Already set by the function */
-                } else if (count == 0) {
-                    if (shift_type == 0) {
+                        emit_mov_x86reg_armreg(EAX, right_reg);
+                        emit_call(arm_shift_proc[shift_need_carry][i.shift]);
+                        shift_need_carry = 0; /* Already set by the function */
+                    } else if (i.operand == AO_REG) {
                         /* Right operand is just an ARM register */
                         right_is_reg = 1;
                         shift_need_carry = 0;
-                    } else if (shift_type == 1) {
+                    } else if (i.operand == AO_RRX) {
+                        /* RRX */
+                        emit_mov_x86reg8_immediate(AL, 0);
+                        emit_alu_x86reg8_flag(CMP, AL, &arm.cpsr_c);
+                        x86_shift_type = RCR;
+                        count = 1;
+                        goto simple_shift;
+                    } else if (count == 32 && i.shift == SHIFT_LSR) {
                         /* LSR #32 */
                         if (shift_need_carry) {
                             emit_mov_x86reg_armreg(EAX, right_reg);
@@ -544,353 +548,338 @@ no_condition:
                         }
                         imm = 0;
                         right_is_imm = 1;
-                    } else if (shift_type == 2) {
+                    } else if (count == 32) {
                         /* ASR #32 */
                         emit_mov_x86reg_armreg(EAX, right_reg);
                         emit_shift_x86reg(SAR, EAX, 31);
                         if (shift_need_carry)
                             emit_shift_x86reg(SAR, EAX, 1);
-                    } else if (shift_type == 3) {
-                        /* RRX */
-                        emit_mov_x86reg8_immediate(AL, 0);
-                        emit_alu_x86reg8_flag(CMP, AL, &arm.cpsr_c);
-                        x86_shift_type = RCR;
-                        count = 1;
-                        goto simple_shift;
-                    }
-                } else {
-simple_shift:
-                    if (dest_reg == right_reg && op == 13) {
-                        /* MOV of a shifted register to itself. Do shift in-place */
-                        emit_shift_armreg(x86_shift_type, dest_reg, count);
-                        right_is_reg = 1;
                     } else {
-                        emit_mov_x86reg_armreg(EAX, right_reg);
-                        emit_shift_x86reg(x86_shift_type, EAX, count);
+simple_shift:
+                        if (dest_reg == right_reg && op == 13) {
+                            /* MOV of a shifted register to itself. Do shift in-place */
+                            emit_shift_armreg(x86_shift_type, dest_reg, count);
+                            right_is_reg = 1;
+                        } else {
+                            emit_mov_x86reg_armreg(EAX, right_reg);
+                            emit_shift_x86reg(x86_shift_type, EAX, count);
+                        }
                     }
+                    if (shift_need_carry)
+                        emit_setcc_flag(SETB, &arm.cpsr_c);
                 }
-                if (shift_need_carry)
-                    emit_setcc_flag(SETB, &arm.cpsr_c);
-            }
 
-            if (op == 13 || op == 15) {
-                if (right_is_imm) {
-                    if (op == 15)
-                        imm = ~imm;
-                    emit_mov_armreg_immediate(dest_reg, imm);
-                    if (setcc)
-                        goto unimpl;
-                } else if (right_is_reg && dest_reg == right_reg) {
-                    /* MOV/MVN of a register to itself */
-                    if (op == 15) {
+                if (op == 13 || op == 15) {
+                    if (right_is_imm) {
+                        if (op == 15)
+                            imm = ~imm;
+                        emit_mov_armreg_immediate(dest_reg, imm);
                         if (setcc)
-                            emit_alu_armreg_immediate(XOR, dest_reg, -1);
-                        else
-                            emit_unary_armreg(NOT, dest_reg);
+                            goto unimpl;
+                    } else if (right_is_reg && dest_reg == right_reg) {
+                        /* MOV/MVN of a register to itself */
+                        if (op == 15) {
+                            if (setcc)
+                                emit_alu_armreg_immediate(XOR, dest_reg, -1);
+                            else
+                                emit_unary_armreg(NOT, dest_reg);
+                        } else {
+                            if (setcc)
+                                emit_alu_armreg_immediate(CMP, dest_reg, 0);
+                        }
                     } else {
+                        if (right_is_reg)
+                            emit_mov_x86reg_armreg(EAX, right_reg);
+                        if (op == 15)
+                            emit_unary_x86reg(NOT, EAX);
+                        emit_mov_armreg_x86reg(dest_reg, EAX);
                         if (setcc)
-                            emit_alu_armreg_immediate(CMP, dest_reg, 0);
+                            emit_test_x86reg_x86reg(EAX, EAX);
                     }
-                } else {
-                    if (right_is_reg)
-                        emit_mov_x86reg_armreg(EAX, right_reg);
-                    if (op == 15)
-                        emit_unary_x86reg(NOT, EAX);
-                    emit_mov_armreg_x86reg(dest_reg, EAX);
-                    if (setcc)
-                        emit_test_x86reg_x86reg(EAX, EAX);
-                }
-            } else if (op == 8) { // TST
-                if (right_is_imm) {
-                    emit_test_armreg_immediate(left_reg, imm);
-                } else {
-                    if (right_is_reg)
-                        emit_mov_x86reg_armreg(EAX, right_reg);
-                    emit_test_armreg_x86reg(left_reg, EAX);
-                }
-            } else if (op == 10) { // CMP
-                if (right_is_imm) {
-                    emit_alu_armreg_immediate(CMP, left_reg, imm);
-                } else {
-                    if (right_is_reg)
-                        emit_mov_x86reg_armreg(EAX, right_reg);
-                    emit_alu_armreg_x86reg(CMP, left_reg, EAX);
-                }
-                set_overflow = SETO;
-                set_carry = SETAE;
-            } else if (op == 9 || op == 11) { // TEQ, CMN
-                int aluop;
-                if (op == 9) { aluop = XOR; }
-                else         { aluop = ADD; set_overflow = SETO; set_carry = SETB; }
-
-                if (right_is_imm) {
-                    emit_mov_x86reg_armreg(EAX, left_reg);
-                    emit_alu_x86reg_immediate(aluop, EAX, imm);
-                } else {
-                    if (right_is_reg)
-                        emit_mov_x86reg_armreg(EAX, right_reg);
-                    emit_alu_x86reg_armreg(aluop, EAX, left_reg);
-                }
-            } else {
-                int aluop;
-                enum { LR = 1, RL = 2 } direction;
-
-                if      (op == 0)  { aluop = AND; direction = LR | RL; }
-                else if (op == 1)  { aluop = XOR; direction = LR | RL; }
-                else if (op == 2)  { aluop = SUB; direction = LR;      set_overflow = SETO; set_carry = SETAE; }
-                else if (op == 3)  { aluop = SUB; direction = RL;      set_overflow = SETO; set_carry = SETAE; }
-                else if (op == 4)  { aluop = ADD; direction = LR | RL; set_overflow = SETO; set_carry = SETB; }
-                else if (op == 5)  { aluop = ADC; direction = LR | RL; set_overflow = SETO; set_carry = SETB; }
-                else if (op == 6)  { aluop = SBB; direction = LR;      set_overflow = SETO; set_carry = SETAE; }
-                else if (op == 7)  { aluop = SBB; direction = RL;      set_overflow = SETO; set_carry = SETAE; }
-                else if (op == 12) { aluop = OR;  direction = LR | RL; }
-                else {
-                    // Convert BIC to AND
+                } else if (op == 8) { // TST
                     if (right_is_imm) {
-                        imm = ~imm;
+                        emit_test_armreg_immediate(left_reg, imm);
                     } else {
-                        if (right_is_reg) {
+                        if (right_is_reg)
                             emit_mov_x86reg_armreg(EAX, right_reg);
-                            right_is_reg = 0;
-                        }
-                        emit_unary_x86reg(NOT, EAX);
+                        emit_test_armreg_x86reg(left_reg, EAX);
                     }
-                    aluop = AND; direction = LR | RL;
-                }
-
-                if (aluop == ADC) {
-                    emit_mov_x86reg8_immediate(CL, 0);
-                    emit_alu_x86reg8_flag(CMP, CL, &arm.cpsr_c);
-                } else if (aluop == SBB) {
-                    emit_cmp_flag_immediate(&arm.cpsr_c, 1);
-                }
+                } else if (op == 10) { // CMP
+                    if (right_is_imm) {
+                        emit_alu_armreg_immediate(CMP, left_reg, imm);
+                    } else {
+                        if (right_is_reg)
+                            emit_mov_x86reg_armreg(EAX, right_reg);
+                        emit_alu_armreg_x86reg(CMP, left_reg, EAX);
+                    }
+                    set_overflow = SETO;
+                    set_carry = SETAE;
+                } else if (op == 9 || op == 11) { // TEQ, CMN
+                    int aluop;
+                    if (op == 9) { aluop = XOR; }
+                    else         { aluop = ADD; set_overflow = SETO; set_carry = SETB; }
 
-                int reg_out = EAX;
-                if (dest_reg == left_reg && (direction & LR)) {
                     if (right_is_imm) {
-                        emit_alu_armreg_immediate(aluop, dest_reg, imm);
+                        emit_mov_x86reg_armreg(EAX, left_reg);
+                        emit_alu_x86reg_immediate(aluop, EAX, imm);
                     } else {
                         if (right_is_reg)
                             emit_mov_x86reg_armreg(EAX, right_reg);
-                        emit_alu_armreg_x86reg(aluop, dest_reg, EAX);
+                        emit_alu_x86reg_armreg(aluop, EAX, left_reg);
                     }
-                } else if (right_is_reg && dest_reg == right_reg && (direction & RL)) {
-                    emit_mov_x86reg_armreg(EAX, left_reg);
-                    emit_alu_armreg_x86reg(aluop, dest_reg, EAX);
                 } else {
-                    if (right_is_imm) {
-                        if (direction & LR) {
-                            emit_mov_x86reg_armreg(EAX, left_reg);
-                            emit_alu_x86reg_immediate(aluop, EAX, imm);
+                    int aluop;
+                    enum { LR = 1, RL = 2 } direction;
+
+                    if      (op == 0)  { aluop = AND; direction = LR | RL; }
+                    else if (op == 1)  { aluop = XOR; direction = LR | RL; }
+                    else if (op == 2)  { aluop = SUB; direction = LR;      set_overflow = SETO; set_carry = SETAE; }
+                    else if (op == 3)  { aluop = SUB; direction = RL;      set_overflow = SETO; set_carry = SETAE; }
+                    else if (op == 4)  { aluop = ADD; direction = LR | RL; set_overflow = SETO; set_carry = SETB; }
+                    else if (op == 5)  { aluop = ADC; direction = LR | RL; set_overflow = SETO; set_carry = SETB; }
+                    else if (op == 6)  { aluop = SBB; direction = LR;      set_overflow = SETO; set_carry = SETAE; }
+                    else if (op == 7)  { aluop = SBB; direction = RL;      set_overflow = SETO; set_carry = SETAE; }
+                    else if (op == 12) { aluop = OR;  direction = LR | RL; }
+                    else {
+                        // Convert BIC to AND
+                        if (right_is_imm) {
+                            imm = ~imm;
                         } else {
-                            if (aluop == SUB && imm == 0) {
-                                if (dest_reg == left_reg) {
-                                    /* RSB reg, reg, 0 is like x86's NEG */
-                                    emit_unary_armreg(NEG, left_reg);
-                                    goto data_proc_done;
-                                }
-                                emit_alu_x86reg_x86reg(XOR, EAX, EAX);
-                            } else {
-                                emit_mov_x86reg_immediate(EAX, imm);
+                            if (right_is_reg) {
+                                emit_mov_x86reg_armreg(EAX, right_reg);
+                                right_is_reg = 0;
                             }
-                            emit_alu_x86reg_armreg(aluop, EAX, left_reg);
+                            emit_unary_x86reg(NOT, EAX);
                         }
-                    } else if (right_is_reg) {
-                        if (direction & LR) {
-                            emit_mov_x86reg_armreg(EAX, left_reg);
-                            emit_alu_x86reg_armreg(aluop, EAX, right_reg);
+                        aluop = AND; direction = LR | RL;
+                    }
+
+                    if (aluop == ADC) {
+                        emit_mov_x86reg8_immediate(CL, 0);
+                        emit_alu_x86reg8_flag(CMP, CL, &arm.cpsr_c);
+                    } else if (aluop == SBB) {
+                        emit_cmp_flag_immediate(&arm.cpsr_c, 1);
+                    }
+
+                    int reg_out = EAX;
+                    if (dest_reg == left_reg && (direction & LR)) {
+                        if (right_is_imm) {
+                            emit_alu_armreg_immediate(aluop, dest_reg, imm);
                         } else {
-                            emit_mov_x86reg_armreg(EAX, right_reg);
-                            emit_alu_x86reg_armreg(aluop, EAX, left_reg);
+                            if (right_is_reg)
+                                emit_mov_x86reg_armreg(EAX, right_reg);
+                            emit_alu_armreg_x86reg(aluop, dest_reg, EAX);
                         }
+                    } else if (right_is_reg && dest_reg == right_reg && (direction & RL)) {
+                        emit_mov_x86reg_armreg(EAX, left_reg);
+                        emit_alu_armreg_x86reg(aluop, dest_reg, EAX);
                     } else {
-                        if (direction & RL) {
-                            emit_alu_x86reg_armreg(aluop, EAX, left_reg);
+                        if (right_is_imm) {
+                            if (direction & LR) {
+                                emit_mov_x86reg_armreg(EAX, left_reg);
+                                emit_alu_x86reg_immediate(aluop, EAX, imm);
+                            } else {
+                                if (aluop == SUB && imm == 0) {
+                                    if (dest_reg == left_reg) {
+                                        /* RSB reg, reg, 0 is like x86's NEG */
+                                        emit_unary_armreg(NEG, left_reg);
+                                        goto data_proc_done;
+                                    }
+                                    emit_alu_x86reg_x86reg(XOR, EAX, EAX);
+                                } else {
+                                    emit_mov_x86reg_immediate(EAX, imm);
+                                }
+                                emit_alu_x86reg_armreg(aluop, EAX, left_reg);
+                            }
+                        } else if (right_is_reg) {
+                            if (direction & LR) {
+                                emit_mov_x86reg_armreg(EAX, left_reg);
+                                emit_alu_x86reg_armreg(aluop, EAX, right_reg);
+                            } else {
+                                emit_mov_x86reg_armreg(EAX, right_reg);
+                                emit_alu_x86reg_armreg(aluop, EAX, left_reg);
+                            }
                         } else {
-                            emit_mov_x86reg_armreg(EDX, left_reg);
-                            emit_alu_x86reg_x86reg(aluop, EDX, EAX);
-                            reg_out = EDX;
+                            if (direction & RL) {
+                                emit_alu_x86reg_armreg(aluop, EAX, left_reg);
+                            } else {
+                                emit_mov_x86reg_armreg(EDX, left_reg);
+                                emit_alu_x86reg_x86reg(aluop, EDX, EAX);
+                                reg_out = EDX;
+                            }
                         }
+                        emit_mov_armreg_x86reg(dest_reg, reg_out);
                     }
-                    emit_mov_armreg_x86reg(dest_reg, reg_out);
                 }
-            }
 data_proc_done:
-            if (setcc) {
-                emit_setcc_flag(SETS, &arm.cpsr_n);
-                emit_setcc_flag(SETZ, &arm.cpsr_z);
-                if (set_carry >= 0) {
-                    if (set_carry < 2)
-                        emit_mov_flag_immediate(&arm.cpsr_c, set_carry);
-                    else
-                        emit_setcc_flag(set_carry, &arm.cpsr_c);
+                if (setcc) {
+                    emit_setcc_flag(SETS, &arm.cpsr_n);
+                    emit_setcc_flag(SETZ, &arm.cpsr_z);
+                    if (set_carry >= 0) {
+                        if (set_carry < 2)
+                            emit_mov_flag_immediate(&arm.cpsr_c, set_carry);
+                        else
+                            emit_setcc_flag(set_carry, &arm.cpsr_c);
+                    }
+                    if (set_overflow >= 0)
+                        emit_setcc_flag(set_overflow, &arm.cpsr_v);
                 }
-                if (set_overflow >= 0)
-                    emit_setcc_flag(set_overflow, &arm.cpsr_v);
-            }
-        } else if ((insn & 0xC000000) == 0x4000000) {
-            /* Byte/word memory access */
-            int post_index = !(insn & (1 << 24));
-            int offset_op = (insn & (1 << 23)) ? ADD : SUB;
-            int is_byteop = insn & (1 << 22);
-            int pre_index = insn & (1 << 21);
-            int is_load   = insn & (1 << 20);
-            int base_reg = insn >> 16 & 15;
-            int data_reg = insn >> 12 & 15;
-
-            if (pre_index || post_index) {
-                if (pre_index && post_index) break;
-                if (base_reg == 15) break;
-                if (is_load && base_reg == data_reg) break;
+                break;
             }
 
-            if (insn & (1 << 25)) {
-                // Offset is register
+            case AI_LS: {
+                /* Byte/word memory access */
+                int offset_op = i.up ? ADD : SUB;
+                int base_reg = i.rn;
+                int data_reg = i.rd;
 
-                int offset_reg = insn & 15;
-                int shift_type = insn >> 5 & 3;
-                static const uint8_t shift_table[] = { SHL, SHR, SAR, ROR };
-                int count;
+                if (i.writeback) {
+                    if (i.user) goto unimpl;
+                    if (base_reg == 15) goto unimpl;
+                    if (i.load && base_reg == data_reg) goto unimpl;
+                }
 
-                if (insn & (1 << 4))
-                    // reg shifted by reg
-                    break;
+                if (i.operand != AO_IMM) {
+                    // Offset is register, shifted by immediate
+                    static const uint8_t shift_table[] = { SHL, SHR, SAR, ROR };
 
-                // reg shifted by immediate
-                count = insn >> 7 & 31;
-                if (count == 0 && shift_type != 0)
-                    break; // special shift
+                    if (i.operand == AO_RRX || i.count == 32)
+                        goto unimpl; // special shift
 
-                if (base_reg == 15)
-                    emit_mov_x86reg_immediate(ECX, pc + 8);
-                else
-                    emit_mov_x86reg_armreg(ECX, base_reg);
+                    if (base_reg == 15)
+                        emit_mov_x86reg_immediate(ECX, pc + 8);
+                    else
+                        emit_mov_x86reg_armreg(ECX, base_reg);
 
-                if (count == 0 && !pre_index && !post_index) {
-                    emit_alu_x86reg_armreg(offset_op, ECX, offset_reg);
+                    if (i.operand == AO_REG && !i.writeback) {
+                        emit_alu_x86reg_armreg(offset_op, ECX, i.rm);
+                    } else {
+                        emit_mov_x86reg_armreg(EDI, i.rm);
+                        emit_shift_x86reg(shift_table[i.shift], EDI, i.count);
+                        if (i.pre)
+                            emit_alu_x86reg_x86reg(offset_op, ECX, EDI);
+                    }
                 } else {
-                    emit_mov_x86reg_armreg(EDI, offset_reg);
-                    emit_shift_x86reg(shift_table[shift_type], EDI, count);
-                    if (!post_index)
-                        emit_alu_x86reg_x86reg(offset_op, ECX, EDI);
+                    // Offset is immediate
+                    int offset = i.imm;
+                    if (base_reg == 15) {
+                        if (offset_op == SUB)
+                            offset = -offset;
+                        emit_mov_x86reg_immediate(ECX, pc + 8 + offset);
+                    } else {
+                        emit_mov_x86reg_armreg(ECX, base_reg);
+                        if (offset != 0 && i.pre)
+                            emit_alu_x86reg_immediate(offset_op, ECX, offset);
+                    }
                 }
-            } else {
-                // Offset is immediate
-                int offset = insn & 0xFFF;
-                if (base_reg == 15) {
-                    if (offset_op == SUB)
-                        offset = -offset;
-                    emit_mov_x86reg_immediate(ECX, pc + 8 + offset);
+
+                if (i.load) {
+                    /* LDR/LDRB instruction */
+                    emit_call(i.byte ? (uint32_t)read_byte : (uint32_t)read_word_ldr);
+                    if (data_reg != 15)
+                        emit_mov_armreg_x86reg(data_reg, EAX);
                 } else {
-                    emit_mov_x86reg_armreg(ECX, base_reg);
-                    if (offset != 0 && !post_index)
-                        emit_alu_x86reg_immediate(offset_op, ECX, offset);
+                    /* STR/STRB instruction */
+                    if (data_reg == 15)
+                        emit_mov_x86reg_immediate(EDX, pc + 12);
+                    else
+                        emit_mov_x86reg_armreg(EDX, data_reg);
+                    emit_call(i.byte ? (uint32_t)write_byte : (uint32_t)write_word);
                 }
-            }
 
-            if (is_load) {
-                /* LDR/LDRB instruction */
-                emit_call(is_byteop ? (uint32_t)read_byte : (uint32_t)read_word_ldr);
-                if (data_reg != 15)
-                    emit_mov_armreg_x86reg(data_reg, EAX);
-            } else {
-                /* STR/STRB instruction */
-                if (data_reg == 15)
-                    emit_mov_x86reg_immediate(EDX, pc + 12);
-                else
-                    emit_mov_x86reg_armreg(EDX, data_reg);
-                emit_call(is_byteop ? (uint32_t)write_byte : (uint32_t)write_word);
-            }
-
-            if (pre_index || post_index) { // Writeback
-                if (insn & (1 << 25)) // Register offset
-                    emit_alu_armreg_x86reg(offset_op, base_reg, EDI);
-                else // Immediate offset
-                    emit_alu_armreg_immediate(offset_op, base_reg, insn & 0xFFF);
-            }
+                if (i.writeback) {
+                    if (i.operand != AO_IMM) // Register offset
+                        emit_alu_armreg_x86reg(offset_op, base_reg, EDI);
+                    else // Immediate offset
+                        emit_alu_armreg_immediate(offset_op, base_reg, i.imm);
+                }
 
-            if (is_load && data_reg == 15) {
-                emit_jump((uint32_t)translation_next_bx);
-                stop_here = 1;
+                if (i.load && data_reg == 15) {
+                    emit_jump((uint32_t)translation_next_bx);
+                    stop_here = 1;
+                }
+                break;
             }
-        } else if ((insn & 0xE000000) == 0x8000000) {
-            /* Load/store multiple */
-            int writeback = insn & (1 << 21);
-            int load      = insn & (1 << 20);
-            int reg, offset, wb_offset, count;
-            bool loaded_addr_reg = false;
-
-            if (insn & (1 << 22)) // restore CPSR, or use umode regs
-                goto unimpl;
 
-            int addr_reg = insn >> 16 & 15;
-            if (addr_reg == 15)
-                goto unimpl;
+            case AI_LSM: {
+                /* Load/store multiple */
+                int addr_reg = i.rn;
+                int reg, offset, wb_offset, count;
+                bool loaded_addr_reg = false;
 
-            if (writeback && load && insn & (1 << addr_reg))
-                goto unimpl;
+                if (i.user) // restore CPSR, or use umode regs
+                    goto unimpl;
+                if (addr_reg == 15)
+                    goto unimpl;
+                if (i.writeback && i.load && i.reglist & (1 << addr_reg))
+                    goto unimpl;
 
-            for (reg = count = 0; reg < 16; reg++)
-                count += (insn >> reg & 1);
+                for (reg = count = 0; reg < 16; reg++)
+                    count += (i.reglist >> reg & 1);
+
+                if (i.up) { /* Increasing */
+                    wb_offset = count * 4;
+                    offset = 0;
+                    if (i.pre) // Preincrement
+                        offset += 4;
+                } else { /* Decreasing */
+                    wb_offset = count * -4;
+                    offset = wb_offset;
+                    if (!i.pre) // Postdecrement
+                        offset += 4;
+                }
 
-            if (insn & (1 << 23)) { /* Increasing */
-                wb_offset = count * 4;
-                offset = 0;
-                if (insn & (1 << 24)) // Preincrement
-                    offset += 4;
-            } else { /* Decreasing */
-                wb_offset = count * -4;
-                offset = wb_offset;
-                if (!(insn & (1 << 24))) // Postdecrement
+                emit_mov_x86reg_armreg(ESI, addr_reg);
+                for (reg = 0; reg < 16; reg++) {
+                    if (!(i.reglist >> reg & 1))
+                        continue;
+                    emit_byte(0x8D); // LEA
+                    emit_modrm_base_offset(ECX, ESI, offset);
+                    if (i.load) {
+                        emit_call((uint32_t)read_word);
+                        if (reg == addr_reg && i.reglist >> reg > 1) {
+                            // Loading the address register, but there are still more
+                            // registers to go. In case they cause a data abort, don't
+                            // write to register yet; save it to EDI
+                            emit_mov_x86reg_x86reg(EDI, EAX);
+                            loaded_addr_reg = true;
+                        } else if (reg != 15)
+                            emit_mov_armreg_x86reg(reg, EAX);
+                    } else {
+                        if (reg == 15)
+                            emit_mov_x86reg_immediate(EDX, pc + 12);
+                        else
+                            emit_mov_x86reg_armreg(EDX, reg);
+                        emit_call((uint32_t)write_word);
+                    }
                     offset += 4;
-            }
-
-            emit_mov_x86reg_armreg(ESI, addr_reg);
-            for (reg = 0; reg < 16; reg++) {
-                if (!(insn >> reg & 1))
-                    continue;
-                emit_byte(0x8D); // LEA
-                emit_modrm_base_offset(ECX, ESI, offset);
-                if (load) {
-                    emit_call((uint32_t)read_word);
-                    if (reg == addr_reg && (insn & -1 << reg & 0xFFFF)) {
-                        // Loading the address register, but there are still more
-                        // registers to go. In case they cause a data abort, don't
-                        // write to register yet; save it to EDI
-                        emit_mov_x86reg_x86reg(EDI, EAX);
-                        loaded_addr_reg = true;
-                    } else if (reg != 15)
-                        emit_mov_armreg_x86reg(reg, EAX);
-                } else {
-                    if (reg == 15)
-                        emit_mov_x86reg_immediate(EDX, pc + 12);
-                    else
-                        emit_mov_x86reg_armreg(EDX, reg);
-                    emit_call((uint32_t)write_word);
                 }
-                offset += 4;
-            }
 
-            if (writeback)
-                emit_alu_armreg_immediate(ADD, addr_reg, wb_offset);
+                if (i.writeback)
+                    emit_alu_armreg_immediate(ADD, addr_reg, wb_offset);
 
-            if (loaded_addr_reg)
-                emit_mov_armreg_x86reg(addr_reg, EDI);
+                if (loaded_addr_reg)
+                    emit_mov_armreg_x86reg(addr_reg, EDI);
 
-            if (insn & (1 << 15) && load) {
-                // LDM with PC
-                emit_jump((uint32_t)translation_next_bx);
-                stop_here = 1;
+                if (i.reglist & 0x8000 && i.load) {
+                    // LDM with PC
+                    emit_jump((uint32_t)translation_next_bx);
+                    stop_here = 1;
+                }
+                break;
             }
-        } else if ((insn & 0xE000000) == 0xA000000) {
-            /* Branch, branch-and-link */
-            if (insn & (1 << 24))
-                emit_mov_armreg_immediate(14, pc + 4);
-            emit_mov_x86reg_immediate(EAX, pc + 8 + ((int32_t)insn << 8 >> 6));
-            emit_jump((uint32_t)translation_next);
-            stop_here = 1;
-        } else {
-            break;
+
+            case AI_BRANCH:
+                /* Branch, branch-and-link */
+                if (i.link)
+                    emit_mov_armreg_immediate(14, pc + 4);
+                emit_mov_x86reg_immediate(EAX, i.imm);
+                emit_jump((uint32_t)translation_next);
+                stop_here = 1;
+                break;
+
+            default:
+                goto unimpl;
         }
 
         /* Fill in the conditional jump offset */
@@ -915,6 +904,7 @@ data_proc_done:
 unimpl:
     out = insn_start;
     RAM_FLAGS(insnp) |= RF_CODE_NO_TRANSLATE;
+    tcache_stats.unimpl[arm_unimpl_class(*insnp)]++;
 branch_conditional:
     emit_mov_x86reg_immediate(EAX, pc);
     emit_jump((uint32_t)translation_next);
@@ -928,14 +918,20 @@ branch_unconditional:
     translation_table[index].start_ptr  = start_insnp;
     translation_table[index].end_ptr    = insnp;
 
+    perf_map_block(insn_bufptr, out - insn_bufptr, start_pc, false);
+    tcache_stats.blocks++;
+    tcache_stats.block_insns += insnp - start_insnp;
+    tcache_stats.block_bytes += out - insn_bufptr;
     insn_bufptr = out;
     jtbl_bufptr = outj;
 
     return index;
 }
 
-void flush_translations() {
+void flush_translations(int cause) {
     int index;
+    tcache_stats.flushes++;
+    tcache_stats.flush_causes[cause]++;
     for (index = 0; index < next_index; index++) {
         uint32_t *start = translation_table[index].start_ptr;
         uint32_t *end   = translation_table[index].end_ptr;
@@ -947,13 +943,16 @@ void flush_translations() {
     jtbl_bufptr = jtbl_buffer;
 }
 
+// Translations are not linked to each other here
+void unlink_translations() {}
+
 void invalidate_translation(int index) {
     if (in_translation_esp) {
         uint32_t flags = RAM_FLAGS(in_translation_pc_ptr);
         if ((flags & RF_CODE_TRANSLATED) && (int)(flags >> RFS_TRANSLATION_INDEX) == index)
             error("Cannot modify currently executing code block.");
     }
-    flush_translations();
+    flush_translations(TF_SMC);
 }
 
 void fix_pc_for_fault() {
@@ -1,4 +1,7 @@
 #include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "emu.h"
 #include "mem.h"
@@ -6,15 +9,24 @@
 #include "asmcode.h"
 #include "translate.h"
 #include "debug.h"
+#include "translate_common.h"
+#include "mmu.h"
+#include "sha256.h"
+#include "perfmap.h"
+
+#ifdef __linux__
+#include <elf.h>
+#include <sys/auxv.h>
+#endif
 
 extern void translation_enter() __asm__("translation_enter");
 extern void translation_next() __asm__("translation_next");
 extern void translation_next_bx() __asm__("translation_next_bx");
+extern void translation_next_link() __asm__("translation_next_link");
 extern uintptr_t arm_shift_proc[2][4] __asm__("arm_shift_proc");
 void **in_translation_rsp __asm__("in_translation_rsp");
 void *in_translation_pc_ptr __asm__("in_translation_pc_ptr");
 
-#define MAX_TRANSLATIONS 262144
 struct translation translation_table[MAX_TRANSLATIONS];
 
 static int next_index = 0;
@@ -22,31 +34,133 @@ uint8_t *insn_buffer = NULL;
 uint8_t *insn_bufptr = NULL;
 static uint8_t *jtbl_buffer[500000];
 static uint8_t **jtbl_bufptr = jtbl_buffer;
-static uint8_t *out;
-static uint8_t **outj;
+// Code of the instruction behind each jump table entry, even if the entry points to a stub
+static uint8_t *jtbl_code[500000];
+static uint8_t *out;  // in the staging area
+static uint8_t **outj; // in stage_jtbl
+#define JTBL_SIZE (sizeof jtbl_buffer / sizeof *jtbl_buffer)
+
+uint32_t tcache_code_limit = INSN_BUFFER_SIZE;
+uint32_t tcache_block_limit = MAX_TRANSLATIONS;
+uint32_t block_max_pages = 4;
+struct tcache_stats tcache_stats;
+uint64_t tcache_dispatches;
+// Upper bounds on the code of one instruction (with its exits) and one entry stub
+#define MAX_INSN_CODE 0x2000
+#define MAX_STUB_CODE 0x60
+
+/* Exits to a fixed address are linked directly to the target's code once it
+ * has been translated. Until then they call translation_next_link. */
+struct translation_exit {
+    uint8_t *jump;         // call translation_next_link, or jmp to the target
+    uint8_t *host_ptr_imm; // immediate: target's host address, for in_translation_pc_ptr
+    uint8_t *cycles_imm;   // immediate: cycles to charge for the target block
+    uint32_t target_pc;
+    int target;            // index of the linked translation, or -1
+    bool cross_page;       // link depends on the virtual memory mapping
+    bool listed;           // in cross_page_links, even if unlinked since
+    int in_prev, in_next;  // other exits linked to the same translation, or -1
+};
+#define MAX_EXITS (MAX_TRANSLATIONS * 2)
+static struct translation_exit exits[MAX_EXITS];
+static int committed_exits = 0;
+// The first exit linked to each translation, or -1, so that dropping it only visits those
+static int incoming[MAX_TRANSLATIONS];
+static int cross_page_links[MAX_EXITS];
+static int num_cross_page_links = 0;
+
+/* Indirect branch cache. translation_next looks up the targets of BX,
+ * LDR PC, LDM with PC and unlinked exits here before taking the long way
+ * through addr_cache, RAM_FLAGS and translation_table, and adds what it
+ * finds that way. Entries depend on the virtual memory mapping and on the
+ * translations, so a change to either empties it. */
+struct ibc_entry {
+    uint32_t pc;
+    uint32_t mode;  // (cpsr & 0x20) | 1, so that an empty entry never matches
+    void *insnp;    // for in_translation_pc_ptr
+    void *code;     // jump table entry
+    int32_t cycles; // to the end of the block
+    uint32_t unused;
+};
+#define IBC_SIZE 1024 // as in asmcode_x86_64.S
+struct ibc_entry ibc_table[IBC_SIZE] __asm__("ibc_table");
+
+static void ibc_clear() {
+    memset(ibc_table, 0, sizeof ibc_table);
+}
 
-#define REG_ARG1 EDI
-#define REG_ARG2 ESI
+/* Translations by the 1kB page of RAM holding their first instruction, so
+ * that a write only drops the translations on its page. Lists are linked through page_next; both hold index + 1, or 0 at the end. */
+#define RAM_PAGES (MEM_MAXSIZE >> 10)
+static int page_first[RAM_PAGES];
+static int page_next[MAX_TRANSLATIONS];
 
-enum x86_reg { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI };
-enum x86_reg8 { AL, CL, DL, BL, AH, CH, DH, BH };
-enum group1 { ADD, OR, ADC, SBB, AND, SUB, XOR, CMP };
-enum group2 { ROL, ROR, RCL, RCR, SHL, SHR, SAL, SAR };
-enum group3 { NOT = 2, NEG, MUL, IMUL, DIV, IDIV };
+static inline int ram_page(void *ptr) {
+    return ((uint8_t *)ptr - mem_and_flags) >> 10;
+}
+static uint32_t block_start_pc;
+static uint32_t block_pages; // 1 KB pages the block has entered so far
+
+/* Register allocation. Within a block, ARM registers can be kept in r8-r15,
+ * which are loaded on first use and written back to arm.reg at exits and
+ * before helper calls. r12-r15 survive calls, r8-r11 don't.
+ * The jump table entry of every instruction but the first goes through a
+ * stub loading the registers that the instruction expects. */
+static const uint8_t alloc_order[] = { 12, 13, 14, 15, 8, 9, 10, 11 };
+struct regalloc {
+    int8_t host_reg[15]; // ARM register -> host register, or -1
+    uint16_t dirty;      // ARM registers not yet written back
+};
+static struct regalloc ra;
+static bool in_cond_insn; // only some paths run: don't load registers or defer flags
+enum { REG_READ = 1, REG_WRITE = 2 };
+
+/* Lazy flags. Flags set by an x86 instruction stay in the host EFLAGS until
+ * something would clobber them, so a flag-setting instruction followed by
+ * another that overwrites the same flags costs nothing, and conditions can
+ * often be tested with a single jcc. */
+struct flagstate {
+    uint8_t pending;     // ARM flags not yet stored to arm.cpsr_*
+    uint8_t valid;       // ARM flags that the host EFLAGS hold
+    bool carry_inverted; // C is !CF (set by a subtraction)
+};
+static struct flagstate fl;
+
+// State at the start of each instruction, for entry stubs and rollback
+#define MAX_BLOCK_INSNS 0x800
+static struct {
+    struct regalloc ra;
+    struct flagstate fl;
+} insn_state[MAX_BLOCK_INSNS];
+
+// The block being built: where its code starts, its jump table and exits
+static uint8_t *stage_code;
+static uint8_t *stage_jtbl[MAX_BLOCK_INSNS];
+static uint8_t *stage_jtbl_code[MAX_BLOCK_INSNS];
+#define MAX_STAGE_EXITS (MAX_BLOCK_INSNS * 2)
+static struct translation_exit stage_exits[MAX_STAGE_EXITS];
+static int next_exit;
 
-/* x86 conditional jump instructions */
-enum { JO = 0x70, JNO, JB,  JAE, JZ, JNZ, JBE, JA,
-       JS = 0x78, JNS, JPE, JPO, JL, JGE, JLE, JG };
+#define REG_ARG1 EDI
+#define REG_ARG2 ESI
 
 static inline void emit_byte(uint8_t b)    { *out++ = b; }
 static inline void emit_word(uint16_t w)   { *(uint16_t *)out = w; out += 2; }
 static inline void emit_dword(uint32_t dw) { *(uint32_t *)out = dw; out += 4; }
 
+static void flags_to_memory();
+static void flags_clobber();
+static void emit_flags_store(int flags);
+static void pcache_reloc_text(uint8_t *site, uintptr_t target);
+static void pcache_reloc_ram(uint8_t *site, uint32_t va, void *ptr);
+
 /*This is a hack:
  * -regs not saved
  * -stack not aligned */
 static inline void emit_call_nosave(uintptr_t target) {
+    flags_clobber();
     emit_byte(0xE8);
+    pcache_reloc_text(out, target);
     int64_t diff = target - ((uintptr_t) out + 4);
     if(diff > INT32_MAX || diff < INT32_MIN)
         assert(false); //Distance doesn't fit into immediate
@@ -55,7 +169,13 @@ static inline void emit_call_nosave(uintptr_t target) {
 }
 
 //The AMD64 ABI says that most regs have to be saved by the caller
+static void emit_regs_writeback();
+static void regs_forget(int first_host_reg, int last_host_reg);
+
 static inline void emit_call(uintptr_t target) {
+    emit_regs_writeback();
+    ra.dirty = 0;
+
     //TODO: Verify that %rdi isn't that important to save (it's the first arg)
     //emit_byte(0x57); // push %rdi
     emit_byte(0x56); // push %rsi
@@ -68,10 +188,13 @@ static inline void emit_call(uintptr_t target) {
     emit_byte(0x5a);
     emit_byte(0x5e);
     //emit_byte(0x5f);
+
+    regs_forget(8, 11);
 }
 
-static inline void emit_jump(uintptr_t target) {
+static inline void emit_jump_nosave(uintptr_t target) {
     emit_byte(0xE9);
+    pcache_reloc_text(out, target);
     int64_t diff = target - ((uintptr_t) out + 4);
     if(diff > INT32_MAX || diff < INT32_MIN)
         assert(false);
@@ -79,6 +202,13 @@ static inline void emit_jump(uintptr_t target) {
     emit_dword(diff);
 }
 
+// Leave the block
+static inline void emit_jump(uintptr_t target) {
+    emit_regs_writeback();
+    emit_flags_store(fl.pending);
+    emit_jump_nosave(target);
+}
+
 // ----------------------------------------------------------------------
 
 static inline void emit_modrm_x86reg(int r, int x86reg) {
@@ -97,9 +227,95 @@ static void emit_modrm_base_offset(int r, int basex86reg, int offset) {
     }
 }
 
+static inline int armreg_offset(int armreg) {
+    return (uint8_t *)&arm.reg[armreg] - (uint8_t *)&arm;
+}
+
+static void regs_reset() {
+    memset(ra.host_reg, -1, sizeof ra.host_reg);
+    ra.dirty = 0;
+    in_cond_insn = false;
+    memset(&fl, 0, sizeof fl);
+}
+
+static void regs_forget(int first_host_reg, int last_host_reg) {
+    int armreg;
+    for (armreg = 0; armreg < 15; armreg++) {
+        if (ra.host_reg[armreg] >= first_host_reg && ra.host_reg[armreg] <= last_host_reg) {
+            ra.host_reg[armreg] = -1;
+            ra.dirty &= ~(1 << armreg);
+        }
+    }
+}
+
+static bool regs_allocated(struct regalloc *state) {
+    int armreg;
+    for (armreg = 0; armreg < 15; armreg++)
+        if (state->host_reg[armreg] >= 0)
+            return true;
+    return false;
+}
+
+// mov [arm.reg], r8-r15
+static void emit_regs_writeback() {
+    int armreg;
+    for (armreg = 0; armreg < 15; armreg++) {
+        if (ra.dirty >> armreg & 1) {
+            emit_byte(0x44);
+            emit_byte(0x89);
+            emit_modrm_base_offset(ra.host_reg[armreg] & 7, EBX, armreg_offset(armreg));
+        }
+    }
+}
+
+// mov r8-r15, [arm.reg]
+static void emit_regs_load(struct regalloc *state) {
+    int armreg;
+    for (armreg = 0; armreg < 15; armreg++) {
+        if (state->host_reg[armreg] >= 0) {
+            emit_byte(0x44);
+            emit_byte(0x8B);
+            emit_modrm_base_offset(state->host_reg[armreg] & 7, EBX, armreg_offset(armreg));
+        }
+    }
+}
+
+/* Must be emitted before the opcode of any instruction with an ARM register
+ * operand. Allocates a host register for it if one is free. */
+static void emit_armreg_prefix(int armreg, int access) {
+    if (armreg < 0 || armreg > 14) error("translation f***up");
+    int host_reg = ra.host_reg[armreg];
+    if (host_reg < 0 && !in_cond_insn) {
+        unsigned int i, armreg2;
+        uint8_t used[16] = { 0 };
+        for (armreg2 = 0; armreg2 < 15; armreg2++)
+            if (ra.host_reg[armreg2] >= 0)
+                used[ra.host_reg[armreg2]] = 1;
+        for (i = 0; i < sizeof alloc_order; i++) {
+            if (!used[alloc_order[i]]) {
+                host_reg = ra.host_reg[armreg] = alloc_order[i];
+                if (access & REG_READ) {
+                    emit_byte(0x44);
+                    emit_byte(0x8B);
+                    emit_modrm_base_offset(host_reg & 7, EBX, armreg_offset(armreg));
+                }
+                break;
+            }
+        }
+    }
+    if (host_reg >= 0) {
+        if (access & REG_WRITE)
+            ra.dirty |= 1 << armreg;
+        emit_byte(0x41); // REX.B
+    }
+}
+
 static void emit_modrm_armreg(int r, int armreg) {
     if (armreg < 0 || armreg > 14) error("translation f***up");
-    emit_modrm_base_offset(r, EBX, (uint8_t *)&arm.reg[armreg] - (uint8_t *)&arm);
+    if (ra.host_reg[armreg] >= 0)
+        emit_modrm_x86reg(r, ra.host_reg[armreg] & 7);
+    else
+        emit_modrm_base_offset(r, EBX, armreg_offset(armreg));
 }
 
 // ----------------------------------------------------------------------
@@ -110,6 +326,7 @@ static void emit_mov_x86reg_immediate(int x86reg, int imm) {
 }
 
 static void emit_alu_x86reg_immediate(int aluop, int x86reg, int imm) {
+    flags_clobber();
     if (imm >= -0x80 && imm < 0x80) {
         emit_byte(0x83);
         emit_modrm_x86reg(aluop, x86reg);
@@ -125,12 +342,15 @@ static void emit_alu_x86reg_immediate(int aluop, int x86reg, int imm) {
 }
 
 static void emit_mov_armreg_immediate(int armreg, int imm) {
+    emit_armreg_prefix(armreg, REG_WRITE);
     emit_byte(0xC7);
     emit_modrm_armreg(0, armreg);
     emit_dword(imm);
 }
 
 static void emit_alu_armreg_immediate(int aluop, int armreg, int imm) {
+    flags_clobber();
+    emit_armreg_prefix(armreg, aluop == CMP ? REG_READ : REG_READ | REG_WRITE);
     if (imm >= -0x80 && imm < 0x80) {
         emit_byte(0x83);
         emit_modrm_armreg(aluop, armreg);
@@ -148,58 +368,77 @@ static inline void emit_mov_x86reg_x86reg(int dest, int src) {
 }
 
 static inline void emit_alu_x86reg_x86reg(int aluop, int dest, int src) {
+    flags_clobber();
     emit_byte(0x03 | aluop << 3);
     emit_modrm_x86reg(dest, src);
 }
 
 static inline void emit_mov_x86reg_armreg(int x86reg, int armreg) {
+    emit_armreg_prefix(armreg, REG_READ);
     emit_byte(0x8B);
     emit_modrm_armreg(x86reg, armreg);
 }
 
 static inline void emit_alu_x86reg_armreg(int aluop, int x86reg, int armreg) {
+    flags_clobber();
+    emit_armreg_prefix(armreg, REG_READ);
     emit_byte(0x03 | aluop << 3);
     emit_modrm_armreg(x86reg, armreg);
 }
 
 static inline void emit_mov_armreg_x86reg(int armreg, int x86reg) {
+    emit_armreg_prefix(armreg, REG_WRITE);
     emit_byte(0x89);
     emit_modrm_armreg(x86reg, armreg);
 }
 
 static inline void emit_alu_armreg_x86reg(int aluop, int armreg, int x86reg) {
+    flags_clobber();
+    emit_armreg_prefix(armreg, aluop == CMP ? REG_READ : REG_READ | REG_WRITE);
     emit_byte(0x01 | aluop << 3);
     emit_modrm_armreg(x86reg, armreg);
 }
 
 static inline void emit_unary_x86reg(int unop, int x86reg) {
+    if (unop != NOT)
+        flags_clobber();
     emit_byte(0xF7);
     emit_modrm_x86reg(unop, x86reg);
 }
 
 static inline void emit_unary_armreg(int unop, int armreg) {
+    if (unop != NOT)
+        flags_clobber();
+    emit_armreg_prefix(armreg, unop <= NEG ? REG_READ | REG_WRITE : REG_READ);
     emit_byte(0xF7);
     emit_modrm_armreg(unop, armreg);
 }
 
 static inline void emit_test_armreg_immediate(int armreg, int imm) {
+    flags_clobber();
+    emit_armreg_prefix(armreg, REG_READ);
     emit_byte(0xF7);
     emit_modrm_armreg(0, armreg);
     emit_dword(imm);
 }
 
 static inline void emit_test_armreg_x86reg(int armreg, int x86reg) {
+    flags_clobber();
+    emit_armreg_prefix(armreg, REG_READ);
     emit_byte(0x85);
     emit_modrm_armreg(x86reg, armreg);
 }
 
 static inline void emit_test_x86reg_x86reg(int reg1, int reg2) {
+    flags_clobber();
     emit_byte(0x85);
     emit_modrm_x86reg(reg1, reg2);
 }
 
 #define SHIFT_BY_CL -1
 static void emit_shift_x86reg(int shiftop, int x86reg, int count) {
+    if (count != 0)
+        flags_clobber();
     if (count == SHIFT_BY_CL) {
         emit_byte(0xD3);
         emit_modrm_x86reg(shiftop, x86reg);
@@ -216,6 +455,10 @@ static void emit_shift_x86reg(int shiftop, int x86reg, int count) {
 }
 
 static void emit_shift_armreg(int shiftop, int armreg, int count) {
+    if (count != 0) {
+        flags_clobber();
+        emit_armreg_prefix(armreg, REG_READ | REG_WRITE);
+    }
     if (count == SHIFT_BY_CL) {
         emit_byte(0xD3);
         emit_modrm_armreg(shiftop, armreg);
@@ -236,199 +479,1259 @@ static inline void emit_mov_x86reg8_immediate(int x86reg, int immediate) {
     emit_byte(immediate);
 }
 static inline void emit_cmp_flag_immediate(void *flagptr, int immediate) {
+    flags_clobber();
     emit_byte(0x80);
     emit_modrm_base_offset(CMP, EBX, (uint8_t *)flagptr - (uint8_t *)&arm);
     emit_byte(immediate);
 }
 static inline void emit_mov_x86reg8_flag(int x86reg, void *flagptr) {
+    flags_to_memory();
     emit_byte(0x8A);
     emit_modrm_base_offset(x86reg, EBX, (uint8_t *)flagptr - (uint8_t *)&arm);
 }
 static inline void emit_alu_x86reg8_flag(int aluop, int x86reg, void *flagptr) {
+    flags_clobber();
     emit_byte(0x02 | aluop << 3);
     emit_modrm_base_offset(x86reg, EBX, (uint8_t *)flagptr - (uint8_t *)&arm);
 }
 static inline void emit_mov_flag_immediate(void *flagptr, int imm) {
+    int flag = flagptr == &arm.cpsr_n ? FLAG_N : flagptr == &arm.cpsr_z ? FLAG_Z
+             : flagptr == &arm.cpsr_c ? FLAG_C : FLAG_V;
+    fl.pending &= ~flag;
+    fl.valid &= ~flag;
     emit_byte(0xC6);
     emit_modrm_base_offset(0, EBX, (uint8_t *)flagptr - (uint8_t *)&arm);
     emit_byte(imm);
 }
-enum { SETO = 0x90, SETNO, SETB,  SETAE, SETZ, SETNZ, SETBE, SETA,
-       SETS,        SETNS, SETPE, SETPO, SETL, SETGE, SETLE, SETG };
 static inline void emit_setcc_flag(int setcc, void *flagptr) {
     emit_byte(0x0F);
     emit_byte(setcc);
     emit_modrm_base_offset(0, EBX, (uint8_t *)flagptr - (uint8_t *)&arm);
 }
 
-int translate(uint32_t start_pc, uint32_t *start_insnp) {
-    out = insn_bufptr;
-    outj = jtbl_bufptr;
+// Store the given flags from the x86 flags
+static void emit_flags_store(int flags) {
+    if (flags & FLAG_N)
+        emit_setcc_flag(SETS, &arm.cpsr_n);
+    if (flags & FLAG_Z)
+        emit_setcc_flag(SETZ, &arm.cpsr_z);
+    if (flags & FLAG_C)
+        emit_setcc_flag(fl.carry_inverted ? SETAE : SETB, &arm.cpsr_c);
+    if (flags & FLAG_V)
+        emit_setcc_flag(SETO, &arm.cpsr_v);
+}
+
+static void flags_to_memory() {
+    emit_flags_store(fl.pending);
+    fl.pending = 0;
+}
+
+// Must be called before emitting anything that changes the x86 flags
+static void flags_clobber() {
+    flags_to_memory();
+    fl.valid = 0;
+}
+
+/* The x86 flags now hold the NZ flags (and C and V, if given as setcc opcodes) */
+static void flags_set(int set_carry, int set_overflow) {
+    fl.valid = FLAG_N | FLAG_Z;
+    if (set_carry >= 0)
+        fl.valid |= FLAG_C;
+    if (set_overflow >= 0)
+        fl.valid |= FLAG_V;
+    fl.carry_inverted = set_carry == SETAE;
+    if (in_cond_insn) {
+        emit_flags_store(fl.valid);
+        fl.valid = 0; // the other path didn't set them
+    } else {
+        fl.pending = fl.valid;
+    }
+}
+
+/* The x86 jcc taken if ARM condition cond holds, judging by the x86 flags,
+ * or -1 if they don't hold what it needs */
+static int host_cond(int cond) {
+    static const uint8_t needs[7] = {
+        FLAG_Z, FLAG_C, FLAG_N, FLAG_V, FLAG_C | FLAG_Z, FLAG_N | FLAG_V, FLAG_N | FLAG_Z | FLAG_V
+    };
+    int jcc;
+    if ((fl.valid & needs[cond >> 1]) != needs[cond >> 1])
+        return -1;
+    switch (cond >> 1) {
+        case 0: jcc = JZ; break;
+        case 1: jcc = fl.carry_inverted ? JAE : JB; break;
+        case 2: jcc = JS; break;
+        case 3: jcc = JO; break;
+        case 4: /* HI (!Z & C) is JA only if C is !CF */
+            if (!fl.carry_inverted)
+                return -1;
+            jcc = JA;
+            break;
+        case 5: jcc = JGE; break;
+        case 6: jcc = JG; break;
+        default: return -1;
+    }
+    // Inverted ARM conditions are inverted x86 conditions
+    return jcc ^ (cond & 1);
+}
+
+/* Emit a test of ARM condition code cond (0-14), followed by a jump
+ * that skips the conditional code if the condition is not met.
+ * Returns the end of the jump, for end_cond_jump, or NULL if cond is AL. */
+static uint8_t *emit_cond_jump(int cond) {
+    int jcc = JZ;
+    if (cond < 0xE) {
+        // Both paths must agree on which registers are dirty
+        emit_regs_writeback();
+        ra.dirty = 0;
+        int host_jcc = host_cond(cond);
+        if (host_jcc >= 0) {
+            emit_byte(0x0F);
+            emit_byte((host_jcc ^ 1) + 0x10);
+            emit_dword(0);
+            in_cond_insn = true;
+            return out;
+        }
+    }
+    switch (cond >> 1) {
+        case 0: /* EQ (Z), NE (!Z) */
+            emit_cmp_flag_immediate(&arm.cpsr_z, 0);
+            break;
+        case 1: /* CS (C), CC (!C) */
+            emit_cmp_flag_immediate(&arm.cpsr_c, 0);
+            break;
+        case 2: /* MI (N), PL (!N) */
+            emit_cmp_flag_immediate(&arm.cpsr_n, 0);
+            break;
+        case 3: /* VS (V), VC (!V) */
+            emit_cmp_flag_immediate(&arm.cpsr_v, 0);
+            break;
+        case 4: /* HI (!Z & C), LS (Z | !C) */
+            emit_mov_x86reg8_flag(AL, &arm.cpsr_z);
+            emit_alu_x86reg8_flag(CMP, AL, &arm.cpsr_c);
+            jcc = JAE; // execute if Z is less than C
+            break;
+        case 5: /* GE (N = V), LT (N != V) */
+            emit_mov_x86reg8_flag(AL, &arm.cpsr_n);
+            emit_alu_x86reg8_flag(CMP, AL, &arm.cpsr_v);
+            jcc = JNZ;
+            break;
+        case 6: /* GT (!Z & N = V), LE (Z | N != V) */
+            emit_mov_x86reg8_flag(AL, &arm.cpsr_n);
+            emit_alu_x86reg8_flag(XOR, AL, &arm.cpsr_v);
+            emit_alu_x86reg8_flag(OR, AL, &arm.cpsr_z);
+            jcc = JNZ;
+            break;
+        case 7: /* AL */
+            return NULL;
+    }
+    /* If condition not met, jump around code.
+     * (If ARM condition code is inverted, invert x86 code too)
+     * Memory accesses are long, so this needs a near jump. */
+    emit_byte(0x0F);
+    emit_byte((jcc ^ (cond & 1)) + 0x10);
+    emit_dword(0);
+    in_cond_insn = true;
+    return out;
+}
+
+// Fill in the conditional jump offset
+static void end_cond_jump(uint8_t *cond_jmp_offset) {
+    in_cond_insn = false;
+    if (cond_jmp_offset)
+        ((int32_t *)cond_jmp_offset)[-1] = out - cond_jmp_offset;
+}
+
+// Globals are addressed relative to %rbx (&arm)
+static inline void emit_modrm_global(int r, void *ptr) {
+    emit_modrm_base_offset(r, EBX, (uint8_t *)ptr - (uint8_t *)&arm);
+}
+
+static inline void patch_rel32(uint8_t *insn, uint8_t opcode, void *target) {
+    insn[0] = opcode;
+    *(int32_t *)(insn + 1) = (uint8_t *)target - (insn + 5);
+}
+
+/* Exit to a fixed address. This can later be linked to the target block,
+ * so it makes the same checks as translation_next itself. */
+static void emit_branch(uint32_t target) {
+    emit_mov_x86reg_immediate(EAX, target);
+    if (next_exit >= MAX_STAGE_EXITS) {
+        emit_jump((uintptr_t)translation_next);
+        return;
+    }
+    emit_regs_writeback();
+    emit_flags_store(fl.pending);
+
+    struct translation_exit *e = &stage_exits[next_exit++];
+    e->target_pc = target;
+    e->target = -1;
+    e->cross_page = ((target ^ block_start_pc) & ~0x3FF) || block_pages > 1;
+
+    uint8_t *skip_events, *skip_cycles;
+    emit_byte(0x83); // cmp dword [cycle_count_delta], 0
+    emit_modrm_global(CMP, &cycle_count_delta);
+    emit_byte(0);
+    emit_byte(JNS);
+    emit_byte(0);
+    skip_cycles = out;
+    emit_byte(0x83); // cmp dword [cpu_events], 0
+    emit_modrm_global(CMP, &cpu_events);
+    emit_byte(0);
+    emit_byte(JNZ);
+    emit_byte(0);
+    skip_events = out;
+
+    // mov rdx, host_ptr; mov [in_translation_pc_ptr], rdx
+    emit_word(0xBA48);
+    e->host_ptr_imm = out;
+    emit_dword(0);
+    emit_dword(0);
+    emit_byte(0x48);
+    emit_byte(0x89);
+    emit_modrm_global(EDX, &in_translation_pc_ptr);
+    // mov [arm.reg[15]], eax: fix_pc_for_fault counts from there
+    emit_byte(0x89);
+    emit_modrm_global(EAX, &arm.reg[15]);
+
+    // add dword [cycle_count_delta], cycles
+    emit_byte(0x81);
+    emit_modrm_global(ADD, &cycle_count_delta);
+    e->cycles_imm = out;
+    emit_dword(0);
+
+    e->jump = out;
+    patch_rel32(out, 0xE8, translation_next_link); // call
+    out += 5;
+
+    skip_cycles[-1] = out - skip_cycles;
+    skip_events[-1] = out - skip_events;
+    emit_jump_nosave((uintptr_t)translation_next);
+}
+
+// Rebuild the x86 flags from arm.cpsr_*: CF (or !CF), ZF, SF, OF
+static void emit_flags_load(struct flagstate *state) {
+    static void *const flagptrs[] = { &arm.cpsr_z, &arm.cpsr_n, &arm.cpsr_v };
+    static const uint8_t bits[] = { 6, 7, 11 };
+    unsigned int i;
+    emit_word(0xB60F); // movzx eax, byte [cpsr_c]
+    emit_modrm_global(EAX, &arm.cpsr_c);
+    if (state->carry_inverted) {
+        emit_byte(0x34); // xor al, 1
+        emit_byte(1);
+    }
+    for (i = 0; i < sizeof bits; i++) {
+        emit_word(0xB60F); // movzx ecx, byte [flag]
+        emit_modrm_global(ECX, flagptrs[i]);
+        emit_byte(0xC1); // shl ecx, bit
+        emit_modrm_x86reg(SHL, ECX);
+        emit_byte(bits[i]);
+        emit_byte(0x09); // or eax, ecx
+        emit_modrm_x86reg(ECX, EAX);
+    }
+    emit_byte(0x50); // push rax
+    emit_byte(0x9D); // popfq
+}
+
+/* Call a C function from a memory access slow path. Unlike emit_call, this
+ * preserves r8-r11 so that the fast path and slow path end in the same state.
+ * The return address lands at in_translation_rsp[-SLOW_CALL_RET], where
+ * fix_pc_for_fault looks for it. */
+#define SLOW_CALL_RET 10
+static void emit_slow_call(uintptr_t target) {
+    emit_regs_writeback();
+    emit_byte(0x56); // push rsi
+    emit_byte(0x52); // push rdx
+    emit_byte(0x51); // push rcx
+    emit_byte(0x57); // push rdi
+    emit_word(0x5041); // push r8
+    emit_word(0x5141); // push r9
+    emit_word(0x5241); // push r10
+    emit_word(0x5341); // push r11
+    emit_byte(0x48); // lea rsp, [rsp-8] (keep the stack aligned)
+    emit_dword(0xF824648D);
+    emit_call_nosave(target);
+    emit_byte(0x48); // lea rsp, [rsp+8]
+    emit_dword(0x0824648D);
+    emit_word(0x5B41); // pop r11
+    emit_word(0x5A41); // pop r10
+    emit_word(0x5941); // pop r9
+    emit_word(0x5841); // pop r8
+    emit_byte(0x5F);
+    emit_byte(0x59);
+    emit_byte(0x5A);
+    emit_byte(0x5E);
+}
+
+static inline void end_short_jump(uint8_t *jmp_end) {
+    assert(out - jmp_end <= 0x7F);
+    jmp_end[-1] = out - jmp_end;
+}
+
+// Jumps over a slow path call, which may write back any number of registers
+static inline void emit_near_jcc(int jcc) {
+    emit_byte(0x0F);
+    emit_byte(jcc + 0x10);
+    emit_dword(0);
+}
+
+static inline void end_near_jump(uint8_t *jmp_end) {
+    ((int32_t *)jmp_end)[-1] = out - jmp_end;
+}
+
+/* Load or store of size 1, 2 or 4 at the address in REG_ARG1.
+ * Stores take the value from REG_ARG2, loads zero-extend it into EAX.
+ * RAM is accessed through addr_cache directly; MMIO, cache misses and
+ * misaligned addresses go to slow_proc, words with read/write actions
+ * (breakpoints, translated code) to read_action/write_action first. */
+static void emit_mem_access(uintptr_t slow_proc, int size, bool is_write) {
+    uint8_t *to_slow, *to_slow_align = NULL, *to_action, *fast, *to_done;
+
+#ifdef AC_TWO_LEVEL
+    emit_byte(0x48); // mov rax, [addr_cache_dir]
+    emit_byte(0x8B);
+    emit_modrm_global(EAX, &addr_cache_dir);
+    emit_byte(0x57); // push rdi
+    emit_shift_x86reg(SHR, REG_ARG1, 18);
+    emit_byte(0x48); // mov rax, [rax + rdi*8] (block)
+    emit_word(0x048B);
+    emit_byte(0xF8);
+    emit_word(0x3C8B); // mov edi, [rsp]
+    emit_byte(0x24);
+    emit_shift_x86reg(SHR, REG_ARG1, 10);
+    emit_dword(0xFFB60F40); // movzx edi, dil
+    emit_shift_x86reg(SHL, REG_ARG1, 4);
+    emit_byte(0x48); // mov rax, [rax + rdi] (read entry) or [rax + rdi + 8] (write entry)
+    emit_word(0x448B);
+    emit_byte(0x38);
+    emit_byte(is_write ? 8 : 0);
+    emit_byte(0x5F); // pop rdi
+#else
+    emit_mov_x86reg_x86reg(EAX, REG_ARG1);
+    emit_shift_x86reg(SHR, EAX, 10);
+    emit_shift_x86reg(SHL, EAX, 4);
+    emit_byte(0x48); // add rax, [addr_cache]
+    emit_byte(0x03);
+    emit_modrm_global(EAX, &addr_cache);
+    emit_byte(0x48); // mov rax, [rax] (read entry) or [rax+8] (write entry)
+    emit_byte(0x8B);
+    emit_modrm_base_offset(EAX, EAX, is_write ? 8 : 0);
+#endif
+    emit_byte(0xA8); // test al, AC_FLAGS
+    emit_byte(AC_FLAGS);
+    emit_near_jcc(JNZ);
+    to_slow = out;
+    if (size > 1) {
+        emit_byte(0x40); // test dil, size - 1
+        emit_byte(0xF6);
+        emit_modrm_x86reg(0, REG_ARG1);
+        emit_byte(size - 1);
+        emit_near_jcc(JNZ);
+        to_slow_align = out;
+    }
+
+    emit_byte(0x48); // add rdi, rax
+    emit_byte(0x01);
+    emit_modrm_x86reg(EAX, REG_ARG1);
+    if (size == 4) {
+        emit_byte(0xF6); // test byte [rdi + RAM_FLAGS], mask
+        emit_modrm_base_offset(0, REG_ARG1, MEM_MAXSIZE);
+    } else {
+        emit_byte(0x48); // mov rax, rdi
+        emit_byte(0x89);
+        emit_modrm_x86reg(REG_ARG1, EAX);
+        emit_word(0xFC24); // and al, ~3
+        emit_byte(0xF6); // test byte [rax + RAM_FLAGS], mask
+        emit_modrm_base_offset(0, EAX, MEM_MAXSIZE);
+    }
+    emit_byte(is_write ? DO_WRITE_ACTION : DO_READ_ACTION);
+    emit_word(JNZ);
+    to_action = out;
+
+    fast = out;
+    if (is_write) {
+        if (size == 2)
+            emit_byte(0x66);
+        else if (size == 1)
+            emit_byte(0x40); // for sil
+        emit_byte(size == 1 ? 0x88 : 0x89);
+        emit_modrm_base_offset(REG_ARG2, REG_ARG1, 0);
+    } else {
+        if (size == 4) {
+            emit_byte(0x8B);
+        } else {
+            emit_byte(0x0F); // movzx
+            emit_byte(size == 1 ? 0xB6 : 0xB7);
+        }
+        emit_modrm_base_offset(EAX, REG_ARG1, 0);
+    }
+    emit_byte(0xE9); // jmp
+    emit_dword(0);
+    to_done = out;
+
+    end_short_jump(to_action);
+    emit_slow_call(is_write ? (uintptr_t)write_action : (uintptr_t)read_action);
+    emit_byte(0xE9); // jmp fast
+    emit_dword(fast - (out + 4));
+
+    end_near_jump(to_slow);
+    if (to_slow_align)
+        end_near_jump(to_slow_align);
+    emit_slow_call(slow_proc);
+    end_near_jump(to_done);
+}
+
+/* ----------------------------------------------------------------------
+ * Blocks are built in a staging area after insn_buffer, from a copy of
+ * their guest code and its RAM_FLAGS, and turned into a relocatable record.
+ * install_block copies a record into the code cache, fixing up the parts
+ * of the code that depend on where things are: calls into the emulator,
+ * and the addr_cache entries checked by page guards. The persistent cache
+ * saves the same records. */
+
+enum { PR_TEXT, PR_RAM };
+struct pcache_reloc {
+    uint32_t offset;   // in the block's code
+    uint32_t type;
+    uint32_t va, phys; // PR_RAM: imm64 = host pointer of phys - va
+    uint32_t symbol;   // PR_TEXT: rel32 to pcache_symbol(symbol)
+};
+struct pcache_exit {
+    uint32_t jump, host_ptr_imm, cycles_imm; // offsets in the block's code
+    uint32_t target_pc, cross_page;
+};
+/* Followed by the code, then as offsets in it the jump table and where each
+ * instruction's code starts, then exits and relocations; each part is padded
+ * to 8 bytes */
+struct pcache_block {
+    uint32_t next;     // next block in the hash chain: offset in pcache_buf + 1
+    uint32_t pc, phys, thumb;
+    uint32_t insns, code_size, exits, relocs;
+    uint32_t digest[8];
+};
+#define PCACHE_ALIGN(x) (((x) + 7) & ~7)
+#define MAX_RELOCS 0x4000
+#define MAX_INSN_RELOCS 0x100 // more than one instruction can need
+
+/* The staging area holds the record, with the code at stage_code. Code is
+ * limited to the least tcache_code_limit, so that a block always fits once
+ * the cache is flushed; the rest of the record takes under 0x80000 bytes. */
+#define STAGE_CODE_SIZE (2 * TCACHE_RESERVE)
+
+static struct pcache_reloc relocs[MAX_RELOCS];
+static int next_reloc; // may go past MAX_RELOCS; the block is dropped then
+
+static inline uint32_t *pcache_jtbl(struct pcache_block *b) {
+    return (uint32_t *)((uint8_t *)(b + 1) + PCACHE_ALIGN(b->code_size));
+}
+static inline struct pcache_exit *pcache_exits(struct pcache_block *b) {
+    return (struct pcache_exit *)((uint8_t *)pcache_jtbl(b) + PCACHE_ALIGN(b->insns * 8));
+}
+static inline struct pcache_reloc *pcache_relocs(struct pcache_block *b) {
+    return (struct pcache_reloc *)((uint8_t *)pcache_exits(b) + PCACHE_ALIGN(b->exits * sizeof(struct pcache_exit)));
+}
+static inline uint32_t pcache_block_size(struct pcache_block *b) {
+    return (uint8_t *)(pcache_relocs(b) + b->relocs) - (uint8_t *)b;
+}
+
+/* Emulator code that blocks call or jump to, followed by the 8 entries of
+ * arm_shift_proc. Relocations name them by index, so a saved block doesn't
+ * depend on where this build put them. Add new ones at the end. */
+static const uintptr_t pcache_symbols[] = {
+    (uintptr_t)translation_next, (uintptr_t)translation_next_bx,
+    (uintptr_t)read_action, (uintptr_t)write_action,
+    (uintptr_t)read_byte, (uintptr_t)read_half, (uintptr_t)read_word, (uintptr_t)read_word_ldr,
+    (uintptr_t)write_byte, (uintptr_t)write_half, (uintptr_t)write_word,
+    (uintptr_t)get_cpsr, (uintptr_t)set_cpsr, (uintptr_t)get_spsr, (uintptr_t)set_spsr,
+    (uintptr_t)cp15_read, (uintptr_t)cp15_write,
+};
+#define PCACHE_SHIFT_SYMBOLS (sizeof pcache_symbols / sizeof *pcache_symbols)
+#define PCACHE_NUM_SYMBOLS (PCACHE_SHIFT_SYMBOLS + 8)
+
+static inline uintptr_t pcache_symbol(uint32_t symbol) {
+    if (symbol < PCACHE_SHIFT_SYMBOLS)
+        return pcache_symbols[symbol];
+    symbol -= PCACHE_SHIFT_SYMBOLS;
+    return arm_shift_proc[symbol >> 2][symbol & 3];
+}
+
+// Code outside the staging area is the emulator's; jumps within a block need nothing
+static void pcache_reloc_text(uint8_t *site, uintptr_t target) {
+    uint32_t symbol;
+    if (target - (uintptr_t)stage_code < STAGE_CODE_SIZE)
+        return;
+    for (symbol = 0; symbol < PCACHE_NUM_SYMBOLS && pcache_symbol(symbol) != target; symbol++);
+    assert(symbol < PCACHE_NUM_SYMBOLS);
+    if (symbol == PCACHE_NUM_SYMBOLS)
+        next_reloc = MAX_RELOCS; // drop the block
+    if (next_reloc < MAX_RELOCS) {
+        struct pcache_reloc *r = &relocs[next_reloc];
+        r->offset = site - stage_code;
+        r->type = PR_TEXT;
+        r->symbol = symbol;
+    }
+    next_reloc++;
+}
+
+static void pcache_reloc_ram(uint8_t *site, uint32_t va, void *ptr) {
+    if (next_reloc < MAX_RELOCS) {
+        struct pcache_reloc *r = &relocs[next_reloc];
+        r->offset = site - stage_code;
+        r->type = PR_RAM;
+        r->va = va;
+        r->phys = phys_mem_addr(ptr);
+    }
+    next_reloc++;
+}
+
+// Code from insn_start on is being thrown away
+static void pcache_rollback(uint8_t *insn_start) {
+    while (next_reloc > 0 && next_reloc <= MAX_RELOCS
+           && relocs[next_reloc - 1].offset >= (uint32_t)(insn_start - stage_code))
+        next_reloc--;
+}
+
+/* A block to build: the words from base on, as far as a block starting at
+ * insnp may go, and their RAM_FLAGS, as they were when it was asked for */
+struct tjob {
+    struct tjob *next;
+    uint32_t pc, phys;
+    bool thumb;
+    uint8_t *insnp;
+    uint32_t *base;
+    uint32_t pages;               // 1 KB pages that follow each other in host memory
+    struct pcache_block *record;  // result of a queued job, or NULL
+    int no_translate;             // result: word to flag RF_CODE_NO_TRANSLATE, or -1
+    int unimpl;                   // result: the class of its instruction
+    bool cut;                     // result: block ended early for lack of room
+    bool cancelled;               // the cache was flushed while the worker had it
+    uint32_t code[MAX_BLOCK_INSNS];
+    uint32_t flags[MAX_BLOCK_INSNS];
+};
+static struct tjob *stage_job;
+// Flags copied for the words of the block being built, which can't have an index yet
+#define STAGE_INDEX MAX_TRANSLATIONS
+
+static inline uint32_t *stage_flags(void *insnp) {
+    return &stage_job->flags[((uint8_t *)insnp - (uint8_t *)stage_job->code) >> 2];
+}
+static inline uint8_t *stage_ram_ptr(void *insnp) {
+    return (uint8_t *)stage_job->base + ((uint8_t *)insnp - (uint8_t *)stage_job->code);
+}
+
+/* Add the entry stubs, and make the block from stage_code to out a record */
+static struct pcache_block *finish_translation(bool thumb) {
+    struct pcache_block *b = (struct pcache_block *)stage_code - 1;
+    int i;
+
+    // Entry stubs for instructions expecting registers or x86 flags to be loaded
+    for (i = 1; i < outj - stage_jtbl; i++) {
+        if (regs_allocated(&insn_state[i].ra) || insn_state[i].fl.valid) {
+            uint8_t *code = stage_jtbl[i];
+            stage_jtbl[i] = out;
+            if (insn_state[i].fl.valid)
+                emit_flags_load(&insn_state[i].fl);
+            emit_regs_load(&insn_state[i].ra);
+            emit_jump_nosave((uintptr_t)code);
+        }
+    }
+
+    if (next_reloc > MAX_RELOCS)
+        return NULL;
+    b->next = 0;
+    b->pc = block_start_pc;
+    b->phys = stage_job->phys;
+    b->thumb = thumb;
+    b->insns = outj - stage_jtbl;
+    b->code_size = out - stage_code;
+    b->exits = next_exit;
+    b->relocs = next_reloc;
+    uint32_t *jtbl = pcache_jtbl(b);
+    for (i = 0; i < (int)b->insns; i++) {
+        jtbl[i] = stage_jtbl[i] - stage_code;
+        jtbl[b->insns + i] = stage_jtbl_code[i] - stage_code;
+    }
+    struct pcache_exit *pe = pcache_exits(b);
+    for (i = 0; i < next_exit; i++) {
+        struct translation_exit *e = &stage_exits[i];
+        pe[i].jump = e->jump - stage_code;
+        pe[i].host_ptr_imm = e->host_ptr_imm - stage_code;
+        pe[i].cycles_imm = e->cycles_imm - stage_code;
+        pe[i].target_pc = e->target_pc;
+        pe[i].cross_page = e->cross_page;
+    }
+    memcpy(pcache_relocs(b), relocs, next_reloc * sizeof *relocs);
+    return b;
+}
+
+/* Flush the code cache if it does not have room for block b */
+static void tcache_make_room(struct pcache_block *b) {
+    int full;
+    if (insn_bufptr + b->code_size > insn_buffer + tcache_code_limit)
+        full = TC_FULL_CODE;
+    else if (jtbl_bufptr + b->insns > &jtbl_buffer[JTBL_SIZE])
+        full = TC_FULL_JUMP_TABLE;
+    else if (next_index >= (int)tcache_block_limit)
+        full = TC_FULL_BLOCKS;
+    else if (committed_exits + b->exits > MAX_EXITS)
+        full = TC_FULL_EXITS;
+    else
+        return;
+    tcache_stats.evictions[full]++;
+    tcache_stats.evicted_blocks += next_index;
+    tcache_stats.evicted_bytes += insn_bufptr - insn_buffer;
+    flush_translations(TF_FULL);
+}
+
+// Make exit i call translation_next_link again
+static void unlink_exit(int i) {
+    struct translation_exit *e = &exits[i];
+    *(int32_t *)e->cycles_imm = 0;
+    patch_rel32(e->jump, 0xE8, translation_next_link);
+    if (e->in_prev >= 0)
+        exits[e->in_prev].in_next = e->in_next;
+    else
+        incoming[e->target] = e->in_next;
+    if (e->in_next >= 0)
+        exits[e->in_next].in_prev = e->in_prev;
+    e->target = -1;
+}
+
+/* Drop every translation starting on page, and unlink exits into them.
+ * Their code stays in the buffer until the next flush. */
+static void drop_page(int page) {
+    int i;
+    for (i = page_first[page]; i; i = page_next[i - 1]) {
+        struct translation *t = &translation_table[i - 1];
+        while (incoming[i - 1] >= 0)
+            unlink_exit(incoming[i - 1]);
+        uint32_t *start = (uint32_t *)((uintptr_t)t->start_ptr & ~3);
+        for (; start < t->end_ptr; start++)
+            RAM_FLAGS(start) &= ~(RF_CODE_TRANSLATED | ~0u << RFS_TRANSLATION_INDEX);
+        // An empty range keeps the dispatcher and translation_link out
+        t->end_ptr = t->start_ptr;
+    }
+    page_first[page] = 0;
+    ibc_clear();
+}
+
+/* Copy block b into the code cache as the translation of the code at insnp.
+ * Its words must be free to take over, as when it was built. Returns its
+ * index, or -1. */
+static int install_block(struct pcache_block *b, void *insnp) {
+    bool thumb = b->thumb;
+    uint32_t *w;
+    int i;
+
+    uint8_t *end_insnp = (uint8_t *)insnp + (b->insns << (thumb ? 1 : 2));
+    uint32_t *first = (uint32_t *)((uintptr_t)insnp & ~3);
+    for (w = first; (uint8_t *)w < end_insnp; w++) {
+        if (RAM_FLAGS(w) & (RF_EXEC_BREAKPOINT | RF_EXEC_DEBUG_NEXT | RF_EXEC_HACK | RF_ARMLOADER_CB
+                            | RF_CODE_NO_TRANSLATE | (w != first ? RF_CODE_TRANSLATED : 0)))
+            return -1;
+    }
+    /* The first word may belong to another block: a THUMB block can start
+     * in the second half of a word ending one, and a queued job can finish
+     * after its code was translated again. The word's index becomes this
+     * block's, so a write there drops only this block's page. Unless the
+     * other starts on that page too, drop it now. */
+    if (RAM_FLAGS(first) & RF_CODE_TRANSLATED) {
+        int owner = RAM_FLAGS(first) >> RFS_TRANSLATION_INDEX;
+        if (ram_page(translation_table[owner].start_ptr) != ram_page(insnp))
+            drop_page(ram_page(translation_table[owner].start_ptr));
+    }
+    tcache_make_room(b);
+    if (insn_bufptr + b->code_size > insn_buffer + tcache_code_limit
+            || jtbl_bufptr + b->insns > &jtbl_buffer[JTBL_SIZE]
+            || committed_exits + b->exits > MAX_EXITS)
+        return -1;
+
+    struct pcache_reloc *r = pcache_relocs(b);
+    for (i = 0; i < (int)b->relocs; i++)
+        if (r[i].type == PR_RAM && !phys_mem_ptr(r[i].phys, 4))
+            return -1;
+
+    memcpy(insn_bufptr, b + 1, b->code_size);
+    for (i = 0; i < (int)b->relocs; i++) {
+        uint8_t *site = insn_bufptr + r[i].offset;
+        if (r[i].type == PR_TEXT)
+            *(int32_t *)site = pcache_symbol(r[i].symbol) - (uintptr_t)(site + 4);
+        else
+            *(uintptr_t *)site = (uintptr_t)phys_mem_ptr(r[i].phys, 4) - r[i].va;
+    }
+    uint32_t *jtbl = pcache_jtbl(b);
+    for (i = 0; i < (int)b->insns; i++) {
+        jtbl_bufptr[i] = insn_bufptr + jtbl[i];
+        jtbl_code[jtbl_bufptr - jtbl_buffer + i] = insn_bufptr + jtbl[b->insns + i];
+    }
+    struct pcache_exit *pe = pcache_exits(b);
+    for (i = 0; i < (int)b->exits; i++) {
+        struct translation_exit *e = &exits[committed_exits + i];
+        e->jump = insn_bufptr + pe[i].jump;
+        e->host_ptr_imm = insn_bufptr + pe[i].host_ptr_imm;
+        e->cycles_imm = insn_bufptr + pe[i].cycles_imm;
+        e->target_pc = pe[i].target_pc;
+        e->target = -1;
+        e->cross_page = pe[i].cross_page;
+        e->listed = false;
+        patch_rel32(e->jump, 0xE8, translation_next_link);
+    }
+
+    int index = next_index++;
+    incoming[index] = -1;
+    for (w = first; (uint8_t *)w < end_insnp; w++)
+        RAM_FLAGS(w) = (RAM_FLAGS(w) & ~(~0u << RFS_TRANSLATION_INDEX)) | RF_CODE_TRANSLATED | index << RFS_TRANSLATION_INDEX;
+
+    translation_table[index].thumb      = thumb;
+    translation_table[index].jump_table = (void**) jtbl_bufptr;
+    translation_table[index].start_ptr  = insnp;
+    translation_table[index].end_ptr    = (uint32_t *)end_insnp;
+
+    int page = ram_page(insnp);
+    page_next[index] = page_first[page];
+    page_first[page] = index + 1;
+
+    perf_map_block(insn_bufptr, b->code_size, b->pc, thumb);
+    tcache_stats.blocks++;
+    tcache_stats.block_insns += b->insns;
+    tcache_stats.block_bytes += b->code_size;
+    insn_bufptr += b->code_size;
+    jtbl_bufptr += b->insns;
+    committed_exits += b->exits;
+    return index;
+}
+
+static uint8_t *pcache_buf; // NULL unless translations are being saved
+static uint32_t pcache_size, pcache_alloc;
+static int num_pending_jobs;
+
+void tcache_info() {
+    gui_debug_printf("Code:       %u of %u bytes\n", (uint32_t)(insn_bufptr - insn_buffer), tcache_code_limit);
+    gui_debug_printf("Blocks:     %d of %u\n", next_index, tcache_block_limit);
+    gui_debug_printf("Jump table: %u of %u entries\n", (uint32_t)(jtbl_bufptr - jtbl_buffer), (uint32_t)JTBL_SIZE);
+    gui_debug_printf("Exits:      %d of %d\n", committed_exits, MAX_EXITS);
+    gui_debug_printf("Flushes when full: %u code, %u jump table, %u blocks, %u exits\n",
+                     tcache_stats.evictions[TC_FULL_CODE], tcache_stats.evictions[TC_FULL_JUMP_TABLE],
+                     tcache_stats.evictions[TC_FULL_BLOCKS], tcache_stats.evictions[TC_FULL_EXITS]);
+    gui_debug_printf("Evicted %u blocks, %llu bytes; %u blocks cut short\n", tcache_stats.evicted_blocks,
+                     (unsigned long long)tcache_stats.evicted_bytes, tcache_stats.cut_blocks);
+    gui_debug_printf("Background translation %s; %d blocks pending\n",
+                     translate_async ? "on" : "off", num_pending_jobs);
+    if (pcache_buf)
+        gui_debug_printf("Saved translations: %u blocks, %u bytes; %u reused\n",
+                         tcache_stats.saved_blocks, pcache_size, tcache_stats.saved_hits);
+    tcache_activity_info();
+    tcache_unimpl_info();
+}
+
+size_t tcache_stats_dump(char *buf, size_t size) {
+    return tcache_stats_write(buf, size, next_index);
+}
+
+/* ----------------------------------------------------------------------
+ * Persistent translation cache. Once tcache_load has enabled it, installed
+ * blocks are also copied to pcache_buf. A block is reused for the same
+ * virtual and physical address and instruction set, if its guest code
+ * still has the same SHA-256. A saved file holds the fingerprint, the size
+ * and SHA-256 of the blocks, then the blocks. */
+
+#define PCACHE_MAX_SIZE (64 << 20)
+#define PCACHE_HASH_SIZE 0x10000
+
+static uint32_t pcache_hash[PCACHE_HASH_SIZE];
+
+static inline uint32_t pcache_hash_key(uint32_t pc, uint32_t phys, bool thumb) {
+    return ((pc ^ phys >> 2) * 0x9E3779B1 + thumb) >> 16;
+}
+
+// A saved block for this address whose guest code is what insnp points to
+static struct pcache_block *pcache_find(uint32_t pc, uint32_t phys, bool thumb, void *insnp) {
+    uint32_t i, digest[8];
+    for (i = pcache_hash[pcache_hash_key(pc, phys, thumb)]; i; ) {
+        struct pcache_block *b = (struct pcache_block *)(pcache_buf + i - 1);
+        uint32_t size = b->insns << (thumb ? 1 : 2);
+        if (b->pc == pc && b->phys == phys && b->thumb == thumb && phys_mem_ptr(phys, size)) {
+            sha256_digest(insnp, size, digest);
+            if (!memcmp(digest, b->digest, sizeof digest))
+                return b;
+        }
+        i = b->next;
+    }
+    return NULL;
+}
+
+// Keep a copy of record, just installed for the code at insnp
+static void pcache_save(struct pcache_block *record, void *insnp) {
+    struct pcache_block *b;
+    uint32_t size = pcache_block_size(record);
+
+    if (pcache_size + size > PCACHE_MAX_SIZE
+            || pcache_find(record->pc, record->phys, record->thumb, insnp))
+        return;
+    if (pcache_size + size > pcache_alloc) {
+        uint32_t new_alloc = pcache_alloc * 2;
+        if (new_alloc > PCACHE_MAX_SIZE)
+            new_alloc = PCACHE_MAX_SIZE;
+        uint8_t *new_buf = realloc(pcache_buf, new_alloc);
+        if (!new_buf)
+            return;
+        pcache_buf = new_buf;
+        pcache_alloc = new_alloc;
+    }
+
+    b = (struct pcache_block *)(pcache_buf + pcache_size);
+    memcpy(b, record, size);
+    sha256_digest(insnp, b->insns << (b->thumb ? 1 : 2), b->digest);
+
+    uint32_t key = pcache_hash_key(b->pc, b->phys, b->thumb);
+    b->next = pcache_hash[key];
+    pcache_hash[key] = pcache_size + 1;
+    pcache_size += size;
+    tcache_stats.saved_blocks++;
+}
+
+/* Install a saved translation of the code at insnp, if there is one.
+ * Returns its index, or -1. */
+static int pcache_install(uint32_t pc, void *insnp, bool thumb) {
+    struct pcache_block *b = pcache_find(pc, phys_mem_addr(insnp), thumb, insnp);
+    if (!b)
+        return -1;
+    int index = install_block(b, insnp);
+    if (index >= 0)
+        tcache_stats.saved_hits++;
+    return index;
+}
+
+// Whether a block of a loaded file, size bytes from its start on, only patches its own code
+static bool pcache_block_valid(struct pcache_block *b, uint32_t size) {
+    uint32_t i;
+    if (size < sizeof *b || b->thumb > 1 || !b->insns || b->insns > MAX_BLOCK_INSNS
+            || b->code_size < 8 || b->code_size > STAGE_CODE_SIZE
+            || b->exits > MAX_STAGE_EXITS || b->relocs > MAX_RELOCS || pcache_block_size(b) > size)
+        return false;
+    uint32_t *jtbl = pcache_jtbl(b);
+    for (i = 0; i < 2 * b->insns; i++)
+        if (jtbl[i] >= b->code_size)
+            return false;
+    struct pcache_exit *pe = pcache_exits(b);
+    for (i = 0; i < b->exits; i++)
+        if (pe[i].jump > b->code_size - 5 || pe[i].host_ptr_imm > b->code_size - 8
+                || pe[i].cycles_imm > b->code_size - 4)
+            return false;
+    struct pcache_reloc *r = pcache_relocs(b);
+    for (i = 0; i < b->relocs; i++) {
+        if (r[i].type == PR_TEXT) {
+            if (r[i].offset > b->code_size - 4 || r[i].symbol >= PCACHE_NUM_SYMBOLS)
+                return false;
+        } else if (r[i].type != PR_RAM || r[i].offset > b->code_size - 8) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Bump when the code blocks are made of, or the way it is saved, changes */
+#define PCACHE_VERSION 3
+#define PCACHE_FP_SIZE 9
+
+#ifdef __linux__
+// Digest of the executable's code segment, found from its program headers
+static bool pcache_text_digest(uint32_t digest[8]) {
+    const Elf64_Phdr *ph = (const Elf64_Phdr *)getauxval(AT_PHDR);
+    size_t i, phnum = getauxval(AT_PHNUM);
+    uintptr_t base = 0, here = (uintptr_t)pcache_text_digest;
+    if (!ph)
+        return false;
+    for (i = 0; i < phnum; i++)
+        if (ph[i].p_type == PT_PHDR)
+            base = (uintptr_t)ph - ph[i].p_vaddr;
+    for (i = 0; i < phnum; i++) {
+        uintptr_t start = base + ph[i].p_vaddr;
+        if (ph[i].p_type == PT_LOAD && (ph[i].p_flags & PF_X)
+                && here - start < ph[i].p_memsz && ph[i].p_memsz <= UINT32_MAX) {
+            sha256_digest((void *)start, ph[i].p_memsz, digest);
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+/* SHA-256 of the executable code of this build, the translator and the
+ * functions its code calls included, where the host lets us find it; of
+ * when this file was compiled otherwise */
+static void pcache_build_digest(uint32_t digest[8]) {
+    static uint32_t build_digest[8];
+    static bool done;
+    if (!done) {
+#ifdef __linux__
+        if (!pcache_text_digest(build_digest))
+#endif
+        {
+            static const char stamp[] = __DATE__ " " __TIME__;
+            sha256_digest(stamp, sizeof stamp, build_digest);
+        }
+        done = true;
+    }
+    memcpy(digest, build_digest, sizeof build_digest);
+}
+
+/* Must match for a file to be loaded: the build that saved it, and the
+ * layout of the saved data */
+static void pcache_fingerprint(int64_t fp[PCACHE_FP_SIZE]) {
+    fp[0] = 0x32544943454E5350; // "PSNECIT2"
+    fp[1] = PCACHE_VERSION | (int64_t)PCACHE_NUM_SYMBOLS << 32;
+    pcache_build_digest((uint32_t *)&fp[2]);
+#ifdef AC_TWO_LEVEL
+    fp[6] = ((uint8_t *)&addr_cache_dir - (uint8_t *)&arm) | 1LL << 62;
+#else
+    fp[6] = (uint8_t *)&addr_cache - (uint8_t *)&arm;
+#endif
+    fp[7] = (uint8_t *)&cycle_count_delta - (uint8_t *)&arm;
+    fp[8] = sizeof(struct pcache_block) << 16 | sizeof(struct pcache_exit) << 8 | sizeof(struct pcache_reloc)
+            | (int64_t)DO_WRITE_ACTION << 32 | (int64_t)DO_READ_ACTION << 40;
+}
+
+/* Start saving translations, and load those saved in filename earlier.
+ * A missing or unusable file leaves the cache empty. */
+bool tcache_load(const char *filename) {
+    int64_t fp[PCACHE_FP_SIZE], file_fp[PCACHE_FP_SIZE];
+    uint32_t size, offset, digest[8], file_digest[8];
+    FILE *f;
+
+    if (!pcache_buf) {
+        pcache_alloc = 1 << 20;
+        pcache_buf = malloc(pcache_alloc);
+        if (!pcache_buf)
+            return false;
+    }
+    pcache_size = 0;
+    memset(pcache_hash, 0, sizeof pcache_hash);
+    tcache_stats.saved_blocks = 0;
+
+    f = fopen(filename, "rb");
+    if (!f)
+        return false;
+    pcache_fingerprint(fp);
+    if (fread(file_fp, sizeof file_fp, 1, f) != 1 || memcmp(fp, file_fp, sizeof fp)
+            || fread(&size, sizeof size, 1, f) != 1 || size > PCACHE_MAX_SIZE
+            || fread(file_digest, sizeof file_digest, 1, f) != 1) {
+        emuprintf("%s: saved translations are from another build, ignoring them\n", filename);
+        fclose(f);
+        return false;
+    }
+    if (size > pcache_alloc) {
+        uint8_t *new_buf = realloc(pcache_buf, size);
+        if (!new_buf) {
+            fclose(f);
+            return false;
+        }
+        pcache_buf = new_buf;
+        pcache_alloc = size;
+    }
+    if (fread(pcache_buf, 1, size, f) != size) {
+        fclose(f);
+        return false;
+    }
+    fclose(f);
+    sha256_digest(pcache_buf, size, digest);
+    if (memcmp(digest, file_digest, sizeof digest)) {
+        emuprintf("%s: saved translations are damaged, ignoring them\n", filename);
+        return false;
+    }
+
+    for (offset = 0; offset < size; ) {
+        struct pcache_block *b = (struct pcache_block *)(pcache_buf + offset);
+        if (!pcache_block_valid(b, size - offset)) {
+            emuprintf("%s: bad saved translation at offset %u, ignoring the rest\n", filename, offset);
+            break;
+        }
+        uint32_t block_size = pcache_block_size(b);
+        uint32_t key = pcache_hash_key(b->pc, b->phys, b->thumb);
+        b->next = pcache_hash[key];
+        pcache_hash[key] = offset + 1;
+        offset += block_size;
+        tcache_stats.saved_blocks++;
+    }
+    pcache_size = offset;
+    return true;
+}
+
+bool tcache_save(const char *filename) {
+    int64_t fp[PCACHE_FP_SIZE];
+    uint32_t digest[8];
+    FILE *f;
+    if (!pcache_buf)
+        return false;
+    f = fopen(filename, "wb");
+    if (!f) {
+        gui_perror(filename);
+        return false;
+    }
+    pcache_fingerprint(fp);
+    sha256_digest(pcache_buf, pcache_size, digest);
+    bool ok = fwrite(fp, sizeof fp, 1, f) == 1
+            && fwrite(&pcache_size, sizeof pcache_size, 1, f) == 1
+            && fwrite(digest, sizeof digest, 1, f) == 1
+            && fwrite(pcache_buf, 1, pcache_size, f) == pcache_size;
+    fclose(f);
+    return ok;
+}
+
+// Result of a data processing instruction. Writing pc leaves the block.
+static void emit_data_proc_result(int dest_reg, int x86reg) {
+    if (dest_reg != 15) {
+        emit_mov_armreg_x86reg(dest_reg, x86reg);
+        return;
+    }
+    if (x86reg != EAX)
+        emit_mov_x86reg_x86reg(EAX, x86reg);
+    emit_jump((uintptr_t)translation_next);
+}
+
+/* Sequential code at pc enters another page. If that page follows the
+ * current one in host memory too, keep translating, behind a guard that
+ * leaves the block when pc no longer maps there. */
+static bool continue_on_page(uint32_t pc, void *insnp) {
+    uint8_t *skip_exit;
+    if (++block_pages > stage_job->pages)
+        return false;
+    insnp = stage_ram_ptr(insnp);
+    flags_clobber();
+#ifdef AC_TWO_LEVEL
+    emit_byte(0x48); // mov rax, [addr_cache_dir]
+    emit_byte(0x8B);
+    emit_modrm_global(EAX, &addr_cache_dir);
+    emit_byte(0x48); // mov rax, [rax + block of pc]
+    emit_byte(0x8B);
+    emit_modrm_base_offset(EAX, EAX, (pc >> 18) << 3);
+    emit_byte(0x48); // mov rax, [rax + read entry of pc]
+    emit_byte(0x8B);
+    emit_modrm_base_offset(EAX, EAX, (pc >> 10 & 0xFF) << 4);
+#else
+    emit_byte(0x48); // mov rax, [addr_cache]
+    emit_byte(0x8B);
+    emit_modrm_global(EAX, &addr_cache);
+    emit_byte(0x48); // mov rax, [rax + read entry of pc]
+    emit_byte(0x8B);
+    emit_modrm_base_offset(EAX, EAX, (pc >> 10) << 4);
+#endif
+    emit_word(0xB948); // mov rcx, entry as of now
+    pcache_reloc_ram(out, pc, insnp);
+    emit_dword((uintptr_t)insnp - pc);
+    emit_dword(((uintptr_t)insnp - pc) >> 32);
+    emit_byte(0x48); // cmp rax, rcx
+    emit_byte(0x39);
+    emit_modrm_x86reg(ECX, EAX);
+    emit_near_jcc(JZ);
+    skip_exit = out;
+    emit_branch(pc);
+    end_near_jump(skip_exit);
+    return true;
+}
+
+static struct pcache_block *translate_arm_code(uint32_t start_pc, uint32_t *start_insnp) {
+    out = stage_code;
+    outj = stage_jtbl;
+    next_exit = 0;
+    next_reloc = 0;
+    block_start_pc = start_pc;
+    block_pages = 1;
+    regs_reset();
     uint32_t pc = start_pc;
     uint32_t *insnp = start_insnp;
 
-    if (next_index >= MAX_TRANSLATIONS)
-        error("too many translations");
-
     uint8_t *insn_start;
+    int insn_exit;
     int stop_here = 0;
     while (1) {
-        if (out >= &insn_buffer[INSN_BUFFER_SIZE - 1000])
-            error("Out of instruction space");
-        if (outj >= &jtbl_buffer[sizeof jtbl_buffer / sizeof *jtbl_buffer])
-            error("Out of jump table space");
+        if (out + MAX_INSN_CODE + (outj - stage_jtbl + 1) * MAX_STUB_CODE > stage_code + STAGE_CODE_SIZE
+                || next_reloc + MAX_INSN_RELOCS > MAX_RELOCS) {
+            stage_job->cut = true;
+            goto branch_conditional;
+        }
+
+        // Multi-page blocks end when insn_state is full
+        if (outj - stage_jtbl >= MAX_BLOCK_INSNS)
+            goto branch_conditional;
 
         insn_start = out;
+        insn_exit = next_exit;
+        insn_state[outj - stage_jtbl].ra = ra;
+        insn_state[outj - stage_jtbl].fl = fl;
 
-        if ((pc ^ start_pc) & ~0x3FF) {
+        if (!(pc & 0x3FF) && pc != start_pc && !continue_on_page(pc, insnp)) {
             //printf("stopping translation - end of page\n");
             goto branch_conditional;
         }
-        if (RAM_FLAGS(insnp) & (RF_EXEC_BREAKPOINT | RF_EXEC_DEBUG_NEXT | RF_EXEC_HACK | RF_CODE_TRANSLATED | RF_CODE_NO_TRANSLATE)) {
+        if (*stage_flags(insnp) & (RF_EXEC_BREAKPOINT | RF_EXEC_DEBUG_NEXT | RF_EXEC_HACK | RF_CODE_TRANSLATED | RF_CODE_NO_TRANSLATE)) {
             //printf("stopping translation - at breakpoint %x (%x)\n", pc);
             goto branch_conditional;
         }
         uint32_t insn = *insnp;
-
-        /* Condition code */
-        int cond = insn >> 28;
-        int jcc = JZ;
-        uint8_t *cond_jmp_offset = NULL;
-        switch (cond >> 1) {
-            case 0: /* EQ (Z), NE (!Z) */
-                emit_cmp_flag_immediate(&arm.cpsr_z, 0);
-                break;
-            case 1: /* CS (C), CC (!C) */
-                emit_cmp_flag_immediate(&arm.cpsr_c, 0);
-                break;
-            case 2: /* MI (N), PL (!N) */
-                emit_cmp_flag_immediate(&arm.cpsr_n, 0);
-                break;
-            case 3: /* VS (V), VC (!V) */
-                emit_cmp_flag_immediate(&arm.cpsr_v, 0);
-                break;
-            case 4: /* HI (!Z & C), LS (Z | !C) */
-                emit_mov_x86reg8_flag(AL, &arm.cpsr_z);
-                emit_alu_x86reg8_flag(CMP, AL, &arm.cpsr_c);
-                jcc = JAE; // execute if Z is less than C
+        struct arm_insn i;
+        arm_decode(insn, pc, &i);
+
+        /* Condition code (NV is the unconditional space) */
+        int cond = i.cond;
+        /* Pending flags that this instruction overwrites are dead. Before a
+         * conditional instruction, the rest go to memory on both paths;
+         * branches leave them alone. */
+        if (cond == 0xE)
+            fl.pending &= ~i.flags_written;
+        else if (i.form != AI_BRANCH && i.form != AI_BLX_IMM)
+            flags_to_memory();
+        uint8_t *cond_jmp_offset = emit_cond_jump(cond);
+
+        switch (i.form) {
+            case AI_PLD:
+                /* no-op */
                 break;
-            case 5: /* GE (N = V), LT (N != V) */
-                emit_mov_x86reg8_flag(AL, &arm.cpsr_n);
-                emit_alu_x86reg8_flag(CMP, AL, &arm.cpsr_v);
-                jcc = JNZ;
-                break;
-            case 6: /* GT (!Z & N = V), LE (Z | N != V) */
-                emit_mov_x86reg8_flag(AL, &arm.cpsr_n);
-                emit_alu_x86reg8_flag(XOR, AL, &arm.cpsr_v);
-                emit_alu_x86reg8_flag(OR, AL, &arm.cpsr_z);
-                jcc = JNZ;
+
+            case AI_BLX_IMM:
+                /* BLX: branch, link, and switch to THUMB */
+                emit_mov_armreg_immediate(14, pc + 4);
+                emit_mov_x86reg_immediate(EAX, i.imm);
+                emit_jump((uintptr_t)translation_next_bx);
+                stop_here = 1;
                 break;
-            case 7: /* AL */
-                if (cond & 1) goto unimpl;
-                goto no_condition;
-        }
-        /* If condition not met, jump around code.
-         * (If ARM condition code is inverted, invert x86 code too) */
-        emit_byte(jcc ^ (cond & 1));
-        emit_byte(0);
-        cond_jmp_offset = out;
-no_condition:
-
-        if ((insn & 0xE000090) == 0x0000090) {
-            if ((insn & 0xFC000F0) == 0x0000090) {
+
+            case AI_MUL:
                 /* MUL, MLA - 32x32->32 multiplications */
-                int left_reg  = insn & 15;
-                int right_reg = insn >> 8 & 15;
-                int acc_reg   = insn >> 12 & 15;
-                int dest_reg  = insn >> 16 & 15;
-                if (left_reg == 15 || right_reg == 15 || acc_reg == 15 || dest_reg == 15)
+                if (i.rm == 15 || i.rs == 15 || i.rn == 15 || i.rd == 15)
                     goto unimpl;
 
-                emit_mov_x86reg_armreg(EAX, left_reg);
-                emit_unary_armreg(MUL, right_reg);
-                if (insn & 0x0200000)
-                    emit_alu_x86reg_armreg(ADD, EAX, acc_reg);
-                emit_mov_armreg_x86reg(dest_reg, EAX);
+                emit_mov_x86reg_armreg(EAX, i.rm);
+                emit_unary_armreg(MUL, i.rs);
+                if (i.accumulate)
+                    emit_alu_x86reg_armreg(ADD, EAX, i.rn);
+                emit_mov_armreg_x86reg(i.rd, EAX);
 
-                if (insn & 0x0100000) {
-                    if (!(insn & 0x0200000))
+                if (i.s) {
+                    if (!i.accumulate)
                         emit_test_x86reg_x86reg(EAX, EAX);
-                    emit_setcc_flag(SETS, &arm.cpsr_n);
-                    emit_setcc_flag(SETZ, &arm.cpsr_z);
+                    flags_set(-1, -1);
                 }
-            } else if ((insn & 0xF8000F0) == 0x0800090) {
-                /* UMULL, UMLAL, SMULL, SMLAL: 32x32 to 64 multiplications */
-                uint32_t left_reg  = insn & 15;
-                uint32_t right_reg = insn >> 8  & 15;
-                uint32_t reg_lo    = insn >> 12 & 15;
-                uint32_t reg_hi    = insn >> 16 & 15;
+                break;
 
-                if (left_reg == 15 || right_reg == 15 || reg_lo == 15 || reg_hi == 15)
+            case AI_MULL: {
+                /* UMULL, UMLAL, SMULL, SMLAL: 32x32 to 64 multiplications */
+                int reg_lo = i.rd, reg_hi = i.rn;
+                if (i.rm == 15 || i.rs == 15 || reg_lo == 15 || reg_hi == 15)
                     goto unimpl;
                 if (reg_lo == reg_hi)
                     goto unimpl;
-                if (insn & 0x0100000) // set flags
-                    goto unimpl;
 
-                emit_mov_x86reg_armreg(EAX, left_reg);
-                emit_unary_armreg((insn & 0x0400000) ? IMUL : MUL, right_reg);
-                if (insn & 0x0200000) {
-                    /* Accumulate */
+                emit_mov_x86reg_armreg(EAX, i.rm);
+                emit_unary_armreg(i.sign ? IMUL : MUL, i.rs);
+                if (i.accumulate) {
                     emit_alu_armreg_x86reg(ADD, reg_lo, EAX);
                     emit_alu_armreg_x86reg(ADC, reg_hi, EDX);
                 } else {
                     emit_mov_armreg_x86reg(reg_lo, EAX);
                     emit_mov_armreg_x86reg(reg_hi, EDX);
                 }
-            } else {
-                enum { INVALID, H, SB, SH } type;
-                int is_load = insn & (1 << 20);
-                type = insn >> 5 & 3;
-                if (type == INVALID || (!is_load && type != H))
-                    // multiply, SWP, or doubleword access
+
+                if (i.s) {
+                    /* N and Z of the 64-bit result */
+                    if (i.accumulate) {
+                        emit_mov_x86reg_armreg(EAX, reg_lo);
+                        emit_mov_x86reg_armreg(EDX, reg_hi);
+                    }
+                    flags_clobber();
+                    emit_byte(0x48); // shl rdx, 32
+                    emit_byte(0xC1);
+                    emit_modrm_x86reg(SHL, EDX);
+                    emit_byte(32);
+                    emit_byte(0x48); // or rax, rdx
+                    emit_byte(0x09);
+                    emit_modrm_x86reg(EDX, EAX);
+                    flags_set(-1, -1);
+                }
+                break;
+            }
+
+            case AI_SWP:
+                /* SWP, SWPB */
+                if (i.rm == 15 || i.rd == 15 || i.rn == 15)
                     goto unimpl;
 
-                int post_index = !(insn & (1 << 24));
-                int offset_op = (insn & (1 << 23)) ? ADD : SUB;
-                int pre_index = insn & (1 << 21);
-                int base_reg = insn >> 16 & 15;
-                int data_reg = insn >> 12 & 15;
+                // The address stays in EDX, the loaded value in ECX
+                emit_mov_x86reg_armreg(EDX, i.rn);
+                emit_mov_x86reg_x86reg(REG_ARG1, EDX);
+                emit_mem_access(i.byte ? (uintptr_t)read_byte : (uintptr_t)read_word_ldr, i.byte ? 1 : 4, false);
+                emit_mov_x86reg_x86reg(ECX, EAX);
+                emit_mov_x86reg_x86reg(REG_ARG1, EDX);
+                emit_mov_x86reg_armreg(REG_ARG2, i.rm);
+                emit_mem_access(i.byte ? (uintptr_t)write_byte : (uintptr_t)write_word, i.byte ? 1 : 4, true);
+                emit_mov_armreg_x86reg(i.rd, ECX);
+                break;
+
+            case AI_EXTRA_LS: {
+                bool is_double = i.op == AX_D;
+                int offset_op = i.up ? ADD : SUB;
+                int base_reg = i.rn;
+                int data_reg = i.rd;
 
-                if (base_reg == 15 || data_reg == 15)
+                if (data_reg == 15 || (is_double && (data_reg & 1 || data_reg == 14)))
                     goto unimpl;
 
-                if (pre_index || post_index) {
-                    if (pre_index && post_index) goto unimpl;
+                if (i.writeback) {
+                    if (i.user) goto unimpl;
                     if (base_reg == 15) goto unimpl;
-                    if (is_load && base_reg == data_reg) goto unimpl;
+                    if (i.load && (base_reg == data_reg || (is_double && base_reg == data_reg + 1))) goto unimpl;
                 }
 
-                if (insn & (1 << 22)) {
-                    // Offset is immediate
-                    int offset = (insn & 0x0F) | (insn >> 4 & 0xF0);
+                if (base_reg == 15)
+                    emit_mov_x86reg_immediate(REG_ARG1, pc + 8);
+                else
                     emit_mov_x86reg_armreg(REG_ARG1, base_reg);
-                    if (!post_index && offset != 0)
-                        emit_alu_x86reg_immediate(offset_op, REG_ARG1, offset);
+                if (i.operand == AO_IMM) {
+                    if (i.pre && i.imm != 0)
+                        emit_alu_x86reg_immediate(offset_op, REG_ARG1, i.imm);
                 } else {
-                    // Offset is register
-                    int offset_reg = insn & 0x0F;
-                    if (offset_reg == 15)
+                    // Offset is register, kept in ECX for writeback
+                    if (i.rm == 15)
                         goto unimpl;
-                    if (post_index || pre_index)
-                        goto unimpl;
-                    emit_mov_x86reg_armreg(REG_ARG1, base_reg);
-                    emit_alu_x86reg_armreg(offset_op, REG_ARG1, offset_reg);
+                    if (i.writeback) {
+                        emit_mov_x86reg_armreg(ECX, i.rm);
+                        if (i.pre)
+                            emit_alu_x86reg_x86reg(offset_op, REG_ARG1, ECX);
+                    } else {
+                        emit_alu_x86reg_armreg(offset_op, REG_ARG1, i.rm);
+                    }
                 }
 
-                if (is_load) {
-                    if (type == SB) {
-                        emit_call((uintptr_t)read_byte);
+                if (is_double) {
+                    // The address stays in EDX
+                    emit_mov_x86reg_x86reg(EDX, REG_ARG1);
+                    if (i.load) {
+                        /* LDRD: the first word waits in ESI, in case the second aborts */
+                        emit_mem_access((uintptr_t)read_word, 4, false);
+                        emit_mov_x86reg_x86reg(REG_ARG2, EAX);
+                        emit_byte(0x8D); // lea edi, [edx + 4]
+                        emit_modrm_base_offset(REG_ARG1, EDX, 4);
+                        emit_mem_access((uintptr_t)read_word, 4, false);
+                        emit_mov_armreg_x86reg(data_reg, REG_ARG2);
+                        emit_mov_armreg_x86reg(data_reg + 1, EAX);
+                    } else {
+                        /* STRD */
+                        emit_mov_x86reg_armreg(REG_ARG2, data_reg);
+                        emit_mem_access((uintptr_t)write_word, 4, true);
+                        emit_byte(0x8D); // lea edi, [edx + 4]
+                        emit_modrm_base_offset(REG_ARG1, EDX, 4);
+                        emit_mov_x86reg_armreg(REG_ARG2, data_reg + 1);
+                        emit_mem_access((uintptr_t)write_word, 4, true);
+                    }
+                } else if (i.load) {
+                    if (i.op == AX_SB) {
+                        emit_mem_access((uintptr_t)read_byte, 1, false);
                         // movsx eax,al
                         emit_word(0xBE0F);
                         emit_byte(0xC0);
                     } else {
-                        emit_call((uintptr_t)read_half);
-                        if (type == SH) {
+                        emit_mem_access((uintptr_t)read_half, 2, false);
+                        if (i.op == AX_SH) {
                             // cwde
                             emit_byte(0x98);
                         }
@@ -436,137 +1739,137 @@ no_condition:
                     emit_mov_armreg_x86reg(data_reg, EAX);
                 } else {
                     emit_mov_x86reg_armreg(REG_ARG2, data_reg);
-                    emit_call((uintptr_t)write_half);
+                    emit_mem_access((uintptr_t)write_half, 2, true);
                 }
 
-                if (post_index || pre_index)
-                    emit_alu_armreg_immediate(offset_op, base_reg, ((insn & 0x0F) | (insn >> 4 & 0xF0)));
+                if (i.writeback) {
+                    if (i.operand == AO_IMM)
+                        emit_alu_armreg_immediate(offset_op, base_reg, i.imm);
+                    else
+                        emit_alu_armreg_x86reg(offset_op, base_reg, ECX);
+                }
+                break;
             }
-        } else if ((insn & 0xD900000) == 0x1000000) {
-            if ((insn & 0xFFFFFD0) == 0x12FFF10) {
+
+            case AI_BX:
                 /* BX/BLX */
-                int target_reg = insn & 15;
-                if (target_reg == 15)
-                    break;
-                emit_mov_x86reg_armreg(EAX, target_reg);
-                if (insn & 0x20)
+                if (i.rm == 15)
+                    goto unimpl;
+                emit_mov_x86reg_armreg(EAX, i.rm);
+                if (i.link)
                     emit_mov_armreg_immediate(14, pc + 4);
                 emit_jump((uintptr_t)translation_next_bx);
                 stop_here = 1;
-            } else if ((insn & 0xFBF0FFF) == 0x10F0000) {
+                break;
+
+            case AI_MRS:
                 /* MRS - move reg <- status */
-                int target_reg = insn >> 12 & 15;
-                if (target_reg == 15)
-                    break;
-                emit_call(insn & 0x0400000 ? (uintptr_t)get_spsr : (uintptr_t)get_cpsr);
-                emit_mov_armreg_x86reg(target_reg, EAX);
-            } else if ((insn & 0xFB0FFF0) == 0x120F000 ||
-                       (insn & 0xFB0F000) == 0x320F000) {
+                if (i.rd == 15)
+                    goto unimpl;
+                emit_call(i.spsr ? (uintptr_t)get_spsr : (uintptr_t)get_cpsr);
+                emit_mov_armreg_x86reg(i.rd, EAX);
+                break;
+
+            case AI_MSR:
                 /* MSR - move status <- reg/imm */
-                uint32_t mask = 0;
-                if (insn & 0x2000000) {
-                    uint32_t imm = insn & 0xFF;
-                    int rotate = insn >> 7 & 30;
-                    imm = imm >> rotate | imm << (32 - rotate);
-                    emit_mov_x86reg_immediate(REG_ARG1, imm);
+                if (i.operand == AO_IMM) {
+                    emit_mov_x86reg_immediate(REG_ARG1, i.imm);
                 } else {
-                    int reg = insn & 15;
-                    if (reg == 15)
-                        break;
-                    emit_mov_x86reg_armreg(REG_ARG1, reg);
+                    if (i.rm == 15)
+                        goto unimpl;
+                    emit_mov_x86reg_armreg(REG_ARG1, i.rm);
                 }
-                if (insn & 0x0080000) mask |= 0xFF000000;
-                if (insn & 0x0040000) mask |= 0x00FF0000;
-                if (insn & 0x0020000) mask |= 0x0000FF00;
-                if (insn & 0x0010000) mask |= 0x000000FF;
-                emit_mov_x86reg_immediate(REG_ARG2, mask);
-                emit_call(insn & 0x0400000 ? (uintptr_t)set_spsr : (uintptr_t)set_cpsr);
+                emit_mov_x86reg_immediate(REG_ARG2, i.mask);
+                emit_call(i.spsr ? (uintptr_t)set_spsr : (uintptr_t)set_cpsr);
+                // A mode change swaps in banked registers
+                regs_forget(8, 15);
                 // If cpsr_c changed, leave translation to check for interrupts
-                if ((insn & 0x0410000) == 0x0010000) {
+                if (!i.spsr && i.mask & 0xFF) {
                     emit_mov_x86reg_immediate(EAX, pc + 4);
                     emit_jump((uintptr_t)translation_next);
                 }
-            } else if ((insn & 0xFFF0FF0) == 0x16F0F10) {
+                break;
+
+            case AI_CLZ:
                 /* CLZ: Count leading zeros */
-                int src_reg = insn & 15;
-                int dst_reg = insn >> 12 & 15;
-                if (src_reg == 15 || dst_reg == 15)
-                    break;
+                if (i.rm == 15 || i.rd == 15)
+                    goto unimpl;
+                flags_clobber();
+                emit_armreg_prefix(i.rm, REG_READ);
                 emit_word(0xBD0F); // BSR
-                emit_modrm_armreg(EAX, src_reg);
+                emit_modrm_armreg(EAX, i.rm);
                 emit_word(5 << 8 | JNZ);
                 emit_mov_x86reg_immediate(EAX, 63);
                 emit_alu_x86reg_immediate(XOR, EAX, 31);
-                emit_mov_armreg_x86reg(dst_reg, EAX);
-            } else {
+                emit_mov_armreg_x86reg(i.rd, EAX);
                 break;
-            }
-        } else if ((insn & 0xC000000) == 0) {
-            /* Data processing instructions */
-            int right_reg = insn & 15;
-            int dest_reg = insn >> 12 & 15;
-            int left_reg = insn >> 16 & 15;
-            int setcc = insn >> 20 & 1;
-            int op = insn >> 21 & 15;
-
-            if (dest_reg == 15 || left_reg == 15)
-                break; // not dealing with this for now
-
-            int set_overflow = -1;
-            int set_carry = -1;
-            int right_is_imm = insn >> 25 & 1;
-            int right_is_reg = 0;
-            uint32_t imm = 0; // value not used, just suppressing uninitialized variable warning
-            if (right_is_imm) {
-                // Right operand is immediate
-                imm = insn & 0xFF;
-                int rotate = insn >> 7 & 30;
-                imm = imm >> rotate | imm << (32 - rotate);
-                if (rotate != 0)
-                    set_carry = imm >> 31;
-            } else if (right_reg == 15) {
-                if (insn & 0xFF0) // Shifted PC?! Not likely.
+
+            case AI_DATA: {
+                /* Data processing instructions */
+                int right_reg = i.rm;
+                int dest_reg = i.rd;
+                int left_reg = i.rn;
+                int setcc = i.s;
+                int op = i.op;
+
+                // Writing pc with S also restores CPSR. As the left operand, pc is
+                // only handled where it is a constant and no carry goes in or out.
+                if (dest_reg == 15 && setcc)
+                    goto unimpl;
+                if (left_reg == 15 && op != 13 && op != 15
+                        && (setcc || (op >= 5 && op <= 7) || i.operand == AO_SHIFT_REG))
                     goto unimpl;
-                imm = pc + 8;
-                right_is_imm = 1;
-            } else {
-                int shift_type = insn >> 5 & 3;
-                static const uint8_t shift_table[] = { SHL, SHR, SAR, ROR };
-                int x86_shift_type = shift_table[shift_type];
-
-                int count = insn >> 7 & 31;
-                int shift_need_carry = setcc & ((0xF303 >> op) & 1);
-                if (insn & (1 << 4)) {
-                    if (insn & (1 << 7))
-                        goto unimpl;
-                    /* Register shifted by register.
-                     * ARM's shifts are very different from x86's, unfortunately.
-                     * In x86, only 5 bits of the shift count are used.
-                     * In ARM, 8 bits are used. To implement ARM shifts on x86,
-                     * one must check for the 32-255 cases explicitly.
-                     * This is done in asmcode.S */
-
-                    int shift_reg = count >> 1;
-                    if (shift_reg == 15)
-                        goto unimpl;
 
-                    emit_mov_x86reg_armreg(ECX, shift_reg);
-                    if (shift_type == 3 && !shift_need_carry) {
-                        /* Ignoring flags, ARM's ROR is the same as x86's :) */
-                        count = SHIFT_BY_CL;
-                        goto simple_shift;
-                    }
+                int set_overflow = -1;
+                int set_carry = -1;
+                int right_is_imm = 0;
+                int right_is_reg = 0;
+                uint32_t imm = i.imm;
+                if (i.operand == AO_IMM) {
+                    // Right operand is immediate (or pc)
+                    right_is_imm = 1;
+                    set_carry = i.imm_carry;
+                } else if (right_reg == 15) {
+                    goto unimpl; // Shifted PC?! Not likely.
+                } else {
+                    static const uint8_t shift_table[] = { SHL, SHR, SAR, ROR };
+                    int x86_shift_type = shift_table[i.shift];
+
+                    int count = i.count;
+                    int shift_need_carry = setcc & ((0xF303 >> op) & 1);
+                    if (i.operand == AO_SHIFT_REG) {
+                        /* Register shifted by register.
+                         * ARM's shifts are very different from x86's, unfortunately.
+                         * In x86, only 5 bits of the shift count are used.
+                         * In ARM, 8 bits are used. To implement ARM shifts on x86,
+                         * one must check for the 32-255 cases explicitly.
+                         * This is done in asmcode.S */
+                        if (i.rs == 15)
+                            goto unimpl;
+
+                        emit_mov_x86reg_armreg(ECX, i.rs);
+                        if (i.shift == SHIFT_ROR && !shift_need_carry) {
+                            /* Ignoring flags, ARM's ROR is the same as x86's :) */
+                            count = SHIFT_BY_CL;
+                            goto simple_shift;
+                        }
 
-                    emit_mov_x86reg_armreg(EAX, right_reg);
-                    emit_call_nosave(arm_shift_proc[shift_need_carry][shift_type]);
+                        emit_mov_x86reg_armreg(EAX, right_reg);
+                        emit_call_nosave(arm_shift_proc[shift_need_carry][i.shift]);
 
-                    shift_need_carry = 0; /* Already set by the function */
-                } else if (count == 0) {
-                    if (shift_type == 0) {
+                        shift_need_carry = 0; /* Already set by the function */
+                    } else if (i.operand == AO_REG) {
                         /* Right operand is just an ARM register */
                         right_is_reg = 1;
                         shift_need_carry = 0;
-                    } else if (shift_type == 1) {
+                    } else if (i.operand == AO_RRX) {
+                        /* RRX */
+                        emit_mov_x86reg8_immediate(AL, 0);
+                        emit_alu_x86reg8_flag(CMP, AL, &arm.cpsr_c);
+                        x86_shift_type = RCR;
+                        count = 1;
+                        goto simple_shift;
+                    } else if (count == 32 && i.shift == SHIFT_LSR) {
                         /* LSR #32 */
                         if (shift_need_carry) {
                             emit_mov_x86reg_armreg(EAX, right_reg);
@@ -574,444 +1877,1205 @@ no_condition:
                         }
                         imm = 0;
                         right_is_imm = 1;
-                    } else if (shift_type == 2) {
+                    } else if (count == 32) {
                         /* ASR #32 */
                         emit_mov_x86reg_armreg(EAX, right_reg);
                         emit_shift_x86reg(SAR, EAX, 31);
                         if (shift_need_carry)
                             emit_shift_x86reg(SAR, EAX, 1);
-                    } else if (shift_type == 3) {
-                        /* RRX */
-                        emit_mov_x86reg8_immediate(AL, 0);
-                        emit_alu_x86reg8_flag(CMP, AL, &arm.cpsr_c);
-                        x86_shift_type = RCR;
-                        count = 1;
-                        goto simple_shift;
-                    }
-                } else {
-simple_shift:
-                    if (dest_reg == right_reg && op == 13) {
-                        /* MOV of a shifted register to itself. Do shift in-place */
-                        emit_shift_armreg(x86_shift_type, dest_reg, count);
-                        right_is_reg = 1;
                     } else {
-                        emit_mov_x86reg_armreg(EAX, right_reg);
-                        emit_shift_x86reg(x86_shift_type, EAX, count);
+simple_shift:
+                        if (dest_reg == right_reg && op == 13) {
+                            /* MOV of a shifted register to itself. Do shift in-place */
+                            emit_shift_armreg(x86_shift_type, dest_reg, count);
+                            right_is_reg = 1;
+                        } else {
+                            emit_mov_x86reg_armreg(EAX, right_reg);
+                            emit_shift_x86reg(x86_shift_type, EAX, count);
+                        }
                     }
+                    if (shift_need_carry)
+                        emit_setcc_flag(SETB, &arm.cpsr_c);
                 }
-                if (shift_need_carry)
-                    emit_setcc_flag(SETB, &arm.cpsr_c);
-            }
 
-            if (op == 13 || op == 15) {
-                if (right_is_imm) {
-                    if (op == 15)
-                        imm = ~imm;
-                    emit_mov_armreg_immediate(dest_reg, imm);
-                    if (setcc)
-                        goto unimpl;
-                } else if (right_is_reg && dest_reg == right_reg) {
-                    /* MOV/MVN of a register to itself */
-                    if (op == 15) {
+                if (op == 13 || op == 15) {
+                    if (right_is_imm && dest_reg != 15) {
+                        if (op == 15)
+                            imm = ~imm;
+                        emit_mov_armreg_immediate(dest_reg, imm);
                         if (setcc)
-                            emit_alu_armreg_immediate(XOR, dest_reg, -1);
-                        else
-                            emit_unary_armreg(NOT, dest_reg);
+                            emit_alu_armreg_immediate(CMP, dest_reg, 0);
+                    } else if (right_is_reg && dest_reg == right_reg) {
+                        /* MOV/MVN of a register to itself */
+                        if (op == 15) {
+                            if (setcc)
+                                emit_alu_armreg_immediate(XOR, dest_reg, -1);
+                            else
+                                emit_unary_armreg(NOT, dest_reg);
+                        } else {
+                            if (setcc)
+                                emit_alu_armreg_immediate(CMP, dest_reg, 0);
+                        }
                     } else {
+                        if (right_is_imm)
+                            emit_mov_x86reg_immediate(EAX, imm);
+                        else if (right_is_reg)
+                            emit_mov_x86reg_armreg(EAX, right_reg);
+                        if (op == 15)
+                            emit_unary_x86reg(NOT, EAX);
+                        emit_data_proc_result(dest_reg, EAX);
                         if (setcc)
-                            emit_alu_armreg_immediate(CMP, dest_reg, 0);
+                            emit_test_x86reg_x86reg(EAX, EAX);
                     }
-                } else {
-                    if (right_is_reg)
-                        emit_mov_x86reg_armreg(EAX, right_reg);
-                    if (op == 15)
-                        emit_unary_x86reg(NOT, EAX);
-                    emit_mov_armreg_x86reg(dest_reg, EAX);
-                    if (setcc)
-                        emit_test_x86reg_x86reg(EAX, EAX);
-                }
-            } else if (op == 8) { // TST
-                if (right_is_imm) {
-                    emit_test_armreg_immediate(left_reg, imm);
-                } else {
-                    if (right_is_reg)
-                        emit_mov_x86reg_armreg(EAX, right_reg);
-                    emit_test_armreg_x86reg(left_reg, EAX);
-                }
-            } else if (op == 10) { // CMP
-                if (right_is_imm) {
-                    emit_alu_armreg_immediate(CMP, left_reg, imm);
-                } else {
-                    if (right_is_reg)
-                        emit_mov_x86reg_armreg(EAX, right_reg);
-                    emit_alu_armreg_x86reg(CMP, left_reg, EAX);
-                }
-                set_overflow = SETO;
-                set_carry = SETAE;
-            } else if (op == 9 || op == 11) { // TEQ, CMN
-                int aluop;
-                if (op == 9) { aluop = XOR; }
-                else         { aluop = ADD; set_overflow = SETO; set_carry = SETB; }
-
-                if (right_is_imm) {
-                    emit_mov_x86reg_armreg(EAX, left_reg);
-                    emit_alu_x86reg_immediate(aluop, EAX, imm);
-                } else {
-                    if (right_is_reg)
-                        emit_mov_x86reg_armreg(EAX, right_reg);
-                    emit_alu_x86reg_armreg(aluop, EAX, left_reg);
-                }
-            } else {
-                int aluop;
-                enum { LR = 1, RL = 2 } direction;
-
-                if      (op == 0)  { aluop = AND; direction = LR | RL; }
-                else if (op == 1)  { aluop = XOR; direction = LR | RL; }
-                else if (op == 2)  { aluop = SUB; direction = LR;      set_overflow = SETO; set_carry = SETAE; }
-                else if (op == 3)  { aluop = SUB; direction = RL;      set_overflow = SETO; set_carry = SETAE; }
-                else if (op == 4)  { aluop = ADD; direction = LR | RL; set_overflow = SETO; set_carry = SETB; }
-                else if (op == 5)  { aluop = ADC; direction = LR | RL; set_overflow = SETO; set_carry = SETB; }
-                else if (op == 6)  { aluop = SBB; direction = LR;      set_overflow = SETO; set_carry = SETAE; }
-                else if (op == 7)  { aluop = SBB; direction = RL;      set_overflow = SETO; set_carry = SETAE; }
-                else if (op == 12) { aluop = OR;  direction = LR | RL; }
-                else {
-                    // Convert BIC to AND
+                } else if (op == 8) { // TST
                     if (right_is_imm) {
-                        imm = ~imm;
+                        emit_test_armreg_immediate(left_reg, imm);
                     } else {
-                        if (right_is_reg) {
+                        if (right_is_reg)
                             emit_mov_x86reg_armreg(EAX, right_reg);
-                            right_is_reg = 0;
-                        }
-                        emit_unary_x86reg(NOT, EAX);
+                        emit_test_armreg_x86reg(left_reg, EAX);
                     }
-                    aluop = AND; direction = LR | RL;
-                }
-
-                if (aluop == ADC) {
-                    emit_mov_x86reg8_immediate(CL, 0);
-                    emit_alu_x86reg8_flag(CMP, CL, &arm.cpsr_c);
-                } else if (aluop == SBB) {
-                    emit_cmp_flag_immediate(&arm.cpsr_c, 1);
-                }
+                } else if (op == 10) { // CMP
+                    if (right_is_imm) {
+                        emit_alu_armreg_immediate(CMP, left_reg, imm);
+                    } else {
+                        if (right_is_reg)
+                            emit_mov_x86reg_armreg(EAX, right_reg);
+                        emit_alu_armreg_x86reg(CMP, left_reg, EAX);
+                    }
+                    set_overflow = SETO;
+                    set_carry = SETAE;
+                } else if (op == 9 || op == 11) { // TEQ, CMN
+                    int aluop;
+                    if (op == 9) { aluop = XOR; }
+                    else         { aluop = ADD; set_overflow = SETO; set_carry = SETB; }
 
-                int reg_out = EAX;
-                if (dest_reg == left_reg && (direction & LR)) {
                     if (right_is_imm) {
-                        emit_alu_armreg_immediate(aluop, dest_reg, imm);
+                        emit_mov_x86reg_armreg(EAX, left_reg);
+                        emit_alu_x86reg_immediate(aluop, EAX, imm);
                     } else {
                         if (right_is_reg)
                             emit_mov_x86reg_armreg(EAX, right_reg);
-                        emit_alu_armreg_x86reg(aluop, dest_reg, EAX);
+                        emit_alu_x86reg_armreg(aluop, EAX, left_reg);
                     }
-                } else if (right_is_reg && dest_reg == right_reg && (direction & RL)) {
-                    emit_mov_x86reg_armreg(EAX, left_reg);
-                    emit_alu_armreg_x86reg(aluop, dest_reg, EAX);
                 } else {
-                    if (right_is_imm) {
-                        if (direction & LR) {
-                            emit_mov_x86reg_armreg(EAX, left_reg);
-                            emit_alu_x86reg_immediate(aluop, EAX, imm);
+                    int aluop;
+                    enum { LR = 1, RL = 2 } direction;
+
+                    if      (op == 0)  { aluop = AND; direction = LR | RL; }
+                    else if (op == 1)  { aluop = XOR; direction = LR | RL; }
+                    else if (op == 2)  { aluop = SUB; direction = LR;      set_overflow = SETO; set_carry = SETAE; }
+                    else if (op == 3)  { aluop = SUB; direction = RL;      set_overflow = SETO; set_carry = SETAE; }
+                    else if (op == 4)  { aluop = ADD; direction = LR | RL; set_overflow = SETO; set_carry = SETB; }
+                    else if (op == 5)  { aluop = ADC; direction = LR | RL; set_overflow = SETO; set_carry = SETB; }
+                    else if (op == 6)  { aluop = SBB; direction = LR;      set_overflow = SETO; set_carry = SETAE; }
+                    else if (op == 7)  { aluop = SBB; direction = RL;      set_overflow = SETO; set_carry = SETAE; }
+                    else if (op == 12) { aluop = OR;  direction = LR | RL; }
+                    else {
+                        // Convert BIC to AND
+                        if (right_is_imm) {
+                            imm = ~imm;
                         } else {
-                            if (aluop == SUB && imm == 0) {
-                                if (dest_reg == left_reg) {
-                                    /* RSB reg, reg, 0 is like x86's NEG */
-                                    emit_unary_armreg(NEG, left_reg);
-                                    goto data_proc_done;
-                                }
-                                emit_alu_x86reg_x86reg(XOR, EAX, EAX);
-                            } else {
-                                emit_mov_x86reg_immediate(EAX, imm);
+                            if (right_is_reg) {
+                                emit_mov_x86reg_armreg(EAX, right_reg);
+                                right_is_reg = 0;
                             }
-                            emit_alu_x86reg_armreg(aluop, EAX, left_reg);
+                            emit_unary_x86reg(NOT, EAX);
                         }
-                    } else if (right_is_reg) {
-                        if (direction & LR) {
-                            emit_mov_x86reg_armreg(EAX, left_reg);
-                            emit_alu_x86reg_armreg(aluop, EAX, right_reg);
-                        } else {
+                        aluop = AND; direction = LR | RL;
+                    }
+
+                    if (aluop == ADC) {
+                        emit_mov_x86reg8_immediate(CL, 0);
+                        emit_alu_x86reg8_flag(CMP, CL, &arm.cpsr_c);
+                    } else if (aluop == SBB) {
+                        emit_cmp_flag_immediate(&arm.cpsr_c, 1);
+                    }
+
+                    if (left_reg == 15) {
+                        /* Left operand is pc: right operand op constant */
+                        if (right_is_imm)
+                            emit_mov_x86reg_immediate(EAX, imm);
+                        else if (right_is_reg)
                             emit_mov_x86reg_armreg(EAX, right_reg);
-                            emit_alu_x86reg_armreg(aluop, EAX, left_reg);
+                        if (direction & RL) {
+                            emit_alu_x86reg_immediate(aluop, EAX, pc + 8);
+                        } else {
+                            emit_unary_x86reg(NEG, EAX);
+                            emit_alu_x86reg_immediate(ADD, EAX, pc + 8);
                         }
+                        emit_data_proc_result(dest_reg, EAX);
+                        goto data_proc_done;
+                    }
+
+                    int reg_out = EAX;
+                    if (dest_reg == left_reg && (direction & LR)) {
+                        if (right_is_imm) {
+                            emit_alu_armreg_immediate(aluop, dest_reg, imm);
+                        } else {
+                            if (right_is_reg)
+                                emit_mov_x86reg_armreg(EAX, right_reg);
+                            emit_alu_armreg_x86reg(aluop, dest_reg, EAX);
+                        }
+                    } else if (right_is_reg && dest_reg == right_reg && (direction & RL)) {
+                        emit_mov_x86reg_armreg(EAX, left_reg);
+                        emit_alu_armreg_x86reg(aluop, dest_reg, EAX);
                     } else {
-                        if (direction & RL) {
-                            emit_alu_x86reg_armreg(aluop, EAX, left_reg);
+                        if (right_is_imm) {
+                            if (direction & LR) {
+                                emit_mov_x86reg_armreg(EAX, left_reg);
+                                emit_alu_x86reg_immediate(aluop, EAX, imm);
+                            } else {
+                                if (aluop == SUB && imm == 0) {
+                                    if (dest_reg == left_reg) {
+                                        /* RSB reg, reg, 0 is like x86's NEG */
+                                        emit_unary_armreg(NEG, left_reg);
+                                        goto data_proc_done;
+                                    }
+                                    emit_alu_x86reg_x86reg(XOR, EAX, EAX);
+                                } else {
+                                    emit_mov_x86reg_immediate(EAX, imm);
+                                }
+                                emit_alu_x86reg_armreg(aluop, EAX, left_reg);
+                            }
+                        } else if (right_is_reg) {
+                            if (direction & LR) {
+                                emit_mov_x86reg_armreg(EAX, left_reg);
+                                emit_alu_x86reg_armreg(aluop, EAX, right_reg);
+                            } else {
+                                emit_mov_x86reg_armreg(EAX, right_reg);
+                                emit_alu_x86reg_armreg(aluop, EAX, left_reg);
+                            }
                         } else {
-                            emit_mov_x86reg_armreg(REG_ARG2, left_reg);
-                            emit_alu_x86reg_x86reg(aluop, REG_ARG2, EAX);
-                            reg_out = REG_ARG2;
+                            if (direction & RL) {
+                                emit_alu_x86reg_armreg(aluop, EAX, left_reg);
+                            } else {
+                                emit_mov_x86reg_armreg(REG_ARG2, left_reg);
+                                emit_alu_x86reg_x86reg(aluop, REG_ARG2, EAX);
+                                reg_out = REG_ARG2;
+                            }
                         }
+                        emit_data_proc_result(dest_reg, reg_out);
                     }
-                    emit_mov_armreg_x86reg(dest_reg, reg_out);
                 }
-            }
 data_proc_done:
-            if (setcc) {
-                emit_setcc_flag(SETS, &arm.cpsr_n);
-                emit_setcc_flag(SETZ, &arm.cpsr_z);
-                if (set_carry >= 0) {
-                    if (set_carry < 2)
+                if (dest_reg == 15)
+                    stop_here = 1;
+                if (setcc) {
+                    if (set_carry == 0 || set_carry == 1) {
                         emit_mov_flag_immediate(&arm.cpsr_c, set_carry);
-                    else
-                        emit_setcc_flag(set_carry, &arm.cpsr_c);
+                        set_carry = -1;
+                    }
+                    flags_set(set_carry, set_overflow);
                 }
-                if (set_overflow >= 0)
-                    emit_setcc_flag(set_overflow, &arm.cpsr_v);
-            }
-        } else if ((insn & 0xC000000) == 0x4000000) {
-            /* Byte/word memory access */
-            int post_index = !(insn & (1 << 24));
-            int offset_op = (insn & (1 << 23)) ? ADD : SUB;
-            int is_byteop = insn & (1 << 22);
-            int pre_index = insn & (1 << 21);
-            int is_load   = insn & (1 << 20);
-            int base_reg = insn >> 16 & 15;
-            int data_reg = insn >> 12 & 15;
-
-            if (pre_index || post_index) {
-                if (pre_index && post_index) break;
-                if (base_reg == 15) break;
-                if (is_load && base_reg == data_reg) break;
+                break;
             }
 
-            if (insn & (1 << 25)) {
-                // Offset is register
+            case AI_LS: {
+                /* Byte/word memory access */
+                int offset_op = i.up ? ADD : SUB;
+                int base_reg = i.rn;
+                int data_reg = i.rd;
 
-                int offset_reg = insn & 15;
-                int shift_type = insn >> 5 & 3;
-                static const uint8_t shift_table[] = { SHL, SHR, SAR, ROR };
-                int count;
+                if (i.writeback) {
+                    if (i.user) goto unimpl;
+                    if (base_reg == 15) goto unimpl;
+                    if (i.load && base_reg == data_reg) goto unimpl;
+                }
 
-                if (insn & (1 << 4))
-                    // reg shifted by reg
-                    break;
+                if (i.operand != AO_IMM) {
+                    // Offset is register, shifted by immediate
+                    static const uint8_t shift_table[] = { SHL, SHR, SAR, ROR };
 
-                // reg shifted by immediate
-                count = insn >> 7 & 31;
-                if (count == 0 && shift_type != 0)
-                    break; // special shift
+                    if (i.operand == AO_RRX || i.count == 32)
+                        goto unimpl; // special shift
 
-                if (base_reg == 15)
-                    emit_mov_x86reg_immediate(REG_ARG1, pc + 8);
-                else
-                    emit_mov_x86reg_armreg(REG_ARG1, base_reg);
+                    if (base_reg == 15)
+                        emit_mov_x86reg_immediate(REG_ARG1, pc + 8);
+                    else
+                        emit_mov_x86reg_armreg(REG_ARG1, base_reg);
 
-                if (count == 0 && !pre_index && !post_index) {
-                    emit_alu_x86reg_armreg(offset_op, REG_ARG1, offset_reg);
+                    if (i.operand == AO_REG && !i.writeback) {
+                        emit_alu_x86reg_armreg(offset_op, REG_ARG1, i.rm);
+                    } else {
+                        emit_mov_x86reg_armreg(ECX, i.rm);
+                        emit_shift_x86reg(shift_table[i.shift], ECX, i.count);
+                        if (i.pre)
+                            emit_alu_x86reg_x86reg(offset_op, REG_ARG1, ECX);
+                    }
                 } else {
-                    emit_mov_x86reg_armreg(ECX, offset_reg);
-                    emit_shift_x86reg(shift_table[shift_type], ECX, count);
-                    if (!post_index)
-                        emit_alu_x86reg_x86reg(offset_op, REG_ARG1, ECX);
+                    // Offset is immediate
+                    int offset = i.imm;
+                    if (base_reg == 15) {
+                        if (offset_op == SUB)
+                            offset = -offset;
+                        emit_mov_x86reg_immediate(REG_ARG1, pc + 8 + offset);
+                    } else {
+                        emit_mov_x86reg_armreg(REG_ARG1, base_reg);
+                        if (offset != 0 && i.pre)
+                            emit_alu_x86reg_immediate(offset_op, REG_ARG1, offset);
+                    }
                 }
-            } else {
-                // Offset is immediate
-                int offset = insn & 0xFFF;
-                if (base_reg == 15) {
-                    if (offset_op == SUB)
-                        offset = -offset;
-                    emit_mov_x86reg_immediate(REG_ARG1, pc + 8 + offset);
+
+                if (i.load) {
+                    /* LDR/LDRB instruction */
+                    if (i.byte)
+                        emit_mem_access((uintptr_t)read_byte, 1, false);
+                    else
+                        emit_mem_access((uintptr_t)read_word_ldr, 4, false);
+                    if (data_reg != 15)
+                        emit_mov_armreg_x86reg(data_reg, EAX);
                 } else {
-                    emit_mov_x86reg_armreg(REG_ARG1, base_reg);
-                    if (offset != 0 && !post_index)
-                        emit_alu_x86reg_immediate(offset_op, REG_ARG1, offset);
+                    /* STR/STRB instruction */
+                    if (data_reg == 15)
+                        emit_mov_x86reg_immediate(REG_ARG2, pc + 12);
+                    else
+                        emit_mov_x86reg_armreg(REG_ARG2, data_reg);
+                    if (i.byte)
+                        emit_mem_access((uintptr_t)write_byte, 1, true);
+                    else
+                        emit_mem_access((uintptr_t)write_word, 4, true);
                 }
-            }
 
-            if (is_load) {
-                /* LDR/LDRB instruction */
-                emit_call(is_byteop ? (uintptr_t)read_byte : (uintptr_t)read_word_ldr);
-                if (data_reg != 15)
-                    emit_mov_armreg_x86reg(data_reg, EAX);
-            } else {
-                /* STR/STRB instruction */
-                if (data_reg == 15)
-                    emit_mov_x86reg_immediate(REG_ARG2, pc + 12);
-                else
-                    emit_mov_x86reg_armreg(REG_ARG2, data_reg);
-                emit_call(is_byteop ? (uintptr_t)write_byte : (uintptr_t)write_word);
+                if (i.writeback) {
+                    if (i.operand != AO_IMM) // Register offset
+                        emit_alu_armreg_x86reg(offset_op, base_reg, ECX);
+                    else // Immediate offset
+                        emit_alu_armreg_immediate(offset_op, base_reg, i.imm);
+                }
+
+                if (i.load && data_reg == 15) {
+                    emit_jump((uintptr_t)translation_next_bx);
+                    stop_here = 1;
+                }
+                break;
             }
 
-            if (pre_index || post_index) { // Writeback
-                if (insn & (1 << 25)) // Register offset
-                    emit_alu_armreg_x86reg(offset_op, base_reg, ECX);
-                else // Immediate offset
-                    emit_alu_armreg_immediate(offset_op, base_reg, insn & 0xFFF);
+            case AI_LSM: {
+                /* Load/store multiple */
+                int addr_reg = i.rn;
+                int reg, offset, wb_offset, count;
+                bool loaded_addr_reg = false;
+
+                if (i.user) // restore CPSR, or use umode regs
+                    goto unimpl;
+                if (addr_reg == 15)
+                    goto unimpl;
+                if (i.writeback && i.load && i.reglist & (1 << addr_reg))
+                    goto unimpl;
+
+                for (reg = count = 0; reg < 16; reg++)
+                    count += (i.reglist >> reg & 1);
+
+                if (i.up) { /* Increasing */
+                    wb_offset = count * 4;
+                    offset = 0;
+                    if (i.pre) // Preincrement
+                        offset += 4;
+                } else { /* Decreasing */
+                    wb_offset = count * -4;
+                    offset = wb_offset;
+                    if (!i.pre) // Postdecrement
+                        offset += 4;
+                }
+
+                emit_mov_x86reg_armreg(EDX, addr_reg);
+                for (reg = 0; reg < 16; reg++) {
+                    if (!(i.reglist >> reg & 1))
+                        continue;
+                    emit_byte(0x8D); // LEA
+                    emit_modrm_base_offset(REG_ARG1, EDX, offset);
+                    if (i.load) {
+                        emit_mem_access((uintptr_t)read_word, 4, false);
+                        if (reg == addr_reg && i.reglist >> reg > 1) {
+                            // Loading the address register, but there are still more
+                            // registers to go. In case they cause a data abort, don't
+                            // write to register yet; save it to ECX
+                            emit_mov_x86reg_x86reg(ECX, EAX);
+                            loaded_addr_reg = true;
+                        } else if (reg != 15)
+                            emit_mov_armreg_x86reg(reg, EAX);
+                    } else {
+                        if (reg == 15)
+                            emit_mov_x86reg_immediate(REG_ARG2, pc + 12);
+                        else
+                            emit_mov_x86reg_armreg(REG_ARG2, reg);
+                        emit_mem_access((uintptr_t)write_word, 4, true);
+                    }
+                    offset += 4;
+                }
+
+                if (i.writeback)
+                    emit_alu_armreg_immediate(ADD, addr_reg, wb_offset);
+
+                if (loaded_addr_reg)
+                    emit_mov_armreg_x86reg(addr_reg, ECX);
+
+                if (i.reglist & 0x8000 && i.load) {
+                    // LDM with PC
+                    emit_jump((uintptr_t)translation_next_bx);
+                    stop_here = 1;
+                }
+                break;
             }
 
-            if (is_load && data_reg == 15) {
-                emit_jump((uintptr_t)translation_next_bx);
+            case AI_BRANCH:
+                /* Branch, branch-and-link */
+                if (i.link)
+                    emit_mov_armreg_immediate(14, pc + 4);
+                emit_branch(i.imm);
                 stop_here = 1;
-            }
-        } else if ((insn & 0xE000000) == 0x8000000) {
-            /* Load/store multiple */
-            int writeback = insn & (1 << 21);
-            int load      = insn & (1 << 20);
-            int reg, offset, wb_offset, count;
-            bool loaded_addr_reg = false;
-
-            if (insn & (1 << 22)) // restore CPSR, or use umode regs
-                goto unimpl;
+                break;
 
-            int addr_reg = insn >> 16 & 15;
-            if (addr_reg == 15)
-                goto unimpl;
+            case AI_MCR15:
+                /* MCR p15. This may change the memory map or wait for an
+                 * interrupt, so leave the block at arm.reg[15] afterwards. */
+                if (i.rd == 15)
+                    goto unimpl;
+                emit_mov_x86reg_armreg(REG_ARG2, i.rd);
+                emit_byte(0xC7); // mov dword [arm.reg[15]], pc + 4
+                emit_modrm_base_offset(0, EBX, armreg_offset(15));
+                emit_dword(pc + 4);
+                emit_mov_x86reg_immediate(REG_ARG1, insn);
+                emit_call((uintptr_t)cp15_write);
+                emit_byte(0x8B); // mov eax, [arm.reg[15]]
+                emit_modrm_base_offset(EAX, EBX, armreg_offset(15));
+                emit_jump((uintptr_t)translation_next);
+                stop_here = 1;
+                break;
 
-            if (writeback && load && insn & (1 << addr_reg))
+            case AI_MRC15:
+                /* MRC p15 */
+                emit_mov_x86reg_immediate(REG_ARG1, insn);
+                emit_call((uintptr_t)cp15_read);
+                if (i.rd == 15) {
+                    // To the flags, from bits 31-28
+                    static void *const flagptrs[] = { &arm.cpsr_v, &arm.cpsr_c, &arm.cpsr_z, &arm.cpsr_n };
+                    int f;
+                    for (f = 0; f < 4; f++) {
+                        emit_mov_x86reg_x86reg(ECX, EAX);
+                        emit_shift_x86reg(SHR, ECX, 28 + f);
+                        emit_alu_x86reg_immediate(AND, ECX, 1);
+                        emit_byte(0x88); // mov [flag], cl
+                        emit_modrm_global(CL, flagptrs[f]);
+                    }
+                } else {
+                    emit_mov_armreg_x86reg(i.rd, EAX);
+                }
+                break;
+
+            default:
                 goto unimpl;
+        }
 
-            for (reg = count = 0; reg < 16; reg++)
-                count += (insn >> reg & 1);
+        end_cond_jump(cond_jmp_offset);
 
-            if (insn & (1 << 23)) { /* Increasing */
-                wb_offset = count * 4;
-                offset = 0;
-                if (insn & (1 << 24)) // Preincrement
-                    offset += 4;
-            } else { /* Decreasing */
-                wb_offset = count * -4;
-                offset = wb_offset;
-                if (!(insn & (1 << 24))) // Postdecrement
-                    offset += 4;
+        pc += 4;
+        insnp++;
+        stage_jtbl_code[outj - stage_jtbl] = insn_start;
+        *outj++ = insn_start;
+
+        if (stop_here) {
+            if (cond >= 0x0E)
+                goto branch_unconditional;
+            else
+                goto branch_conditional;
+        }
+    }
+unimpl:
+    pcache_rollback(insn_start);
+    out = insn_start;
+    next_exit = insn_exit;
+    ra = insn_state[outj - stage_jtbl].ra;
+    fl = insn_state[outj - stage_jtbl].fl;
+    in_cond_insn = false;
+    stage_job->no_translate = stage_flags(insnp) - stage_job->flags;
+    stage_job->unimpl = arm_unimpl_class(*insnp);
+branch_conditional:
+    emit_branch(pc);
+branch_unconditional:
+
+    if (pc == start_pc)
+        return NULL;
+
+    return finish_translation(false);
+}
+
+/* THUMB load/store types, numbered as in the register offset instructions */
+enum { MEM_STR, MEM_STRH, MEM_STRB, MEM_LDRSB, MEM_LDR, MEM_LDRH, MEM_LDRB, MEM_LDRSH };
+
+/* Emit a load or store of data_reg, with the address already in REG_ARG1 */
+static void emit_thumb_mem(int type, int data_reg) {
+    switch (type) {
+        case MEM_STR:
+        case MEM_STRH:
+        case MEM_STRB:
+            emit_mov_x86reg_armreg(REG_ARG2, data_reg);
+            if (type == MEM_STR)
+                emit_mem_access((uintptr_t)write_word, 4, true);
+            else if (type == MEM_STRH)
+                emit_mem_access((uintptr_t)write_half, 2, true);
+            else
+                emit_mem_access((uintptr_t)write_byte, 1, true);
+            return;
+        case MEM_LDRSB:
+            emit_mem_access((uintptr_t)read_byte, 1, false);
+            // movsx eax,al
+            emit_word(0xBE0F);
+            emit_byte(0xC0);
+            break;
+        case MEM_LDR:
+            emit_mem_access((uintptr_t)read_word_ldr, 4, false);
+            break;
+        case MEM_LDRH:
+        case MEM_LDRSH:
+            emit_mem_access((uintptr_t)read_half, 2, false);
+            if (type == MEM_LDRSH) {
+                // cwde
+                emit_byte(0x98);
             }
+            break;
+        case MEM_LDRB:
+            emit_mem_access((uintptr_t)read_byte, 1, false);
+            break;
+    }
+    emit_mov_armreg_x86reg(data_reg, EAX);
+}
+
+// Same for THUMB
+static int flags_written_thumb(uint16_t insn) {
+    if (insn < 0x1800)
+        return (insn >> 6 & 31) ? FLAG_N | FLAG_Z | FLAG_C : FLAG_N | FLAG_Z;
+    if (insn < 0x2000)
+        return FLAG_N | FLAG_Z | FLAG_C | FLAG_V;
+    if (insn < 0x4000)
+        return (insn & 0x1800) ? FLAG_N | FLAG_Z | FLAG_C | FLAG_V : FLAG_N | FLAG_Z;
+    if (insn < 0x4400) {
+        switch (insn >> 6 & 15) {
+            case 0x5: case 0x6: /* ADC, SBC */
+                return FLAG_N | FLAG_Z | FLAG_V;
+            case 0x9: case 0xA: case 0xB: /* NEG, CMP, CMN */
+                return FLAG_N | FLAG_Z | FLAG_C | FLAG_V;
+            default:
+                return FLAG_N | FLAG_Z;
+        }
+    }
+    if ((insn & 0xFF00) == 0x4500)
+        return FLAG_N | FLAG_Z | FLAG_C | FLAG_V;
+    return 0;
+}
 
-            emit_mov_x86reg_armreg(EDX, addr_reg);
-            for (reg = 0; reg < 16; reg++) {
-                if (!(insn >> reg & 1))
+static struct pcache_block *translate_thumb_code(uint32_t start_pc, uint16_t *start_insnp) {
+    out = stage_code;
+    outj = stage_jtbl;
+    next_exit = 0;
+    next_reloc = 0;
+    block_start_pc = start_pc;
+    block_pages = 1;
+    regs_reset();
+    uint32_t pc = start_pc;
+    uint16_t *insnp = start_insnp;
+    uint32_t *flags;
+
+    uint8_t *insn_start;
+    int insn_exit;
+    enum { CONTINUE, STOP_CONDITIONAL, STOP_UNCONDITIONAL } stop_here = CONTINUE;
+    while (1) {
+        if (out + MAX_INSN_CODE + (outj - stage_jtbl + 1) * MAX_STUB_CODE > stage_code + STAGE_CODE_SIZE
+                || next_reloc + MAX_INSN_RELOCS > MAX_RELOCS) {
+            stage_job->cut = true;
+            goto branch_conditional;
+        }
+
+        // Multi-page blocks end when insn_state is full
+        if (outj - stage_jtbl >= MAX_BLOCK_INSNS)
+            goto branch_conditional;
+
+        insn_start = out;
+        insn_exit = next_exit;
+        insn_state[outj - stage_jtbl].ra = ra;
+        insn_state[outj - stage_jtbl].fl = fl;
+
+        if (!(pc & 0x3FF) && pc != start_pc && !continue_on_page(pc, insnp))
+            goto branch_conditional;
+
+        /* Flags are per word, so a word may already belong to this block */
+        flags = stage_flags(insnp);
+        if (*flags & (RF_EXEC_BREAKPOINT | RF_EXEC_DEBUG_NEXT | RF_EXEC_HACK | RF_ARMLOADER_CB | RF_CODE_NO_TRANSLATE))
+            goto branch_conditional;
+        if ((*flags & RF_CODE_TRANSLATED) && insnp != start_insnp
+                && (*flags >> RFS_TRANSLATION_INDEX) != STAGE_INDEX)
+            goto branch_conditional;
+
+        uint16_t insn = *insnp;
+        // Pending flags that this instruction overwrites are dead
+        fl.pending &= ~flags_written_thumb(insn);
+
+        if (insn < 0x1800) {
+            /* LSL, LSR, ASR Rd, Rm, #imm */
+            static const uint8_t shift_table[] = { SHL, SHR, SAR };
+            int count = insn >> 6 & 31;
+            if (count == 0 && insn >= 0x0800)
+                goto unimpl; // LSR/ASR #32
+
+            emit_mov_x86reg_armreg(EAX, insn >> 3 & 7);
+            if (count != 0) {
+                emit_shift_x86reg(shift_table[insn >> 11], EAX, count);
+                flags_set(SETB, -1);
+            } else {
+                emit_test_x86reg_x86reg(EAX, EAX);
+                flags_set(-1, -1);
+            }
+            emit_mov_armreg_x86reg(insn & 7, EAX);
+        } else if (insn < 0x2000) {
+            /* ADD, SUB Rd, Rn, Rm/#imm */
+            int aluop = (insn & 0x200) ? SUB : ADD;
+            emit_mov_x86reg_armreg(EAX, insn >> 3 & 7);
+            if (insn & 0x400)
+                emit_alu_x86reg_immediate(aluop, EAX, insn >> 6 & 7);
+            else
+                emit_alu_x86reg_armreg(aluop, EAX, insn >> 6 & 7);
+            flags_set(aluop == ADD ? SETB : SETAE, SETO);
+            emit_mov_armreg_x86reg(insn & 7, EAX);
+        } else if (insn < 0x4000) {
+            /* MOV, CMP, ADD, SUB Rd, #imm */
+            int reg = insn >> 8 & 7, imm = insn & 0xFF;
+            switch (insn >> 11 & 3) {
+                case 0:
+                    emit_mov_armreg_immediate(reg, imm);
+                    emit_mov_flag_immediate(&arm.cpsr_n, 0);
+                    emit_mov_flag_immediate(&arm.cpsr_z, imm == 0);
+                    break;
+                case 1:
+                    emit_alu_armreg_immediate(CMP, reg, imm);
+                    flags_set(SETAE, SETO);
+                    break;
+                case 2:
+                    emit_alu_armreg_immediate(ADD, reg, imm);
+                    flags_set(SETB, SETO);
+                    break;
+                case 3:
+                    emit_alu_armreg_immediate(SUB, reg, imm);
+                    flags_set(SETAE, SETO);
+                    break;
+            }
+        } else if (insn < 0x4400) {
+            /* Data processing, Rd = Rd op Rm */
+            static const uint8_t shift_type[] = { [2] = 0, [3] = 1, [4] = 2, [7] = 3 };
+            int dst = insn & 7, src = insn >> 3 & 7;
+            int op = insn >> 6 & 15;
+            switch (op) {
+                case 0x0: /* AND */
+                case 0x1: /* EOR */
+                case 0xC: /* ORR */
+                    emit_mov_x86reg_armreg(EAX, src);
+                    emit_alu_armreg_x86reg(op == 0 ? AND : op == 1 ? XOR : OR, dst, EAX);
+                    flags_set(-1, -1);
+                    break;
+                case 0x2: /* LSL */
+                case 0x3: /* LSR */
+                case 0x4: /* ASR */
+                case 0x7: /* ROR */
+                    emit_mov_x86reg_armreg(ECX, src);
+                    emit_mov_x86reg_armreg(EAX, dst);
+                    emit_call_nosave(arm_shift_proc[1][shift_type[op]]);
+                    emit_mov_armreg_x86reg(dst, EAX);
+                    emit_test_x86reg_x86reg(EAX, EAX);
+                    flags_set(-1, -1);
+                    break;
+                case 0x5: /* ADC */
+                    emit_mov_x86reg_armreg(EAX, src);
+                    emit_mov_x86reg8_immediate(CL, 0);
+                    emit_alu_x86reg8_flag(CMP, CL, &arm.cpsr_c);
+                    emit_alu_armreg_x86reg(ADC, dst, EAX);
+                    flags_set(SETB, SETO);
+                    break;
+                case 0x6: /* SBC */
+                    emit_mov_x86reg_armreg(EAX, src);
+                    emit_cmp_flag_immediate(&arm.cpsr_c, 1);
+                    emit_alu_armreg_x86reg(SBB, dst, EAX);
+                    flags_set(SETAE, SETO);
+                    break;
+                case 0x8: /* TST */
+                    emit_mov_x86reg_armreg(EAX, src);
+                    emit_test_armreg_x86reg(dst, EAX);
+                    flags_set(-1, -1);
+                    break;
+                case 0x9: /* NEG */
+                    emit_mov_x86reg_armreg(EAX, src);
+                    emit_unary_x86reg(NEG, EAX);
+                    flags_set(SETAE, SETO);
+                    emit_mov_armreg_x86reg(dst, EAX);
+                    break;
+                case 0xA: /* CMP */
+                    emit_mov_x86reg_armreg(EAX, src);
+                    emit_alu_armreg_x86reg(CMP, dst, EAX);
+                    flags_set(SETAE, SETO);
+                    break;
+                case 0xB: /* CMN */
+                    emit_mov_x86reg_armreg(EAX, src);
+                    emit_alu_x86reg_armreg(ADD, EAX, dst);
+                    flags_set(SETB, SETO);
+                    break;
+                case 0xD: /* MUL */
+                    emit_mov_x86reg_armreg(EAX, dst);
+                    emit_unary_armreg(MUL, src);
+                    emit_mov_armreg_x86reg(dst, EAX);
+                    emit_test_x86reg_x86reg(EAX, EAX);
+                    flags_set(-1, -1);
+                    break;
+                case 0xE: /* BIC */
+                case 0xF: /* MVN */
+                    emit_mov_x86reg_armreg(EAX, src);
+                    emit_unary_x86reg(NOT, EAX);
+                    if (op == 0xE) {
+                        emit_alu_armreg_x86reg(AND, dst, EAX);
+                    } else {
+                        emit_mov_armreg_x86reg(dst, EAX);
+                        emit_test_x86reg_x86reg(EAX, EAX);
+                    }
+                    flags_set(-1, -1);
+                    break;
+            }
+        } else if (insn < 0x4800) {
+            /* ADD, CMP, MOV with high registers, BX/BLX */
+            int left = (insn >> 4 & 8) | (insn & 7), right = insn >> 3 & 15;
+            int op = insn >> 8 & 3;
+            if (op == 3) {
+                if (right == 15)
+                    goto unimpl;
+                emit_mov_x86reg_armreg(EAX, right);
+                if (insn & 0x80)
+                    emit_mov_armreg_immediate(14, pc + 3);
+                emit_jump((uintptr_t)translation_next_bx);
+                stop_here = STOP_UNCONDITIONAL;
+            } else {
+                if (left == 15)
+                    goto unimpl;
+                if (right == 15) {
+                    if (op == 2)
+                        emit_mov_armreg_immediate(left, pc + 4);
+                    else
+                        emit_alu_armreg_immediate(op == 0 ? ADD : CMP, left, pc + 4);
+                } else {
+                    emit_mov_x86reg_armreg(EAX, right);
+                    if (op == 2)
+                        emit_mov_armreg_x86reg(left, EAX);
+                    else
+                        emit_alu_armreg_x86reg(op == 0 ? ADD : CMP, left, EAX);
+                }
+                if (op == 1)
+                    flags_set(SETAE, SETO);
+            }
+        } else if (insn < 0x5000) {
+            /* LDR Rd, [PC, #imm] */
+            emit_mov_x86reg_immediate(REG_ARG1, ((pc + 4) & ~3) + ((insn & 0xFF) << 2));
+            emit_thumb_mem(MEM_LDR, insn >> 8 & 7);
+        } else if (insn < 0x6000) {
+            /* Load/store Rd, [Rn, Rm] */
+            emit_mov_x86reg_armreg(REG_ARG1, insn >> 3 & 7);
+            emit_alu_x86reg_armreg(ADD, REG_ARG1, insn >> 6 & 7);
+            emit_thumb_mem(insn >> 9 & 7, insn & 7);
+        } else if (insn < 0x9000) {
+            /* Load/store Rd, [Rn, #imm] */
+            static const uint8_t types[] = { MEM_STR, MEM_LDR, MEM_STRB, MEM_LDRB, MEM_STRH, MEM_LDRH };
+            static const uint8_t scale[] = { 2, 2, 0, 0, 1, 1 };
+            int kind = (insn >> 11) - 0xC;
+            int offset = (insn >> 6 & 31) << scale[kind];
+            emit_mov_x86reg_armreg(REG_ARG1, insn >> 3 & 7);
+            if (offset != 0)
+                emit_alu_x86reg_immediate(ADD, REG_ARG1, offset);
+            emit_thumb_mem(types[kind], insn & 7);
+        } else if (insn < 0xA000) {
+            /* STR, LDR Rd, [SP, #imm] */
+            emit_mov_x86reg_armreg(REG_ARG1, 13);
+            if (insn & 0xFF)
+                emit_alu_x86reg_immediate(ADD, REG_ARG1, (insn & 0xFF) << 2);
+            emit_thumb_mem((insn & 0x800) ? MEM_LDR : MEM_STR, insn >> 8 & 7);
+        } else if (insn < 0xB000) {
+            /* ADD Rd, PC/SP, #imm */
+            int reg = insn >> 8 & 7, offset = (insn & 0xFF) << 2;
+            if (insn & 0x800) {
+                emit_mov_x86reg_armreg(EAX, 13);
+                emit_alu_x86reg_immediate(ADD, EAX, offset);
+                emit_mov_armreg_x86reg(reg, EAX);
+            } else {
+                emit_mov_armreg_immediate(reg, ((pc + 4) & ~3) + offset);
+            }
+        } else if ((insn & 0xFF00) == 0xB000) {
+            /* ADD/SUB SP, #imm */
+            int offset = (insn & 0x7F) << 2;
+            emit_alu_armreg_immediate(ADD, 13, (insn & 0x80) ? -offset : offset);
+        } else if ((insn & 0xF600) == 0xB400 || (insn & 0xF000) == 0xC000) {
+            /* PUSH, POP, STMIA, LDMIA */
+            int load = insn & 0x800;
+            int list = insn & ((insn & 0xF000) == 0xB000 ? 0x1FF : 0xFF);
+            int base_reg = (insn & 0xF000) == 0xB000 ? 13 : insn >> 8 & 7;
+            int reg, count, offset;
+
+            for (reg = count = 0; reg < 9; reg++)
+                count += list >> reg & 1;
+            offset = (base_reg == 13 && !load) ? -4 * count : 0;
+
+            emit_mov_x86reg_armreg(EDX, base_reg);
+            for (reg = 0; reg < 9; reg++) {
+                if (!(list >> reg & 1))
                     continue;
                 emit_byte(0x8D); // LEA
                 emit_modrm_base_offset(REG_ARG1, EDX, offset);
                 if (load) {
-                    emit_call((uintptr_t)read_word);
-                    if (reg == addr_reg && (insn & -1 << reg & 0xFFFF)) {
-                        // Loading the address register, but there are still more
-                        // registers to go. In case they cause a data abort, don't
-                        // write to register yet; save it to ECX
+                    emit_mem_access((uintptr_t)read_word, 4, false);
+                    if (reg == base_reg) {
+                        // LDMIA with the base register in the list: it gets the loaded value
                         emit_mov_x86reg_x86reg(ECX, EAX);
-                        loaded_addr_reg = true;
-                    } else if (reg != 15)
+                    } else if (reg != 8) {
                         emit_mov_armreg_x86reg(reg, EAX);
+                    }
                 } else {
-                    if (reg == 15)
-                        emit_mov_x86reg_immediate(REG_ARG2, pc + 12);
-                    else
-                        emit_mov_x86reg_armreg(REG_ARG2, reg);
-                    emit_call((uintptr_t)write_word);
+                    emit_mov_x86reg_armreg(REG_ARG2, reg == 8 ? 14 : reg);
+                    emit_mem_access((uintptr_t)write_word, 4, true);
                 }
                 offset += 4;
             }
 
-            if (writeback)
-                emit_alu_armreg_immediate(ADD, addr_reg, wb_offset);
-
-            if (loaded_addr_reg)
-                emit_mov_armreg_x86reg(addr_reg, ECX);
+            if (load && (list >> base_reg & 1))
+                emit_mov_armreg_x86reg(base_reg, ECX);
+            else if (count != 0)
+                emit_alu_armreg_immediate((base_reg == 13 && !load) ? SUB : ADD, base_reg, 4 * count);
 
-            if (insn & (1 << 15) && load) {
-                // LDM with PC
+            if (list & 0x100 && load) {
+                // POP with PC: the loaded value is still in EAX
                 emit_jump((uintptr_t)translation_next_bx);
-                stop_here = 1;
+                stop_here = STOP_UNCONDITIONAL;
+            }
+        } else if (insn >= 0xD000 && insn < 0xDE00) {
+            /* B<cond> */
+            uint8_t *cond_jmp_offset = emit_cond_jump(insn >> 8 & 15);
+            emit_branch(pc + 4 + ((int8_t)insn << 1));
+            end_cond_jump(cond_jmp_offset);
+            stop_here = STOP_CONDITIONAL;
+        } else if (insn >= 0xE000 && insn < 0xE800) {
+            /* B */
+            emit_branch(pc + 4 + ((int32_t)insn << 21 >> 20));
+            stop_here = STOP_UNCONDITIONAL;
+        } else if (insn >= 0xE800) {
+            /* BL, BLX */
+            if (insn < 0xF000 || insn >= 0xF800) {
+                /* Second half: target is LR + offset */
+                emit_mov_x86reg_armreg(EAX, 14);
+                emit_alu_x86reg_immediate(ADD, EAX, (insn & 0x7FF) << 1);
+                emit_mov_armreg_immediate(14, pc + 3);
+                if (insn < 0xF000) {
+                    // BLX: switch to ARM
+                    emit_alu_x86reg_immediate(AND, EAX, ~3);
+                    emit_jump((uintptr_t)translation_next_bx);
+                } else {
+                    emit_jump((uintptr_t)translation_next);
+                }
+                stop_here = STOP_UNCONDITIONAL;
+            } else {
+                /* First half: LR = PC + 4 + (offset << 12) */
+                emit_mov_armreg_immediate(14, pc + 4 + ((int32_t)insn << 21 >> 9));
             }
-        } else if ((insn & 0xE000000) == 0xA000000) {
-            /* Branch, branch-and-link */
-            if (insn & (1 << 24))
-                emit_mov_armreg_immediate(14, pc + 4);
-            emit_mov_x86reg_immediate(EAX, pc + 8 + ((int32_t)insn << 8 >> 6));
-            emit_jump((uintptr_t)translation_next);
-            stop_here = 1;
         } else {
-            break;
+            goto unimpl;
         }
 
-        /* Fill in the conditional jump offset */
-        if (cond_jmp_offset) {
-            if (out - cond_jmp_offset > 0x7F)
-                goto unimpl; /* yes, this could happen (with large LDM/STM) */
-            cond_jmp_offset[-1] = out - cond_jmp_offset;
-        }
-
-        RAM_FLAGS(insnp) |= (RF_CODE_TRANSLATED | next_index << RFS_TRANSLATION_INDEX);
-        pc += 4;
+        *flags = (*flags & ~(~0u << RFS_TRANSLATION_INDEX)) | RF_CODE_TRANSLATED | STAGE_INDEX << RFS_TRANSLATION_INDEX;
+        pc += 2;
         insnp++;
+        stage_jtbl_code[outj - stage_jtbl] = insn_start;
         *outj++ = insn_start;
 
-        if (stop_here) {
-            if (cond == 0x0E)
-                goto branch_unconditional;
-            else
-                goto branch_conditional;
-        }
+        if (stop_here == STOP_UNCONDITIONAL)
+            goto branch_unconditional;
+        if (stop_here == STOP_CONDITIONAL)
+            goto branch_conditional;
     }
 unimpl:
+    pcache_rollback(insn_start);
     out = insn_start;
-    RAM_FLAGS(insnp) |= RF_CODE_NO_TRANSLATE;
+    next_exit = insn_exit;
+    ra = insn_state[outj - stage_jtbl].ra;
+    fl = insn_state[outj - stage_jtbl].fl;
+    in_cond_insn = false;
+    stage_job->no_translate = flags - stage_job->flags;
+    stage_job->unimpl = thumb_unimpl_class(*insnp);
 branch_conditional:
-    emit_mov_x86reg_immediate(EAX, pc);
-    emit_jump((uintptr_t)translation_next);
+    emit_branch(pc);
 branch_unconditional:
 
     if (pc == start_pc)
+        return NULL;
+
+    return finish_translation(true);
+}
+
+/* ----------------------------------------------------------------------
+ * Building blocks. With translate_async set, translate() only copies the
+ * code and queues it for a worker thread, and the emulator goes on
+ * interpreting it. The next translate() call installs what the worker has
+ * finished, unless the code has been changed in the meantime. Flushing the
+ * cache forgets the jobs not yet installed. */
+
+bool translate_async = true;
+static pthread_mutex_t stage_lock = PTHREAD_MUTEX_INITIALIZER; // held while building a block
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct tjob *queue_first, **queue_last = &queue_first; // for the worker
+static struct tjob *done_jobs;                                // from the worker
+static struct tjob *worker_job;                               // being built by the worker
+static bool worker_running, worker_stop;
+static pthread_t worker_thread;
+// Jobs not yet collected, only used by the emulator thread
+#define MAX_PENDING_JOBS 16
+static struct tjob *pending_jobs[MAX_PENDING_JOBS];
+static struct tjob sync_job;
+
+static void init_job(struct tjob *j, uint32_t pc, void *insnp, bool thumb) {
+    uint32_t end_pc = (pc | 0x3FF) + 1, words, i;
+    j->pc = pc;
+    j->phys = phys_mem_addr(insnp);
+    j->thumb = thumb;
+    j->insnp = insnp;
+    j->base = (uint32_t *)((uintptr_t)insnp & ~3);
+    j->pages = 1;
+    while (j->pages < block_max_pages && end_pc - pc < sizeof j->code
+           && virt_mem_ptr(end_pc, 4) == (uint8_t *)insnp + (end_pc - pc)) {
+        j->pages++;
+        end_pc += 0x400;
+    }
+    words = ((uint8_t *)insnp + (end_pc - pc) - (uint8_t *)j->base) >> 2;
+    if (words > MAX_BLOCK_INSNS)
+        words = MAX_BLOCK_INSNS;
+    memcpy(j->code, j->base, words << 2);
+    for (i = 0; i < words; i++)
+        j->flags[i] = RAM_FLAGS(&j->base[i]);
+}
+
+// Build the block of job j in the staging area. Returns its record, or NULL
+static struct pcache_block *stage_block(struct tjob *j) {
+    void *start_insnp = (uint8_t *)j->code + (j->insnp - (uint8_t *)j->base);
+    stage_job = j;
+    stage_code = insn_buffer + INSN_BUFFER_SIZE + sizeof(struct pcache_block);
+    j->no_translate = -1;
+    j->cut = false;
+    if (j->thumb)
+        return translate_thumb_code(j->pc, start_insnp);
+    return translate_arm_code(j->pc, start_insnp);
+}
+
+/* Apply the results of job j, with b its block. A queued job worked on a
+ * copy of the code that must still be current. */
+static int finish_job(struct tjob *j, struct pcache_block *b, bool check) {
+    int w = j->no_translate, index = -1;
+    if (j->cut)
+        tcache_stats.cut_blocks++;
+    if (w >= 0 && (!check || j->base[w] == j->code[w])) {
+        RAM_FLAGS(&j->base[w]) |= RF_CODE_NO_TRANSLATE;
+        tcache_stats.unimpl[j->unimpl]++;
+    }
+    if (b && check && (virt_mem_ptr(j->pc, 4) != j->insnp
+                       || memcmp(j->insnp, (uint8_t *)j->code + (j->insnp - (uint8_t *)j->base),
+                                 b->insns << (j->thumb ? 1 : 2))))
         return -1;
+    if (b) {
+        index = install_block(b, j->insnp);
+        if (index >= 0 && pcache_buf)
+            pcache_save(b, j->insnp);
+    }
+    return index;
+}
 
-    int index = next_index++;
+static void *translate_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&queue_lock);
+    while (!worker_stop) {
+        struct tjob *j = queue_first;
+        if (!j) {
+            pthread_cond_wait(&queue_cond, &queue_lock);
+            continue;
+        }
+        queue_first = j->next;
+        if (!queue_first)
+            queue_last = &queue_first;
+        worker_job = j;
+        pthread_mutex_unlock(&queue_lock);
+
+        pthread_mutex_lock(&stage_lock);
+        struct pcache_block *b = stage_block(j);
+        if (b && (j->record = malloc(pcache_block_size(b))))
+            memcpy(j->record, b, pcache_block_size(b));
+        pthread_mutex_unlock(&stage_lock);
+
+        pthread_mutex_lock(&queue_lock);
+        worker_job = NULL;
+        if (j->cancelled) {
+            free(j->record);
+            free(j);
+            continue;
+        }
+        j->next = done_jobs;
+        done_jobs = j;
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return NULL;
+}
 
-    translation_table[index].jump_table = (void**) jtbl_bufptr;
-    translation_table[index].start_ptr  = start_insnp;
-    translation_table[index].end_ptr    = insnp;
+// Forget the jobs not yet collected. The worker frees the one it is on
+static void cancel_jobs() {
+    struct tjob *j, *next;
+    pthread_mutex_lock(&queue_lock);
+    for (j = queue_first; j; j = next) {
+        next = j->next;
+        free(j);
+    }
+    queue_first = NULL;
+    queue_last = &queue_first;
+    for (j = done_jobs; j; j = next) {
+        next = j->next;
+        free(j->record);
+        free(j);
+    }
+    done_jobs = NULL;
+    if (worker_job)
+        worker_job->cancelled = true;
+    num_pending_jobs = 0;
+    pthread_mutex_unlock(&queue_lock);
+}
 
-    insn_bufptr = out;
-    jtbl_bufptr = outj;
+void translate_worker_quit() {
+    if (!worker_running)
+        return;
+    pthread_mutex_lock(&queue_lock);
+    worker_stop = true;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    pthread_join(worker_thread, NULL);
+    worker_running = worker_stop = false;
+    cancel_jobs();
+}
 
+// Queue the code at insnp, unless it already is. Returns false if it can't be
+static bool queue_job(uint32_t pc, void *insnp, bool thumb) {
+    struct tjob *j;
+    int i;
+    for (i = 0; i < num_pending_jobs; i++)
+        if (pending_jobs[i]->insnp == insnp && pending_jobs[i]->thumb == thumb)
+            return true;
+    if (num_pending_jobs == MAX_PENDING_JOBS)
+        return true; // it gets asked for again
+    if (!worker_running) {
+        if (pthread_create(&worker_thread, NULL, translate_worker, NULL))
+            return false;
+        worker_running = true;
+    }
+    j = malloc(sizeof *j);
+    if (!j)
+        return false;
+    init_job(j, pc, insnp, thumb);
+    j->record = NULL;
+    j->next = NULL;
+    j->cancelled = false;
+    pending_jobs[num_pending_jobs++] = j;
+
+    pthread_mutex_lock(&queue_lock);
+    *queue_last = j;
+    queue_last = &j->next;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    return true;
+}
+
+// Install the blocks the worker has finished. Returns the index of the one at insnp, or -1
+static int collect_jobs(void *insnp, bool thumb) {
+    struct tjob *j, *next;
+    int i, index, found = -1;
+    pthread_mutex_lock(&queue_lock);
+    j = done_jobs;
+    done_jobs = NULL;
+    pthread_mutex_unlock(&queue_lock);
+    // Installing one may flush the cache, which must not see these
+    for (next = j; next; next = next->next) {
+        for (i = 0; pending_jobs[i] != next; i++);
+        pending_jobs[i] = pending_jobs[--num_pending_jobs];
+    }
+    for (; j; j = next) {
+        next = j->next;
+        index = finish_job(j, j->record, true);
+        if (j->insnp == insnp && j->thumb == thumb)
+            found = index;
+        free(j->record);
+        free(j);
+    }
+    // Installing a later one may have flushed the cache
+    if (found >= next_index || (found >= 0 && translation_table[found].start_ptr != insnp))
+        found = -1;
+    return found;
+}
+
+static int translate_block(uint32_t pc, void *insnp, bool thumb) {
+    struct pcache_block *b;
+    int index;
+    if (num_pending_jobs && (index = collect_jobs(insnp, thumb)) >= 0)
+        return index;
+    if (pcache_buf && (index = pcache_install(pc, insnp, thumb)) >= 0)
+        return index;
+    if (translate_async && queue_job(pc, insnp, thumb))
+        return -1;
+
+    pthread_mutex_lock(&stage_lock);
+    init_job(&sync_job, pc, insnp, thumb);
+    b = stage_block(&sync_job);
+    index = finish_job(&sync_job, b, false);
+    pthread_mutex_unlock(&stage_lock);
     return index;
 }
 
-void flush_translations() {
+int translate(uint32_t start_pc, uint32_t *start_insnp) {
+    return translate_block(start_pc, start_insnp, false);
+}
+
+int translate_thumb(uint32_t start_pc, uint16_t *start_insnp) {
+    return translate_block(start_pc, start_insnp, true);
+}
+
+void flush_translations(int cause) {
     int index;
+    tcache_stats.flushes++;
+    tcache_stats.flush_causes[cause]++;
     for (index = 0; index < next_index; index++) {
-        uint32_t *start = translation_table[index].start_ptr;
+        // THUMB blocks may start in the middle of a word
+        uint32_t *start = (uint32_t *)((uintptr_t)translation_table[index].start_ptr & ~3);
         uint32_t *end   = translation_table[index].end_ptr;
+        page_first[ram_page(start)] = 0;
         for (; start < end; start++)
             RAM_FLAGS(start) &= ~(RF_CODE_TRANSLATED | (-1 << RFS_TRANSLATION_INDEX));
     }
+    // A write from translated code may get here: it must not follow links afterwards
+    for (index = 0; index < committed_exits; index++) {
+        if (exits[index].target >= 0) {
+            *(int32_t *)exits[index].cycles_imm = 0;
+            patch_rel32(exits[index].jump, 0xE8, translation_next_link);
+        }
+    }
+    cancel_jobs();
     next_index = 0;
     insn_bufptr = insn_buffer;
     jtbl_bufptr = jtbl_buffer;
+    committed_exits = 0;
+    num_cross_page_links = 0;
+    ibc_clear();
 }
 
-void invalidate_translation(int index) {
-    if (in_translation_rsp) {
-        uint32_t flags = RAM_FLAGS(in_translation_pc_ptr);
-        if ((flags & RF_CODE_TRANSLATED) && (int)(flags >> RFS_TRANSLATION_INDEX) == index)
-            error("Cannot modify currently executing code block.");
+/* Called by translation_next_link, with the return address of its call.
+ * If the exit's target has been translated, jump straight to it from now on. */
+void translation_link(uint8_t *ret_addr) __asm__("translation_link");
+void translation_link(uint8_t *ret_addr) {
+    int lo = 0, hi = committed_exits;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (exits[mid].jump + 5 < ret_addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == committed_exits || exits[lo].jump + 5 != ret_addr)
+        return;
+    struct translation_exit *e = &exits[lo];
+
+    // Don't cause a miss here; translation_next will do that
+    uintptr_t entry = (uintptr_t)AC_ENTRY((e->target_pc >> 10) << 1);
+    if (entry & AC_FLAGS)
+        return;
+    uint8_t *insnp = (uint8_t *)(entry + e->target_pc);
+
+    uint32_t flags = RAM_FLAGS((uintptr_t)insnp & ~3);
+    if (!(flags & RF_CODE_TRANSLATED))
+        return;
+    int index = flags >> RFS_TRANSLATION_INDEX;
+    struct translation *t = &translation_table[index];
+    // Direct branches never change the instruction set
+    bool thumb = arm.cpsr_low28 & 0x20;
+    if (!t->thumb != !thumb || ((uintptr_t)insnp & (thumb ? 1 : 3))
+            || insnp < (uint8_t *)t->start_ptr || insnp >= (uint8_t *)t->end_ptr)
+        return;
+
+    int shift = thumb ? 1 : 2;
+    *(uintptr_t *)e->host_ptr_imm = (uintptr_t)insnp;
+    *(int32_t *)e->cycles_imm = ((uint8_t *)t->end_ptr - insnp) >> shift;
+    patch_rel32(e->jump, 0xE9, t->jump_table[(insnp - (uint8_t *)t->start_ptr) >> shift]);
+    e->target = index;
+    e->in_prev = -1;
+    e->in_next = incoming[index];
+    if (e->in_next >= 0)
+        exits[e->in_next].in_prev = lo;
+    incoming[index] = lo;
+    // Once listed, an exit stays so until unlink_translations, so it is never there twice
+    if (e->cross_page && !e->listed) {
+        e->listed = true;
+        cross_page_links[num_cross_page_links++] = lo;
     }
-    flush_translations();
 }
 
+/* The virtual memory mapping changed: links between pages may now be wrong */
+void unlink_translations() {
+    int i;
+    for (i = 0; i < num_cross_page_links; i++) {
+        struct translation_exit *e = &exits[cross_page_links[i]];
+        if (e->target >= 0)
+            unlink_exit(cross_page_links[i]);
+        e->listed = false;
+    }
+    num_cross_page_links = 0;
+    ibc_clear();
+}
+
+/* Code on the page of translation index was written to. Drop every
+ * translation there; the running block may be among them: it runs on to
+ * its exit, and the dispatcher translates the new code. */
+void invalidate_translation(int index) {
+    drop_page(ram_page(translation_table[index].start_ptr));
+    tcache_stats.smc_pages++;
+}
+
+/* Called on a data abort. If it came from translated code, the faulting
+ * access went through emit_slow_call, whose return address tells which
+ * instruction of the running block it was. arm.reg[15] is the PC of the
+ * instruction the block was entered at (in_translation_pc_ptr). */
 void fix_pc_for_fault() {
-    //TODO: Due to the difference of pointer size, the old jump_table format doesn't work
-    //Adapt this function to the new format:
-    //jump_table[0] is pointer to code on pc=start_ptr
-    //jump_table[1] is pointer to code on pc=start_ptr+4
-    assert(false);
-    /*if (in_translation_rsp) {
-        uint32_t *insnp = in_translation_pc_ptr;
-        void *ret_eip = in_translation_rsp[-1];
-        uint32_t flags = RAM_FLAGS(insnp);
-        if (!(flags & RF_CODE_TRANSLATED))
-            error("Couldn't get PC for fault");
-        int index = flags >> RFS_TRANSLATION_INDEX;
-        uintptr_t start = (uintptr_t)translation_table[index].start_ptr;
-        uintptr_t end = (uintptr_t)translation_table[index].end_ptr;
-        for (; start < end; start += 4) {
-            void *code = *(void **)(translation_table[index].jump_table);
-            if (code >= ret_eip)
-                break;
+    if (in_translation_rsp) {
+        uint8_t *ret = in_translation_rsp[-SLOW_CALL_RET];
+
+        // Blocks' code is laid out in index order
+        int lo = 0, hi = next_index;
+        while (hi - lo > 1) {
+            int mid = (lo + hi) / 2;
+            if ((uint8_t *)translation_table[mid].jump_table[0] < ret)
+                lo = mid;
+            else
+                hi = mid;
         }
-        arm.reg[15] += (uintptr_t)start - (uintptr_t)insnp;
-        cycle_count_delta -= ((uintptr_t)end - (uintptr_t)insnp) >> 2;
+        struct translation *t = &translation_table[lo];
+        uint8_t **code = &jtbl_code[(uint8_t **)t->jump_table - jtbl_buffer];
+        uint8_t **code_end = lo + 1 < next_index
+                ? &jtbl_code[(uint8_t **)translation_table[lo + 1].jump_table - jtbl_buffer]
+                : &jtbl_code[jtbl_bufptr - jtbl_buffer];
+        if (ret <= code[0] || ret > insn_bufptr)
+            error("Couldn't get PC for fault");
+
+        int i = 0, count = code_end - code;
+        while (i + 1 < count && code[i + 1] < ret)
+            i++;
+        // Make the PC point after the faulting instruction, as in the interpreter
+        int shift = t->thumb ? 1 : 2;
+        uint8_t *insnp = (uint8_t *)t->start_ptr + (i << shift);
+        arm.reg[15] += insnp + (1 << shift) - (uint8_t *)in_translation_pc_ptr;
+        // Cycles were counted up to the end of the block
+        cycle_count_delta -= count - i - 1;
         in_translation_rsp = NULL;
     }
-    arm.reg[15] -= (arm.cpsr_low28 & 0x20) ? 2 : 4;*/
+    arm.reg[15] -= (arm.cpsr_low28 & 0x20) ? 2 : 4;
 }
 
 // returns 1 if at least one instruction translated in the range